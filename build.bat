@@ -1,3 +1,7 @@
 @ECHO OFF
 
+REM add -DREAL_FLOAT for a single precision build
 clang .\src\main.cpp -g -lUser32 -lGdi32
+
+REM headless, run from the repo root: benchmark [results.json], benchmark --write-references, benchmark --engine megakernel|wavefront, benchmark --bvh-builder sah|lbvh or benchmark --refit-frames n
+clang .\src\benchmark.cpp -O2 -g -o benchmark.exe
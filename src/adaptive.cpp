@@ -0,0 +1,94 @@
+#include "adaptive.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+static AdaptiveTiles construct_adaptive_tiles(const int width, const int height) {
+    assert(width > 0 && height > 0);
+
+    AdaptiveTiles adaptive_tiles = {};
+    adaptive_tiles.width = width;
+    adaptive_tiles.height = height;
+    adaptive_tiles.column_count = (width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+    adaptive_tiles.tile_count = adaptive_tiles.column_count * ((height + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE);
+    adaptive_tiles.active = std::vector<int>(adaptive_tiles.tile_count, 1);
+
+    return adaptive_tiles;
+}
+
+static void activate_all(AdaptiveTiles& adaptive_tiles) {
+    std::fill(adaptive_tiles.active.begin(), adaptive_tiles.active.end(), 1);
+}
+
+static bool is_active(const AdaptiveTiles& adaptive_tiles, const int row, const int column) {
+    const int tile_index = (row / ADAPTIVE_TILE_SIZE) * adaptive_tiles.column_count + column / ADAPTIVE_TILE_SIZE;
+    return (adaptive_tiles.active[tile_index] != 0);
+}
+
+static RenderTile get_adaptive_tile_bounds(const AdaptiveTiles& adaptive_tiles, const int tile_index) {
+    const int row_start = (tile_index / adaptive_tiles.column_count) * ADAPTIVE_TILE_SIZE;
+    const int column_start = (tile_index % adaptive_tiles.column_count) * ADAPTIVE_TILE_SIZE;
+    const int row_end = std::min(row_start + ADAPTIVE_TILE_SIZE, adaptive_tiles.height);
+    const int column_end = std::min(column_start + ADAPTIVE_TILE_SIZE, adaptive_tiles.width);
+    return RenderTile{row_start, row_end, column_start, column_end};
+}
+
+static int get_active_pixel_count(const AdaptiveTiles& adaptive_tiles) {
+    int active_pixel_count = 0;
+    for (int tile_index = 0; tile_index < adaptive_tiles.tile_count; ++tile_index) {
+        if (adaptive_tiles.active[tile_index] != 0) {
+            const RenderTile bounds = get_adaptive_tile_bounds(adaptive_tiles, tile_index);
+            active_pixel_count += (bounds.row_end - bounds.row_start) * (bounds.column_end - bounds.column_start);
+        }
+    }
+
+    return active_pixel_count;
+}
+
+// standard error of the pixel's mean luminance taken through the display's sqrt and clamp
+static real get_pixel_display_error(const Film& film, const int pixel_index) {
+    const real sample_count = static_cast<real>(film.sample_counts[pixel_index]);
+    if (sample_count < 2.0f) {
+        return REAL_MAX;
+    }
+
+    const real* const colour = film.colours + 3 * pixel_index;
+    const real mean = get_luminance(colour[0], colour[1], colour[2]) / sample_count;
+    const real mean_square = film.luminance_squares[pixel_index] / sample_count;
+    const real variance = std::max<real>(0.0f, mean_square - mean * mean) * sample_count / (sample_count - 1.0f);
+    const real standard_error = std::sqrt(variance / sample_count);
+
+    return std::min<real>(std::sqrt(mean + standard_error), 1.0f) - std::min<real>(std::sqrt(mean), 1.0f);
+}
+
+static int update_active_tiles(const Film& film, AdaptiveTiles& adaptive_tiles) {
+    assert(film.width == adaptive_tiles.width && film.height == adaptive_tiles.height);
+
+    int active_tile_count = 0;
+    for (int tile_index = 0; tile_index < adaptive_tiles.tile_count; ++tile_index) {
+        if (adaptive_tiles.active[tile_index] == 0) {
+            continue;
+        }
+
+        const RenderTile bounds = get_adaptive_tile_bounds(adaptive_tiles, tile_index);
+        bool sampled_enough = true;
+        real error_square_sum = 0.0f;
+        for (int row = bounds.row_start; row < bounds.row_end && sampled_enough; ++row) {
+            for (int column = bounds.column_start; column < bounds.column_end && sampled_enough; ++column) {
+                const int pixel_index = get_pixel_index(film, row, column);
+                sampled_enough = (film.sample_counts[pixel_index] >= ADAPTIVE_MIN_SAMPLE_COUNT);
+
+                const real error = get_pixel_display_error(film, pixel_index);
+                error_square_sum += error * error;
+            }
+        }
+
+        const real pixel_count = static_cast<real>((bounds.row_end - bounds.row_start) * (bounds.column_end - bounds.column_start));
+        const bool converged = sampled_enough && (std::sqrt(error_square_sum / pixel_count) < ADAPTIVE_ERROR_THRESHOLD);
+        adaptive_tiles.active[tile_index] = converged ? 0 : 1;
+        active_tile_count += converged ? 0 : 1;
+    }
+
+    return active_tile_count;
+}
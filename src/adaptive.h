@@ -0,0 +1,35 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include "film.h"
+#include "types.h"
+
+#include <vector>
+
+// Adaptive sampling, once a tile's pixels have had the minimum samples the tile stops getting more when the
+// RMS of their displayed values' standard errors is under the threshold. The RMS rather than the worst pixel
+// so a few fireflies don't keep whole tiles going.
+static constexpr int ADAPTIVE_TILE_SIZE = 16;
+static constexpr int ADAPTIVE_MIN_SAMPLE_COUNT = 16;
+static constexpr real ADAPTIVE_ERROR_THRESHOLD = 0.01f;
+
+// Which tiles of an image are still getting samples. Pixels skip passes once their tile converges, so each
+// pixel's own sample count is what keeps its sample sequence in order.
+struct AdaptiveTiles {
+    int width;
+    int height;
+    int column_count;
+    int tile_count;
+    std::vector<int> active;    // 0 or 1, ints rather than vector<bool>'s packed bits
+};
+
+static AdaptiveTiles construct_adaptive_tiles(int width, int height);
+static void activate_all(AdaptiveTiles& adaptive_tiles);  // for starting the image again
+
+static bool is_active(const AdaptiveTiles& adaptive_tiles, int row, int column);
+static int get_active_pixel_count(const AdaptiveTiles& adaptive_tiles);
+
+// turns off tiles that have converged, returns how many are still active
+static int update_active_tiles(const Film& film, AdaptiveTiles& adaptive_tiles);
+
+#endif
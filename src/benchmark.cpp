@@ -0,0 +1,997 @@
+// Headless benchmark. Renders each built in scene on the thread pool with the fixed sample sequences for a few
+// time budgets and writes throughput and error against a stored high sample count reference as JSON, for
+// comparing builds.
+//
+//   benchmark [options] [results.json]     results go to stdout without a filename
+//   benchmark --write-references           renders the references into REFERENCE_DIRECTORY first
+//
+//   --order scanlines|morton|hilbert       how the image is split into jobs, see construct_render_tiles()
+//   --tile-size n                          for morton and hilbert
+//   --width n                              errors are only measured at the references' width
+//   --scene name                           just the one scene
+//   --sampler random|sobol|blue-noise      where each sample's random numbers come from
+//   --min-bounces n                        bounces before russian roulette, clamped to the max
+//   --max-bounces n                        clamped to MAX_BOUNCE_COUNT, errors are only measured against
+//                                          references rendered with the same bounces
+//   --engine megakernel|wavefront          which engine traces the paths, the wavefront engine's images are
+//                                          first checked against the megakernel's, exits with 1 if they differ
+//   --adaptive                             tiles stop getting samples once they converge, as the app's do, and
+//                                          rendering stops once they all have. Budgets report the samples
+//                                          taken against giving every pixel one every pass, compare their
+//                                          errors with a run without it.
+//
+//   --bvh-builder sah|lbvh                 times and checks BVH builds instead of rendering, see
+//                                          run_bvh_build_benchmark(), exits with 1 if a check fails
+//   --mesh-copies n                        the most copies of the king built into one mesh, rounded down to
+//                                          a power of two
+//   --refit-frames n                       animates geometry refitting its BVH every frame instead of
+//                                          rendering, see run_bvh_refit_benchmark(), exits with 1 if a
+//                                          refit BVH's hits differ from a rebuilt one's
+
+#include "linear_algebra.h"
+#include "model_loading.h"
+#include "path_tracing.h"
+#include "geometry.h"
+#include "material.h"
+#include "sampling.h"
+#include "adaptive.h"
+#include "wavefront.h"
+#include "bvh_benchmark.h"
+#include "thread_pool.h"
+#include "scenes.h"
+#include "tiles.h"
+#include "film.h"
+#include "colour.h"
+#include "types.h"
+#include "jobs.h"
+#include "bvh.h"
+#include "rng.h"
+
+#include "linear_algebra.cpp"
+#include "model_loading.cpp"
+#include "path_tracing.cpp"
+#include "geometry.cpp"
+#include "material.cpp"
+#include "sampling.cpp"
+#include "adaptive.cpp"
+#include "wavefront.cpp"
+#include "thread_pool.cpp"
+#include "scenes.cpp"
+#include "bvh_benchmark.cpp"
+#include "tiles.cpp"
+#include "film.cpp"
+#include "colour.cpp"
+#include "jobs.cpp"
+#include "bvh.cpp"
+#include "rng.cpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static constexpr int BENCHMARK_IMAGE_WIDTH = 160;
+static constexpr int BENCHMARK_TILE_SIZE = 16;
+static constexpr TileOrder::Type BENCHMARK_TILE_ORDER = TileOrder::Type::HILBERT;
+static constexpr int BENCHMARK_PACKET_SIZE = 8;
+static constexpr int BENCHMARK_MESH_COPY_COUNT = 16;
+static constexpr Sampler::Type BENCHMARK_SAMPLER = Sampler::Type::SOBOL;
+
+// The megakernel renders a tile per job, the wavefront engine a band of whole rows per job as the app does.
+// The wavefront engine shades the same way so its images should match the megakernel's exactly, it renders
+// this many samples both ways before being timed.
+struct RenderEngine {
+    enum Type {
+        MEGAKERNEL = 0,
+        WAVEFRONT = 1
+    };
+};
+
+static constexpr RenderEngine::Type BENCHMARK_RENDER_ENGINE = RenderEngine::Type::MEGAKERNEL;
+static constexpr int BENCHMARK_BAND_HEIGHT = 8;
+static constexpr int ENGINE_CHECK_SAMPLE_COUNT = 4;
+
+// error is recorded at the first pass to finish after each, times only count rendering
+static constexpr int TIME_BUDGET_COUNT = 3;
+static constexpr double TIME_BUDGETS[TIME_BUDGET_COUNT] = {0.5, 2.0, 8.0};
+
+static constexpr int REFERENCE_SAMPLE_COUNT = 4096;
+static constexpr const char* REFERENCE_DIRECTORY = "./benchmarks/references/";
+
+struct BenchmarkScene {
+    enum Type {
+        RANDOM_SPHERES = 0,
+        CORNELL_BOX = 1,
+        CHESS = 2,
+        CHESS_PIECE = 3     // one of each piece
+    };
+
+    Type type;
+    ChessPiece::Type piece;
+    const char* name;
+};
+
+static constexpr int BENCHMARK_SCENE_COUNT = 3 + CHESS_PIECE_COUNT;
+static constexpr BenchmarkScene BENCHMARK_SCENES[BENCHMARK_SCENE_COUNT] = {
+    BenchmarkScene{BenchmarkScene::Type::RANDOM_SPHERES, ChessPiece::Type::PAWN, "random_spheres"},
+    BenchmarkScene{BenchmarkScene::Type::CORNELL_BOX, ChessPiece::Type::PAWN, "cornell_box"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS, ChessPiece::Type::PAWN, "chess"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS_PIECE, ChessPiece::Type::PAWN, "chess_pawn"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS_PIECE, ChessPiece::Type::ROOK, "chess_rook"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS_PIECE, ChessPiece::Type::KNIGHT, "chess_knight"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS_PIECE, ChessPiece::Type::BISHOP, "chess_bishop"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS_PIECE, ChessPiece::Type::QUEEN, "chess_queen"},
+    BenchmarkScene{BenchmarkScene::Type::CHESS_PIECE, ChessPiece::Type::KING, "chess_king"}
+};
+
+static SceneData construct_scene_data(const BenchmarkScene& benchmark_scene, const JobScheduler& scheduler) {
+    switch (benchmark_scene.type) {
+        case BenchmarkScene::Type::RANDOM_SPHERES: {
+            return construct_random_spheres_scene();
+        }
+
+        case BenchmarkScene::Type::CORNELL_BOX: {
+            return construct_cornell_box_scene();
+        }
+
+        case BenchmarkScene::Type::CHESS: {
+            return construct_chess_scene(scheduler);
+        }
+
+        case BenchmarkScene::Type::CHESS_PIECE: {
+            return construct_chess_piece_scene(benchmark_scene.piece, scheduler);
+        }
+
+        default: {
+            assert(false);
+            return SceneData{};
+        }
+    }
+}
+
+template <typename T>
+static u64 get_memory_size(const std::vector<T>& values) {
+    return values.capacity() * sizeof(T);
+}
+
+static u64 get_memory_size(const BVH& bvh) {
+    return get_memory_size(bvh.nodes) + get_memory_size(bvh.wide_nodes) + get_memory_size(bvh.primitive_indices);
+}
+
+static u64 get_memory_size(const TriangleRecords& triangles) {
+    return
+        get_memory_size(triangles.a_x) + get_memory_size(triangles.a_y) + get_memory_size(triangles.a_z) +
+        get_memory_size(triangles.a_to_b_x) + get_memory_size(triangles.a_to_b_y) + get_memory_size(triangles.a_to_b_z) +
+        get_memory_size(triangles.a_to_c_x) + get_memory_size(triangles.a_to_c_y) + get_memory_size(triangles.a_to_c_z) +
+        get_memory_size(triangles.unit_normals);
+}
+
+// geometry, BVHs and materials, everything the renderer reads that scales with the scene
+static u64 get_memory_size(const SceneData& scene_data) {
+    u64 size = get_memory_size(scene_data.materials) + get_memory_size(scene_data.lights);
+    size += get_memory_size(scene_data.spheres) + get_memory_size(scene_data.sphere_bvh) + get_memory_size(scene_data.sphere_material_indices);
+    size += get_memory_size(scene_data.triangles) + get_memory_size(scene_data.triangle_bvh) + get_memory_size(scene_data.triangle_material_indices);
+    for (const TriangleRecords& mesh_triangles : scene_data.mesh_triangles) {
+        size += get_memory_size(mesh_triangles);
+    }
+
+    for (const BVH& mesh_bvh : scene_data.mesh_bvhs) {
+        size += get_memory_size(mesh_bvh);
+    }
+
+    size += get_memory_size(scene_data.meshes) + get_memory_size(scene_data.instances) + get_memory_size(scene_data.instance_bvh);
+    return size;
+}
+
+struct BenchmarkFrame {
+    const Scene* scene;
+    const Sampler* sampler;
+    PathSettings path_settings;
+    int width;
+    int height;
+    int sample;                         // passes so far, pixels count their own samples
+    real aperture;
+    Vec3 camera_position;
+    Vec3 camera_x;
+    Vec3 camera_y;
+    Vec3 bottom_left;
+    Vec3 step_x;
+    Vec3 step_y;
+    RenderEngine::Type engine;
+    const RenderTile* tiles;
+    int job_count;                      // tiles or bands
+    const AdaptiveTiles* adaptive_tiles;
+    Film* film;
+    BounceHistogram* bounce_histograms; // one per job so they don't share counts
+    RayCounts* ray_counts;              // likewise
+    std::atomic<int>* next_tile_index;  // jobs take tiles in list order, as the app's do
+};
+
+static BenchmarkFrame construct_benchmark_frame(const Scene& scene, const Camera& camera, const Sampler& sampler, const PathSettings& path_settings, const int width, const int height) {
+    const Vec3 camera_x = get_column(camera.orientation, 0);
+    const Vec3 camera_y = get_column(camera.orientation, 1);
+    const Vec3 camera_z = get_column(camera.orientation, 2);
+
+    const real viewport_height = 2.0f * std::tan(0.5f * camera.fov_y);
+    const real viewport_width = static_cast<real>(width) / static_cast<real>(height) * viewport_height;
+
+    BenchmarkFrame frame = {};
+    frame.scene = &scene;
+    frame.sampler = &sampler;
+    frame.path_settings = path_settings;
+    frame.width = width;
+    frame.height = height;
+    frame.aperture = camera.aperture;
+    frame.camera_position = get_position(camera);
+    frame.camera_x = camera_x;
+    frame.camera_y = camera_y;
+    frame.step_x = camera.focus_distance * viewport_width * camera_x;
+    frame.step_y = camera.focus_distance * viewport_height * camera_y;
+    frame.bottom_left = frame.camera_position - 0.5f * frame.step_x - 0.5f * frame.step_y - camera.focus_distance * camera_z;
+
+    return frame;
+}
+
+// one sample for every active pixel in the tile, camera rays traced in packets along its rows as the app does
+static void render_tile_job(void* const data, int) {
+    const BenchmarkFrame& frame = *static_cast<const BenchmarkFrame*>(data);
+    const int tile_index = frame.next_tile_index->fetch_add(1, std::memory_order_relaxed);
+    const RenderTile& tile = frame.tiles[tile_index];
+
+    thread_local FilmTile film_tile = {};
+    begin_film_tile(film_tile, tile);
+    for (int row = tile.row_start; row < tile.row_end; ++row) {
+        for (int packet_start = tile.column_start; packet_start < tile.column_end; packet_start += BENCHMARK_PACKET_SIZE) {
+            int columns[BENCHMARK_PACKET_SIZE];
+            SampleStream sample_streams[BENCHMARK_PACKET_SIZE];
+            Ray rays[BENCHMARK_PACKET_SIZE];
+            int ray_count = 0;
+
+            const int packet_end = std::min(packet_start + BENCHMARK_PACKET_SIZE, tile.column_end);
+            for (int column = packet_start; column < packet_end; ++column) {
+                if (!is_active(*frame.adaptive_tiles, row, column)) {
+                    continue;
+                }
+
+                const int sample = static_cast<int>(frame.film->sample_counts[get_pixel_index(*frame.film, row, column)]);
+                sample_streams[ray_count] = construct_sample_stream(*frame.sampler, column, row, sample);
+                rays[ray_count] = generate_camera_ray(
+                    row,
+                    column,
+                    frame.width,
+                    frame.height,
+                    frame.aperture,
+                    frame.camera_position,
+                    frame.camera_x,
+                    frame.camera_y,
+                    frame.bottom_left,
+                    frame.step_x,
+                    frame.step_y,
+                    sample_streams[ray_count]
+                );
+                columns[ray_count] = column;
+                ++ray_count;
+            }
+
+            if (ray_count == 0) {
+                continue;
+            }
+
+            SceneIntersection first_intersections[BENCHMARK_PACKET_SIZE];
+            intersect_closest(rays, ray_count, *frame.scene, first_intersections);
+            frame.ray_counts[tile_index].closest_hit_count += ray_count;
+            for (int ray_index = 0; ray_index < ray_count; ++ray_index) {
+                const Colour colour = trace_path(rays[ray_index], first_intersections[ray_index], *frame.scene, frame.path_settings, sample_streams[ray_index], frame.bounce_histograms[tile_index], frame.ray_counts[tile_index]);
+                add_sample(film_tile, row, columns[ray_index], colour);
+            }
+        }
+    }
+
+    merge_film_tile(*frame.film, film_tile);
+}
+
+// Every path in a band of whole rows traced together by the wavefront engine, as the app's
+// render_band_wavefront() does
+static void render_band_job(void* const data, const int band) {
+    const BenchmarkFrame& frame = *static_cast<const BenchmarkFrame*>(data);
+    const int row_start = band * BENCHMARK_BAND_HEIGHT;
+    const int row_end = std::min(row_start + BENCHMARK_BAND_HEIGHT, frame.height);
+
+    // kept between passes so the queues aren't reallocated every time
+    thread_local WavefrontQueues queues = {};
+    thread_local FilmTile film_tile = {};
+    thread_local std::vector<Ray> camera_rays;
+    thread_local std::vector<SampleStream> sample_streams;
+    thread_local std::vector<int> pixel_indices;
+    thread_local std::vector<Colour> colours;
+    thread_local std::vector<FeatureSample> features;
+
+    camera_rays.clear();
+    sample_streams.clear();
+    pixel_indices.clear();
+    for (int row = row_start; row < row_end; ++row) {
+        for (int column = 0; column < frame.width; ++column) {
+            if (!is_active(*frame.adaptive_tiles, row, column)) {
+                continue;
+            }
+
+            const int sample = static_cast<int>(frame.film->sample_counts[get_pixel_index(*frame.film, row, column)]);
+            SampleStream sample_stream = construct_sample_stream(*frame.sampler, column, row, sample);
+            camera_rays.push_back(generate_camera_ray(
+                row,
+                column,
+                frame.width,
+                frame.height,
+                frame.aperture,
+                frame.camera_position,
+                frame.camera_x,
+                frame.camera_y,
+                frame.bottom_left,
+                frame.step_x,
+                frame.step_y,
+                sample_stream
+            ));
+            sample_streams.push_back(sample_stream);
+            pixel_indices.push_back(row * frame.width + column);
+        }
+    }
+
+    const int path_count = static_cast<int>(camera_rays.size());
+    colours.resize(path_count);
+    features.resize(path_count);
+    trace_paths(camera_rays.data(), sample_streams.data(), path_count, *frame.scene, frame.path_settings, queues, colours.data(), features.data(), frame.bounce_histograms[band], frame.ray_counts[band]);
+
+    begin_film_tile(film_tile, RenderTile{row_start, row_end, 0, frame.width});
+    for (int path_index = 0; path_index < path_count; ++path_index) {
+        add_sample(film_tile, pixel_indices[path_index] / frame.width, pixel_indices[path_index] % frame.width, colours[path_index]);
+    }
+
+    merge_film_tile(*frame.film, film_tile);
+}
+
+static int get_job_count(const RenderEngine::Type engine, const int tile_count, const int height) {
+    return (engine == RenderEngine::Type::WAVEFRONT) ? (height + BENCHMARK_BAND_HEIGHT - 1) / BENCHMARK_BAND_HEIGHT : tile_count;
+}
+
+// one sample for every active pixel
+static void render_pass(const JobScheduler& scheduler, BenchmarkFrame& frame) {
+    frame.next_tile_index->store(0, std::memory_order_relaxed);
+    parallel_for(scheduler, (frame.engine == RenderEngine::Type::WAVEFRONT) ? render_band_job : render_tile_job, &frame, frame.job_count);
+}
+
+// the first sample_count samples into a film of the caller's, with counts nobody reads
+static void render_check_passes(const JobScheduler& scheduler, BenchmarkFrame frame, const RenderEngine::Type engine, const int tile_count, const int sample_count, Film& film) {
+    frame.engine = engine;
+    frame.job_count = get_job_count(engine, tile_count, frame.height);
+    frame.film = &film;
+
+    std::vector<BounceHistogram> bounce_histograms(frame.job_count);
+    std::vector<RayCounts> ray_counts(frame.job_count);
+    frame.bounce_histograms = bounce_histograms.data();
+    frame.ray_counts = ray_counts.data();
+
+    std::atomic<int> next_tile_index{0};
+    frame.next_tile_index = &next_tile_index;
+    for (frame.sample = 0; frame.sample < sample_count; ++frame.sample) {
+        render_pass(scheduler, frame);
+    }
+}
+
+// pixels whose sums aren't bit for bit the same, any at all means the engines traced different paths
+static int count_differing_pixels(const Film& lhs, const Film& rhs) {
+    assert(lhs.width == rhs.width && lhs.height == rhs.height);
+
+    int differing_pixel_count = 0;
+    for (int row = 0; row < lhs.height; ++row) {
+        for (int column = 0; column < lhs.width; ++column) {
+            const int pixel_index = get_pixel_index(lhs, row, column);
+            const bool pixels_match =
+                (lhs.sample_counts[pixel_index] == rhs.sample_counts[pixel_index]) &&
+                (memcmp(lhs.colours + 3 * pixel_index, rhs.colours + 3 * pixel_index, 3 * sizeof(real)) == 0);
+
+            differing_pixel_count += pixels_match ? 0 : 1;
+        }
+    }
+
+    return differing_pixel_count;
+}
+
+static real to_display(const real value) {
+    return std::min<real>(std::sqrt(std::max<real>(value, 0.0f)), 1.0f);
+}
+
+// rgb, without the film's row padding
+static std::vector<real> get_mean_colours(const Film& film) {
+    std::vector<real> means(3 * film.width * film.height);
+    for (int row = 0; row < film.height; ++row) {
+        for (int column = 0; column < film.width; ++column) {
+            const int pixel_index = get_pixel_index(film, row, column);
+            const real sample_count = static_cast<real>(film.sample_counts[pixel_index]);
+            for (int channel = 0; channel < 3; ++channel) {
+                means[3 * (row * film.width + column) + channel] = film.colours[3 * pixel_index + channel] / sample_count;
+            }
+        }
+    }
+
+    return means;
+}
+
+// through the display's sqrt and clamp so bright pixels the screen clips don't dominate
+static real get_display_rmse(const Film& film, const std::vector<float>& reference) {
+    const std::vector<real> means = get_mean_colours(film);
+    assert(means.size() == reference.size());
+
+    real sum_of_squares = 0.0f;
+    for (std::size_t index = 0; index < means.size(); ++index) {
+        const real difference = to_display(means[index]) - to_display(reference[index]);
+        sum_of_squares += difference * difference;
+    }
+
+    return std::sqrt(sum_of_squares / static_cast<real>(means.size()));
+}
+
+// Per pixel means as floats whatever the build's precision, so either can be measured against them. Bounce
+// limits change what the paths converge to, so they have to match as well as the size.
+struct ReferenceImageHeader {
+    char magic[4];
+    u32 width;
+    u32 height;
+    u32 sample_count;
+    u32 min_bounce_count;
+    u32 max_bounce_count;
+};
+
+static constexpr char REFERENCE_IMAGE_MAGIC[4] = {'R', 'E', 'F', '2'};
+
+static std::string get_reference_filename(const BenchmarkScene& benchmark_scene) {
+    return std::string(REFERENCE_DIRECTORY) + benchmark_scene.name + ".reference";
+}
+
+static void save_reference_image(const char* const filename, const Film& film, const int sample_count, const PathSettings& path_settings) {
+    FILE* const file = fopen(filename, "wb");
+    assert(file != nullptr);
+
+    ReferenceImageHeader header = {};
+    memcpy(header.magic, REFERENCE_IMAGE_MAGIC, sizeof(REFERENCE_IMAGE_MAGIC));
+    header.width = film.width;
+    header.height = film.height;
+    header.sample_count = sample_count;
+    header.min_bounce_count = path_settings.min_bounce_count;
+    header.max_bounce_count = path_settings.max_bounce_count;
+
+    const std::vector<real> real_means = get_mean_colours(film);
+    const std::vector<float> means(real_means.begin(), real_means.end());
+
+    const std::size_t headers_written = fwrite(&header, sizeof(header), 1, file);
+    assert(headers_written == 1);
+    const std::size_t means_written = fwrite(means.data(), sizeof(float), means.size(), file);
+    assert(means_written == means.size());
+
+    const int closed_file = fclose(file);
+    assert(closed_file == 0);
+}
+
+// invalid if there's no reference or it was rendered at another size or with other bounce limits
+static Maybe<ReferenceImageHeader> load_reference_image(const char* const filename, const int width, const int height, const PathSettings& path_settings, std::vector<float>& means) {
+    Maybe<ReferenceImageHeader> header = {};
+    FILE* const file = fopen(filename, "rb");
+    if (file == nullptr) {
+        return header;
+    }
+
+    const std::size_t headers_read = fread(&header.value, sizeof(header.value), 1, file);
+    const bool header_matches =
+        (headers_read == 1) &&
+        (memcmp(header.value.magic, REFERENCE_IMAGE_MAGIC, sizeof(REFERENCE_IMAGE_MAGIC)) == 0) &&
+        (header.value.width == static_cast<u32>(width)) &&
+        (header.value.height == static_cast<u32>(height)) &&
+        (header.value.min_bounce_count == static_cast<u32>(path_settings.min_bounce_count)) &&
+        (header.value.max_bounce_count == static_cast<u32>(path_settings.max_bounce_count));
+
+    if (header_matches) {
+        means.resize(3 * width * height);
+        header.is_valid = (fread(means.data(), sizeof(float), means.size(), file) == means.size());
+    }
+
+    fclose(file);
+    return header;
+}
+
+struct BudgetResult {
+    double seconds;
+    int sample_count;           // passes, the most any pixel has had
+    u64 pixel_sample_count;     // what they add up to, fewer than every pixel every pass when adaptive
+    real display_rmse;
+};
+
+struct SceneResult {
+    const char* name;
+    int width;
+    int height;
+    double build_seconds;
+    u64 memory_size;
+    double render_seconds;
+    int sample_count;
+    u64 pixel_sample_count;
+    RayCounts ray_counts;
+    real mean_bounce_count;
+    Maybe<ReferenceImageHeader> reference;
+    Maybe<int> megakernel_differing_pixel_count;   // only checked for the wavefront engine
+    BudgetResult budget_results[TIME_BUDGET_COUNT];
+    ThreadPoolCounters render_counters;
+};
+
+struct BenchmarkOptions {
+    bool writing_references;
+    const char* results_filename;
+    const char* scene_name;     // every scene when null
+    int image_width;
+    int tile_size;
+    TileOrder::Type tile_order;
+    Sampler::Type sampler;
+    PathSettings path_settings;
+    RenderEngine::Type engine;
+    bool adaptive;
+
+    bool benchmarking_bvh_builds;
+    BVHBuilder::Type bvh_builder;
+    int mesh_copy_count;
+    int refit_frame_count;      // zero unless benchmarking refits
+};
+
+static Maybe<TileOrder::Type> parse_tile_order(const char* const name) {
+    static constexpr TileOrder::Type TILE_ORDERS[3] = {TileOrder::Type::SCANLINES, TileOrder::Type::MORTON, TileOrder::Type::HILBERT};
+
+    Maybe<TileOrder::Type> tile_order = {};
+    for (const TileOrder::Type order : TILE_ORDERS) {
+        if (strcmp(name, get_tile_order_name(order)) == 0) {
+            tile_order.value = order;
+            tile_order.is_valid = true;
+        }
+    }
+
+    return tile_order;
+}
+
+static const char* get_render_engine_name(const RenderEngine::Type engine) {
+    switch (engine) {
+        case RenderEngine::Type::MEGAKERNEL: {
+            return "megakernel";
+        }
+
+        case RenderEngine::Type::WAVEFRONT: {
+            return "wavefront";
+        }
+
+        default: {
+            assert(false);
+            return "";
+        }
+    }
+}
+
+static Maybe<RenderEngine::Type> parse_render_engine(const char* const name) {
+    static constexpr RenderEngine::Type RENDER_ENGINES[2] = {RenderEngine::Type::MEGAKERNEL, RenderEngine::Type::WAVEFRONT};
+
+    Maybe<RenderEngine::Type> render_engine = {};
+    for (const RenderEngine::Type engine : RENDER_ENGINES) {
+        if (strcmp(name, get_render_engine_name(engine)) == 0) {
+            render_engine.value = engine;
+            render_engine.is_valid = true;
+        }
+    }
+
+    return render_engine;
+}
+
+static Maybe<BVHBuilder::Type> parse_bvh_builder(const char* const name) {
+    static constexpr BVHBuilder::Type BVH_BUILDERS[2] = {BVHBuilder::Type::SAH, BVHBuilder::Type::LINEAR};
+
+    Maybe<BVHBuilder::Type> bvh_builder = {};
+    for (const BVHBuilder::Type builder : BVH_BUILDERS) {
+        if (strcmp(name, get_bvh_builder_name(builder)) == 0) {
+            bvh_builder.value = builder;
+            bvh_builder.is_valid = true;
+        }
+    }
+
+    return bvh_builder;
+}
+
+static Maybe<Sampler::Type> parse_sampler(const char* const name) {
+    static constexpr Sampler::Type SAMPLERS[3] = {Sampler::Type::RANDOM, Sampler::Type::SOBOL, Sampler::Type::BLUE_NOISE};
+
+    Maybe<Sampler::Type> sampler = {};
+    for (const Sampler::Type type : SAMPLERS) {
+        if (strcmp(name, get_sampler_name(type)) == 0) {
+            sampler.value = type;
+            sampler.is_valid = true;
+        }
+    }
+
+    return sampler;
+}
+
+// invalid if the arguments don't make sense
+static Maybe<BenchmarkOptions> parse_options(const int argument_count, char** const arguments) {
+    Maybe<BenchmarkOptions> options = {};
+    options.value.image_width = BENCHMARK_IMAGE_WIDTH;
+    options.value.tile_size = BENCHMARK_TILE_SIZE;
+    options.value.tile_order = BENCHMARK_TILE_ORDER;
+    options.value.mesh_copy_count = BENCHMARK_MESH_COPY_COUNT;
+    options.value.sampler = BENCHMARK_SAMPLER;
+    options.value.path_settings = DEFAULT_PATH_SETTINGS;
+    options.value.engine = BENCHMARK_RENDER_ENGINE;
+
+    for (int argument_index = 1; argument_index < argument_count; ++argument_index) {
+        const char* const argument = arguments[argument_index];
+        const char* const value = (argument_index + 1 < argument_count) ? arguments[argument_index + 1] : nullptr;
+        if (strcmp(argument, "--write-references") == 0) {
+            options.value.writing_references = true;
+        } else if (strcmp(argument, "--adaptive") == 0) {
+            options.value.adaptive = true;
+        } else if (strcmp(argument, "--order") == 0 && value != nullptr) {
+            const Maybe<TileOrder::Type> tile_order = parse_tile_order(value);
+            if (!tile_order.is_valid) {
+                return options;
+            }
+
+            options.value.tile_order = tile_order.value;
+            ++argument_index;
+        } else if (strcmp(argument, "--tile-size") == 0 && value != nullptr) {
+            options.value.tile_size = atoi(value);
+            ++argument_index;
+        } else if (strcmp(argument, "--width") == 0 && value != nullptr) {
+            options.value.image_width = atoi(value);
+            ++argument_index;
+        } else if (strcmp(argument, "--scene") == 0 && value != nullptr) {
+            options.value.scene_name = value;
+            ++argument_index;
+        } else if (strcmp(argument, "--sampler") == 0 && value != nullptr) {
+            const Maybe<Sampler::Type> sampler = parse_sampler(value);
+            if (!sampler.is_valid) {
+                return options;
+            }
+
+            options.value.sampler = sampler.value;
+            ++argument_index;
+        } else if (strcmp(argument, "--min-bounces") == 0 && value != nullptr) {
+            options.value.path_settings.min_bounce_count = atoi(value);
+            ++argument_index;
+        } else if (strcmp(argument, "--max-bounces") == 0 && value != nullptr) {
+            options.value.path_settings.max_bounce_count = atoi(value);
+            ++argument_index;
+        } else if (strcmp(argument, "--engine") == 0 && value != nullptr) {
+            const Maybe<RenderEngine::Type> engine = parse_render_engine(value);
+            if (!engine.is_valid) {
+                return options;
+            }
+
+            options.value.engine = engine.value;
+            ++argument_index;
+        } else if (strcmp(argument, "--bvh-builder") == 0 && value != nullptr) {
+            const Maybe<BVHBuilder::Type> bvh_builder = parse_bvh_builder(value);
+            if (!bvh_builder.is_valid) {
+                return options;
+            }
+
+            options.value.benchmarking_bvh_builds = true;
+            options.value.bvh_builder = bvh_builder.value;
+            ++argument_index;
+        } else if (strcmp(argument, "--mesh-copies") == 0 && value != nullptr) {
+            options.value.mesh_copy_count = atoi(value);
+            ++argument_index;
+        } else if (strcmp(argument, "--refit-frames") == 0 && value != nullptr) {
+            options.value.refit_frame_count = atoi(value);
+            if (options.value.refit_frame_count <= 0) {
+                return options;
+            }
+
+            ++argument_index;
+        } else if (argument[0] != '-' && options.value.results_filename == nullptr) {
+            options.value.results_filename = argument;
+        } else {
+            return options;
+        }
+    }
+
+    const PathSettings& path_settings = options.value.path_settings;
+    options.value.path_settings = construct_path_settings(path_settings.min_bounce_count, path_settings.max_bounce_count);
+    options.is_valid = (options.value.image_width > 0) && (options.value.tile_size > 0) && (options.value.mesh_copy_count > 0);
+    return options;
+}
+
+static void write_results(FILE* const file, const SceneResult* const results, const int result_count, const BenchmarkOptions& options, const int thread_count) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"precision\": \"%s\",\n", (sizeof(real) == sizeof(float)) ? "float" : "double");
+    fprintf(file, "  \"real_size\": %d,\n", static_cast<int>(sizeof(real)));
+    fprintf(file, "  \"thread_count\": %d,\n", thread_count);
+    fprintf(file, "  \"engine\": \"%s\",\n", get_render_engine_name(options.engine));
+    fprintf(file, "  \"tile_order\": \"%s\",\n", get_tile_order_name(options.tile_order));
+    fprintf(file, "  \"tile_size\": %d,\n", (options.tile_order == TileOrder::Type::SCANLINES) ? 1 : options.tile_size);
+    fprintf(file, "  \"sampler\": \"%s\",\n", get_sampler_name(options.sampler));
+    fprintf(file, "  \"min_bounces\": %d,\n", options.path_settings.min_bounce_count);
+    fprintf(file, "  \"max_bounces\": %d,\n", options.path_settings.max_bounce_count);
+    fprintf(file, "  \"sampling\": \"%s\",\n", options.adaptive ? "adaptive" : "uniform");
+    fprintf(file, "  \"adaptive_min_samples\": %d,\n", ADAPTIVE_MIN_SAMPLE_COUNT);
+    fprintf(file, "  \"adaptive_error_threshold\": %.4f,\n", static_cast<double>(ADAPTIVE_ERROR_THRESHOLD));
+    fprintf(file, "  \"scenes\": [\n");
+    for (int result_index = 0; result_index < result_count; ++result_index) {
+        const SceneResult& result = results[result_index];
+        const double pixel_sample_count = static_cast<double>(result.pixel_sample_count);
+        const u64 ray_count = result.ray_counts.closest_hit_count + result.ray_counts.shadow_count;
+
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": \"%s\",\n", result.name);
+        fprintf(file, "      \"width\": %d,\n", result.width);
+        fprintf(file, "      \"height\": %d,\n", result.height);
+        fprintf(file, "      \"build_seconds\": %.4f,\n", result.build_seconds);
+        fprintf(file, "      \"memory_bytes\": %llu,\n", result.memory_size);
+        fprintf(file, "      \"render_seconds\": %.4f,\n", result.render_seconds);
+        fprintf(file, "      \"samples_per_pixel\": %d,\n", result.sample_count);
+        fprintf(file, "      \"pixel_samples\": %llu,\n", result.pixel_sample_count);
+        fprintf(file, "      \"mean_bounce_count\": %.4f,\n", static_cast<double>(result.mean_bounce_count));
+        fprintf(file, "      \"msamples_per_second\": %.4f,\n", pixel_sample_count / result.render_seconds * 1.0e-6);
+        fprintf(file, "      \"closest_hit_rays\": %llu,\n", result.ray_counts.closest_hit_count);
+        fprintf(file, "      \"shadow_rays\": %llu,\n", result.ray_counts.shadow_count);
+        // closest hit and shadow rays together, every intersect_closest() and occluded() call
+        fprintf(file, "      \"mrays_per_second\": %.4f,\n", static_cast<double>(ray_count) / result.render_seconds * 1.0e-6);
+        if (result.reference.is_valid) {
+            fprintf(file, "      \"reference_samples_per_pixel\": %u,\n", result.reference.value.sample_count);
+        } else {
+            fprintf(file, "      \"reference_samples_per_pixel\": null,\n");
+        }
+
+        if (result.megakernel_differing_pixel_count.is_valid) {
+            fprintf(file, "      \"megakernel_differing_pixels\": %d,\n", result.megakernel_differing_pixel_count.value);
+        } else {
+            fprintf(file, "      \"megakernel_differing_pixels\": null,\n");
+        }
+
+        const ThreadPoolCounters& counters = result.render_counters;
+        fprintf(
+            file,
+            "      \"render_thread_pool\": {\"jobs\": %llu, \"steals\": %llu, \"failed_steals\": %llu, \"sleeps\": %llu, \"sleep_seconds\": %.4f},\n",
+            counters.job_count,
+            counters.steal_count,
+            counters.failed_steal_count,
+            counters.sleep_count,
+            counters.sleep_seconds
+        );
+
+        fprintf(file, "      \"budgets\": [\n");
+        for (int budget_index = 0; budget_index < TIME_BUDGET_COUNT; ++budget_index) {
+            const BudgetResult& budget_result = result.budget_results[budget_index];
+            const double uniform_pixel_sample_count = static_cast<double>(result.width) * result.height * budget_result.sample_count;
+            fprintf(
+                file,
+                "        {\"seconds\": %.2f, \"samples_per_pixel\": %d, \"pixel_samples\": %llu, \"uniform_sample_fraction\": %.4f, \"display_rmse\": ",
+                budget_result.seconds,
+                budget_result.sample_count,
+                budget_result.pixel_sample_count,
+                static_cast<double>(budget_result.pixel_sample_count) / uniform_pixel_sample_count
+            );
+            if (result.reference.is_valid) {
+                fprintf(file, "%.6f}", static_cast<double>(budget_result.display_rmse));
+            } else {
+                fprintf(file, "null}");
+            }
+
+            fprintf(file, (budget_index + 1 < TIME_BUDGET_COUNT) ? ",\n" : "\n");
+        }
+
+        fprintf(file, "      ]\n");
+        fprintf(file, (result_index + 1 < result_count) ? "    },\n" : "    }\n");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+static ThreadPoolCounters get_difference(const ThreadPoolCounters& lhs, const ThreadPoolCounters& rhs) {
+    return ThreadPoolCounters{
+        lhs.job_count - rhs.job_count,
+        lhs.steal_count - rhs.steal_count,
+        lhs.failed_steal_count - rhs.failed_steal_count,
+        lhs.sleep_count - rhs.sleep_count,
+        lhs.sleep_seconds - rhs.sleep_seconds
+    };
+}
+
+static double get_seconds_since(const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(const int argument_count, char** const arguments) {
+    const Maybe<BenchmarkOptions> parsed_options = parse_options(argument_count, arguments);
+    if (!parsed_options.is_valid) {
+        fprintf(stderr, "usage: benchmark [--write-references] [--order scanlines|morton|hilbert] [--tile-size n] [--width n] [--scene name]\n");
+        fprintf(stderr, "                 [--sampler random|sobol|blue-noise] [--min-bounces n] [--max-bounces n]\n");
+        fprintf(stderr, "                 [--engine megakernel|wavefront] [--adaptive] [results.json]\n");
+        fprintf(stderr, "       benchmark --bvh-builder sah|lbvh [--mesh-copies n] [results.json]\n");
+        fprintf(stderr, "       benchmark --refit-frames n [results.json]\n");
+        return 1;
+    }
+
+    const BenchmarkOptions& options = parsed_options.value;
+
+    ThreadPool thread_pool;
+    start_thread_pool(thread_pool, get_default_worker_count());
+    const JobScheduler job_scheduler = get_job_scheduler(thread_pool);
+    if (options.benchmarking_bvh_builds) {
+        const std::vector<BVHBuildResult> build_results = run_bvh_build_benchmark(options.bvh_builder, options.mesh_copy_count, job_scheduler);
+        const int thread_count = static_cast<int>(thread_pool.threads.size()) + 1;
+        stop_thread_pool(thread_pool);
+
+        FILE* const results_file = (options.results_filename != nullptr) ? fopen(options.results_filename, "w") : stdout;
+        assert(results_file != nullptr);
+        write_bvh_build_results(results_file, build_results, options.bvh_builder, thread_count);
+        if (results_file != stdout) {
+            fclose(results_file);
+        }
+
+        return passed_checks(build_results) ? 0 : 1;
+    }
+
+    if (options.refit_frame_count > 0) {
+        const std::vector<BVHRefitResult> refit_results = run_bvh_refit_benchmark(options.refit_frame_count, job_scheduler);
+        const int thread_count = static_cast<int>(thread_pool.threads.size()) + 1;
+        stop_thread_pool(thread_pool);
+
+        FILE* const results_file = (options.results_filename != nullptr) ? fopen(options.results_filename, "w") : stdout;
+        assert(results_file != nullptr);
+        write_bvh_refit_results(results_file, refit_results, thread_count);
+        if (results_file != stdout) {
+            fclose(results_file);
+        }
+
+        return passed_checks(refit_results) ? 0 : 1;
+    }
+
+    const BlueNoiseTile blue_noise_tile = construct_blue_noise_tile();
+    const Sampler sampler = construct_sampler(options.sampler, blue_noise_tile);
+
+    SceneResult results[BENCHMARK_SCENE_COUNT] = {};
+    int result_count = 0;
+    bool engines_matched = true;
+    for (int scene_index = 0; scene_index < BENCHMARK_SCENE_COUNT; ++scene_index) {
+        const BenchmarkScene& benchmark_scene = BENCHMARK_SCENES[scene_index];
+        if (options.scene_name != nullptr && strcmp(options.scene_name, benchmark_scene.name) != 0) {
+            continue;
+        }
+
+        fprintf(stderr, "%s\n", benchmark_scene.name);
+
+        const std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+        const SceneData scene_data = construct_scene_data(benchmark_scene, job_scheduler);
+        const double build_seconds = get_seconds_since(build_start);
+
+        const Scene scene = get_scene(scene_data);
+        const int width = options.image_width;
+        const int height = static_cast<int>(static_cast<real>(width) / scene_data.aspect_ratio);
+
+        const std::vector<RenderTile> tiles = construct_render_tiles(width, height, options.tile_size, options.tile_order);
+        const int tile_count = static_cast<int>(tiles.size());
+
+        const int job_count = get_job_count(options.engine, tile_count, height);
+        AdaptiveTiles adaptive_tiles = construct_adaptive_tiles(width, height);
+
+        Film film = construct_film(width, height);
+        std::vector<BounceHistogram> job_bounce_histograms(job_count);
+        std::vector<RayCounts> job_ray_counts(job_count);
+        BenchmarkFrame frame = construct_benchmark_frame(scene, scene_data.camera, sampler, options.path_settings, width, height);
+        frame.engine = options.engine;
+        frame.tiles = tiles.data();
+        frame.job_count = job_count;
+        frame.adaptive_tiles = &adaptive_tiles;
+        frame.film = &film;
+        frame.bounce_histograms = job_bounce_histograms.data();
+        frame.ray_counts = job_ray_counts.data();
+
+        std::atomic<int> next_tile_index{0};
+        frame.next_tile_index = &next_tile_index;
+
+        const std::string reference_filename = get_reference_filename(benchmark_scene);
+        if (options.writing_references) {
+            for (frame.sample = 0; frame.sample < REFERENCE_SAMPLE_COUNT; ++frame.sample) {
+                render_pass(job_scheduler, frame);
+            }
+
+            save_reference_image(reference_filename.c_str(), film, REFERENCE_SAMPLE_COUNT, options.path_settings);
+            destroy_film(film);
+            continue;
+        }
+
+        SceneResult& result = results[result_count];
+        ++result_count;
+        result.name = benchmark_scene.name;
+        result.width = width;
+        result.height = height;
+        result.build_seconds = build_seconds;
+        result.memory_size = get_memory_size(scene_data);
+
+        std::vector<float> reference;
+        result.reference = load_reference_image(reference_filename.c_str(), width, height, options.path_settings, reference);
+        if (!result.reference.is_valid) {
+            fprintf(stderr, "  no reference at %s for this size and bounces, errors won't be measured\n", reference_filename.c_str());
+        }
+
+        if (options.engine == RenderEngine::Type::WAVEFRONT) {
+            Film megakernel_film = construct_film(width, height);
+            Film wavefront_film = construct_film(width, height);
+            render_check_passes(job_scheduler, frame, RenderEngine::Type::MEGAKERNEL, tile_count, ENGINE_CHECK_SAMPLE_COUNT, megakernel_film);
+            render_check_passes(job_scheduler, frame, RenderEngine::Type::WAVEFRONT, tile_count, ENGINE_CHECK_SAMPLE_COUNT, wavefront_film);
+
+            result.megakernel_differing_pixel_count.value = count_differing_pixels(megakernel_film, wavefront_film);
+            result.megakernel_differing_pixel_count.is_valid = true;
+            engines_matched = engines_matched && (result.megakernel_differing_pixel_count.value == 0);
+            if (result.megakernel_differing_pixel_count.value > 0) {
+                fprintf(stderr, "  %d pixels differ from the megakernel's\n", result.megakernel_differing_pixel_count.value);
+            }
+
+            destroy_film(wavefront_film);
+            destroy_film(megakernel_film);
+        }
+
+        // sleeps are counted when they end, so workers idle while the scene was built add that time here
+        const ThreadPoolCounters counters_before_render = get_counters(thread_pool);
+        int budget_index = 0;
+        int active_tile_count = adaptive_tiles.tile_count;
+        while (budget_index < TIME_BUDGET_COUNT) {
+            // deciding which tiles have converged is part of what adaptive sampling costs, so it's timed
+            const std::chrono::steady_clock::time_point pass_start = std::chrono::steady_clock::now();
+            result.pixel_sample_count += get_active_pixel_count(adaptive_tiles);
+            render_pass(job_scheduler, frame);
+            if (options.adaptive) {
+                active_tile_count = update_active_tiles(film, adaptive_tiles);
+            }
+
+            result.render_seconds += get_seconds_since(pass_start);
+            ++frame.sample;
+
+            // once every tile has converged the image won't change, the budgets left over get it as it is
+            while (budget_index < TIME_BUDGET_COUNT && (result.render_seconds >= TIME_BUDGETS[budget_index] || active_tile_count == 0)) {
+                BudgetResult& budget_result = result.budget_results[budget_index];
+                budget_result.seconds = TIME_BUDGETS[budget_index];
+                budget_result.sample_count = frame.sample;
+                budget_result.pixel_sample_count = result.pixel_sample_count;
+                budget_result.display_rmse = result.reference.is_valid ? get_display_rmse(film, reference) : 0.0f;
+                ++budget_index;
+            }
+        }
+
+        result.render_counters = get_difference(get_counters(thread_pool), counters_before_render);
+
+        BounceHistogram bounce_histogram = {};
+        for (const BounceHistogram& job_bounce_histogram : job_bounce_histograms) {
+            add(bounce_histogram, job_bounce_histogram);
+        }
+
+        for (const RayCounts& job_ray_count : job_ray_counts) {
+            add(result.ray_counts, job_ray_count);
+        }
+
+        destroy_film(film);
+        result.sample_count = frame.sample;
+        result.mean_bounce_count = get_mean_bounce_count(bounce_histogram);
+    }
+
+    const int thread_count = static_cast<int>(thread_pool.threads.size()) + 1;
+    stop_thread_pool(thread_pool);
+    if (options.writing_references) {
+        return 0;
+    }
+
+    FILE* const results_file = (options.results_filename != nullptr) ? fopen(options.results_filename, "w") : stdout;
+    assert(results_file != nullptr);
+    write_results(results_file, results, result_count, options, thread_count);
+    if (results_file != stdout) {
+        fclose(results_file);
+    }
+
+    return engines_matched ? 0 : 1;
+}
@@ -1,100 +1,1294 @@
 #include "bvh.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <memory>
 
-using AABBLessThan = bool(*)(const std::vector<AABB>&, int, int);
+static constexpr AABB EMPTY_AABB{Vec3{REAL_MAX, REAL_MAX, REAL_MAX}, Vec3{-REAL_MAX, -REAL_MAX, -REAL_MAX}};
 
-static bool aabb_less_than_x(const std::vector<AABB>& aabbs, const int lhs_index, const int rhs_index) {
-    return aabbs[lhs_index].min.x < aabbs[rhs_index].min.x;
+// a primitive, or after spatial splits the part of a triangle on one side of the splitting planes
+struct BVHReference {
+    AABB aabb;
+    int primitive_index;
+};
+
+struct SAHBin {
+    AABB aabb;
+    int count;
+};
+
+struct SAHSplit {
+    int axis;
+    int bin_index;  // references with centroids in bins [0, bin_index] go to the left child
+    real cost;
+    AABB left_aabb;
+    AABB right_aabb;
+};
+
+struct SpatialBin {
+    AABB aabb;          // clipped to the bin
+    int entry_count;    // references whose bounds start in this bin
+    int exit_count;     // references whose bounds end in this bin
+};
+
+struct SpatialSplit {
+    int axis;
+    real position;
+    real cost;
+};
+
+struct BVHBuildState {
+    BVHBuildSettings settings;
+    const Triangle* triangles;  // only set when references can be split spatially
+    real root_area;
+    int duplicate_budget;       // references spatial splits can still add
+    int max_depth;              // below the root being built, MAX_BVH_DEPTH unless it goes under another tree
+
+    // scratch space for the binning sweeps so nodes don't allocate
+    std::vector<SAHBin> bins;
+    std::vector<SpatialBin> spatial_bins;
+    std::vector<AABB> right_aabbs;
+    std::vector<int> right_counts;
+};
+
+static int get_bin_index(const real component, const real bin_min, const real bin_scale, const int bin_count) {
+    const int bin_index = static_cast<int>((component - bin_min) * bin_scale);
+    return std::min(std::max(bin_index, 0), bin_count - 1);
 }
 
-static bool aabb_less_than_y(const std::vector<AABB>& aabbs, const int lhs_index, const int rhs_index) {
-    return aabbs[lhs_index].min.y < aabbs[rhs_index].min.y;
+static Maybe<SAHSplit> find_sah_split(BVHBuildState& state, const std::vector<BVHReference>& references, const AABB& node_aabb, const AABB& centroid_aabb) {
+    const int bin_count = state.settings.bin_count;
+    const real node_area = surface_area(node_aabb);
+
+    Maybe<SAHSplit> best_split = {};
+    best_split.value.cost = REAL_MAX;
+    for (int axis = 0; axis < 3; ++axis) {
+        const real centroid_min = get_component(centroid_aabb.min, axis);
+        const real centroid_extent = get_component(centroid_aabb.max, axis) - centroid_min;
+        if (centroid_extent <= 0.0f) {
+            continue;
+        }
+
+        const real bin_scale = static_cast<real>(bin_count) / centroid_extent;
+        for (SAHBin& bin : state.bins) {
+            bin = SAHBin{EMPTY_AABB, 0};
+        }
+
+        for (const BVHReference& reference : references) {
+            const real centroid_component = get_component(centroid(reference.aabb), axis);
+            SAHBin& bin = state.bins[get_bin_index(centroid_component, centroid_min, bin_scale, bin_count)];
+            bin.aabb += reference.aabb;
+            ++bin.count;
+        }
+
+        // sweep right to left accumulating the right hand side of every candidate plane
+        AABB right_aabb = EMPTY_AABB;
+        int right_count = 0;
+        for (int bin_index = bin_count - 1; bin_index > 0; --bin_index) {
+            right_aabb += state.bins[bin_index].aabb;
+            right_count += state.bins[bin_index].count;
+            state.right_aabbs[bin_index - 1] = right_aabb;
+            state.right_counts[bin_index - 1] = right_count;
+        }
+
+        // then left to right, the plane after bin_index splits [0, bin_index] | [bin_index + 1, bin_count)
+        AABB left_aabb = EMPTY_AABB;
+        int left_count = 0;
+        for (int bin_index = 0; bin_index < bin_count - 1; ++bin_index) {
+            left_aabb += state.bins[bin_index].aabb;
+            left_count += state.bins[bin_index].count;
+            const int right_count_for_plane = state.right_counts[bin_index];
+            if (left_count == 0 || right_count_for_plane == 0) {
+                continue;
+            }
+
+            const real left_cost = surface_area(left_aabb) * static_cast<real>(left_count);
+            const real right_cost = surface_area(state.right_aabbs[bin_index]) * static_cast<real>(right_count_for_plane);
+            const real cost = state.settings.traversal_cost + state.settings.intersection_cost * (left_cost + right_cost) / node_area;
+            if (cost < best_split.value.cost) {
+                best_split.value = SAHSplit{axis, bin_index, cost, left_aabb, state.right_aabbs[bin_index]};
+                best_split.is_valid = true;
+            }
+        }
+    }
+
+    return best_split;
 }
 
-static bool aabb_less_than_z(const std::vector<AABB>& aabbs, const int lhs_index, const int rhs_index) {
-    return aabbs[lhs_index].min.z < aabbs[rhs_index].min.z;
+// Clips the triangle to either side of the plane, each side is also kept inside the reference's
+// bounds since it may already have been split. A side the triangle doesn't reach comes back empty.
+static void split_reference(const BVHReference& reference, const Triangle& triangle, const int axis, const real position, BVHReference& left, BVHReference& right) {
+    AABB left_aabb = EMPTY_AABB;
+    AABB right_aabb = EMPTY_AABB;
+    const Vec3 vertices[3] = {triangle.a, triangle.b, triangle.c};
+    for (int vertex_index = 0; vertex_index < 3; ++vertex_index) {
+        const Vec3& start = vertices[vertex_index];
+        const Vec3& end = vertices[(vertex_index + 1) % 3];
+        const real start_component = get_component(start, axis);
+        const real end_component = get_component(end, axis);
+        if (start_component <= position) {
+            left_aabb += AABB{start, start};
+        }
+
+        if (start_component >= position) {
+            right_aabb += AABB{start, start};
+        }
+
+        const bool edge_crosses_plane = (start_component < position && position < end_component) || (end_component < position && position < start_component);
+        if (edge_crosses_plane) {
+            const real t = (position - start_component) / (end_component - start_component);
+            const Vec3 crossing = start + t * (end - start);
+            left_aabb += AABB{crossing, crossing};
+            right_aabb += AABB{crossing, crossing};
+        }
+    }
+
+    left = BVHReference{intersection(left_aabb, reference.aabb), reference.primitive_index};
+    right = BVHReference{intersection(right_aabb, reference.aabb), reference.primitive_index};
 }
 
-static int add_node(BVH& bvh, const int axis, const std::vector<AABB>& aabbs, std::vector<int>& indices, const int start_index, const int end_index) {
-    bvh.push_back(Node{});
-    const int node_index = bvh.size() - 1;
+// Stich et al. spatial splits: bins are evenly spaced over the node's bounds and references are
+// clipped into every bin they cover, so a straddling reference counts on both sides of a plane.
+static Maybe<SpatialSplit> find_spatial_split(BVHBuildState& state, const std::vector<BVHReference>& references, const AABB& node_aabb) {
+    const int bin_count = state.settings.bin_count;
+    const int count = references.size();
+    const real node_area = surface_area(node_aabb);
 
-    const int count = end_index - start_index;
-    if (count == 1) {
-        Node& node = bvh[node_index];
-        const int aabb_index = indices[start_index];
-        node.aabb = aabbs[aabb_index];
-        node.index = aabb_index;
-        return node_index;
+    Maybe<SpatialSplit> best_split = {};
+    best_split.value.cost = REAL_MAX;
+    for (int axis = 0; axis < 3; ++axis) {
+        const real node_min = get_component(node_aabb.min, axis);
+        const real node_extent = get_component(node_aabb.max, axis) - node_min;
+        if (node_extent <= 0.0f) {
+            continue;
+        }
+
+        const real bin_width = node_extent / static_cast<real>(bin_count);
+        const real bin_scale = static_cast<real>(bin_count) / node_extent;
+        for (SpatialBin& bin : state.spatial_bins) {
+            bin = SpatialBin{EMPTY_AABB, 0, 0};
+        }
+
+        for (const BVHReference& reference : references) {
+            const int first_bin_index = get_bin_index(get_component(reference.aabb.min, axis), node_min, bin_scale, bin_count);
+            const int last_bin_index = get_bin_index(get_component(reference.aabb.max, axis), node_min, bin_scale, bin_count);
+
+            // chop the reference along the bin boundaries it covers
+            BVHReference remaining = reference;
+            for (int bin_index = first_bin_index; bin_index < last_bin_index; ++bin_index) {
+                const real position = node_min + static_cast<real>(bin_index + 1) * bin_width;
+                BVHReference left = {};
+                BVHReference right = {};
+                split_reference(remaining, state.triangles[reference.primitive_index], axis, position, left, right);
+                if (!is_empty(left.aabb)) {
+                    state.spatial_bins[bin_index].aabb += left.aabb;
+                }
+
+                remaining = right;
+            }
+
+            if (!is_empty(remaining.aabb)) {
+                state.spatial_bins[last_bin_index].aabb += remaining.aabb;
+            }
+
+            ++state.spatial_bins[first_bin_index].entry_count;
+            ++state.spatial_bins[last_bin_index].exit_count;
+        }
+
+        AABB right_aabb = EMPTY_AABB;
+        int right_count = 0;
+        for (int bin_index = bin_count - 1; bin_index > 0; --bin_index) {
+            right_aabb += state.spatial_bins[bin_index].aabb;
+            right_count += state.spatial_bins[bin_index].exit_count;
+            state.right_aabbs[bin_index - 1] = right_aabb;
+            state.right_counts[bin_index - 1] = right_count;
+        }
+
+        AABB left_aabb = EMPTY_AABB;
+        int left_count = 0;
+        for (int bin_index = 0; bin_index < bin_count - 1; ++bin_index) {
+            left_aabb += state.spatial_bins[bin_index].aabb;
+            left_count += state.spatial_bins[bin_index].entry_count;
+            const int right_count_for_plane = state.right_counts[bin_index];
+            const int duplicate_count = left_count + right_count_for_plane - count;
+            if (left_count == 0 || right_count_for_plane == 0 || duplicate_count > state.duplicate_budget) {
+                continue;
+            }
+
+            const real left_cost = surface_area(left_aabb) * static_cast<real>(left_count);
+            const real right_cost = surface_area(state.right_aabbs[bin_index]) * static_cast<real>(right_count_for_plane);
+            const real cost = state.settings.traversal_cost + state.settings.intersection_cost * (left_cost + right_cost) / node_area;
+            if (cost < best_split.value.cost) {
+                best_split.value = SpatialSplit{axis, node_min + static_cast<real>(bin_index + 1) * bin_width, cost};
+                best_split.is_valid = true;
+            }
+        }
     }
 
-    const AABBLessThan aabb_less_than = (axis == 0) ? aabb_less_than_x : ((axis == 1) ? aabb_less_than_y : aabb_less_than_z);
-    std::sort(
-        indices.begin() + start_index,
-        indices.begin() + end_index,
-        [&aabbs, aabb_less_than](const int lhs_index, const int rhs_index) { return aabb_less_than(aabbs, lhs_index, rhs_index); }
-    );
+    return best_split;
+}
 
-    const int next_axis = (axis + 1) % 3;
-    const int mid_index = start_index + (count / 2);
-    bvh[node_index].left = add_node(bvh, next_axis, aabbs, indices, start_index, mid_index);
-    bvh[node_index].right = add_node(bvh, next_axis, aabbs, indices, mid_index, end_index);
+static float round_down_to_float(const real value) {
+    const float rounded = static_cast<float>(value);
+    return (static_cast<real>(rounded) > value) ? std::nextafter(rounded, -FLT_MAX) : rounded;
+}
 
-    Node& node = bvh[node_index];
-    node.aabb = bvh[node.left].aabb;
-    node.aabb += bvh[node.right].aabb;
+static float round_up_to_float(const real value) {
+    const float rounded = static_cast<float>(value);
+    return (static_cast<real>(rounded) < value) ? std::nextafter(rounded, FLT_MAX) : rounded;
+}
 
-    const int prev_axis = (axis + 2) % 3;
-    const AABBLessThan prev_aabb_less_than = (prev_axis == 0) ? aabb_less_than_x : ((prev_axis == 1) ? aabb_less_than_y : aabb_less_than_z);
-    std::sort(
-        indices.begin() + start_index,
-        indices.begin() + end_index,
-        [&aabbs, prev_aabb_less_than](const int lhs_index, const int rhs_index) { return prev_aabb_less_than(aabbs, lhs_index, rhs_index); }
-    );
+static void set_aabb(Node& node, const AABB& aabb) {
+    node.min[0] = round_down_to_float(aabb.min.x);
+    node.min[1] = round_down_to_float(aabb.min.y);
+    node.min[2] = round_down_to_float(aabb.min.z);
+
+    node.max[0] = round_up_to_float(aabb.max.x);
+    node.max[1] = round_up_to_float(aabb.max.y);
+    node.max[2] = round_up_to_float(aabb.max.z);
+}
+
+static AABB get_aabb(const Node& node) {
+    return AABB{Vec3{node.min[0], node.min[1], node.min[2]}, Vec3{node.max[0], node.max[1], node.max[2]}};
+}
+
+static bool is_leaf(const Node& node) {
+    return node.primitive_count > 0;
+}
+
+static bool is_wide(const BVH& bvh) {
+    return !bvh.wide_nodes.empty();
+}
+
+// moves the right hand side of the object split into right_references
+static void partition_references(const BVHBuildState& state, const Maybe<SAHSplit>& split, const AABB& centroid_aabb, std::vector<BVHReference>& references, std::vector<BVHReference>& right_references) {
+    // all centroids coincide when there's no valid split, any partition is as good as another
+    auto mid = references.begin() + (references.size() / 2);
+    if (split.is_valid) {
+        const int axis = split.value.axis;
+        const real centroid_min = get_component(centroid_aabb.min, axis);
+        const real bin_scale = static_cast<real>(state.settings.bin_count) / (get_component(centroid_aabb.max, axis) - centroid_min);
+        mid = std::partition(
+            references.begin(),
+            references.end(),
+            [&state, &split, axis, centroid_min, bin_scale](const BVHReference& reference) {
+                const real centroid_component = get_component(centroid(reference.aabb), axis);
+                return get_bin_index(centroid_component, centroid_min, bin_scale, state.settings.bin_count) <= split.value.bin_index;
+            }
+        );
+
+        assert(mid != references.begin() && mid != references.end());
+    }
+
+    right_references.assign(mid, references.end());
+    references.erase(mid, references.end());
+}
+
+// References straddling the plane are split into both children. Binning can disagree with the exact
+// test about references touching a bin boundary, so this fails if either side comes out empty.
+static bool split_references(BVHBuildState& state, const SpatialSplit& split, std::vector<BVHReference>& references, std::vector<BVHReference>& right_references) {
+    std::vector<BVHReference> left_references;
+    std::vector<BVHReference> split_right_references;
+    for (const BVHReference& reference : references) {
+        if (get_component(reference.aabb.max, split.axis) <= split.position) {
+            left_references.push_back(reference);
+        } else if (get_component(reference.aabb.min, split.axis) >= split.position) {
+            split_right_references.push_back(reference);
+        } else {
+            BVHReference left = {};
+            BVHReference right = {};
+            split_reference(reference, state.triangles[reference.primitive_index], split.axis, split.position, left, right);
+            if (!is_empty(left.aabb)) {
+                left_references.push_back(left);
+            }
+
+            if (!is_empty(right.aabb)) {
+                split_right_references.push_back(right);
+            }
+        }
+    }
+
+    if (left_references.empty() || split_right_references.empty()) {
+        return false;
+    }
+
+    state.duplicate_budget -= static_cast<int>(left_references.size() + split_right_references.size() - references.size());
+    references = std::move(left_references);
+    right_references = std::move(split_right_references);
+    return true;
+}
+
+static int add_node(BVH& bvh, BVHBuildState& state, std::vector<BVHReference>& references, const int depth) {
+    bvh.nodes.push_back(Node{});
+    const int node_index = bvh.nodes.size() - 1;
+
+    AABB node_aabb = EMPTY_AABB;
+    AABB centroid_aabb = EMPTY_AABB;
+    for (const BVHReference& reference : references) {
+        node_aabb += reference.aabb;
+        const Vec3 reference_centroid = centroid(reference.aabb);
+        centroid_aabb += AABB{reference_centroid, reference_centroid};
+    }
+
+    set_aabb(bvh.nodes[node_index], node_aabb);
+
+    const int count = references.size();
+    const bool splittable = (count > 1) && (depth < state.max_depth);
+    const Maybe<SAHSplit> object_split = splittable ? find_sah_split(state, references, node_aabb, centroid_aabb) : Maybe<SAHSplit>{};
+
+    // only look for a spatial split where the object split's children overlap by a meaningful amount
+    Maybe<SpatialSplit> spatial_split = {};
+    if (splittable && state.triangles != nullptr && state.duplicate_budget > 0) {
+        const AABB overlap = object_split.is_valid ? intersection(object_split.value.left_aabb, object_split.value.right_aabb) : node_aabb;
+        const real overlap_area = is_empty(overlap) ? 0.0f : surface_area(overlap);
+        if (!object_split.is_valid || overlap_area > state.settings.spatial_split_alpha * state.root_area) {
+            spatial_split = find_spatial_split(state, references, node_aabb);
+        }
+    }
+
+    const bool spatial_split_is_better = spatial_split.is_valid && (!object_split.is_valid || spatial_split.value.cost < object_split.value.cost);
+    const real split_cost = spatial_split_is_better ? spatial_split.value.cost : (object_split.is_valid ? object_split.value.cost : REAL_MAX);
+    const real leaf_cost = state.settings.intersection_cost * static_cast<real>(count);
+    if (!splittable || (count <= state.settings.max_leaf_size && !(split_cost < leaf_cost))) {
+        Node& node = bvh.nodes[node_index];
+        node.offset = bvh.primitive_indices.size();
+        node.primitive_count = count;
+        for (const BVHReference& reference : references) {
+            bvh.primitive_indices.push_back(reference.primitive_index);
+        }
+
+        return node_index;
+    }
+
+    std::vector<BVHReference> right_references;
+    if (!spatial_split_is_better || !split_references(state, spatial_split.value, references, right_references)) {
+        partition_references(state, object_split, centroid_aabb, references, right_references);
+    }
+
+    const int left_index = add_node(bvh, state, references, depth + 1);
+    assert(left_index == node_index + 1);
+    references = std::vector<BVHReference>{};
+    bvh.nodes[node_index].offset = add_node(bvh, state, right_references, depth + 1);
 
     return node_index;
 }
 
-static BVH construct_sphere_bvh(const Sphere* const spheres, const int count) {
-    std::vector<AABB> sphere_aabbs;
-    sphere_aabbs.resize(count);
-    std::vector<int> sphere_indices;
-    sphere_indices.resize(count);
-    for (int sphere_index = 0; sphere_index < count; ++sphere_index) {
-        sphere_aabbs[sphere_index] = construct_aabb(spheres[sphere_index]);
-        sphere_indices[sphere_index] = sphere_index;
+static int add_wide_node(BVH& bvh, const int node_index) {
+    bvh.wide_nodes.push_back(WideNode{});
+    const int wide_node_index = bvh.wide_nodes.size() - 1;
+
+    // open up the interior child with the largest surface area until the wide node is full
+    int children[WIDE_NODE_WIDTH] = {node_index};
+    int child_count = 1;
+    while (child_count < WIDE_NODE_WIDTH) {
+        int largest_child = -1;
+        real largest_child_area = -1.0f;
+        for (int child = 0; child < child_count; ++child) {
+            const Node& child_node = bvh.nodes[children[child]];
+            const real child_area = surface_area(get_aabb(child_node));
+            if (!is_leaf(child_node) && child_area > largest_child_area) {
+                largest_child = child;
+                largest_child_area = child_area;
+            }
+        }
+
+        if (largest_child == -1) {
+            break;
+        }
+
+        const int opened_node_index = children[largest_child];
+        children[largest_child] = opened_node_index + 1;
+        children[child_count++] = bvh.nodes[opened_node_index].offset;
+    }
+
+    static constexpr float EMPTY_SLOT = std::numeric_limits<float>::quiet_NaN();
+    for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+        WideNode& wide_node = bvh.wide_nodes[wide_node_index];
+        if (slot >= child_count) {
+            wide_node.min_x[slot] = wide_node.min_y[slot] = wide_node.min_z[slot] = EMPTY_SLOT;
+            wide_node.max_x[slot] = wide_node.max_y[slot] = wide_node.max_z[slot] = EMPTY_SLOT;
+            continue;
+        }
+
+        const Node& child_node = bvh.nodes[children[slot]];
+        wide_node.min_x[slot] = child_node.min[0];
+        wide_node.min_y[slot] = child_node.min[1];
+        wide_node.min_z[slot] = child_node.min[2];
+        wide_node.max_x[slot] = child_node.max[0];
+        wide_node.max_y[slot] = child_node.max[1];
+        wide_node.max_z[slot] = child_node.max[2];
+
+        if (is_leaf(child_node)) {
+            wide_node.offsets[slot] = child_node.offset;
+            wide_node.primitive_counts[slot] = child_node.primitive_count;
+        } else {
+            const int wide_child_index = add_wide_node(bvh, children[slot]);
+            bvh.wide_nodes[wide_node_index].offsets[slot] = wide_child_index;
+        }
+    }
+
+    return wide_node_index;
+}
+
+static void collapse_to_width(BVH& bvh, const int width) {
+    if (width == WIDE_NODE_WIDTH) {
+        bvh.wide_nodes.reserve(bvh.nodes.size());
+        const int first_wide_node_index = add_wide_node(bvh, 0);
+        assert(first_wide_node_index == 0);
+
+        bvh.wide_nodes.shrink_to_fit();
+        bvh.nodes = std::vector<Node>{};
+    } else {
+        assert(width == 2);
+        bvh.nodes.shrink_to_fit();
     }
+}
 
-    const std::size_t leaf_count = count;
-    const std::size_t max_node_count = 4 * leaf_count - 1;
+static BVH build_bvh(BVHBuildState& state, std::vector<BVHReference>& references) {
+    assert(state.settings.bin_count >= 2);
+    assert(state.settings.max_leaf_size >= 1);
+    assert(0 <= state.max_depth && state.max_depth <= MAX_BVH_DEPTH);
+    assert(!references.empty());
+    state.bins.resize(state.settings.bin_count);
+    state.right_aabbs.resize(state.settings.bin_count - 1);
+    state.right_counts.resize(state.settings.bin_count - 1);
 
     BVH bvh;
-    bvh.reserve(max_node_count);
-    const int first_node_index = add_node(bvh, 0, sphere_aabbs, sphere_indices, 0, count);
+    bvh.aabb = EMPTY_AABB;
+    for (const BVHReference& reference : references) {
+        bvh.aabb += reference.aabb;
+    }
+
+    const int count = references.size();
+    state.root_area = surface_area(bvh.aabb);
+    state.duplicate_budget = 0;
+    if (state.triangles != nullptr) {
+        assert(state.settings.spatial_split_budget >= 0.0f);
+        state.duplicate_budget = static_cast<int>(state.settings.spatial_split_budget * static_cast<real>(count));
+        state.spatial_bins.resize(state.settings.bin_count);
+    }
+
+    const std::size_t max_leaf_count = count + state.duplicate_budget;
+    const std::size_t max_node_count = 2 * max_leaf_count - 1;
+    bvh.nodes.reserve(max_node_count);
+    bvh.primitive_indices.reserve(max_leaf_count);
+    const int first_node_index = add_node(bvh, state, references, 0);
     assert(first_node_index == 0);
 
+    collapse_to_width(bvh, state.settings.width);
+
     return bvh;
 }
 
-static BVH construct_triangle_bvh(const Triangle* const triangles, const int count) {
-    std::vector<AABB> triangle_aabbs;
-    triangle_aabbs.resize(count);
-    std::vector<int> triangle_indices;
-    triangle_indices.resize(count);
+static BVH construct_bvh(const AABB* const aabbs, const int count, const BVHBuildSettings& settings, const int max_depth) {
+    BVHBuildState state = {};
+    state.settings = settings;
+    state.max_depth = max_depth;
+
+    std::vector<BVHReference> references(count);
+    for (int index = 0; index < count; ++index) {
+        references[index] = BVHReference{aabbs[index], index};
+    }
+
+    return build_bvh(state, references);
+}
+
+static BVH construct_bvh(const AABB* const aabbs, const int count, const BVHBuildSettings& settings) {
+    return construct_bvh(aabbs, count, settings, MAX_BVH_DEPTH);
+}
+
+static BVH construct_sphere_bvh(const Sphere* const spheres, const int count, const BVHBuildSettings& settings) {
+    BVHBuildState state = {};
+    state.settings = settings;
+    state.max_depth = MAX_BVH_DEPTH;
+
+    std::vector<BVHReference> references(count);
+    for (int sphere_index = 0; sphere_index < count; ++sphere_index) {
+        references[sphere_index] = BVHReference{construct_aabb(spheres[sphere_index]), sphere_index};
+    }
+
+    return build_bvh(state, references);
+}
+
+static BVH construct_triangle_bvh(const Triangle* const triangles, const int count, const BVHBuildSettings& settings) {
+    BVHBuildState state = {};
+    state.settings = settings;
+    state.max_depth = MAX_BVH_DEPTH;
+    if (settings.spatial_split_budget > 0.0f) {
+        state.triangles = triangles;
+    }
+
+    std::vector<BVHReference> references(count);
     for (int triangle_index = 0; triangle_index < count; ++triangle_index) {
-        triangle_aabbs[triangle_index] = construct_aabb(triangles[triangle_index]);
-        triangle_indices[triangle_index] = triangle_index;
+        references[triangle_index] = BVHReference{construct_aabb(triangles[triangle_index]), triangle_index};
+    }
+
+    return build_bvh(state, references);
+}
+
+static constexpr int LINEAR_BVH_JOB_SIZE = 4096;
+static constexpr int RADIX_BITS = 8;
+static constexpr int RADIX_BUCKET_COUNT = 1 << RADIX_BITS;
+static constexpr int MORTON_CODE_BITS = 30;
+
+struct LinearBVHBuildState {
+    BVHBuildSettings settings;
+    int count;
+    int job_count;
+
+    const Triangle* triangles;
+    std::vector<AABB> aabbs;
+    std::vector<AABB> job_centroid_aabbs;
+    AABB centroid_aabb;
+
+    // sorted by morton code, sorting ping-pongs between these and the scratch arrays
+    std::vector<u32> morton_codes;
+    std::vector<int> indices;
+    std::vector<u32> scratch_morton_codes;
+    std::vector<int> scratch_indices;
+    std::vector<int> job_histograms;  // RADIX_BUCKET_COUNT per job, prefix summed into scatter offsets
+    int radix_shift;
+
+    // internal nodes are [0, count - 1), a child < 0 is the leaf ~child
+    std::vector<int> left_children;
+    std::vector<int> right_children;
+    std::vector<int> first_primitives;
+    std::vector<int> primitive_counts;
+    std::vector<int> internal_parents;
+    std::vector<int> leaf_parents;
+    std::vector<AABB> internal_aabbs;
+    std::unique_ptr<std::atomic<int>[]> visit_counts;
+};
+
+static int get_job_start(const int job_index) {
+    return job_index * LINEAR_BVH_JOB_SIZE;
+}
+
+static int get_job_end(const int job_index, const int count) {
+    return std::min(count, (job_index + 1) * LINEAR_BVH_JOB_SIZE);
+}
+
+static u32 count_leading_zeros(const u32 value) {
+    return (value == 0) ? 32 : __builtin_clz(value);
+}
+
+// spreads the bottom 10 bits out so there are two zero bits between each
+static u32 expand_bits(u32 value) {
+    value = (value * 0x00010001u) & 0xFF0000FFu;
+    value = (value * 0x00000101u) & 0x0F00F00Fu;
+    value = (value * 0x00000011u) & 0xC30C30C3u;
+    value = (value * 0x00000005u) & 0x49249249u;
+    return value;
+}
+
+static u32 morton_code(const Vec3& point, const AABB& bounds) {
+    static constexpr real QUANTISATION_SCALE = 1024.0f;
+
+    const Vec3 extent = bounds.max - bounds.min;
+    const Vec3 offset = point - bounds.min;
+    const real x = (extent.x > 0.0f) ? offset.x / extent.x : 0.0f;
+    const real y = (extent.y > 0.0f) ? offset.y / extent.y : 0.0f;
+    const real z = (extent.z > 0.0f) ? offset.z / extent.z : 0.0f;
+
+    const u32 quantised_x = static_cast<u32>(std::min(std::max(x * QUANTISATION_SCALE, static_cast<real>(0.0f)), QUANTISATION_SCALE - 1.0f));
+    const u32 quantised_y = static_cast<u32>(std::min(std::max(y * QUANTISATION_SCALE, static_cast<real>(0.0f)), QUANTISATION_SCALE - 1.0f));
+    const u32 quantised_z = static_cast<u32>(std::min(std::max(z * QUANTISATION_SCALE, static_cast<real>(0.0f)), QUANTISATION_SCALE - 1.0f));
+
+    return (expand_bits(quantised_x) << 2) | (expand_bits(quantised_y) << 1) | expand_bits(quantised_z);
+}
+
+static void compute_triangle_aabbs_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    for (int index = get_job_start(job_index); index < get_job_end(job_index, state.count); ++index) {
+        state.aabbs[index] = construct_aabb(state.triangles[index]);
+    }
+}
+
+static void compute_centroid_aabb_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    AABB centroid_aabb = EMPTY_AABB;
+    for (int index = get_job_start(job_index); index < get_job_end(job_index, state.count); ++index) {
+        const Vec3 primitive_centroid = centroid(state.aabbs[index]);
+        centroid_aabb += AABB{primitive_centroid, primitive_centroid};
+    }
+
+    state.job_centroid_aabbs[job_index] = centroid_aabb;
+}
+
+static void compute_morton_codes_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    for (int index = get_job_start(job_index); index < get_job_end(job_index, state.count); ++index) {
+        state.morton_codes[index] = morton_code(centroid(state.aabbs[index]), state.centroid_aabb);
+        state.indices[index] = index;
+    }
+}
+
+static void radix_histogram_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    int* const histogram = state.job_histograms.data() + job_index * RADIX_BUCKET_COUNT;
+    std::fill(histogram, histogram + RADIX_BUCKET_COUNT, 0);
+    for (int index = get_job_start(job_index); index < get_job_end(job_index, state.count); ++index) {
+        ++histogram[(state.morton_codes[index] >> state.radix_shift) & (RADIX_BUCKET_COUNT - 1)];
+    }
+}
+
+static void radix_scatter_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    int* const offsets = state.job_histograms.data() + job_index * RADIX_BUCKET_COUNT;
+    for (int index = get_job_start(job_index); index < get_job_end(job_index, state.count); ++index) {
+        const u32 code = state.morton_codes[index];
+        const int destination = offsets[(code >> state.radix_shift) & (RADIX_BUCKET_COUNT - 1)]++;
+        state.scratch_morton_codes[destination] = code;
+        state.scratch_indices[destination] = state.indices[index];
+    }
+}
+
+// least significant digit first, each pass is stable because jobs scatter their own ranges in order
+static void radix_sort_morton_codes(LinearBVHBuildState& state, const JobScheduler& scheduler) {
+    state.job_histograms.resize(state.job_count * RADIX_BUCKET_COUNT);
+    state.scratch_morton_codes.resize(state.count);
+    state.scratch_indices.resize(state.count);
+
+    for (state.radix_shift = 0; state.radix_shift < MORTON_CODE_BITS; state.radix_shift += RADIX_BITS) {
+        parallel_for(scheduler, radix_histogram_job, &state, state.job_count);
+
+        int offset = 0;
+        for (int bucket = 0; bucket < RADIX_BUCKET_COUNT; ++bucket) {
+            for (int job_index = 0; job_index < state.job_count; ++job_index) {
+                int& job_bucket = state.job_histograms[job_index * RADIX_BUCKET_COUNT + bucket];
+                const int job_bucket_count = job_bucket;
+                job_bucket = offset;
+                offset += job_bucket_count;
+            }
+        }
+
+        parallel_for(scheduler, radix_scatter_job, &state, state.job_count);
+        std::swap(state.morton_codes, state.scratch_morton_codes);
+        std::swap(state.indices, state.scratch_indices);
+    }
+}
+
+// length of the common prefix of two sorted keys, duplicate codes are told apart by their position
+static int common_prefix_length(const LinearBVHBuildState& state, const int lhs_index, const int rhs_index) {
+    if (rhs_index < 0 || rhs_index >= state.count) {
+        return -1;
+    }
+
+    const u32 lhs_code = state.morton_codes[lhs_index];
+    const u32 rhs_code = state.morton_codes[rhs_index];
+    if (lhs_code == rhs_code) {
+        return 32 + count_leading_zeros(static_cast<u32>(lhs_index) ^ static_cast<u32>(rhs_index));
+    }
+
+    return count_leading_zeros(lhs_code ^ rhs_code);
+}
+
+// Karras 2012, every internal node finds its key range and split independently of the others
+static void emit_internal_nodes_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    const int internal_count = state.count - 1;
+    for (int index = get_job_start(job_index); index < get_job_end(job_index, internal_count); ++index) {
+        const int direction = (common_prefix_length(state, index, index + 1) > common_prefix_length(state, index, index - 1)) ? 1 : -1;
+        const int min_prefix_length = common_prefix_length(state, index, index - direction);
+
+        int max_length = 2;
+        while (common_prefix_length(state, index, index + max_length * direction) > min_prefix_length) {
+            max_length *= 2;
+        }
+
+        int length = 0;
+        for (int step = max_length / 2; step >= 1; step /= 2) {
+            if (common_prefix_length(state, index, index + (length + step) * direction) > min_prefix_length) {
+                length += step;
+            }
+        }
+
+        const int other_end = index + length * direction;
+        const int node_prefix_length = common_prefix_length(state, index, other_end);
+
+        int split_offset = 0;
+        int divisor = 2;
+        for (int step = (length + divisor - 1) / divisor; ; step = (length + divisor - 1) / divisor) {
+            if (common_prefix_length(state, index, index + (split_offset + step) * direction) > node_prefix_length) {
+                split_offset += step;
+            }
+
+            if (step == 1) {
+                break;
+            }
+
+            divisor *= 2;
+        }
+
+        const int split = index + split_offset * direction + std::min(direction, 0);
+        const int first = std::min(index, other_end);
+        const int last = std::max(index, other_end);
+
+        const int left_child = (first == split) ? ~split : split;
+        const int right_child = (last == split + 1) ? ~(split + 1) : split + 1;
+        state.left_children[index] = left_child;
+        state.right_children[index] = right_child;
+        state.first_primitives[index] = first;
+        state.primitive_counts[index] = last - first + 1;
+
+        int& left_parent = (left_child < 0) ? state.leaf_parents[~left_child] : state.internal_parents[left_child];
+        int& right_parent = (right_child < 0) ? state.leaf_parents[~right_child] : state.internal_parents[right_child];
+        left_parent = index;
+        right_parent = index;
+    }
+}
+
+static AABB get_child_aabb(const LinearBVHBuildState& state, const int child) {
+    return (child < 0) ? state.aabbs[state.indices[~child]] : state.internal_aabbs[child];
+}
+
+// each leaf walks towards the root, only the second visitor of a node has both child bounds ready
+static void compute_internal_aabbs_job(void* const data, const int job_index) {
+    LinearBVHBuildState& state = *static_cast<LinearBVHBuildState*>(data);
+    for (int leaf_index = get_job_start(job_index); leaf_index < get_job_end(job_index, state.count); ++leaf_index) {
+        int node_index = state.leaf_parents[leaf_index];
+        while (node_index != -1 && state.visit_counts[node_index].fetch_add(1, std::memory_order_acq_rel) == 1) {
+            AABB node_aabb = get_child_aabb(state, state.left_children[node_index]);
+            node_aabb += get_child_aabb(state, state.right_children[node_index]);
+            state.internal_aabbs[node_index] = node_aabb;
+            node_index = state.internal_parents[node_index];
+        }
+    }
+}
+
+// reorders the implicit tree depth first, collapsing small subtrees into leaves
+static int add_linear_node(BVH& bvh, const LinearBVHBuildState& state, const int child, const int depth) {
+    bvh.nodes.push_back(Node{});
+    const int node_index = bvh.nodes.size() - 1;
+    set_aabb(bvh.nodes[node_index], get_child_aabb(state, child));
+
+    // equal Morton codes are split by index, so many primitives in one place can make the tree deep
+    if (child < 0 || state.primitive_counts[child] <= state.settings.max_leaf_size || depth == MAX_BVH_DEPTH) {
+        Node& node = bvh.nodes[node_index];
+        node.offset = (child < 0) ? ~child : state.first_primitives[child];
+        node.primitive_count = (child < 0) ? 1 : state.primitive_counts[child];
+        return node_index;
     }
 
-    const std::size_t leaf_count = count;
-    const std::size_t max_node_count = 4 * leaf_count - 1;
+    const int left_index = add_linear_node(bvh, state, state.left_children[child], depth + 1);
+    assert(left_index == node_index + 1);
+    bvh.nodes[node_index].offset = add_linear_node(bvh, state, state.right_children[child], depth + 1);
+
+    return node_index;
+}
+
+static BVH build_linear_bvh(LinearBVHBuildState& state, const JobScheduler& scheduler) {
+    assert(state.settings.max_leaf_size >= 1);
+    if (state.count < 2) {
+        return construct_bvh(state.aabbs.data(), state.count, state.settings);
+    }
+
+    state.job_centroid_aabbs.resize(state.job_count);
+    parallel_for(scheduler, compute_centroid_aabb_job, &state, state.job_count);
+
+    state.centroid_aabb = EMPTY_AABB;
+    for (const AABB& job_centroid_aabb : state.job_centroid_aabbs) {
+        state.centroid_aabb += job_centroid_aabb;
+    }
+
+    state.morton_codes.resize(state.count);
+    state.indices.resize(state.count);
+    parallel_for(scheduler, compute_morton_codes_job, &state, state.job_count);
+    radix_sort_morton_codes(state, scheduler);
+
+    const int internal_count = state.count - 1;
+    state.left_children.resize(internal_count);
+    state.right_children.resize(internal_count);
+    state.first_primitives.resize(internal_count);
+    state.primitive_counts.resize(internal_count);
+    state.internal_parents.assign(internal_count, -1);
+    state.leaf_parents.assign(state.count, -1);
+    state.internal_aabbs.resize(internal_count);
+    state.visit_counts.reset(new std::atomic<int>[internal_count]);
+    for (int index = 0; index < internal_count; ++index) {
+        state.visit_counts[index].store(0, std::memory_order_relaxed);
+    }
+
+    parallel_for(scheduler, emit_internal_nodes_job, &state, state.job_count);
+    parallel_for(scheduler, compute_internal_aabbs_job, &state, state.job_count);
 
     BVH bvh;
-    bvh.reserve(max_node_count);
-    const int first_node_index = add_node(bvh, 0, triangle_aabbs, triangle_indices, 0, count);
+    bvh.aabb = state.internal_aabbs[0];
+    bvh.nodes.reserve(2 * state.count - 1);
+    const int first_node_index = add_linear_node(bvh, state, 0, 0);
     assert(first_node_index == 0);
 
+    bvh.primitive_indices = std::move(state.indices);
+    collapse_to_width(bvh, state.settings.width);
+
     return bvh;
 }
+
+static BVH construct_linear_bvh(const AABB* const aabbs, const int count, const BVHBuildSettings& settings, const JobScheduler& scheduler) {
+    LinearBVHBuildState state = {};
+    state.settings = settings;
+    state.count = count;
+    state.job_count = (count + LINEAR_BVH_JOB_SIZE - 1) / LINEAR_BVH_JOB_SIZE;
+    state.aabbs.assign(aabbs, aabbs + count);
+
+    return build_linear_bvh(state, scheduler);
+}
+
+static BVH construct_linear_triangle_bvh(const Triangle* const triangles, const int count, const BVHBuildSettings& settings, const JobScheduler& scheduler) {
+    LinearBVHBuildState state = {};
+    state.settings = settings;
+    state.count = count;
+    state.job_count = (count + LINEAR_BVH_JOB_SIZE - 1) / LINEAR_BVH_JOB_SIZE;
+    state.triangles = triangles;
+    state.aabbs.resize(count);
+    parallel_for(scheduler, compute_triangle_aabbs_job, &state, state.job_count);
+
+    return build_linear_bvh(state, scheduler);
+}
+
+static constexpr int REFIT_SUBTREE_SIZE = 4096;   // subtrees with more primitives than this are split between jobs
+
+struct BVHRefitJobData {
+    BVH* bvh;
+    BVHRefitState* refit_state;
+
+    // exactly one of these is set
+    const Sphere* spheres;
+    const Triangle* triangles;
+};
+
+static AABB get_primitive_aabb(const BVHRefitJobData& data, const int primitive_index) {
+    return (data.triangles != nullptr) ? construct_aabb(data.triangles[primitive_index]) : construct_aabb(data.spheres[primitive_index]);
+}
+
+static AABB get_leaf_aabb(const BVHRefitJobData& data, const int offset, const int primitive_count) {
+    AABB aabb = EMPTY_AABB;
+    for (int index = offset; index < offset + primitive_count; ++index) {
+        aabb += get_primitive_aabb(data, data.bvh->primitive_indices[index]);
+    }
+
+    return aabb;
+}
+
+static bool is_empty_slot(const WideNode& node, const int slot) {
+    return std::isnan(node.min_x[slot]);
+}
+
+static bool is_interior_slot(const WideNode& node, const int slot) {
+    return !is_empty_slot(node, slot) && node.primitive_counts[slot] == 0;
+}
+
+static AABB get_slot_aabb(const WideNode& node, const int slot) {
+    return AABB{Vec3{node.min_x[slot], node.min_y[slot], node.min_z[slot]}, Vec3{node.max_x[slot], node.max_y[slot], node.max_z[slot]}};
+}
+
+static void set_slot_aabb(WideNode& node, const int slot, const AABB& aabb) {
+    node.min_x[slot] = round_down_to_float(aabb.min.x);
+    node.min_y[slot] = round_down_to_float(aabb.min.y);
+    node.min_z[slot] = round_down_to_float(aabb.min.z);
+
+    node.max_x[slot] = round_up_to_float(aabb.max.x);
+    node.max_y[slot] = round_up_to_float(aabb.max.y);
+    node.max_z[slot] = round_up_to_float(aabb.max.z);
+}
+
+static AABB get_wide_node_aabb(const WideNode& node) {
+    AABB aabb = EMPTY_AABB;
+    for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+        if (!is_empty_slot(node, slot)) {
+            aabb += get_slot_aabb(node, slot);
+        }
+    }
+
+    return aabb;
+}
+
+static real get_subtree_root_area(const BVH& bvh, const BVHSubtree& subtree) {
+    return surface_area(is_wide(bvh) ? get_wide_node_aabb(bvh.wide_nodes[subtree.node_index]) : get_aabb(bvh.nodes[subtree.node_index]));
+}
+
+// children always come after their parent so refitting nodes in reverse order is bottom up
+static void refit_node(const BVHRefitJobData& data, const int node_index) {
+    std::vector<Node>& nodes = data.bvh->nodes;
+    Node& node = nodes[node_index];
+    if (is_leaf(node)) {
+        set_aabb(node, get_leaf_aabb(data, node.offset, node.primitive_count));
+    } else {
+        AABB aabb = get_aabb(nodes[node_index + 1]);
+        aabb += get_aabb(nodes[node.offset]);
+        set_aabb(node, aabb);
+    }
+}
+
+static void refit_wide_node(const BVHRefitJobData& data, const int wide_node_index) {
+    std::vector<WideNode>& wide_nodes = data.bvh->wide_nodes;
+    WideNode& node = wide_nodes[wide_node_index];
+    for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+        if (is_empty_slot(node, slot)) {
+            continue;
+        }
+
+        const bool is_leaf_slot = node.primitive_counts[slot] > 0;
+        const AABB aabb = is_leaf_slot ? get_leaf_aabb(data, node.offsets[slot], node.primitive_counts[slot]) : get_wide_node_aabb(wide_nodes[node.offsets[slot]]);
+        set_slot_aabb(node, slot, aabb);
+    }
+}
+
+static void refit_nodes(const BVHRefitJobData& data, const int node_index, const int node_end) {
+    for (int index = node_end - 1; index >= node_index; --index) {
+        if (is_wide(*data.bvh)) {
+            refit_wide_node(data, index);
+        } else {
+            refit_node(data, index);
+        }
+    }
+}
+
+// SAH cost scaled by the subtree root's surface area, the sum of every node's cost times its own area
+static real get_subtree_area_cost(const BVH& bvh, const BVHBuildSettings& settings, const BVHSubtree& subtree) {
+    real cost = 0.0f;
+    if (is_wide(bvh)) {
+        for (int index = subtree.node_index; index < subtree.node_end; ++index) {
+            const WideNode& node = bvh.wide_nodes[index];
+            for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+                if (is_empty_slot(node, slot)) {
+                    continue;
+                }
+
+                const real area = surface_area(get_slot_aabb(node, slot));
+                const int primitive_count = node.primitive_counts[slot];
+                cost += (primitive_count > 0) ? settings.intersection_cost * static_cast<real>(primitive_count) * area : settings.traversal_cost * area;
+            }
+        }
+
+        cost += settings.traversal_cost * get_subtree_root_area(bvh, subtree);
+    } else {
+        for (int index = subtree.node_index; index < subtree.node_end; ++index) {
+            const Node& node = bvh.nodes[index];
+            const real area = surface_area(get_aabb(node));
+            cost += is_leaf(node) ? settings.intersection_cost * static_cast<real>(node.primitive_count) * area : settings.traversal_cost * area;
+        }
+    }
+
+    return cost;
+}
+
+// SAH cost relative to the subtree's own root, so moving or uniformly scaling it doesn't change the cost
+static real get_subtree_cost(const BVH& bvh, const BVHBuildSettings& settings, const BVHSubtree& subtree) {
+    const real root_area = get_subtree_root_area(bvh, subtree);
+    return (root_area > 0.0f) ? get_subtree_area_cost(bvh, settings, subtree) / root_area : 0.0f;
+}
+
+static BVHSubtree get_subtree(const BVH& bvh, const int node_index) {
+    BVHSubtree subtree = {};
+    subtree.node_index = node_index;
+    subtree.primitive_start = std::numeric_limits<int>::max();
+    subtree.primitive_end = 0;
+
+    // the last node of a depth first subtree is found by always taking the rightmost child
+    int last_index = node_index;
+    if (is_wide(bvh)) {
+        for (int child_index = last_index; child_index != -1;) {
+            last_index = child_index;
+            child_index = -1;
+            const WideNode& node = bvh.wide_nodes[last_index];
+            for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+                if (is_interior_slot(node, slot)) {
+                    child_index = std::max(child_index, node.offsets[slot]);
+                }
+            }
+        }
+
+        subtree.node_end = last_index + 1;
+        for (int index = subtree.node_index; index < subtree.node_end; ++index) {
+            const WideNode& node = bvh.wide_nodes[index];
+            for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+                if (node.primitive_counts[slot] > 0 && !is_empty_slot(node, slot)) {
+                    subtree.primitive_start = std::min(subtree.primitive_start, node.offsets[slot]);
+                    subtree.primitive_end = std::max(subtree.primitive_end, node.offsets[slot] + node.primitive_counts[slot]);
+                }
+            }
+        }
+    } else {
+        while (!is_leaf(bvh.nodes[last_index])) {
+            last_index = bvh.nodes[last_index].offset;
+        }
+
+        subtree.node_end = last_index + 1;
+        for (int index = subtree.node_index; index < subtree.node_end; ++index) {
+            const Node& node = bvh.nodes[index];
+            if (is_leaf(node)) {
+                subtree.primitive_start = std::min(subtree.primitive_start, node.offset);
+                subtree.primitive_end = std::max(subtree.primitive_end, node.offset + node.primitive_count);
+            }
+        }
+    }
+
+    return subtree;
+}
+
+static real get_sah_cost(const BVH& bvh, const BVHBuildSettings& settings) {
+    return get_subtree_cost(bvh, settings, get_subtree(bvh, 0));
+}
+
+static void add_refit_subtrees(const BVH& bvh, BVHRefitState& refit_state, const int node_index, const int depth) {
+    BVHSubtree subtree = get_subtree(bvh, node_index);
+    subtree.depth = depth;
+    if (subtree.primitive_end - subtree.primitive_start <= REFIT_SUBTREE_SIZE || subtree.node_end - subtree.node_index == 1) {
+        refit_state.subtrees.push_back(subtree);
+        return;
+    }
+
+    // leaf children of a wide node aren't subtrees, they're refit along with their parent
+    if (is_wide(bvh)) {
+        const WideNode& node = bvh.wide_nodes[node_index];
+        for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+            if (is_interior_slot(node, slot)) {
+                add_refit_subtrees(bvh, refit_state, node.offsets[slot], depth + 1);
+            }
+        }
+    } else {
+        add_refit_subtrees(bvh, refit_state, node_index + 1, depth + 1);
+        add_refit_subtrees(bvh, refit_state, bvh.nodes[node_index].offset, depth + 1);
+    }
+}
+
+static BVHRefitState construct_bvh_refit_state(const BVH& bvh, const BVHBuildSettings& settings, const real rebuild_threshold) {
+    assert(rebuild_threshold >= 1.0f);
+
+    BVHRefitState refit_state = {};
+    refit_state.settings = settings;
+    refit_state.settings.width = is_wide(bvh) ? WIDE_NODE_WIDTH : 2;
+    refit_state.rebuild_threshold = rebuild_threshold;
+
+    add_refit_subtrees(bvh, refit_state, 0, 0);
+    for (BVHSubtree& subtree : refit_state.subtrees) {
+        subtree.built_cost = subtree.cost = get_subtree_cost(bvh, refit_state.settings, subtree);
+    }
+
+    const BVHSubtree tree = get_subtree(bvh, 0);
+    refit_state.built_root_area = get_subtree_root_area(bvh, tree);
+    refit_state.built_cost = refit_state.cost = (refit_state.built_root_area > 0.0f) ? get_subtree_area_cost(bvh, refit_state.settings, tree) / refit_state.built_root_area : 0.0f;
+
+    refit_state.rebuilt_subtrees.resize(refit_state.subtrees.size());
+    return refit_state;
+}
+
+// over the primitives' current bounds, numbered from zero and indexing primitives from the start of the subtree's range
+static BVH rebuild_subtree(const BVHRefitJobData& data, const BVHSubtree& subtree) {
+    const int primitive_count = subtree.primitive_end - subtree.primitive_start;
+    std::vector<AABB> aabbs(primitive_count);
+    for (int index = 0; index < primitive_count; ++index) {
+        aabbs[index] = get_primitive_aabb(data, data.bvh->primitive_indices[subtree.primitive_start + index]);
+    }
+
+    return construct_bvh(aabbs.data(), primitive_count, data.refit_state->settings, MAX_BVH_DEPTH - subtree.depth);
+}
+
+// Spatial splits put a triangle in several leaves with its bounds clipped to each, refitting can't clip them
+// so the whole tree is rebuilt with each primitive once
+static void rebuild_bvh(const BVHRefitJobData& data) {
+    BVH& bvh = *data.bvh;
+    std::vector<int> primitive_indices = bvh.primitive_indices;
+    std::sort(primitive_indices.begin(), primitive_indices.end());
+    primitive_indices.erase(std::unique(primitive_indices.begin(), primitive_indices.end()), primitive_indices.end());
+
+    const int primitive_count = static_cast<int>(primitive_indices.size());
+    std::vector<AABB> aabbs(primitive_count);
+    for (int index = 0; index < primitive_count; ++index) {
+        aabbs[index] = get_primitive_aabb(data, primitive_indices[index]);
+    }
+
+    bvh = construct_bvh(aabbs.data(), primitive_count, data.refit_state->settings);
+    for (int& primitive_index : bvh.primitive_indices) {
+        primitive_index = primitive_indices[primitive_index];
+    }
+}
+
+static void refit_subtree_job(void* const data, const int job_index) {
+    const BVHRefitJobData& job_data = *static_cast<const BVHRefitJobData*>(data);
+    BVHRefitState& refit_state = *job_data.refit_state;
+    BVHSubtree& subtree = refit_state.subtrees[job_index];
+    refit_nodes(job_data, subtree.node_index, subtree.node_end);
+
+    subtree.cost = get_subtree_cost(*job_data.bvh, refit_state.settings, subtree);
+    if (subtree.cost > refit_state.rebuild_threshold * subtree.built_cost) {
+        refit_state.rebuilt_subtrees[job_index] = rebuild_subtree(job_data, subtree);
+    }
+}
+
+// Replaces the subtree's nodes with the rebuilt ones, which are numbered from zero and index primitives
+// from the start of the subtree's range. Returns how many nodes the tree grew by.
+static int splice_subtree(BVH& bvh, BVHSubtree& subtree, const BVH& rebuilt) {
+    const int node_count_delta = (rebuilt.wide_nodes.size() + rebuilt.nodes.size()) - (subtree.node_end - subtree.node_index);
+    if (is_wide(bvh)) {
+        for (WideNode& node : bvh.wide_nodes) {
+            for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+                if (is_interior_slot(node, slot) && node.offsets[slot] >= subtree.node_end) {
+                    node.offsets[slot] += node_count_delta;
+                }
+            }
+        }
+
+        std::vector<WideNode> wide_nodes = rebuilt.wide_nodes;
+        for (WideNode& node : wide_nodes) {
+            for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+                if (!is_empty_slot(node, slot)) {
+                    node.offsets[slot] += is_interior_slot(node, slot) ? subtree.node_index : subtree.primitive_start;
+                }
+            }
+        }
+
+        bvh.wide_nodes.erase(bvh.wide_nodes.begin() + subtree.node_index, bvh.wide_nodes.begin() + subtree.node_end);
+        bvh.wide_nodes.insert(bvh.wide_nodes.begin() + subtree.node_index, wide_nodes.begin(), wide_nodes.end());
+    } else {
+        for (Node& node : bvh.nodes) {
+            if (!is_leaf(node) && node.offset >= subtree.node_end) {
+                node.offset += node_count_delta;
+            }
+        }
+
+        std::vector<Node> nodes = rebuilt.nodes;
+        for (Node& node : nodes) {
+            node.offset += is_leaf(node) ? subtree.primitive_start : subtree.node_index;
+        }
+
+        bvh.nodes.erase(bvh.nodes.begin() + subtree.node_index, bvh.nodes.begin() + subtree.node_end);
+        bvh.nodes.insert(bvh.nodes.begin() + subtree.node_index, nodes.begin(), nodes.end());
+    }
+
+    const std::vector<int> primitive_indices(bvh.primitive_indices.begin() + subtree.primitive_start, bvh.primitive_indices.begin() + subtree.primitive_end);
+    for (std::size_t index = 0; index < rebuilt.primitive_indices.size(); ++index) {
+        bvh.primitive_indices[subtree.primitive_start + index] = primitive_indices[rebuilt.primitive_indices[index]];
+    }
+
+    subtree.node_end += node_count_delta;
+    return node_count_delta;
+}
+
+static int refit_bvh(BVHRefitJobData& data, const JobScheduler& scheduler) {
+    BVH& bvh = *data.bvh;
+    BVHRefitState& refit_state = *data.refit_state;
+    parallel_for(scheduler, refit_subtree_job, &data, refit_state.subtrees.size());
+
+    int rebuilt_subtree_count = 0;
+    int node_count_delta = 0;
+    for (std::size_t subtree_index = 0; subtree_index < refit_state.subtrees.size(); ++subtree_index) {
+        BVHSubtree& subtree = refit_state.subtrees[subtree_index];
+        subtree.node_index += node_count_delta;
+        subtree.node_end += node_count_delta;
+
+        BVH& rebuilt = refit_state.rebuilt_subtrees[subtree_index];
+        if (rebuilt.nodes.empty() && rebuilt.wide_nodes.empty()) {
+            continue;
+        }
+
+        node_count_delta += splice_subtree(bvh, subtree, rebuilt);
+        subtree.built_cost = subtree.cost = get_subtree_cost(bvh, refit_state.settings, subtree);
+        rebuilt = BVH{};
+        ++rebuilt_subtree_count;
+    }
+
+    // then whatever is above the subtrees, skipping over each subtree's nodes
+    int subtree_index = refit_state.subtrees.size() - 1;
+    const int node_count = is_wide(bvh) ? bvh.wide_nodes.size() : bvh.nodes.size();
+    for (int node_index = node_count - 1; node_index >= 0; --node_index) {
+        if (subtree_index >= 0 && node_index < refit_state.subtrees[subtree_index].node_end) {
+            node_index = refit_state.subtrees[subtree_index].node_index;
+            --subtree_index;
+            continue;
+        }
+
+        refit_nodes(data, node_index, node_index + 1);
+    }
+
+    bvh.aabb = is_wide(bvh) ? get_wide_node_aabb(bvh.wide_nodes[0]) : get_aabb(bvh.nodes[0]);
+
+    // Each subtree's cost is relative to its own root, which grows along with its children when they turn, and
+    // nothing above the subtrees is checked. The whole tree against its root's area when it was built catches both.
+    const BVHSubtree tree = get_subtree(bvh, 0);
+    refit_state.cost = (refit_state.built_root_area > 0.0f) ? get_subtree_area_cost(bvh, refit_state.settings, tree) / refit_state.built_root_area : 0.0f;
+    if (refit_state.cost > refit_state.rebuild_threshold * refit_state.built_cost) {
+        rebuild_bvh(data);
+
+        const int tree_rebuild_count = refit_state.tree_rebuild_count + 1;
+        refit_state = construct_bvh_refit_state(bvh, refit_state.settings, refit_state.rebuild_threshold);
+        refit_state.tree_rebuild_count = tree_rebuild_count;
+        return static_cast<int>(refit_state.subtrees.size());
+    }
+
+    return rebuilt_subtree_count;
+}
+
+static int refit_sphere_bvh(BVH& bvh, BVHRefitState& refit_state, const Sphere* const spheres, const JobScheduler& scheduler) {
+    BVHRefitJobData data = {};
+    data.bvh = &bvh;
+    data.refit_state = &refit_state;
+    data.spheres = spheres;
+
+    return refit_bvh(data, scheduler);
+}
+
+static int refit_triangle_bvh(BVH& bvh, BVHRefitState& refit_state, const Triangle* const triangles, const JobScheduler& scheduler) {
+    BVHRefitJobData data = {};
+    data.bvh = &bvh;
+    data.refit_state = &refit_state;
+    data.triangles = triangles;
+
+    return refit_bvh(data, scheduler);
+}
+
+static WideRay construct_wide_ray(const Ray& ray, const Vec3& inverse_direction) {
+    WideRay wide_ray = {};
+    wide_ray.origin_x = _mm_set1_ps(static_cast<float>(ray.origin.x));
+    wide_ray.origin_y = _mm_set1_ps(static_cast<float>(ray.origin.y));
+    wide_ray.origin_z = _mm_set1_ps(static_cast<float>(ray.origin.z));
+    wide_ray.inverse_direction_x = _mm_set1_ps(static_cast<float>(inverse_direction.x));
+    wide_ray.inverse_direction_y = _mm_set1_ps(static_cast<float>(inverse_direction.y));
+    wide_ray.inverse_direction_z = _mm_set1_ps(static_cast<float>(inverse_direction.z));
+
+    return wide_ray;
+}
+
+// Slab test against all children at once, returns a bit per child hit within [0, max_distance]. Empty
+// slots have NaN bounds, min/max return their second operand when either is NaN so keeping the child
+// terms second carries the NaN through to the comparison, which then fails.
+static int intersect(const WideRay& ray, const WideNode& node, const real max_distance, float* const min_distances) {
+    static constexpr float ROBUST_MAX_DISTANCE_SCALE = 1.0f + 4.0f * FLT_EPSILON;   // float ray against real primitives
+
+    const __m128 min_x_plane_intersection_times = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), ray.origin_x), ray.inverse_direction_x);
+    const __m128 max_x_plane_intersection_times = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), ray.origin_x), ray.inverse_direction_x);
+    const __m128 min_y_plane_intersection_times = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), ray.origin_y), ray.inverse_direction_y);
+    const __m128 max_y_plane_intersection_times = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), ray.origin_y), ray.inverse_direction_y);
+    const __m128 min_z_plane_intersection_times = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), ray.origin_z), ray.inverse_direction_z);
+    const __m128 max_z_plane_intersection_times = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), ray.origin_z), ray.inverse_direction_z);
+
+    const __m128 min_x_intersection_times = _mm_min_ps(min_x_plane_intersection_times, max_x_plane_intersection_times);
+    const __m128 max_x_intersection_times = _mm_max_ps(min_x_plane_intersection_times, max_x_plane_intersection_times);
+    const __m128 min_y_intersection_times = _mm_min_ps(min_y_plane_intersection_times, max_y_plane_intersection_times);
+    const __m128 max_y_intersection_times = _mm_max_ps(min_y_plane_intersection_times, max_y_plane_intersection_times);
+    const __m128 min_z_intersection_times = _mm_min_ps(min_z_plane_intersection_times, max_z_plane_intersection_times);
+    const __m128 max_z_intersection_times = _mm_max_ps(min_z_plane_intersection_times, max_z_plane_intersection_times);
+
+    const float clamped_max_distance = static_cast<float>(std::min<real>(max_distance, FLT_MAX));
+    const __m128 min_intersection_times = _mm_max_ps(_mm_setzero_ps(), _mm_max_ps(min_z_intersection_times, _mm_max_ps(min_y_intersection_times, min_x_intersection_times)));
+    const __m128 max_intersection_times = _mm_min_ps(_mm_set1_ps(clamped_max_distance), _mm_min_ps(max_z_intersection_times, _mm_min_ps(max_y_intersection_times, max_x_intersection_times)));
+    const __m128 robust_max_intersection_times = _mm_mul_ps(max_intersection_times, _mm_set1_ps(ROBUST_MAX_DISTANCE_SCALE));
+
+    _mm_storeu_ps(min_distances, min_intersection_times);
+    return _mm_movemask_ps(_mm_cmple_ps(min_intersection_times, robust_max_intersection_times));
+}
+
+template <typename T>
+static std::vector<T> reorder_to_leaf_order(const BVH& bvh, const T* const primitives) {
+    std::vector<T> leaf_ordered_primitives(bvh.primitive_indices.size());
+    for (std::size_t leaf_order_index = 0; leaf_order_index < bvh.primitive_indices.size(); ++leaf_order_index) {
+        leaf_ordered_primitives[leaf_order_index] = primitives[bvh.primitive_indices[leaf_order_index]];
+    }
+
+    return leaf_ordered_primitives;
+}
@@ -2,19 +2,139 @@
 #define BVH_H
 
 #include "geometry.h"
+#include "types.h"
+#include "jobs.h"
 
 #include <vector>
+#include <xmmintrin.h>
 
+// Nodes are laid out depth first so an interior node's left child is always the next node. Bounds
+// are stored as floats rounded outwards, which keeps a node at 32 bytes (two per cache line).
 struct Node {
+    float min[3];
+    float max[3];
+    int offset;             // interior: index of right child, leaf: index of first primitive
+    int primitive_count;    // zero for interior nodes
+};
+
+static_assert(sizeof(Node) == 32, "BVH nodes should pack two to a cache line");
+
+static constexpr int WIDE_NODE_WIDTH = 4;
+
+// Children of a binary node collapsed into one node, bounds are stored as structure of arrays so all
+// four slab tests run in one pass. Unused slots' bounds are NaN, every comparison with them is false so
+// they're never hit.
+struct alignas(64) WideNode {
+    float min_x[WIDE_NODE_WIDTH];
+    float min_y[WIDE_NODE_WIDTH];
+    float min_z[WIDE_NODE_WIDTH];
+    float max_x[WIDE_NODE_WIDTH];
+    float max_y[WIDE_NODE_WIDTH];
+    float max_z[WIDE_NODE_WIDTH];
+    int offsets[WIDE_NODE_WIDTH];           // interior child: index of wide node, leaf child: index of first primitive
+    int primitive_counts[WIDE_NODE_WIDTH];  // zero for interior children
+};
+
+static_assert(sizeof(WideNode) == 128, "wide BVH nodes should span exactly two cache lines");
+
+// only one of nodes and wide_nodes is populated, depending on the width the BVH was built with
+struct BVH {
     AABB aabb;
-    int index;
-    int left;
-    int right;
+    std::vector<Node> nodes;
+    std::vector<WideNode> wide_nodes;
+    std::vector<int> primitive_indices; // leaf order to original primitive index, may repeat with spatial splits
 };
 
-using BVH = std::vector<Node>;
+struct WideRay {
+    __m128 origin_x;
+    __m128 origin_y;
+    __m128 origin_z;
+    __m128 inverse_direction_x;
+    __m128 inverse_direction_y;
+    __m128 inverse_direction_z;
+};
+
+// binned surface area heuristic, costs are relative to each other so only their ratio matters
+struct BVHBuildSettings {
+    int bin_count;
+    int max_leaf_size;
+    real traversal_cost;
+    real intersection_cost;
+    int width;  // 2 for a binary BVH, WIDE_NODE_WIDTH to collapse it into wide nodes
+
+    // Spatial splits (SBVH), only used for triangles. Long thin triangles make object split children
+    // overlap badly, so where they overlap by more than alpha times the root's surface area a triangle
+    // may be clipped into both children. The budget caps the duplicates as a fraction of the triangle
+    // count, zero turns spatial splits off.
+    real spatial_split_budget;
+    real spatial_split_alpha;
+};
+
+static constexpr BVHBuildSettings DEFAULT_BVH_BUILD_SETTINGS{16, 4, 1.0f, 1.0f, WIDE_NODE_WIDTH, 0.0f, 1.0e-5f};
+
+// Every builder stops splitting at this depth, the root's is zero, leaving bigger leaves rather than deeper
+// trees. Traversal stacks are sized from it, badly spread primitives would otherwise overflow them.
+static constexpr int MAX_BVH_DEPTH = 63;
+
+static AABB get_aabb(const Node& node);
+static bool is_leaf(const Node& node);
+static bool is_wide(const BVH& bvh);
+
+static WideRay construct_wide_ray(const Ray& ray, const Vec3& inverse_direction);
+static int intersect(const WideRay& ray, const WideNode& node, real max_distance, float* min_distances);
+
+static BVH construct_bvh(const AABB* aabbs, int count, const BVHBuildSettings& settings);
+static BVH construct_sphere_bvh(const Sphere* spheres, int count, const BVHBuildSettings& settings);
+static BVH construct_triangle_bvh(const Triangle* triangles, int count, const BVHBuildSettings& settings);
+
+// Linear BVH from Morton ordered centroids, every pass runs as jobs on the scheduler. Much quicker to
+// build than the SAH builder for big meshes but the tree traces slower. Only max_leaf_size and width
+// are used from the settings.
+static BVH construct_linear_bvh(const AABB* aabbs, int count, const BVHBuildSettings& settings, const JobScheduler& scheduler);
+static BVH construct_linear_triangle_bvh(const Triangle* triangles, int count, const BVHBuildSettings& settings, const JobScheduler& scheduler);
+
+// A BVH split into subtrees that are refit as separate jobs. Each subtree remembers its SAH cost from when
+// it was built, a refit that degrades it past the threshold rebuilds just that subtree. Subtree costs are
+// relative to the subtree's root, which grows along with its children when a rigid mesh spins, so the whole
+// tree's cost is also kept against its root's area when built and the whole tree is rebuilt once that degrades.
+// Refit leaves can't clip triangles the way spatial splits did, so the first refit of an SBVH usually rebuilds it.
+struct BVHSubtree {
+    int node_index;         // root node, a wide node for wide BVHs
+    int node_end;           // depth first layout keeps the subtree's nodes in [node_index, node_end)
+    int primitive_start;    // and its leaves' primitives in [primitive_start, primitive_end)
+    int primitive_end;
+    int depth;              // of the root, rebuilds can only go MAX_BVH_DEPTH below the tree's root
+    real built_cost;
+    real cost;
+};
+
+struct BVHRefitState {
+    BVHBuildSettings settings;          // for rebuilding subtrees, which never use spatial splits
+    real rebuild_threshold;             // rebuild once a subtree costs this many times its built cost
+    std::vector<BVHSubtree> subtrees;
+    std::vector<BVH> rebuilt_subtrees;  // scratch for the refit jobs, empty unless that subtree was rebuilt
+
+    real built_root_area;
+    real built_cost;                    // the whole tree's, over built_root_area
+    real cost;
+    int tree_rebuild_count;             // times the whole tree was rebuilt
+};
+
+static BVHRefitState construct_bvh_refit_state(const BVH& bvh, const BVHBuildSettings& settings, real rebuild_threshold);
+
+// Recomputes every bound bottom up after primitives have moved, keeping the tree as it is unless a subtree
+// or the whole tree has degraded too far. Primitives are in their original order. Returns the number of
+// subtrees rebuilt, all of them when the whole tree was, if that isn't zero the leaf order has changed and
+// leaf ordered copies have to be made again.
+static int refit_sphere_bvh(BVH& bvh, BVHRefitState& refit_state, const Sphere* spheres, const JobScheduler& scheduler);
+static int refit_triangle_bvh(BVH& bvh, BVHRefitState& refit_state, const Triangle* triangles, const JobScheduler& scheduler);
+
+// the SAH cost of the whole tree over its root's surface area, to compare trees from different builders
+static real get_sah_cost(const BVH& bvh, const BVHBuildSettings& settings);
 
-static BVH construct_sphere_bvh(const Sphere* spheres, int count);
-static BVH construct_triangle_bvh(const Triangle* triangles, int count);
+// Leaves index primitives in leaf order, so anything indexed by primitive has to be copied into leaf
+// order once after building. Spatial splits put a triangle in several leaves, so the copy can be longer.
+template <typename T>
+static std::vector<T> reorder_to_leaf_order(const BVH& bvh, const T* primitives);
 
 #endif
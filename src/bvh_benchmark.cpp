@@ -0,0 +1,478 @@
+#include "bvh_benchmark.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+
+static constexpr const char* BVH_BENCHMARK_MODEL_FILENAME = "./models/king.triangles";
+
+static const char* get_bvh_builder_name(const BVHBuilder::Type builder) {
+    switch (builder) {
+        case BVHBuilder::Type::SAH: {
+            return "sah";
+        }
+
+        case BVHBuilder::Type::LINEAR: {
+            return "lbvh";
+        }
+
+        default: {
+            assert(false);
+            return "";
+        }
+    }
+}
+
+static real next_check_real(u64& rng_state) {
+    return real_from_rng(pcg32(rng_state));
+}
+
+// aimed at a point inside the bounds from anywhere in a box three times their size around them
+static Ray construct_check_ray(const AABB& bounds, u64& rng_state) {
+    const Vec3 extent = bounds.max - bounds.min;
+
+    Vec3 target = bounds.min;
+    target.x += next_check_real(rng_state) * extent.x;
+    target.y += next_check_real(rng_state) * extent.y;
+    target.z += next_check_real(rng_state) * extent.z;
+
+    Vec3 origin = bounds.min;
+    origin.x += (3.0f * next_check_real(rng_state) - 1.0f) * extent.x;
+    origin.y += (3.0f * next_check_real(rng_state) - 1.0f) * extent.y;
+    origin.z += (3.0f * next_check_real(rng_state) - 1.0f) * extent.z;
+
+    return Ray{origin, normalise(target - origin)};
+}
+
+// the same rays for every check so results can be compared between builders and widths
+static constexpr u64 BVH_CHECK_SEED = 0x853c49e6748fea9bull;
+
+static BVHCheck compare_check_hits(const std::vector<real>& hit_distances, const std::vector<real>& expected_hit_distances) {
+    assert(hit_distances.size() == expected_hit_distances.size());
+
+    BVHCheck check = {};
+    check.ray_count = static_cast<int>(hit_distances.size());
+    for (int ray_index = 0; ray_index < check.ray_count; ++ray_index) {
+        check.hit_count += (hit_distances[ray_index] != REAL_MAX) ? 1 : 0;
+        check.mismatch_count += (hit_distances[ray_index] == expected_hit_distances[ray_index]) ? 0 : 1;
+    }
+
+    return check;
+}
+
+static std::vector<real> get_check_hit_distances(const BVH& bvh, const AABB& bounds, const Triangle* const triangles) {
+    const std::vector<Triangle> leaf_ordered_triangles = reorder_to_leaf_order(bvh, triangles);
+    const TriangleRecords leaf_ordered_records = construct_triangle_records(leaf_ordered_triangles.data(), leaf_ordered_triangles.size());
+
+    std::vector<real> hit_distances(BVH_CHECK_RAY_COUNT);
+    u64 rng_state = BVH_CHECK_SEED;
+    for (real& hit_distance : hit_distances) {
+        const Ray ray = construct_check_ray(bounds, rng_state);
+        const ClosestShapeIntersection hit = intersect(ray, bvh, leaf_ordered_records, REAL_MAX);
+        hit_distance = (hit.index != -1) ? hit.distance : REAL_MAX;
+    }
+
+    return hit_distances;
+}
+
+static std::vector<real> get_check_hit_distances(const BVH& bvh, const AABB& bounds, const Sphere* const spheres) {
+    const std::vector<Sphere> leaf_ordered_spheres = reorder_to_leaf_order(bvh, spheres);
+
+    std::vector<real> hit_distances(BVH_CHECK_RAY_COUNT);
+    u64 rng_state = BVH_CHECK_SEED;
+    for (real& hit_distance : hit_distances) {
+        const Ray ray = construct_check_ray(bounds, rng_state);
+        const ClosestShapeIntersection hit = intersect(ray, bvh, leaf_ordered_spheres.data(), REAL_MAX);
+        hit_distance = (hit.index != -1) ? hit.distance : REAL_MAX;
+    }
+
+    return hit_distances;
+}
+
+static BVHCheck check_triangle_bvh(const BVH& bvh, const Triangle* const triangles, const int count) {
+    const TriangleRecords records = construct_triangle_records(triangles, count);
+
+    std::vector<real> closest_distances(BVH_CHECK_RAY_COUNT, REAL_MAX);
+    u64 rng_state = BVH_CHECK_SEED;
+    for (real& closest_distance : closest_distances) {
+        const Ray ray = construct_check_ray(bvh.aabb, rng_state);
+        for (int triangle_index = 0; triangle_index < count; ++triangle_index) {
+            const Maybe<real> triangle_intersection = intersect(ray, records, triangle_index);
+            if (triangle_intersection.is_valid) {
+                closest_distance = std::min(closest_distance, triangle_intersection.value);
+            }
+        }
+    }
+
+    return compare_check_hits(get_check_hit_distances(bvh, bvh.aabb, triangles), closest_distances);
+}
+
+static BVHCheck check_sphere_bvh(const BVH& bvh, const Sphere* const spheres, const int count) {
+    std::vector<real> closest_distances(BVH_CHECK_RAY_COUNT, REAL_MAX);
+    u64 rng_state = BVH_CHECK_SEED;
+    for (real& closest_distance : closest_distances) {
+        const Ray ray = construct_check_ray(bvh.aabb, rng_state);
+        for (int sphere_index = 0; sphere_index < count; ++sphere_index) {
+            const Maybe<real> sphere_intersection = intersect_front(ray, spheres[sphere_index]);
+            if (sphere_intersection.is_valid) {
+                closest_distance = std::min(closest_distance, sphere_intersection.value);
+            }
+        }
+    }
+
+    return compare_check_hits(get_check_hit_distances(bvh, bvh.aabb, spheres), closest_distances);
+}
+
+static std::vector<Triangle> replicate_mesh(const std::vector<Triangle>& triangles, const int copy_count) {
+    assert(copy_count > 0);
+
+    AABB bounds = construct_aabb(triangles[0]);
+    for (const Triangle& triangle : triangles) {
+        bounds += construct_aabb(triangle);
+    }
+
+    // a tenth of the mesh's size between neighbours so copies don't overlap
+    const Vec3 spacing = 1.1f * (bounds.max - bounds.min);
+    int grid_size = 1;
+    while (grid_size * grid_size < copy_count) {
+        ++grid_size;
+    }
+
+    std::vector<Triangle> replicated_triangles;
+    replicated_triangles.reserve(static_cast<std::size_t>(copy_count) * triangles.size());
+    for (int copy_index = 0; copy_index < copy_count; ++copy_index) {
+        const Vec3 offset{static_cast<real>(copy_index % grid_size) * spacing.x, static_cast<real>(copy_index / grid_size) * spacing.y, 0.0f};
+        for (const Triangle& triangle : triangles) {
+            replicated_triangles.push_back(Triangle{triangle.a + offset, triangle.b + offset, triangle.c + offset});
+        }
+    }
+
+    return replicated_triangles;
+}
+
+static std::vector<Sphere> construct_sphere_field(const int count) {
+    static constexpr real VOLUME_PER_SPHERE = 64.0f;
+    static constexpr real MIN_RADIUS = 0.2f;
+    static constexpr real MAX_RADIUS = 1.0f;
+
+    const real side = std::cbrt(VOLUME_PER_SPHERE * static_cast<real>(count));
+    u64 rng_state = BVH_CHECK_SEED + 1;
+
+    std::vector<Sphere> spheres(count);
+    for (Sphere& sphere : spheres) {
+        sphere.centre.x = side * next_check_real(rng_state);
+        sphere.centre.y = side * next_check_real(rng_state);
+        sphere.centre.z = side * next_check_real(rng_state);
+        sphere.radius = MIN_RADIUS + (MAX_RADIUS - MIN_RADIUS) * next_check_real(rng_state);
+    }
+
+    return spheres;
+}
+
+static BVH build_triangle_bvh(const BVHBuilder::Type builder, const std::vector<Triangle>& triangles, const BVHBuildSettings& settings, const JobScheduler& scheduler) {
+    const int count = static_cast<int>(triangles.size());
+    return (builder == BVHBuilder::Type::LINEAR)
+        ? construct_linear_triangle_bvh(triangles.data(), count, settings, scheduler)
+        : construct_triangle_bvh(triangles.data(), count, settings);
+}
+
+static BVH build_sphere_bvh(const BVHBuilder::Type builder, const std::vector<Sphere>& spheres, const BVHBuildSettings& settings, const JobScheduler& scheduler) {
+    const int count = static_cast<int>(spheres.size());
+    if (builder == BVHBuilder::Type::SAH) {
+        return construct_sphere_bvh(spheres.data(), count, settings);
+    }
+
+    std::vector<AABB> aabbs(count);
+    for (int sphere_index = 0; sphere_index < count; ++sphere_index) {
+        aabbs[sphere_index] = construct_aabb(spheres[sphere_index]);
+    }
+
+    return construct_linear_bvh(aabbs.data(), count, settings, scheduler);
+}
+
+static int get_node_count(const BVH& bvh) {
+    return is_wide(bvh) ? static_cast<int>(bvh.wide_nodes.size()) : static_cast<int>(bvh.nodes.size());
+}
+
+static std::vector<BVHBuildResult> run_bvh_build_benchmark(const BVHBuilder::Type builder, const int max_copy_count, const JobScheduler& scheduler) {
+    static constexpr int WIDTHS[2] = {2, WIDE_NODE_WIDTH};
+
+    const std::vector<Triangle> model_triangles = load_triangles_file(BVH_BENCHMARK_MODEL_FILENAME);
+    std::vector<BVHBuildResult> results;
+    for (int copy_count = 1; copy_count <= max_copy_count; copy_count *= 2) {
+        const std::vector<Triangle> triangles = replicate_mesh(model_triangles, copy_count);
+        for (const int width : WIDTHS) {
+            fprintf(stderr, "king x%d, width %d\n", copy_count, width);
+
+            BVHBuildSettings settings = MODEL_BVH_BUILD_SETTINGS;
+            settings.width = width;
+
+            const std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+            const BVH bvh = build_triangle_bvh(builder, triangles, settings, scheduler);
+            const std::chrono::duration<double> build_duration = std::chrono::steady_clock::now() - build_start;
+
+            BVHBuildResult result = {};
+            result.geometry = "king";
+            result.copy_count = copy_count;
+            result.primitive_count = static_cast<int>(triangles.size());
+            result.width = width;
+            result.build_seconds = build_duration.count();
+            result.node_count = get_node_count(bvh);
+            result.sah_cost = get_sah_cost(bvh, settings);
+            result.check = check_triangle_bvh(bvh, triangles.data(), result.primitive_count);
+            results.push_back(result);
+        }
+    }
+
+    const int sphere_count = results.back().primitive_count;
+    const std::vector<Sphere> spheres = construct_sphere_field(sphere_count);
+    for (const int width : WIDTHS) {
+        fprintf(stderr, "%d spheres, width %d\n", sphere_count, width);
+
+        BVHBuildSettings settings = DEFAULT_BVH_BUILD_SETTINGS;
+        settings.width = width;
+
+        const std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+        const BVH bvh = build_sphere_bvh(builder, spheres, settings, scheduler);
+        const std::chrono::duration<double> build_duration = std::chrono::steady_clock::now() - build_start;
+
+        BVHBuildResult result = {};
+        result.geometry = "spheres";
+        result.copy_count = 1;
+        result.primitive_count = sphere_count;
+        result.width = width;
+        result.build_seconds = build_duration.count();
+        result.node_count = get_node_count(bvh);
+        result.sah_cost = get_sah_cost(bvh, settings);
+        result.check = check_sphere_bvh(bvh, spheres.data(), sphere_count);
+        results.push_back(result);
+    }
+
+    return results;
+}
+
+static void write_bvh_build_results(FILE* const file, const std::vector<BVHBuildResult>& results, const BVHBuilder::Type builder, const int thread_count) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"precision\": \"%s\",\n", (sizeof(real) == sizeof(float)) ? "float" : "double");
+    fprintf(file, "  \"thread_count\": %d,\n", thread_count);
+    fprintf(file, "  \"bvh_builder\": \"%s\",\n", get_bvh_builder_name(builder));
+    fprintf(file, "  \"builds\": [\n");
+    for (std::size_t result_index = 0; result_index < results.size(); ++result_index) {
+        const BVHBuildResult& result = results[result_index];
+        fprintf(
+            file,
+            "    {\"geometry\": \"%s\", \"copies\": %d, \"primitives\": %d, \"width\": %d, \"build_seconds\": %.4f, \"nodes\": %d, \"sah_cost\": %.2f, "
+            "\"check_rays\": %d, \"check_hits\": %d, \"check_mismatches\": %d}",
+            result.geometry,
+            result.copy_count,
+            result.primitive_count,
+            result.width,
+            result.build_seconds,
+            result.node_count,
+            static_cast<double>(result.sah_cost),
+            result.check.ray_count,
+            result.check.hit_count,
+            result.check.mismatch_count
+        );
+
+        fprintf(file, (result_index + 1 < results.size()) ? ",\n" : "\n");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+static bool passed_checks(const std::vector<BVHBuildResult>& results) {
+    for (const BVHBuildResult& result : results) {
+        if (result.check.mismatch_count > 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static constexpr int REFIT_SPHERE_COUNT = 20000;
+static constexpr real SPHERE_DRIFT_SPEED = 0.1f;                   // most a sphere moves along an axis in a frame
+static constexpr real TURNTABLE_STEP = 3.0f * PI / 180.0f;         // radians a frame
+static constexpr real BVH_REFIT_REBUILD_THRESHOLD = 1.5f;
+
+static void add(BVHCheck& check, const BVHCheck& other) {
+    check.ray_count += other.ray_count;
+    check.hit_count += other.hit_count;
+    check.mismatch_count += other.mismatch_count;
+}
+
+static double get_seconds_between(const std::chrono::steady_clock::time_point start, const std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double>(end - start).count();
+}
+
+static BVHRefitResult run_sphere_refit_benchmark(const int width, const int frame_count, const JobScheduler& scheduler) {
+    const std::vector<Sphere> start_spheres = construct_sphere_field(REFIT_SPHERE_COUNT);
+    std::vector<Sphere> spheres = start_spheres;
+
+    // each sphere keeps its own direction so the field spreads out and the tree degrades
+    std::vector<Vec3> velocities(REFIT_SPHERE_COUNT);
+    u64 rng_state = BVH_CHECK_SEED + 2;
+    for (Vec3& velocity : velocities) {
+        velocity.x = SPHERE_DRIFT_SPEED * (2.0f * next_check_real(rng_state) - 1.0f);
+        velocity.y = SPHERE_DRIFT_SPEED * (2.0f * next_check_real(rng_state) - 1.0f);
+        velocity.z = SPHERE_DRIFT_SPEED * (2.0f * next_check_real(rng_state) - 1.0f);
+    }
+
+    BVHBuildSettings settings = DEFAULT_BVH_BUILD_SETTINGS;
+    settings.width = width;
+
+    BVH bvh = construct_sphere_bvh(spheres.data(), REFIT_SPHERE_COUNT, settings);
+    BVHRefitState refit_state = construct_bvh_refit_state(bvh, settings, BVH_REFIT_REBUILD_THRESHOLD);
+
+    BVHRefitResult result = {};
+    result.geometry = "drifting_spheres";
+    result.primitive_count = REFIT_SPHERE_COUNT;
+    result.width = width;
+    result.frame_count = frame_count;
+    for (int frame = 1; frame <= frame_count; ++frame) {
+        for (int sphere_index = 0; sphere_index < REFIT_SPHERE_COUNT; ++sphere_index) {
+            spheres[sphere_index].centre = start_spheres[sphere_index].centre + static_cast<real>(frame) * velocities[sphere_index];
+        }
+
+        const std::chrono::steady_clock::time_point refit_start = std::chrono::steady_clock::now();
+        result.rebuilt_subtree_count += refit_sphere_bvh(bvh, refit_state, spheres.data(), scheduler);
+        const std::chrono::steady_clock::time_point rebuild_start = std::chrono::steady_clock::now();
+        const BVH rebuilt_bvh = construct_sphere_bvh(spheres.data(), REFIT_SPHERE_COUNT, settings);
+        const std::chrono::steady_clock::time_point rebuild_end = std::chrono::steady_clock::now();
+
+        result.refit_seconds += get_seconds_between(refit_start, rebuild_start) / frame_count;
+        result.rebuild_seconds += get_seconds_between(rebuild_start, rebuild_end) / frame_count;
+        add(result.check, compare_check_hits(get_check_hit_distances(bvh, rebuilt_bvh.aabb, spheres.data()), get_check_hit_distances(rebuilt_bvh, rebuilt_bvh.aabb, spheres.data())));
+        result.refit_sah_cost = get_sah_cost(bvh, settings);
+        result.rebuilt_sah_cost = get_sah_cost(rebuilt_bvh, settings);
+        result.worst_sah_cost_ratio = std::max(result.worst_sah_cost_ratio, result.refit_sah_cost / result.rebuilt_sah_cost);
+    }
+
+    result.rebuilt_tree_count = refit_state.tree_rebuild_count;
+
+    return result;
+}
+
+static BVHRefitResult run_turntable_refit_benchmark(const int width, const int frame_count, const JobScheduler& scheduler) {
+    const std::vector<Triangle> start_triangles = load_triangles_file(BVH_BENCHMARK_MODEL_FILENAME);
+    const int triangle_count = static_cast<int>(start_triangles.size());
+    std::vector<Triangle> triangles = start_triangles;
+
+    AABB bounds = construct_aabb(start_triangles[0]);
+    for (const Triangle& triangle : start_triangles) {
+        bounds += construct_aabb(triangle);
+    }
+
+    const Vec3 centre = centroid(bounds);
+
+    BVHBuildSettings settings = MODEL_BVH_BUILD_SETTINGS;
+    settings.width = width;
+
+    BVH bvh = construct_triangle_bvh(triangles.data(), triangle_count, settings);
+    BVHRefitState refit_state = construct_bvh_refit_state(bvh, settings, BVH_REFIT_REBUILD_THRESHOLD);
+
+    BVHRefitResult result = {};
+    result.geometry = "turntable_king";
+    result.primitive_count = triangle_count;
+    result.width = width;
+    result.frame_count = frame_count;
+    for (int frame = 1; frame <= frame_count; ++frame) {
+        // the models are z up
+        const Mat3 rotation = rotation_matrix(static_cast<real>(frame) * TURNTABLE_STEP, 0.0f, 0.0f, 1.0f);
+        for (int triangle_index = 0; triangle_index < triangle_count; ++triangle_index) {
+            const Triangle& start_triangle = start_triangles[triangle_index];
+            triangles[triangle_index].a = centre + rotation * (start_triangle.a - centre);
+            triangles[triangle_index].b = centre + rotation * (start_triangle.b - centre);
+            triangles[triangle_index].c = centre + rotation * (start_triangle.c - centre);
+        }
+
+        const std::chrono::steady_clock::time_point refit_start = std::chrono::steady_clock::now();
+        result.rebuilt_subtree_count += refit_triangle_bvh(bvh, refit_state, triangles.data(), scheduler);
+        const std::chrono::steady_clock::time_point rebuild_start = std::chrono::steady_clock::now();
+        const BVH rebuilt_bvh = construct_triangle_bvh(triangles.data(), triangle_count, settings);
+        const std::chrono::steady_clock::time_point rebuild_end = std::chrono::steady_clock::now();
+
+        result.refit_seconds += get_seconds_between(refit_start, rebuild_start) / frame_count;
+        result.rebuild_seconds += get_seconds_between(rebuild_start, rebuild_end) / frame_count;
+        add(result.check, compare_check_hits(get_check_hit_distances(bvh, rebuilt_bvh.aabb, triangles.data()), get_check_hit_distances(rebuilt_bvh, rebuilt_bvh.aabb, triangles.data())));
+        result.refit_sah_cost = get_sah_cost(bvh, settings);
+        result.rebuilt_sah_cost = get_sah_cost(rebuilt_bvh, settings);
+        result.worst_sah_cost_ratio = std::max(result.worst_sah_cost_ratio, result.refit_sah_cost / result.rebuilt_sah_cost);
+    }
+
+    result.rebuilt_tree_count = refit_state.tree_rebuild_count;
+
+    return result;
+}
+
+static std::vector<BVHRefitResult> run_bvh_refit_benchmark(const int frame_count, const JobScheduler& scheduler) {
+    static constexpr int WIDTHS[2] = {2, WIDE_NODE_WIDTH};
+
+    std::vector<BVHRefitResult> results;
+    for (const int width : WIDTHS) {
+        fprintf(stderr, "drifting spheres, width %d\n", width);
+        results.push_back(run_sphere_refit_benchmark(width, frame_count, scheduler));
+    }
+
+    for (const int width : WIDTHS) {
+        fprintf(stderr, "turntable king, width %d\n", width);
+        results.push_back(run_turntable_refit_benchmark(width, frame_count, scheduler));
+    }
+
+    return results;
+}
+
+static bool is_degraded(const BVHRefitResult& result) {
+    return result.worst_sah_cost_ratio > BVH_REFIT_REBUILD_THRESHOLD;
+}
+
+static void write_bvh_refit_results(FILE* const file, const std::vector<BVHRefitResult>& results, const int thread_count) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"precision\": \"%s\",\n", (sizeof(real) == sizeof(float)) ? "float" : "double");
+    fprintf(file, "  \"thread_count\": %d,\n", thread_count);
+    fprintf(file, "  \"rebuild_threshold\": %.2f,\n", static_cast<double>(BVH_REFIT_REBUILD_THRESHOLD));
+    fprintf(file, "  \"animations\": [\n");
+    for (std::size_t result_index = 0; result_index < results.size(); ++result_index) {
+        const BVHRefitResult& result = results[result_index];
+        fprintf(
+            file,
+            "    {\"geometry\": \"%s\", \"primitives\": %d, \"width\": %d, \"frames\": %d, \"refit_seconds_per_frame\": %.5f, "
+            "\"rebuild_seconds_per_frame\": %.5f, \"rebuilt_subtrees\": %d, \"rebuilt_trees\": %d, \"refit_sah_cost\": %.2f, \"rebuilt_sah_cost\": %.2f, "
+            "\"worst_sah_cost_ratio\": %.3f, \"degraded\": %s, "
+            "\"check_rays\": %d, \"check_hits\": %d, \"check_mismatches\": %d}",
+            result.geometry,
+            result.primitive_count,
+            result.width,
+            result.frame_count,
+            result.refit_seconds,
+            result.rebuild_seconds,
+            result.rebuilt_subtree_count,
+            result.rebuilt_tree_count,
+            static_cast<double>(result.refit_sah_cost),
+            static_cast<double>(result.rebuilt_sah_cost),
+            static_cast<double>(result.worst_sah_cost_ratio),
+            is_degraded(result) ? "true" : "false",
+            result.check.ray_count,
+            result.check.hit_count,
+            result.check.mismatch_count
+        );
+
+        fprintf(file, (result_index + 1 < results.size()) ? ",\n" : "\n");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+static bool passed_checks(const std::vector<BVHRefitResult>& results) {
+    for (const BVHRefitResult& result : results) {
+        if (result.check.mismatch_count > 0 || is_degraded(result)) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef BVH_BENCHMARK_H
+#define BVH_BENCHMARK_H
+
+#include "geometry.h"
+#include "types.h"
+#include "jobs.h"
+#include "bvh.h"
+
+#include <cstdio>
+#include <vector>
+
+struct BVHBuilder {
+    enum Type {
+        SAH = 0,
+        LINEAR = 1  // construct_linear_bvh() and construct_linear_triangle_bvh()
+    };
+};
+
+static const char* get_bvh_builder_name(BVHBuilder::Type builder);
+
+// Random rays aimed into the BVH's bounds, some starting inside them. Each one's closest hit through the BVH
+// has to be at the same distance as the closest found by testing every primitive, or both have to miss.
+struct BVHCheck {
+    int ray_count;
+    int hit_count;
+    int mismatch_count;
+};
+
+static constexpr int BVH_CHECK_RAY_COUNT = 256;
+
+// primitives in their original order, the checks make their own leaf ordered copies
+static BVHCheck check_triangle_bvh(const BVH& bvh, const Triangle* triangles, int count);
+static BVHCheck check_sphere_bvh(const BVH& bvh, const Sphere* spheres, int count);
+
+// copies side by side on a square grid, standing in for one big scanned mesh
+static std::vector<Triangle> replicate_mesh(const std::vector<Triangle>& triangles, int copy_count);
+
+// small spheres scattered through a cube with roughly the same number in any unit of volume whatever the count
+static std::vector<Sphere> construct_sphere_field(int count);
+
+struct BVHBuildResult {
+    const char* geometry;
+    int copy_count;
+    int primitive_count;
+    int width;
+    double build_seconds;
+    int node_count;
+    real sah_cost;
+    BVHCheck check;
+};
+
+// Builds the king replicated 1, 2, 4... up to max_copy_count times and a sphere field of the same size as the
+// biggest, at both widths, timing and checking each build
+static std::vector<BVHBuildResult> run_bvh_build_benchmark(BVHBuilder::Type builder, int max_copy_count, const JobScheduler& scheduler);
+static void write_bvh_build_results(FILE* file, const std::vector<BVHBuildResult>& results, BVHBuilder::Type builder, int thread_count);
+
+// true if every build's check found the same hits as testing every primitive
+static bool passed_checks(const std::vector<BVHBuildResult>& results);
+
+struct BVHRefitResult {
+    const char* geometry;
+    int primitive_count;
+    int width;
+    int frame_count;
+    double refit_seconds;       // a frame, on average
+    double rebuild_seconds;     // a frame from scratch with the same builder
+    int rebuilt_subtree_count;  // over every frame
+    int rebuilt_tree_count;     // whole tree rebuilds, also counted in the subtrees
+    real refit_sah_cost;        // after the last frame
+    real rebuilt_sah_cost;
+    real worst_sah_cost_ratio;  // refit over rebuilt, the worst of any frame
+    BVHCheck check;             // every frame's rays through the refit BVH against a full rebuild's
+};
+
+// A sphere field drifting apart and the king spinning on a turntable, the BVH refit every frame and compared
+// against building it again from scratch, at both widths
+static std::vector<BVHRefitResult> run_bvh_refit_benchmark(int frame_count, const JobScheduler& scheduler);
+static void write_bvh_refit_results(FILE* file, const std::vector<BVHRefitResult>& results, int thread_count);
+
+// true if the refit BVHs hit the same as the rebuilt ones every frame and never cost more than the rebuild
+// threshold times as much
+static bool passed_checks(const std::vector<BVHRefitResult>& results);
+
+#endif
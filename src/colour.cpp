@@ -35,3 +35,7 @@ static Colour& operator/=(Colour& lhs, const real scalar) {
 
     return lhs;
 }
+
+static real get_luminance(const real r, const real g, const real b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
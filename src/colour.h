@@ -16,4 +16,7 @@ static Colour& operator+=(Colour& lhs, const Colour& rhs);
 static Colour& operator*=(Colour& lhs, const Colour& rhs);
 static Colour& operator/=(Colour& lhs, const real scalar);
 
+// Rec. 709 weights
+static real get_luminance(real r, real g, real b);
+
 #endif
@@ -0,0 +1,132 @@
+#include "denoising.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+// keeps black surfaces from dividing by zero, they come back black when remodulated
+static constexpr real MIN_DEMODULATION_ALBEDO = 0.01f;
+
+struct DenoisePass {
+    const DenoiseImages* images;
+    const DenoiseSettings* settings;
+    const real* input;
+    real* output;
+    int step;
+    real colour_sigma;
+};
+
+static real get_distance_squared(const real* const lhs, const real* const rhs) {
+    const real x = lhs[0] - rhs[0];
+    const real y = lhs[1] - rhs[1];
+    const real z = lhs[2] - rhs[2];
+    return x * x + y * y + z * z;
+}
+
+// differences in display space rather than radiance so one sigma suits dim and bright scenes alike
+static real get_display_distance_squared(const real* const lhs, const real* const rhs) {
+    const real x = std::sqrt(std::max<real>(lhs[0], 0.0f)) - std::sqrt(std::max<real>(rhs[0], 0.0f));
+    const real y = std::sqrt(std::max<real>(lhs[1], 0.0f)) - std::sqrt(std::max<real>(rhs[1], 0.0f));
+    const real z = std::sqrt(std::max<real>(lhs[2], 0.0f)) - std::sqrt(std::max<real>(rhs[2], 0.0f));
+    return x * x + y * y + z * z;
+}
+
+static void demodulate_row_job(void* const data, const int row) {
+    const DenoisePass& pass = *static_cast<const DenoisePass*>(data);
+    const DenoiseImages& images = *pass.images;
+    for (int index = 3 * row * images.width; index < 3 * (row + 1) * images.width; ++index) {
+        pass.output[index] = images.colours[index] / std::max(images.albedos[index], MIN_DEMODULATION_ALBEDO);
+    }
+}
+
+static void remodulate_row_job(void* const data, const int row) {
+    const DenoisePass& pass = *static_cast<const DenoisePass*>(data);
+    const DenoiseImages& images = *pass.images;
+    for (int index = 3 * row * images.width; index < 3 * (row + 1) * images.width; ++index) {
+        pass.output[index] = pass.input[index] * std::max(images.albedos[index], MIN_DEMODULATION_ALBEDO);
+    }
+}
+
+static void filter_row_job(void* const data, const int row) {
+    static constexpr int KERNEL_RADIUS = 2;
+    static constexpr real KERNEL[2 * KERNEL_RADIUS + 1] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+    const DenoisePass& pass = *static_cast<const DenoisePass*>(data);
+    const DenoiseImages& images = *pass.images;
+    const DenoiseSettings& settings = *pass.settings;
+
+    const real inverse_colour_variance = 1.0f / (pass.colour_sigma * pass.colour_sigma);
+    const real inverse_normal_variance = 1.0f / (settings.normal_sigma * settings.normal_sigma);
+    const real inverse_albedo_variance = 1.0f / (settings.albedo_sigma * settings.albedo_sigma);
+    for (int column = 0; column < images.width; ++column) {
+        const int pixel_index = row * images.width + column;
+        const real* const colour = pass.input + 3 * pixel_index;
+        const real* const normal = images.normals + 3 * pixel_index;
+        const real* const albedo = images.albedos + 3 * pixel_index;
+        const real depth = images.depths[pixel_index];
+
+        real sum[3] = {0.0f, 0.0f, 0.0f};
+        real weight_sum = 0.0f;
+        for (int y = -KERNEL_RADIUS; y <= KERNEL_RADIUS; ++y) {
+            const int tap_row = row + pass.step * y;
+            if (tap_row < 0 || tap_row >= images.height) {
+                continue;
+            }
+
+            for (int x = -KERNEL_RADIUS; x <= KERNEL_RADIUS; ++x) {
+                const int tap_column = column + pass.step * x;
+                if (tap_column < 0 || tap_column >= images.width) {
+                    continue;
+                }
+
+                const int tap_index = tap_row * images.width + tap_column;
+                const real* const tap_colour = pass.input + 3 * tap_index;
+                const real tap_depth = images.depths[tap_index];
+
+                const real depth_scale = settings.depth_sigma * std::max(depth, tap_depth);
+                const real depth_difference = (depth_scale > 0.0f) ? std::abs(depth - tap_depth) / depth_scale : 0.0f;
+                const real exponent =
+                    get_display_distance_squared(colour, tap_colour) * inverse_colour_variance +
+                    get_distance_squared(normal, images.normals + 3 * tap_index) * inverse_normal_variance +
+                    get_distance_squared(albedo, images.albedos + 3 * tap_index) * inverse_albedo_variance +
+                    depth_difference;
+
+                const real weight = KERNEL[y + KERNEL_RADIUS] * KERNEL[x + KERNEL_RADIUS] * std::exp(-exponent);
+                sum[0] += weight * tap_colour[0];
+                sum[1] += weight * tap_colour[1];
+                sum[2] += weight * tap_colour[2];
+                weight_sum += weight;
+            }
+        }
+
+        // the centre tap always has weight so this never divides by zero
+        real* const output = pass.output + 3 * pixel_index;
+        output[0] = sum[0] / weight_sum;
+        output[1] = sum[1] / weight_sum;
+        output[2] = sum[2] / weight_sum;
+    }
+}
+
+static void denoise(const DenoiseImages& images, const DenoiseSettings& settings, const JobScheduler& scheduler) {
+    assert(settings.pass_count > 0);
+
+    real* const scratch_images[2] = {images.scratch, images.scratch + 3 * images.width * images.height};
+
+    DenoisePass pass = {};
+    pass.images = &images;
+    pass.settings = &settings;
+    pass.output = scratch_images[0];
+    parallel_for(scheduler, demodulate_row_job, &pass, images.height);
+
+    for (int pass_index = 0; pass_index < settings.pass_count; ++pass_index) {
+        pass.input = scratch_images[pass_index % 2];
+        pass.output = scratch_images[(pass_index + 1) % 2];
+        pass.step = 1 << pass_index;
+        pass.colour_sigma = settings.colour_sigma / static_cast<real>(1 << pass_index);
+        parallel_for(scheduler, filter_row_job, &pass, images.height);
+    }
+
+    pass.input = scratch_images[settings.pass_count % 2];
+    pass.output = images.denoised_colours;
+    parallel_for(scheduler, remodulate_row_job, &pass, images.height);
+}
@@ -0,0 +1,35 @@
+#ifndef DENOISING_H
+#define DENOISING_H
+
+#include "types.h"
+#include "jobs.h"
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010). Every pass is a 5x5 B3 spline kernel with its taps
+// twice as far apart as the last pass's, so four passes cover 61x61 pixels. Taps are weighed down where colour,
+// normal, albedo or depth differ from the centre pixel's.
+struct DenoiseSettings {
+    int pass_count;
+    real colour_sigma;  // in display space, halved every pass since the image is smoother each time
+    real normal_sigma;
+    real albedo_sigma;
+    real depth_sigma;   // relative to the further pixel's depth
+};
+
+static constexpr DenoiseSettings DEFAULT_DENOISE_SETTINGS{4, 1.0f, 0.2f, 0.05f, 0.02f};
+
+// Per pixel means, three reals a pixel for colours, albedos and normals and one for depths. Colours are divided
+// by albedo before filtering so texture and material edges stay sharp.
+struct DenoiseImages {
+    int width;
+    int height;
+    const real* colours;
+    const real* albedos;
+    const real* normals;
+    const real* depths;
+    real* scratch;          // room for two colour images
+    real* denoised_colours;
+};
+
+static void denoise(const DenoiseImages& images, const DenoiseSettings& settings, const JobScheduler& scheduler);
+
+#endif
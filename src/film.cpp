@@ -0,0 +1,124 @@
+#include "film.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
+
+template <typename T>
+static T* allocate_film_channel(const int element_count) {
+    return static_cast<T*>(operator new[](element_count * sizeof(T), std::align_val_t{FILM_CACHE_LINE_SIZE}));
+}
+
+template <typename T>
+static void free_film_channel(T* const channel) {
+    operator delete[](channel, std::align_val_t{FILM_CACHE_LINE_SIZE});
+}
+
+static Film construct_film(const int width, const int height) {
+    assert(width > 0 && height > 0);
+    static_assert(FILM_ROW_ALIGNMENT * sizeof(u32) % FILM_CACHE_LINE_SIZE == 0, "the narrowest channel's rows have to be whole cache lines");
+
+    Film film = {};
+    film.width = width;
+    film.height = height;
+    film.row_stride = (width + FILM_ROW_ALIGNMENT - 1) / FILM_ROW_ALIGNMENT * FILM_ROW_ALIGNMENT;
+
+    const int pixel_count = film.row_stride * height;
+    film.colours = allocate_film_channel<real>(3 * pixel_count);
+    film.luminance_squares = allocate_film_channel<real>(pixel_count);
+    film.albedos = allocate_film_channel<real>(3 * pixel_count);
+    film.normals = allocate_film_channel<real>(3 * pixel_count);
+    film.depths = allocate_film_channel<real>(pixel_count);
+    film.sample_counts = allocate_film_channel<u32>(pixel_count);
+    clear(film);
+
+    return film;
+}
+
+static void destroy_film(Film& film) {
+    free_film_channel(film.colours);
+    free_film_channel(film.luminance_squares);
+    free_film_channel(film.albedos);
+    free_film_channel(film.normals);
+    free_film_channel(film.depths);
+    free_film_channel(film.sample_counts);
+    film = Film{};
+}
+
+static void clear(Film& film) {
+    const int pixel_count = film.row_stride * film.height;
+    memset(film.colours, 0, 3 * pixel_count * sizeof(real));
+    memset(film.luminance_squares, 0, pixel_count * sizeof(real));
+    memset(film.albedos, 0, 3 * pixel_count * sizeof(real));
+    memset(film.normals, 0, 3 * pixel_count * sizeof(real));
+    memset(film.depths, 0, pixel_count * sizeof(real));
+    memset(film.sample_counts, 0, pixel_count * sizeof(u32));
+}
+
+static int get_pixel_index(const Film& film, const int row, const int column) {
+    return row * film.row_stride + column;
+}
+
+static int get_tile_pixel_index(const FilmTile& film_tile, const int row, const int column) {
+    const RenderTile& bounds = film_tile.bounds;
+    assert(row >= bounds.row_start && row < bounds.row_end);
+    assert(column >= bounds.column_start && column < bounds.column_end);
+
+    return (row - bounds.row_start) * (bounds.column_end - bounds.column_start) + column - bounds.column_start;
+}
+
+static void begin_film_tile(FilmTile& film_tile, const RenderTile& bounds) {
+    film_tile.bounds = bounds;
+
+    // assign reuses the vectors' memory once they've grown to the biggest tile
+    const int pixel_count = (bounds.row_end - bounds.row_start) * (bounds.column_end - bounds.column_start);
+    film_tile.colours.assign(3 * pixel_count, 0.0f);
+    film_tile.luminance_squares.assign(pixel_count, 0.0f);
+    film_tile.albedos.assign(3 * pixel_count, 0.0f);
+    film_tile.normals.assign(3 * pixel_count, 0.0f);
+    film_tile.depths.assign(pixel_count, 0.0f);
+    film_tile.sample_counts.assign(pixel_count, 0);
+}
+
+static void add_sample(FilmTile& film_tile, const int row, const int column, const Colour& colour) {
+    const int pixel_index = get_tile_pixel_index(film_tile, row, column);
+    film_tile.colours[3 * pixel_index + 0] += static_cast<float>(colour.r);
+    film_tile.colours[3 * pixel_index + 1] += static_cast<float>(colour.g);
+    film_tile.colours[3 * pixel_index + 2] += static_cast<float>(colour.b);
+
+    const real luminance = get_luminance(colour.r, colour.g, colour.b);
+    film_tile.luminance_squares[pixel_index] += static_cast<float>(luminance * luminance);
+    ++film_tile.sample_counts[pixel_index];
+}
+
+static void add_feature_sample(FilmTile& film_tile, const int row, const int column, const FeatureSample& feature_sample) {
+    const int pixel_index = get_tile_pixel_index(film_tile, row, column);
+    film_tile.albedos[3 * pixel_index + 0] += static_cast<float>(feature_sample.albedo.r);
+    film_tile.albedos[3 * pixel_index + 1] += static_cast<float>(feature_sample.albedo.g);
+    film_tile.albedos[3 * pixel_index + 2] += static_cast<float>(feature_sample.albedo.b);
+    film_tile.normals[3 * pixel_index + 0] += static_cast<float>(feature_sample.normal.x);
+    film_tile.normals[3 * pixel_index + 1] += static_cast<float>(feature_sample.normal.y);
+    film_tile.normals[3 * pixel_index + 2] += static_cast<float>(feature_sample.normal.z);
+    film_tile.depths[pixel_index] += static_cast<float>(feature_sample.depth);
+}
+
+static void merge_film_tile(Film& film, const FilmTile& film_tile) {
+    const RenderTile& bounds = film_tile.bounds;
+    const int tile_width = bounds.column_end - bounds.column_start;
+    for (int row = bounds.row_start; row < bounds.row_end; ++row) {
+        const int tile_row_start = (row - bounds.row_start) * tile_width;
+        const int film_row_start = get_pixel_index(film, row, bounds.column_start);
+        for (int index = 0; index < 3 * tile_width; ++index) {
+            film.colours[3 * film_row_start + index] += film_tile.colours[3 * tile_row_start + index];
+            film.albedos[3 * film_row_start + index] += film_tile.albedos[3 * tile_row_start + index];
+            film.normals[3 * film_row_start + index] += film_tile.normals[3 * tile_row_start + index];
+        }
+
+        for (int index = 0; index < tile_width; ++index) {
+            film.luminance_squares[film_row_start + index] += film_tile.luminance_squares[tile_row_start + index];
+            film.depths[film_row_start + index] += film_tile.depths[tile_row_start + index];
+            film.sample_counts[film_row_start + index] += film_tile.sample_counts[tile_row_start + index];
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include "path_tracing.h"
+#include "colour.h"
+#include "tiles.h"
+#include "types.h"
+
+#include <vector>
+
+// Rows are padded out to this many pixels and every channel starts on a cache line, so any row of a channel
+// starting on a multiple of it does too. Tiles whose columns start on multiples of it never share a line.
+static constexpr int FILM_ROW_ALIGNMENT = 16;
+static constexpr int FILM_CACHE_LINE_SIZE = 64;
+
+// Sums of every sample so far, colours and first hit features for the denoiser. Pixel (row, column) is at
+// row * row_stride + column, rgb channels three to a pixel.
+struct Film {
+    int width;
+    int height;
+    int row_stride;
+    real* colours;
+    real* luminance_squares;    // for adaptive sampling's error estimates
+    real* albedos;
+    real* normals;
+    real* depths;
+    u32* sample_counts;
+};
+
+// A job's samples for one tile before they're summed into the film, each thread keeps one to reuse. Floats
+// since one pass adds at most a sample a pixel and half the size of the film's sums.
+struct FilmTile {
+    RenderTile bounds;
+    std::vector<float> colours;
+    std::vector<float> luminance_squares;
+    std::vector<float> albedos;
+    std::vector<float> normals;
+    std::vector<float> depths;
+    std::vector<u32> sample_counts;
+};
+
+static Film construct_film(int width, int height);
+static void destroy_film(Film& film);
+static void clear(Film& film);
+
+static int get_pixel_index(const Film& film, int row, int column);
+
+// zeroes the tile's sums for the next pass over bounds
+static void begin_film_tile(FilmTile& film_tile, const RenderTile& bounds);
+static void add_sample(FilmTile& film_tile, int row, int column, const Colour& colour);
+static void add_feature_sample(FilmTile& film_tile, int row, int column, const FeatureSample& feature_sample);
+
+// Tiles mustn't overlap, there's nothing stopping two threads adding to the same pixel
+static void merge_film_tile(Film& film, const FilmTile& film_tile);
+
+#endif
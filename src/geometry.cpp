@@ -4,34 +4,40 @@
 #include <cassert>
 #include <cmath>
 
-static AABBIntersections intersect(const Ray& ray, const AABB& aabb) {
+static Vec3 inverse_direction(const Ray& ray) {
+    return Vec3{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+}
+
+// clipped to [0, max_distance] so a miss, a box behind the ray and a box beyond the closest hit all come back empty
+static AABBIntersections intersect(const Ray& ray, const Vec3& inverse_direction, const AABB& aabb, const real max_distance) {
     static_assert(std::numeric_limits<real>::is_iec559, "IEEE754 floating-point implementation required");
-    assert(std::abs(ray.direction * ray.direction - 1.0f) < 1.0e-6f);
+    assert(std::abs(ray.direction * ray.direction - 1.0f) < UNIT_LENGTH_TOLERANCE);
 
-    const real inverse_x = 1.0f / ray.direction.x;
-    const real min_x_plane_intersection_time = (aabb.min.x - ray.origin.x) * inverse_x;
-    const real max_x_plane_intersection_time = (aabb.max.x - ray.origin.x) * inverse_x;
+    const real min_x_plane_intersection_time = (aabb.min.x - ray.origin.x) * inverse_direction.x;
+    const real max_x_plane_intersection_time = (aabb.max.x - ray.origin.x) * inverse_direction.x;
 
     const real min_x_intersection_time = std::min(min_x_plane_intersection_time, max_x_plane_intersection_time);
     const real max_x_intersection_time = std::max(min_x_plane_intersection_time, max_x_plane_intersection_time);
 
-    const real inverse_y = 1.0f / ray.direction.y;
-    const real min_y_plane_intersection_time = (aabb.min.y - ray.origin.y) * inverse_y;
-    const real max_y_plane_intersection_time = (aabb.max.y - ray.origin.y) * inverse_y;
+    const real min_y_plane_intersection_time = (aabb.min.y - ray.origin.y) * inverse_direction.y;
+    const real max_y_plane_intersection_time = (aabb.max.y - ray.origin.y) * inverse_direction.y;
 
     const real min_y_intersection_time = std::min(min_y_plane_intersection_time, max_y_plane_intersection_time);
     const real max_y_intersection_time = std::max(min_y_plane_intersection_time, max_y_plane_intersection_time);
 
-    const real inverse_z = 1.0f / ray.direction.z;
-    const real min_z_plane_intersection_time = (aabb.min.z - ray.origin.z) * inverse_z;
-    const real max_z_plane_intersection_time = (aabb.max.z - ray.origin.z) * inverse_z;
+    const real min_z_plane_intersection_time = (aabb.min.z - ray.origin.z) * inverse_direction.z;
+    const real max_z_plane_intersection_time = (aabb.max.z - ray.origin.z) * inverse_direction.z;
 
     const real min_z_intersection_time = std::min(min_z_plane_intersection_time, max_z_plane_intersection_time);
     const real max_z_intersection_time = std::max(min_z_plane_intersection_time, max_z_plane_intersection_time);
 
+    // far times grow by the bound on the slab test's rounding, 1 + 2 gamma(3) from PBRT, so rays along a box's
+    // face aren't lost to it, which happens often enough at float precision to leave holes
+    static constexpr real ROBUST_FAR_SCALE = 1.0f + 2.0f * (3.0f * REAL_EPSILON) / (1.0f - 3.0f * REAL_EPSILON);
+
     AABBIntersections result = {};
-    result.min_distance = std::max(min_z_intersection_time, std::max(min_y_intersection_time, min_x_intersection_time));
-    result.max_distance = std::min(max_z_intersection_time, std::min(max_y_intersection_time, max_x_intersection_time));
+    result.min_distance = std::max(min_z_intersection_time, std::max(min_y_intersection_time, std::max(min_x_intersection_time, static_cast<real>(0.0f))));
+    result.max_distance = std::min(ROBUST_FAR_SCALE * max_z_intersection_time, std::min(ROBUST_FAR_SCALE * max_y_intersection_time, std::min(ROBUST_FAR_SCALE * max_x_intersection_time, max_distance)));
 
     return result;
 }
@@ -48,6 +54,50 @@ static AABB& operator+=(AABB& lhs, const AABB& rhs) {
     return lhs;
 }
 
+static AABB intersection(const AABB& lhs, const AABB& rhs) {
+    AABB result = {};
+    result.min.x = std::max(lhs.min.x, rhs.min.x);
+    result.min.y = std::max(lhs.min.y, rhs.min.y);
+    result.min.z = std::max(lhs.min.z, rhs.min.z);
+
+    result.max.x = std::min(lhs.max.x, rhs.max.x);
+    result.max.y = std::min(lhs.max.y, rhs.max.y);
+    result.max.z = std::min(lhs.max.z, rhs.max.z);
+
+    return result;
+}
+
+// inverted boxes come from intersecting boxes that don't overlap
+static bool is_empty(const AABB& aabb) {
+    return aabb.min.x > aabb.max.x || aabb.min.y > aabb.max.y || aabb.min.z > aabb.max.z;
+}
+
+static Vec3 centroid(const AABB& aabb) {
+    return 0.5f * (aabb.min + aabb.max);
+}
+
+static real surface_area(const AABB& aabb) {
+    const Vec3 extent = aabb.max - aabb.min;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static AABB transform(const AABB& aabb, const Mat3& linear, const Vec3& translation) {
+    const Vec3 first_corner = linear * aabb.min + translation;
+    AABB result{first_corner, first_corner};
+    for (int corner_index = 1; corner_index < 8; ++corner_index) {
+        const Vec3 corner{
+            (corner_index & 1) ? aabb.max.x : aabb.min.x,
+            (corner_index & 2) ? aabb.max.y : aabb.min.y,
+            (corner_index & 4) ? aabb.max.z : aabb.min.z
+        };
+
+        const Vec3 transformed_corner = linear * corner + translation;
+        result += AABB{transformed_corner, transformed_corner};
+    }
+
+    return result;
+}
+
 static AABB construct_aabb(const Sphere& sphere) {
     AABB aabb = {};
     aabb.min = sphere.centre - Vec3{sphere.radius, sphere.radius, sphere.radius};
@@ -57,16 +107,17 @@ static AABB construct_aabb(const Sphere& sphere) {
 }
 
 static Maybe<SphereIntersections> intersect(const Ray& ray, const Sphere& sphere) {
-    assert(std::abs(ray.direction * ray.direction - 1.0f) < 1.0e-6f);
+    assert(std::abs(ray.direction * ray.direction - 1.0f) < UNIT_LENGTH_TOLERANCE);
 
     Maybe<SphereIntersections> result = {};
 
     const Vec3 ray_origin_to_sphere_centre = sphere.centre - ray.origin;
     const real intersections_mid_point_distance = ray_origin_to_sphere_centre * ray.direction;
 
-    const real ray_origin_to_sphere_centre_distance_squared = ray_origin_to_sphere_centre * ray_origin_to_sphere_centre;
-    const real intersections_mid_point_distance_squared = intersections_mid_point_distance * intersections_mid_point_distance;
-    const real sphere_centre_to_intersections_mid_point_squared = ray_origin_to_sphere_centre_distance_squared - intersections_mid_point_distance_squared;
+    // from the perpendicular itself rather than by Pythagoras, the difference of squares cancels badly in
+    // float for big spheres like the ground
+    const Vec3 sphere_centre_to_intersections_mid_point = intersections_mid_point_distance * ray.direction - ray_origin_to_sphere_centre;
+    const real sphere_centre_to_intersections_mid_point_squared = sphere_centre_to_intersections_mid_point * sphere_centre_to_intersections_mid_point;
     const real sphere_radius_squared = sphere.radius * sphere.radius;
     const real intersections_mid_point_to_intersections_distance_squared = sphere_radius_squared - sphere_centre_to_intersections_mid_point_squared;
     if (intersections_mid_point_to_intersections_distance_squared < 0.0f) { // TODO: removing this branch causes a huge slowdown, look into that
@@ -103,31 +154,75 @@ static AABB construct_aabb(const Triangle& triangle) {
     return aabb;
 }
 
-static Maybe<real> intersect(const Ray& ray, const Triangle& triangle) {
-    assert(std::abs(ray.direction * ray.direction - 1.0f) < 1.0e-6f);
+static TriangleRecords construct_triangle_records(const Triangle* const triangles, const int count) {
+    TriangleRecords records = {};
+    records.a_x.resize(count);
+    records.a_y.resize(count);
+    records.a_z.resize(count);
+    records.a_to_b_x.resize(count);
+    records.a_to_b_y.resize(count);
+    records.a_to_b_z.resize(count);
+    records.a_to_c_x.resize(count);
+    records.a_to_c_y.resize(count);
+    records.a_to_c_z.resize(count);
+    records.unit_normals.resize(count);
+
+    for (int triangle_index = 0; triangle_index < count; ++triangle_index) {
+        const Triangle& triangle = triangles[triangle_index];
+        const Vec3 a_to_b = triangle.b - triangle.a;
+        const Vec3 a_to_c = triangle.c - triangle.a;
+
+        records.a_x[triangle_index] = triangle.a.x;
+        records.a_y[triangle_index] = triangle.a.y;
+        records.a_z[triangle_index] = triangle.a.z;
+        records.a_to_b_x[triangle_index] = a_to_b.x;
+        records.a_to_b_y[triangle_index] = a_to_b.y;
+        records.a_to_b_z[triangle_index] = a_to_b.z;
+        records.a_to_c_x[triangle_index] = a_to_c.x;
+        records.a_to_c_y[triangle_index] = a_to_c.y;
+        records.a_to_c_z[triangle_index] = a_to_c.z;
+        records.unit_normals[triangle_index] = unit_normal(triangle);
+    }
 
-    Maybe<real> result = {};
+    return records;
+}
 
-    const Vec3 a_to_b = triangle.b - triangle.a;
-    const Vec3 a_to_c = triangle.c - triangle.a;
+// Moller-Trumbore, edges count as inside and hits closer than MIN_INTERSECTION_DISTANCE or rays within
+// TRIANGLE_PARALLEL_SINE of the plane are misses
+static Maybe<real> intersect(const Ray& ray, const TriangleRecords& triangles, const int triangle_index) {
+    assert(std::abs(ray.direction * ray.direction - 1.0f) < UNIT_LENGTH_TOLERANCE);
 
-    const Vec3 plane_normal = a_to_b ^ a_to_c;
-    const real ray_direction_dot_plane_normal = ray.direction * plane_normal;
-    const bool ray_is_parallel_to_plane = std::abs(ray_direction_dot_plane_normal) < 1.0e-6f;
+    Maybe<real> result = {};
 
-    const Vec3 ray_origin_to_a = triangle.a - ray.origin;
-    const real intersection_distance = ray_origin_to_a * plane_normal / ray_direction_dot_plane_normal;
+    const Vec3 a{triangles.a_x[triangle_index], triangles.a_y[triangle_index], triangles.a_z[triangle_index]};
+    const Vec3 a_to_b{triangles.a_to_b_x[triangle_index], triangles.a_to_b_y[triangle_index], triangles.a_to_b_z[triangle_index]};
+    const Vec3 a_to_c{triangles.a_to_c_x[triangle_index], triangles.a_to_c_y[triangle_index], triangles.a_to_c_z[triangle_index]};
+
+    // The determinant is the ray direction dotted with the unnormalised plane normal, up to sign, so it scales
+    // with the edges' lengths. Compared against them rather than a fixed cutoff, which in float threw away
+    // small triangles seen face on. Squared to save the square roots, <= so degenerate triangles miss.
+    const Vec3 direction_cross_a_to_c = ray.direction ^ a_to_c;
+    const real determinant = a_to_b * direction_cross_a_to_c;
+    const real edge_length_squares = (a_to_b * a_to_b) * (a_to_c * a_to_c);
+    if (determinant * determinant <= TRIANGLE_PARALLEL_SINE * TRIANGLE_PARALLEL_SINE * edge_length_squares) {
+        return result;
+    }
 
-    const Vec3 intersection_point = ray.origin + intersection_distance * ray.direction;
-    const Vec3 a_to_intersection = intersection_point - triangle.a;
+    const real inverse_determinant = 1.0f / determinant;
+    const Vec3 a_to_origin = ray.origin - a;
+    const real beta = (a_to_origin * direction_cross_a_to_c) * inverse_determinant;
+    if (beta < 0.0f || beta > 1.0f) {
+        return result;
+    }
 
-    const real plane_normal_magnitude_squared = plane_normal * plane_normal;
-    const real alpha = ((a_to_b ^ a_to_intersection) * plane_normal) / plane_normal_magnitude_squared;
-    const real beta = ((a_to_intersection ^ a_to_c) * plane_normal) / plane_normal_magnitude_squared;
-    const bool intersection_is_inside_triangle = (alpha >= 0.0f) && (beta >= 0.0f) && (alpha + beta <= 1.0f);
+    const Vec3 a_to_origin_cross_a_to_b = a_to_origin ^ a_to_b;
+    const real gamma = (ray.direction * a_to_origin_cross_a_to_b) * inverse_determinant;
+    if (gamma < 0.0f || beta + gamma > 1.0f) {
+        return result;
+    }
 
-    result.is_valid = !ray_is_parallel_to_plane && (intersection_distance >= 1.0e-6f) && intersection_is_inside_triangle;
-    result.value = intersection_distance;
+    result.value = (a_to_c * a_to_origin_cross_a_to_b) * inverse_determinant;
+    result.is_valid = (result.value >= MIN_INTERSECTION_DISTANCE);
 
     return result;
 }
@@ -6,6 +6,8 @@
 
 #include "maybe.hpp"
 
+#include <vector>
+
 struct Ray {
     Vec3 origin;
     Vec3 direction;
@@ -17,13 +19,19 @@ struct AABB {
 };
 
 static AABB& operator+=(AABB& lhs, const AABB& rhs);
+static AABB intersection(const AABB& lhs, const AABB& rhs);
+static bool is_empty(const AABB& aabb);
+static Vec3 centroid(const AABB& aabb);
+static real surface_area(const AABB& aabb);
+static AABB transform(const AABB& aabb, const Mat3& linear, const Vec3& translation);
 
 struct AABBIntersections {
     real min_distance;
     real max_distance;
 };
 
-static AABBIntersections intersect(const Ray& ray, const AABB& aabb);
+static Vec3 inverse_direction(const Ray& ray);
+static AABBIntersections intersect(const Ray& ray, const Vec3& inverse_direction, const AABB& aabb, real max_distance);
 
 struct Sphere {
     Vec3 centre;
@@ -45,8 +53,37 @@ struct Triangle {
     Vec3 c;
 };
 
+// Triangle hits nearer than this are taken to be the surface the ray just left. Float hit distances are
+// only good to a few ulps of the scene's size so need far more room.
+#ifdef REAL_FLOAT
+static constexpr real MIN_INTERSECTION_DISTANCE = 1.0e-4f;
+#else
+static constexpr real MIN_INTERSECTION_DISTANCE = 1.0e-6f;
+#endif
+
+// Rays closer than this sine of the angle to a triangle's plane (less where its corner at a is sharp) miss it
+static constexpr real TRIANGLE_PARALLEL_SINE = 1.0e-6f;
+
 static Vec3 unit_normal(const Triangle& triangle);
 static AABB construct_aabb(const Triangle& triangle);
-static Maybe<real> intersect(const Ray& ray, const Triangle& triangle);
+
+// Triangles set up for intersection, a vertex and the two edges out of it for Moller-Trumbore plus the
+// normal for shading. Kept as structure of arrays in BVH leaf order so a leaf's triangles are next to
+// each other in every array. Only exporting needs the original triangles.
+struct TriangleRecords {
+    std::vector<real> a_x;
+    std::vector<real> a_y;
+    std::vector<real> a_z;
+    std::vector<real> a_to_b_x;
+    std::vector<real> a_to_b_y;
+    std::vector<real> a_to_b_z;
+    std::vector<real> a_to_c_x;
+    std::vector<real> a_to_c_y;
+    std::vector<real> a_to_c_z;
+    std::vector<Vec3> unit_normals;
+};
+
+static TriangleRecords construct_triangle_records(const Triangle* triangles, int count);
+static Maybe<real> intersect(const Ray& ray, const TriangleRecords& triangles, int triangle_index);
 
 #endif
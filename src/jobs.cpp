@@ -0,0 +1,11 @@
+#include "jobs.h"
+
+static void parallel_for(const JobScheduler& scheduler, const Job job, void* const data, const int job_count) {
+    scheduler.parallel_for(scheduler.context, job, data, job_count);
+}
+
+static void run_jobs_serially(void*, const Job job, void* const data, const int job_count) {
+    for (int job_index = 0; job_index < job_count; ++job_index) {
+        job(data, job_index);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+using Job = void(*)(void* data, int job_index);
+
+// Work is split into independent jobs, the scheduler picks which threads run them and only returns
+// once every job has finished
+struct JobScheduler {
+    void* context;
+    void (*parallel_for)(void* context, Job job, void* data, int job_count);
+};
+
+static void parallel_for(const JobScheduler& scheduler, Job job, void* data, int job_count);
+static void run_jobs_serially(void* context, Job job, void* data, int job_count);
+
+static constexpr JobScheduler SERIAL_JOB_SCHEDULER{nullptr, run_jobs_serially};
+
+#endif
@@ -1,5 +1,6 @@
 #include "linear_algebra.h"
 
+#include <cassert>
 #include <cmath>
 
 static Vec3 operator+(const Vec3& lhs, const Vec3& rhs) {
@@ -30,6 +31,10 @@ static Vec3 operator^(const Vec3& lhs, const Vec3& rhs) {
     };
 }
 
+static real get_component(const Vec3& v, const int component) {
+    return (component == 0) ? v.x : ((component == 1) ? v.y : v.z);
+}
+
 static real magnitude(const Vec3& v) {
     return std::sqrt(v * v);
 }
@@ -39,6 +44,10 @@ static Vec3 normalise(const Vec3& v) {
     return inverse_magnitude * v;
 }
 
+static real degrees_to_radians(const real degrees) {
+    return degrees / 180.0f * PI;
+}
+
 static Vec3 operator*(const Mat3& m, const Vec3& v) {
     return Vec3{
         m.rows[0][0] * v.x + m.rows[0][1] * v.y + m.rows[0][2] * v.z,
@@ -69,6 +78,47 @@ static Vec3 get_column(const Mat3& m, const int column) {
     return Vec3{m.rows[0][column], m.rows[1][column], m.rows[2][column]};
 }
 
+static Mat3 transpose(const Mat3& m) {
+    Mat3 result = {};
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 3; ++column) {
+            result.rows[row][column] = m.rows[column][row];
+        }
+    }
+
+    return result;
+}
+
+// rows of the inverse are the cross products of the columns, divided by the determinant
+static Mat3 inverse(const Mat3& m) {
+    const Vec3 column_0 = get_column(m, 0);
+    const Vec3 column_1 = get_column(m, 1);
+    const Vec3 column_2 = get_column(m, 2);
+
+    const Vec3 row_0 = column_1 ^ column_2;
+    const Vec3 row_1 = column_2 ^ column_0;
+    const Vec3 row_2 = column_0 ^ column_1;
+
+    const real determinant = column_0 * row_0;
+    assert(std::abs(determinant) > 0.0f);
+    const real inverse_determinant = 1.0f / determinant;
+
+    Mat3 result = {};
+    result.rows[0][0] = inverse_determinant * row_0.x;
+    result.rows[0][1] = inverse_determinant * row_0.y;
+    result.rows[0][2] = inverse_determinant * row_0.z;
+
+    result.rows[1][0] = inverse_determinant * row_1.x;
+    result.rows[1][1] = inverse_determinant * row_1.y;
+    result.rows[1][2] = inverse_determinant * row_1.z;
+
+    result.rows[2][0] = inverse_determinant * row_2.x;
+    result.rows[2][1] = inverse_determinant * row_2.y;
+    result.rows[2][2] = inverse_determinant * row_2.z;
+
+    return result;
+}
+
 static Mat3 scaling_matrix(const real x_scale, const real y_scale, const real z_scale) {
     Mat3 result = {};
     result.rows[0][0] = x_scale;
@@ -120,3 +170,27 @@ static Mat3 look_at_matrix(const Vec3& position, const Vec3& target) {
 
     return result;
 }
+
+// columns are an arbitrary right handed frame around unit_z, branchless version from Duff et al. 2017
+static Mat3 orthonormal_basis(const Vec3& unit_z) {
+    const real sign = std::copysign(static_cast<real>(1.0f), unit_z.z);
+    const real a = -1.0f / (sign + unit_z.z);
+    const real b = unit_z.x * unit_z.y * a;
+    const Vec3 x_axis{1.0f + sign * unit_z.x * unit_z.x * a, sign * b, -sign * unit_z.x};
+    const Vec3 y_axis{b, sign + unit_z.y * unit_z.y * a, -unit_z.y};
+
+    Mat3 result = {};
+    result.rows[0][0] = x_axis.x;
+    result.rows[1][0] = x_axis.y;
+    result.rows[2][0] = x_axis.z;
+
+    result.rows[0][1] = y_axis.x;
+    result.rows[1][1] = y_axis.y;
+    result.rows[2][1] = y_axis.z;
+
+    result.rows[0][2] = unit_z.x;
+    result.rows[1][2] = unit_z.y;
+    result.rows[2][2] = unit_z.z;
+
+    return result;
+}
@@ -9,6 +9,9 @@ struct Vec3 {
     real z;
 };
 
+// how far a unit vector's squared length can drift from one through rounding
+static constexpr real UNIT_LENGTH_TOLERANCE = (64.0f * REAL_EPSILON > 1.0e-6f) ? 64.0f * REAL_EPSILON : 1.0e-6f;
+
 static Vec3 operator+(const Vec3& lhs, const Vec3& rhs);
 static Vec3 operator-(const Vec3& v);
 static Vec3 operator-(const Vec3& lhs, const Vec3& rhs);
@@ -16,9 +19,12 @@ static Vec3 operator*(real scalar, const Vec3& v);
 static real operator*(const Vec3& lhs, const Vec3& rhs);
 static Vec3 operator^(const Vec3& lhs, const Vec3& rhs);
 
+static real get_component(const Vec3& v, int component);
 static real magnitude(const Vec3& v);
 static Vec3 normalise(const Vec3& v);
 
+static real degrees_to_radians(real degrees);
+
 struct Mat3 {
     real rows[3][3];
 };
@@ -26,8 +32,11 @@ struct Mat3 {
 static Vec3 operator*(const Mat3& m, const Vec3& v);
 static Mat3 operator*(const Mat3& lhs, const Mat3& rhs);
 static Vec3 get_column(const Mat3& m, int column);
+static Mat3 transpose(const Mat3& m);
+static Mat3 inverse(const Mat3& m);
 static Mat3 scaling_matrix(real x_scale, real y_scale, real z_scale);
 static Mat3 rotation_matrix(real angle, real axis_x, real axis_y, real axis_z);
 static Mat3 look_at_matrix(const Vec3& position, const Vec3& target);
+static Mat3 orthonormal_basis(const Vec3& unit_z);
 
 #endif
@@ -3,8 +3,17 @@
 #include "path_tracing.h"
 #include "geometry.h"
 #include "material.h"
+#include "sampling.h"
+#include "adaptive.h"
+#include "wavefront.h"
+#include "denoising.h"
+#include "scenes.h"
+#include "tiles.h"
+#include "film.h"
 #include "colour.h"
 #include "types.h"
+#include "thread_pool.h"
+#include "jobs.h"
 #include "bvh.h"
 #include "rng.h"
 
@@ -13,68 +22,125 @@
 #include "path_tracing.cpp"
 #include "geometry.cpp"
 #include "material.cpp"
+#include "sampling.cpp"
+#include "adaptive.cpp"
+#include "wavefront.cpp"
+#include "denoising.cpp"
+#include "scenes.cpp"
+#include "tiles.cpp"
+#include "film.cpp"
 #include "colour.cpp"
+#include "thread_pool.cpp"
+#include "jobs.cpp"
 #include "bvh.cpp"
 #include "rng.cpp"
 
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
+#include <cstdio>
 
 #define NOMINMAX
 #include <Windows.h>
 
-static constexpr real PI = 3.14159265358979323846264f;
-static real degrees_to_radians(const real degrees) {
-    return degrees / 180.0f * PI;
-}
-
 // app settings
-static constexpr real SPHERES_ASPECT_RATIO = 3.0f / 2.0f;
-static constexpr real CORNELL_ASPECT_RATIO = 1.0f;
-static constexpr real MODEL_ASPECT_RATIO = 1.0f;
-
-static constexpr real ASPECT_RATIO = MODEL_ASPECT_RATIO;
+static constexpr real ASPECT_RATIO = CHESS_ASPECT_RATIO;
 static constexpr int CLIENT_WIDTH = 600;
 static constexpr int CLIENT_HEIGHT = static_cast<int>(static_cast<real>(CLIENT_WIDTH) / ASPECT_RATIO);
 
-struct RenderWorkQueue {
-    struct Entry {
-        int row;
-        int sample;
-        Scene scene;
-        real aperture;
-        Vec3 camera_position;
-        Vec3 camera_x;
-        Vec3 camera_y;
-        Vec3 bottom_left;
-        Vec3 step_x;
-        Vec3 step_y;
-        real* pixels;
-    };
-
-    static constexpr int CAPACITY = CLIENT_HEIGHT;
-    Entry entries[CAPACITY];
-    volatile LONG entry_count;
-    volatile LONG next_entry_to_do_index;
-    volatile LONG completed_entry_count;
-    HANDLE semaphore;
-};
+// Otherwise the megakernel traces each path to the end on its own, the wavefront engine traces a band of
+// scanlines' paths together a stage at a time. Both give the same image, benchmark --engine wavefront checks.
+static constexpr bool USE_WAVEFRONT_ENGINE = false;
+static constexpr int WAVEFRONT_BAND_HEIGHT = 8;
+static constexpr int WAVEFRONT_BAND_COUNT = (CLIENT_HEIGHT + WAVEFRONT_BAND_HEIGHT - 1) / WAVEFRONT_BAND_HEIGHT;
+
+// The megakernel renders a tile per job, 16 or 32 square keeps a job's rays in the same part of the BVH.
+// Scanline tiles are the old way of splitting the image, for comparison.
+static constexpr int RENDER_TILE_SIZE = 32;
+static constexpr TileOrder::Type RENDER_TILE_ORDER = TileOrder::Type::HILBERT;
+static_assert(RENDER_TILE_SIZE % FILM_ROW_ALIGNMENT == 0, "tiles sharing the film's cache lines would slow each other down");
+
+// After the camera moves the image is previewed with one short path per block of pixels, the blocks halving
+// each pass from this size down to single pixels before passes go back to adding full paths to the film
+static constexpr int PREVIEW_START_SCALE = 8;
+static constexpr PathSettings PREVIEW_PATH_SETTINGS{2, 2};
+static_assert(RENDER_TILE_SIZE % PREVIEW_START_SCALE == 0, "preview blocks can't straddle render tiles");
+
+// neighbouring camera rays along a tile's row go down the BVH together, 4, 8 or 16 at a time
+static constexpr int PRIMARY_PACKET_SIZE = 8;
+static_assert(PRIMARY_PACKET_SIZE <= MAX_PACKET_SIZE, "primary packets can't be bigger than the traversal supports");
+
+static void render_tile(
+    const RenderTile& tile,
+    const AdaptiveTiles& adaptive_tiles,
+    const Scene& scene,
+    const PathSettings& path_settings,
+    const Sampler& sampler,
+    const real aperture,
+    const Vec3& camera_position,
+    const Vec3& camera_x,
+    const Vec3& camera_y,
+    const Vec3& bottom_left,
+    const Vec3& step_x,
+    const Vec3& step_y,
+    Film& film,
+    BounceHistogram& bounce_histogram,
+    RayCounts& ray_counts
+) {
+    // samples go to the thread's own float copy of the tile first, summed into the film at the end
+    thread_local FilmTile film_tile = {};
+    begin_film_tile(film_tile, tile);
+
+    for (int row = tile.row_start; row < tile.row_end; ++row) {
+        for (int packet_start = tile.column_start; packet_start < tile.column_end; packet_start += PRIMARY_PACKET_SIZE) {
+            int columns[PRIMARY_PACKET_SIZE];
+            SampleStream sample_streams[PRIMARY_PACKET_SIZE];
+            Ray rays[PRIMARY_PACKET_SIZE];
+            int ray_count = 0;
+
+            const int packet_end = std::min(packet_start + PRIMARY_PACKET_SIZE, tile.column_end);
+            for (int column = packet_start; column < packet_end; ++column) {
+                if (!is_active(adaptive_tiles, row, column)) {
+                    continue;
+                }
+
+                // pixels skip passes once converged, so the pixel's own count keeps its sequence in order
+                const int sample = static_cast<int>(film.sample_counts[get_pixel_index(film, row, column)]);
+                sample_streams[ray_count] = construct_sample_stream(sampler, column, row, sample);
+                rays[ray_count] = generate_camera_ray(row, column, CLIENT_WIDTH, CLIENT_HEIGHT, aperture, camera_position, camera_x, camera_y, bottom_left, step_x, step_y, sample_streams[ray_count]);
+                columns[ray_count] = column;
+                ++ray_count;
+            }
 
-static void push_entry(RenderWorkQueue& work_queue, const RenderWorkQueue::Entry& entry) {
-    assert(work_queue.entry_count < work_queue.CAPACITY);
+            if (ray_count == 0) {
+                continue;
+            }
 
-    work_queue.entries[work_queue.entry_count] = entry;
+            // bounces after the first scatter every which way so only the camera rays are traced as a packet
+            SceneIntersection first_intersections[PRIMARY_PACKET_SIZE];
+            intersect_closest(rays, ray_count, scene, first_intersections);
+            ray_counts.closest_hit_count += ray_count;
+            for (int ray_index = 0; ray_index < ray_count; ++ray_index) {
+                const FeatureSample feature_sample = get_feature_sample(rays[ray_index], first_intersections[ray_index], scene);
+                const Colour colour = trace_path(rays[ray_index], first_intersections[ray_index], scene, path_settings, sample_streams[ray_index], bounce_histogram, ray_counts);
+                add_sample(film_tile, row, columns[ray_index], colour);
+                add_feature_sample(film_tile, row, columns[ray_index], feature_sample);
+            }
+        }
+    }
 
-    _mm_sfence();
-    ++work_queue.entry_count;
-    ReleaseSemaphore(work_queue.semaphore, 1, nullptr);
+    merge_film_tile(film, film_tile);
 }
 
-static void render_scanline(
-    const int row,
-    const int sample,
+// Generates the camera rays for a band of scanlines then hands them to the wavefront engine in one batch,
+// the batch needs to be big for sorting by material to find much to group together
+static void render_band_wavefront(
+    const int row_start,
+    const int row_end,
+    const AdaptiveTiles& adaptive_tiles,
     const Scene& scene,
+    const PathSettings& path_settings,
+    const Sampler& sampler,
     const real aperture,
     const Vec3& camera_position,
     const Vec3& camera_x,
@@ -82,98 +148,246 @@ static void render_scanline(
     const Vec3& bottom_left,
     const Vec3& step_x,
     const Vec3& step_y,
-    real* const pixels
+    Film& film,
+    BounceHistogram& bounce_histogram,
+    RayCounts& ray_counts
 ) {
-    const real lens_radius = 0.5f * aperture;
-    for (int column = 0; column < CLIENT_WIDTH; ++column) {
-        u32 rng = noise_3d(row, column, sample);
-        
-        rng = random_number(rng);
-        const real u_randomness = real_from_rng(rng);
-        const real u = (static_cast<real>(column) + u_randomness) / static_cast<real>(CLIENT_WIDTH - 1);
+    // kept between frames so the queues aren't reallocated every time
+    thread_local WavefrontQueues queues = {};
+    thread_local FilmTile film_tile = {};
+    thread_local std::vector<Ray> camera_rays;
+    thread_local std::vector<SampleStream> sample_streams;
+    thread_local std::vector<int> pixel_indices;
+    thread_local std::vector<Colour> colours;
+    thread_local std::vector<FeatureSample> features;
+
+    camera_rays.clear();
+    sample_streams.clear();
+    pixel_indices.clear();
+    for (int row = row_start; row < row_end; ++row) {
+        for (int column = 0; column < CLIENT_WIDTH; ++column) {
+            if (!is_active(adaptive_tiles, row, column)) {
+                continue;
+            }
 
-        rng = random_number(rng);
-        const real v_randomness = real_from_rng(rng);
-        const real v = (static_cast<real>(row) + v_randomness) / static_cast<real>(CLIENT_HEIGHT - 1);
+            const int pixel_index = row * CLIENT_WIDTH + column;
+            const int sample = static_cast<int>(film.sample_counts[get_pixel_index(film, row, column)]);
+            SampleStream sample_stream = construct_sample_stream(sampler, column, row, sample);
+            camera_rays.push_back(generate_camera_ray(row, column, CLIENT_WIDTH, CLIENT_HEIGHT, aperture, camera_position, camera_x, camera_y, bottom_left, step_x, step_y, sample_stream));
+            sample_streams.push_back(sample_stream);
+            pixel_indices.push_back(pixel_index);
+        }
+    }
 
-        rng = random_number(rng);
-        const real a_randomness = real_from_rng(rng);
-        const real a = aperture * a_randomness - lens_radius;
+    const int path_count = static_cast<int>(camera_rays.size());
+    colours.resize(path_count);
+    features.resize(path_count);
+    trace_paths(camera_rays.data(), sample_streams.data(), path_count, scene, path_settings, queues, colours.data(), features.data(), bounce_histogram, ray_counts);
+
+    begin_film_tile(film_tile, RenderTile{row_start, row_end, 0, CLIENT_WIDTH});
+    for (int path_index = 0; path_index < path_count; ++path_index) {
+        const int row = pixel_indices[path_index] / CLIENT_WIDTH;
+        const int column = pixel_indices[path_index] % CLIENT_WIDTH;
+        add_sample(film_tile, row, column, colours[path_index]);
+        add_feature_sample(film_tile, row, column, features[path_index]);
+    }
 
-        const real b_max = std::sqrt(lens_radius * lens_radius - a * a);
-        const real b_min = -b_max;
+    merge_film_tile(film, film_tile);
+}
 
-        rng = random_number(rng);
-        const real b_randomness = real_from_rng(rng);
-        const real b = (b_max - b_min) * b_randomness + b_min;
+struct FrameRenderData {
+    const RenderTile* render_tiles;
+    const AdaptiveTiles* adaptive_tiles;
+    Scene scene;
+    PathSettings path_settings;
+    Sampler sampler;
+    real aperture;
+    Vec3 camera_position;
+    Vec3 camera_x;
+    Vec3 camera_y;
+    Vec3 bottom_left;
+    Vec3 step_x;
+    Vec3 step_y;
+    Film* film;
+    BounceHistogram* bounce_histograms; // one per job so they don't share counts
+    RayCounts* ray_counts;              // likewise
+    real* preview_colours;              // rgb, written instead of the film when preview_scale > 1
+    int preview_scale;
+
+    // jobs that start after the main loop moves the epoch on skip their tile
+    const std::atomic<u32>* render_epoch;
+    u32 epoch;
+
+    // Thieves take the back half of a range, so jobs don't start in index order. Tile jobs take the next tile
+    // from here instead, whichever job they are, so tiles start in the list's centre first order.
+    std::atomic<int>* next_tile_index;
+};
 
-        const Vec3 random_offset = a * camera_x + b * camera_y;
+static bool is_cancelled(const FrameRenderData& frame) {
+    return frame.render_epoch->load(std::memory_order_relaxed) != frame.epoch;
+}
 
-        const Vec3 ray_direction = normalise(Vec3{bottom_left + u * step_x + v * step_y - camera_position - random_offset});
-        const Ray ray{camera_position + random_offset, ray_direction};
+static void render_tile_job(void* const data, int) {
+    const FrameRenderData& frame = *static_cast<const FrameRenderData*>(data);
+    if (is_cancelled(frame)) {
+        return;
+    }
 
-        const Colour colour = intersect(ray, scene);
+    const int tile_index = frame.next_tile_index->fetch_add(1, std::memory_order_relaxed);
+
+    render_tile(
+        frame.render_tiles[tile_index],
+        *frame.adaptive_tiles,
+        frame.scene,
+        frame.path_settings,
+        frame.sampler,
+        frame.aperture,
+        frame.camera_position,
+        frame.camera_x,
+        frame.camera_y,
+        frame.bottom_left,
+        frame.step_x,
+        frame.step_y,
+        *frame.film,
+        frame.bounce_histograms[tile_index],
+        frame.ray_counts[tile_index]
+    );
+}
 
-        const int index = 4 * (row * CLIENT_WIDTH + column);
-        pixels[index + 0] += colour.b;
-        pixels[index + 1] += colour.g;
-        pixels[index + 2] += colour.r;
-        pixels[index + 3] += 1.0f;
+static void render_band_wavefront_job(void* const data, const int band) {
+    const FrameRenderData& frame = *static_cast<const FrameRenderData*>(data);
+    if (is_cancelled(frame)) {
+        return;
     }
+
+    const int row_start = band * WAVEFRONT_BAND_HEIGHT;
+    render_band_wavefront(
+        row_start,
+        std::min(row_start + WAVEFRONT_BAND_HEIGHT, CLIENT_HEIGHT),
+        *frame.adaptive_tiles,
+        frame.scene,
+        frame.path_settings,
+        frame.sampler,
+        frame.aperture,
+        frame.camera_position,
+        frame.camera_x,
+        frame.camera_y,
+        frame.bottom_left,
+        frame.step_x,
+        frame.step_y,
+        *frame.film,
+        frame.bounce_histograms[band],
+        frame.ray_counts[band]
+    );
 }
 
-static bool process_work_queue_entry(RenderWorkQueue& work_queue) {
-    bool had_entry_to_process = false;
-
-    const LONG original_entry_to_do_index = work_queue.next_entry_to_do_index;
-    if (original_entry_to_do_index < work_queue.entry_count) {
-        const LONG entry_to_do_index = InterlockedCompareExchange(&work_queue.next_entry_to_do_index, original_entry_to_do_index + 1, original_entry_to_do_index);
-        if (entry_to_do_index == original_entry_to_do_index) {
-            const RenderWorkQueue::Entry& entry_to_do = work_queue.entries[entry_to_do_index];
-            render_scanline(
-                entry_to_do.row,
-                entry_to_do.sample,
-                entry_to_do.scene,
-                entry_to_do.aperture,
-                entry_to_do.camera_position,
-                entry_to_do.camera_x,
-                entry_to_do.camera_y,
-                entry_to_do.bottom_left,
-                entry_to_do.step_x,
-                entry_to_do.step_y,
-                entry_to_do.pixels
-            );
+// One path through the middle of each preview_scale square block of the tile, its colour fills the block
+static void render_preview_tile_job(void* const data, int) {
+    const FrameRenderData& frame = *static_cast<const FrameRenderData*>(data);
+    if (is_cancelled(frame)) {
+        return;
+    }
 
-            InterlockedIncrement(&work_queue.completed_entry_count);
-            ReleaseSemaphore(work_queue.semaphore, 1, nullptr);
-            had_entry_to_process = true;
+    const int tile_index = frame.next_tile_index->fetch_add(1, std::memory_order_relaxed);
+
+    // preview paths are cut short, they'd only skew the counts
+    BounceHistogram bounce_histogram = {};
+    RayCounts ray_counts = {};
+
+    const RenderTile& tile = frame.render_tiles[tile_index];
+    const int scale = frame.preview_scale;
+    for (int block_row = tile.row_start; block_row < tile.row_end; block_row += scale) {
+        for (int block_column = tile.column_start; block_column < tile.column_end; block_column += scale) {
+            const int block_row_end = std::min(block_row + scale, tile.row_end);
+            const int block_column_end = std::min(block_column + scale, tile.column_end);
+            const int row = (block_row + block_row_end) / 2;
+            const int column = (block_column + block_column_end) / 2;
+
+            SampleStream sample_stream = construct_sample_stream(frame.sampler, column, row, 0);
+            const Ray ray = generate_camera_ray(row, column, CLIENT_WIDTH, CLIENT_HEIGHT, frame.aperture, frame.camera_position, frame.camera_x, frame.camera_y, frame.bottom_left, frame.step_x, frame.step_y, sample_stream);
+            const Colour colour = intersect(ray, frame.scene, PREVIEW_PATH_SETTINGS, sample_stream, bounce_histogram, ray_counts);
+
+            for (int pixel_row = block_row; pixel_row < block_row_end; ++pixel_row) {
+                for (int pixel_column = block_column; pixel_column < block_column_end; ++pixel_column) {
+                    real* const preview_colour = frame.preview_colours + 3 * (pixel_row * CLIENT_WIDTH + pixel_column);
+                    preview_colour[0] = colour.r;
+                    preview_colour[1] = colour.g;
+                    preview_colour[2] = colour.b;
+                }
+            }
         }
     }
+}
+
+// Each pass's sums are copied out as means once it's finished, so the next pass can render into the film while
+// this one is denoised, converted for display and presented
+struct ResolveData {
+    const Film* film;
+    real* mean_colours;
+    real* mean_albedos;
+    real* mean_normals;
+    real* mean_depths;
+    const real* display_colours;
+    unsigned char* pixels_u8;   // bgra
+};
+
+static void copy_means_row_job(void* const data, const int row) {
+    const ResolveData& resolve_data = *static_cast<const ResolveData*>(data);
+    const Film& film = *resolve_data.film;
+    for (int column = 0; column < CLIENT_WIDTH; ++column) {
+        const int pixel_index = row * CLIENT_WIDTH + column;
+        const int film_pixel_index = get_pixel_index(film, row, column);
+        const real sample_count = static_cast<real>(film.sample_counts[film_pixel_index]);
+        for (int channel = 0; channel < 3; ++channel) {
+            resolve_data.mean_colours[3 * pixel_index + channel] = film.colours[3 * film_pixel_index + channel] / sample_count;
+            resolve_data.mean_albedos[3 * pixel_index + channel] = film.albedos[3 * film_pixel_index + channel] / sample_count;
+            resolve_data.mean_normals[3 * pixel_index + channel] = film.normals[3 * film_pixel_index + channel] / sample_count;
+        }
 
-    return had_entry_to_process;
+        resolve_data.mean_depths[pixel_index] = film.depths[film_pixel_index] / sample_count;
+    }
 }
 
-static bool work_in_progress(const RenderWorkQueue& work_queue) {
-    return (work_queue.completed_entry_count != work_queue.entry_count);
+static void convert_for_display_row_job(void* const data, const int row) {
+    const ResolveData& resolve_data = *static_cast<const ResolveData*>(data);
+    for (int pixel_index = row * CLIENT_WIDTH; pixel_index < (row + 1) * CLIENT_WIDTH; ++pixel_index) {
+        const real* const colour = resolve_data.display_colours + 3 * pixel_index;
+        const real r = std::min<real>(std::sqrt(std::max<real>(colour[0], 0.0f)), 1.0f);
+        const real g = std::min<real>(std::sqrt(std::max<real>(colour[1], 0.0f)), 1.0f);
+        const real b = std::min<real>(std::sqrt(std::max<real>(colour[2], 0.0f)), 1.0f);
+
+        unsigned char* const pixel = resolve_data.pixels_u8 + 4 * pixel_index;
+        pixel[0] = static_cast<unsigned char>(255.0f * b);
+        pixel[1] = static_cast<unsigned char>(255.0f * g);
+        pixel[2] = static_cast<unsigned char>(255.0f * r);
+        pixel[3] = 255;
+    }
 }
 
-static void reset(RenderWorkQueue& work_queue) {
-    work_queue.entry_count = 0;
-    work_queue.next_entry_to_do_index = 0;
-    work_queue.completed_entry_count = 0;
+// seconds, averaged over recent frames so the title bar is readable
+struct FrameTimings {
+    real frame;
+    real render;    // from a pass starting to the main loop seeing it finish
+    real waiting;   // of the render time, how long the main loop had nothing better to do
+    real copy;
+    real resolve;   // denoising and converting for display, only the resolve's own jobs, see below
+    real present;
+};
+
+static void update_timing(real& average, const real seconds) {
+    average += 0.1f * (seconds - average);
 }
 
-static DWORD thread_proc(const LPVOID parameter) {
-    RenderWorkQueue* const work_queue = static_cast<RenderWorkQueue*>(parameter);
+static LARGE_INTEGER get_ticks() {
+    LARGE_INTEGER ticks = {};
+    const BOOL read_ticks = QueryPerformanceCounter(&ticks);
+    assert(read_ticks != FALSE);
 
-    while (true) {
-        const bool had_entry_to_process = process_work_queue_entry(*work_queue);
-        if (!had_entry_to_process) {
-            WaitForSingleObject(work_queue->semaphore, INFINITE);
-        }
-    }
+    return ticks;
+}
 
-    return 0;
+static real get_seconds_between(const LARGE_INTEGER start, const LARGE_INTEGER end, const LARGE_INTEGER tick_frequency) {
+    return static_cast<real>(end.QuadPart - start.QuadPart) / static_cast<real>(tick_frequency.QuadPart);
 }
 
 static void write_pixel_data_to_file(unsigned char* const pixels, const u32 pixel_byte_count) {
@@ -211,10 +425,45 @@ static void write_pixel_data_to_file(unsigned char* const pixels, const u32 pixe
     assert(closed_handle != FALSE);
 }
 
+// shows up in the debugger's output window
+static void print_bounce_histogram(const BounceHistogram& bounce_histogram) {
+    for (int bounce_count = 0; bounce_count <= MAX_BOUNCE_COUNT; ++bounce_count) {
+        if (bounce_histogram.path_counts[bounce_count] > 0) {
+            char line[64] = {};
+            snprintf(line, sizeof(line), "%2d bounces: %llu paths\n", bounce_count, bounce_histogram.path_counts[bounce_count]);
+            OutputDebugStringA(line);
+        }
+    }
+}
+
+static void print_ray_counts(const RayCounts& ray_counts) {
+    char line[96] = {};
+    snprintf(line, sizeof(line), "%llu closest hit rays, %llu shadow rays\n", ray_counts.closest_hit_count, ray_counts.shadow_count);
+    OutputDebugStringA(line);
+}
+
+static void print_thread_pool_counters(const ThreadPoolCounters& counters) {
+    char line[192] = {};
+    snprintf(
+        line,
+        sizeof(line),
+        "%llu jobs, %llu steals, %llu failed steals, %llu sleeps totalling %.2fs\n",
+        counters.job_count,
+        counters.steal_count,
+        counters.failed_steal_count,
+        counters.sleep_count,
+        counters.sleep_seconds
+    );
+
+    OutputDebugStringA(line);
+}
+
 struct KeyboardInput {
     bool a;
     bool d;
     bool e;
+    bool m;
+    bool n;
     bool q;
     bool s;
     bool w;
@@ -223,6 +472,10 @@ struct KeyboardInput {
     bool down;
     bool left;
     bool right;
+    bool home;
+    bool end;
+    bool page_up;
+    bool page_down;
 };
 
 struct MouseInput {
@@ -282,6 +535,16 @@ static LRESULT CALLBACK main_window_proc(const HWND window, const UINT message,
                     return 0;
                 }
 
+                case 'M': {
+                    keyboard_input.m = true;
+                    return 0;
+                }
+
+                case 'N': {
+                    keyboard_input.n = true;
+                    return 0;
+                }
+
                 case 'Q': {
                     keyboard_input.q = true;
                     return 0;
@@ -322,6 +585,26 @@ static LRESULT CALLBACK main_window_proc(const HWND window, const UINT message,
                     return 0;
                 }
 
+                case VK_HOME: {
+                    keyboard_input.home = true;
+                    return 0;
+                }
+
+                case VK_END: {
+                    keyboard_input.end = true;
+                    return 0;
+                }
+
+                case VK_PRIOR: {
+                    keyboard_input.page_up = true;
+                    return 0;
+                }
+
+                case VK_NEXT: {
+                    keyboard_input.page_down = true;
+                    return 0;
+                }
+
                 default: {
                     return DefWindowProcA(window, message, w_param, l_param);
                 }
@@ -348,6 +631,16 @@ static LRESULT CALLBACK main_window_proc(const HWND window, const UINT message,
                     return 0;
                 }
 
+                case 'M': {
+                    keyboard_input.m = false;
+                    return 0;
+                }
+
+                case 'N': {
+                    keyboard_input.n = false;
+                    return 0;
+                }
+
                 case 'Q': {
                     keyboard_input.q = false;
                     return 0;
@@ -388,6 +681,26 @@ static LRESULT CALLBACK main_window_proc(const HWND window, const UINT message,
                     return 0;
                 }
 
+                case VK_HOME: {
+                    keyboard_input.home = false;
+                    return 0;
+                }
+
+                case VK_END: {
+                    keyboard_input.end = false;
+                    return 0;
+                }
+
+                case VK_PRIOR: {
+                    keyboard_input.page_up = false;
+                    return 0;
+                }
+
+                case VK_NEXT: {
+                    keyboard_input.page_down = false;
+                    return 0;
+                }
+
                 default: {
                     return DefWindowProcA(window, message, w_param, l_param);
                 }
@@ -497,347 +810,16 @@ int WINAPI wWinMain(const HINSTANCE instance, HINSTANCE, PWSTR, int) {
     const BOOL queried_performance_frequency = QueryPerformanceFrequency(&tick_frequency);
     assert(queried_performance_frequency != FALSE);
 
-    SYSTEM_INFO system_info = {};
-    GetSystemInfo(&system_info);
-
-    const DWORD core_count = system_info.dwNumberOfProcessors;
-    assert(core_count > 0);
-    const DWORD thread_count = core_count - 1;
-
-    RenderWorkQueue work_queue = {};
-    work_queue.semaphore = CreateSemaphoreA(nullptr, 0, thread_count, nullptr);
-
-    for (DWORD thread_index = 0; thread_index < thread_count; ++thread_index) {
-        DWORD thread_id = 0;
-        const HANDLE thread_handle = CreateThread(nullptr, 0, thread_proc, static_cast<LPVOID>(&work_queue), 0, &thread_id);
-        CloseHandle(thread_handle);
-    }
-
-    static constexpr int SPHERE_COUNT = 22 * 22 + 4;
-    Material materials[SPHERE_COUNT] = {};
-    Sphere spheres[SPHERE_COUNT] = {};
-    int sphere_material_indices[SPHERE_COUNT] = {};
-
-    int sphere_index = 0;
-    materials[sphere_index] = construct_lambertian_material(Colour{0.5f, 0.5f, 0.5f});
-    spheres[sphere_index] = Sphere{Vec3{0.0f, -1000.0f, 0.0f}, 1000.0f};
-    sphere_material_indices[sphere_index] = sphere_index;
-    ++sphere_index;
-
-    u32 rng = 479001599;
-    for (int a = -11; a < 11; ++a) {
-        for (int b = -11; b < 11; ++b) {
-            rng = random_number(rng);
-            const real material_choice = real_from_rng(rng);
-
-            rng = random_number(rng);
-            const real x_offset = 0.9f * real_from_rng(rng);
-
-            rng = random_number(rng);
-            const real z_offset = 0.9f * real_from_rng(rng);
-
-            const Vec3 sphere_centre{static_cast<real>(a) + x_offset, 0.2f, static_cast<real>(b) + z_offset};
-            spheres[sphere_index] = Sphere{sphere_centre, 0.2f};
-
-            if (material_choice < 0.8f) {
-                rng = random_number(rng);
-                const real colour_1_r = real_from_rng(rng);
-                rng = random_number(rng);
-                const real colour_1_g = real_from_rng(rng);
-                rng = random_number(rng);
-                const real colour_1_b = real_from_rng(rng);
-
-                const Colour colour_1{colour_1_r, colour_1_g, colour_1_b};
-
-                rng = random_number(rng);
-                const real colour_2_r = real_from_rng(rng);
-                rng = random_number(rng);
-                const real colour_2_g = real_from_rng(rng);
-                rng = random_number(rng);
-                const real colour_2_b = real_from_rng(rng);
-
-                const Colour colour_2{colour_2_r, colour_2_g, colour_2_b};
-
-                const Colour albedo = colour_1 * colour_2;
-                materials[sphere_index] = construct_lambertian_material(albedo);
-            } else if (material_choice < 0.95f) {
-                rng = random_number(rng);
-                const real colour_r = 0.5f * real_from_rng(rng) + 0.5f;
-                rng = random_number(rng);
-                const real colour_g = 0.5f * real_from_rng(rng) + 0.5f;
-                rng = random_number(rng);
-                const real colour_b = 0.5f * real_from_rng(rng) + 0.5f;                
-
-                const Colour albedo{colour_r, colour_g, colour_b};
-
-                rng = random_number(rng);
-                const real fuzziness = real_from_rng(rng);                
-
-                materials[sphere_index] = construct_metal_material(albedo, fuzziness);
-            } else {
-                materials[sphere_index] = construct_dielectric_material(1.5f);
-            }
-
-            sphere_material_indices[sphere_index] = sphere_index;
-            ++sphere_index;
-        }
-    }
-
-    assert(sphere_index == SPHERE_COUNT - 3);
-
-    materials[sphere_index] = construct_dielectric_material(1.5f);
-    spheres[sphere_index] = Sphere{Vec3{0.0f, 1.0f, 0.0f}, 1.0f};
-    sphere_material_indices[sphere_index] = sphere_index;
-    ++sphere_index;
-
-    materials[sphere_index] = construct_lambertian_material(Colour{0.4f, 0.2f, 0.1f});
-    spheres[sphere_index] = Sphere{Vec3{-4.0f, 1.0f, 0.0f}, 1.0f};
-    sphere_material_indices[sphere_index] = sphere_index;
-    ++sphere_index;
-
-    materials[sphere_index] = construct_metal_material(Colour{0.7f, 0.6f, 0.5f}, 0.0f);
-    spheres[sphere_index] = Sphere{Vec3{4.0f, 1.0f, 0.0f}, 1.0f};
-    sphere_material_indices[sphere_index] = sphere_index;
-    ++sphere_index;
-
-    assert(sphere_index == SPHERE_COUNT);
-
-    const BVH sphere_bvh = construct_sphere_bvh(spheres, SPHERE_COUNT);
-    const Scene random_spheres{
-        materials,
-        spheres,
-        &sphere_bvh,
-        sphere_material_indices,
-        nullptr,
-        nullptr,
-        nullptr,
-        Colour{1.0f, 1.0f, 1.0f},
-        Colour{0.5f, 0.7f, 1.0f}
-    };
-
-    const Vec3 sphere_camera_start_position{13.0f, 2.0f, 3.0f};
-    Camera sphere_camera = {};
-    sphere_camera.target = Vec3{0.0f, 0.0f, 0.0f};
-    sphere_camera.orientation = look_at_matrix(sphere_camera_start_position, sphere_camera.target);
-    sphere_camera.distance = magnitude(sphere_camera_start_position - sphere_camera.target);
-    sphere_camera.fov_y = degrees_to_radians(20.0f);
-    sphere_camera.aperture = 0.1f;
-    sphere_camera.focus_distance = 10.0f;
-
-    const Material cornell_materials[] = {
-        construct_lambertian_material(Colour{0.65f, 0.05f, 0.05f}), // red
-        construct_lambertian_material(Colour{0.73f, 0.73f, 0.73f}), // white
-        construct_lambertian_material(Colour{0.12f, 0.45f, 0.15f}), // green
-        construct_diffuse_light_material(Colour{1.0f, 1.0f, 1.0f}, 15.0f),  // light
-        construct_dielectric_material(1.5f)
-    };
-
-    const Sphere cornell_spheres[1] = {
-        Sphere{Vec3{183.0f, 240.0f, 169.0f}, 75.0f}
-    };
-
-    const int cornell_sphere_material_indices[1] = {4};
-
-    const BVH cornell_sphere_bvh = construct_sphere_bvh(cornell_spheres, 1);
-
-    const Vec3 unit_box_vertices[] = {
-        // +z
-        Vec3{0.0f, 1.0f, 1.0f}, Vec3{0.0f, 0.0f, 1.0f}, Vec3{1.0f, 0.0f, 1.0f},
-        Vec3{1.0f, 0.0f, 1.0f}, Vec3{1.0f, 1.0f, 1.0f}, Vec3{0.0f, 1.0f, 1.0f},
-
-        // +x
-        Vec3{1.0f, 1.0f, 1.0f}, Vec3{1.0f, 0.0f, 1.0f}, Vec3{1.0f, 0.0f, 0.0f},
-        Vec3{1.0f, 0.0f, 0.0f}, Vec3{1.0f, 1.0f, 0.0f}, Vec3{1.0f, 1.0f, 1.0f},
-
-        // -z
-        Vec3{1.0f, 1.0f, 0.0f}, Vec3{1.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 0.0f},
-        Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f}, Vec3{1.0f, 1.0f, 0.0f},
-
-        // -x
-        Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f},
-        Vec3{0.0f, 0.0f, 1.0f}, Vec3{0.0f, 1.0f, 1.0f}, Vec3{0.0f, 1.0f, 0.0f},
-
-        // +y
-        Vec3{1.0f, 1.0f, 1.0f}, Vec3{1.0f, 1.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f},
-        Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 1.0f, 1.0f}, Vec3{1.0f, 1.0f, 1.0f},
-
-        // -y
-        Vec3{0.0f, 0.0f, 1.0f}, Vec3{0.0f, 0.0f, 0.0f}, Vec3{1.0f, 0.0f, 0.0f},
-        Vec3{1.0f, 0.0f, 0.0f}, Vec3{1.0f, 0.0f, 1.0f}, Vec3{0.0f, 0.0f, 1.0f}
-    };
-
-    const Mat3 right_box_transform = scaling_matrix(165.0f, 165.0f, 165.0f) * rotation_matrix(-PI / 10.0f, 0.0f, 1.0f, 0.0f);
-    Vec3 right_box_vertices[36] = {};
-    for (int i = 0; i < 36; ++i) {
-        right_box_vertices[i] = right_box_transform * unit_box_vertices[i] + Vec3{130.0f, 0.0f, 65.0f};
-    }
-
-    Vec3 location = right_box_transform * Vec3{0.5f, 1.0f, 0.5f} + Vec3{130.0f, 0.0f, 65.0f};
-
-    assert(sizeof(unit_box_vertices) == sizeof(right_box_vertices));
-
-    const Mat3 left_box_transform = scaling_matrix(165.0f, 330.0f, 165.0f) * rotation_matrix(PI / 12.0f, 0.0f, 1.0f, 0.0f);
-    Vec3 left_box_vertices[36] = {};
-    for (int i = 0; i < 36; ++i) {
-        left_box_vertices[i] = left_box_transform * unit_box_vertices[i] + Vec3{265.0f, 0.0f, 295.0f};
-    }
-
-    assert(sizeof(unit_box_vertices) == sizeof(left_box_vertices));
-
-    const Triangle cornell_triangles[36] = {
-        // left wall
-        Triangle{Vec3{555.0f, 0.0f, 0.0f}, Vec3{555.0f, 0.0f, 555.0f}, Vec3{555.0f, 555.0f, 555.0f}},
-        Triangle{Vec3{555.0f, 555.0f, 555.0f}, Vec3{555.0f, 555.0f, 0.0f}, Vec3{555.0f, 0.0f, 0.0f}},
-
-        // right wall
-        Triangle{Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 555.0f, 0.0f}, Vec3{0.0f, 555.0f, 555.0f}},
-        Triangle{Vec3{0.0f, 555.0f, 555.0f}, Vec3{0.0f, 0.0f, 555.0f}, Vec3{0.0f, 0.0f, 0.0f}},
-
-        // floor
-        Triangle{Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 555.0f}, Vec3{555.0f, 0.0f, 555.0f}},
-        Triangle{Vec3{555.0f, 0.0f, 555.0f}, Vec3{555.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 0.0f}},
-
-        // ceiling
-        Triangle{Vec3{0.0f, 555.0f, 0.0f}, Vec3{555.0f, 555.0f, 0.0f}, Vec3{555.0f, 555.0f, 555.0f}},
-        Triangle{Vec3{555.0f, 555.0f, 555.0f}, Vec3{0.0f, 555.0f, 555.0f}, Vec3{0.0f, 555.0f, 0.0f}},
-
-        // back
-        Triangle{Vec3{0.0f, 0.0f, 555.0f}, Vec3{0.0f, 555.0f, 555.0f}, Vec3{555.0f, 555.0f, 555.0f}},
-        Triangle{Vec3{555.0f, 555.0f, 555.0f}, Vec3{555.0f, 0.0f, 555.0f}, Vec3{0.0f, 0.0f, 555.0f}},
-
-        // light
-        Triangle{Vec3{213.0f, 554.0f, 227.0f}, Vec3{343.0f, 554.0f, 227.0f}, Vec3{343.0f, 554.0f, 332.0f}},
-        Triangle{Vec3{343.0f, 554.0f, 332.0f}, Vec3{213.0f, 554.0f, 332.0f}, Vec3{213.0f, 554.0f, 227.0f}},
-
-        // right box
-        Triangle{right_box_vertices[0], right_box_vertices[1], right_box_vertices[2]},
-        Triangle{right_box_vertices[3], right_box_vertices[4], right_box_vertices[5]},
-
-        Triangle{right_box_vertices[6], right_box_vertices[7], right_box_vertices[8]},
-        Triangle{right_box_vertices[9], right_box_vertices[10], right_box_vertices[11]},
-
-        Triangle{right_box_vertices[12], right_box_vertices[13], right_box_vertices[14]},
-        Triangle{right_box_vertices[15], right_box_vertices[16], right_box_vertices[17]},
-
-        Triangle{right_box_vertices[18], right_box_vertices[19], right_box_vertices[20]},
-        Triangle{right_box_vertices[21], right_box_vertices[22], right_box_vertices[23]},
-
-        Triangle{right_box_vertices[24], right_box_vertices[25], right_box_vertices[26]},
-        Triangle{right_box_vertices[27], right_box_vertices[28], right_box_vertices[29]},
-
-        Triangle{right_box_vertices[30], right_box_vertices[31], right_box_vertices[32]},
-        Triangle{right_box_vertices[33], right_box_vertices[34], right_box_vertices[35]},
-
-        // left box
-        Triangle{left_box_vertices[0], left_box_vertices[1], left_box_vertices[2]},
-        Triangle{left_box_vertices[3], left_box_vertices[4], left_box_vertices[5]},
-
-        Triangle{left_box_vertices[6], left_box_vertices[7], left_box_vertices[8]},
-        Triangle{left_box_vertices[9], left_box_vertices[10], left_box_vertices[11]},
-
-        Triangle{left_box_vertices[12], left_box_vertices[13], left_box_vertices[14]},
-        Triangle{left_box_vertices[15], left_box_vertices[16], left_box_vertices[17]},
-
-        Triangle{left_box_vertices[18], left_box_vertices[19], left_box_vertices[20]},
-        Triangle{left_box_vertices[21], left_box_vertices[22], left_box_vertices[23]},
-
-        Triangle{left_box_vertices[24], left_box_vertices[25], left_box_vertices[26]},
-        Triangle{left_box_vertices[27], left_box_vertices[28], left_box_vertices[29]},
-
-        Triangle{left_box_vertices[30], left_box_vertices[31], left_box_vertices[32]},
-        Triangle{left_box_vertices[33], left_box_vertices[34], left_box_vertices[35]}
-    };
-
-    const int cornell_triangle_material_indices[36] = {
-        // left wall
-        2, 2,
-
-        // right wall
-        0, 0,
-
-        // floor
-        1, 1,
+    ThreadPool thread_pool;
+    start_thread_pool(thread_pool, get_default_worker_count());
+    const JobScheduler job_scheduler = get_job_scheduler(thread_pool);
 
-        // ceiling
-        1, 1,
+    // The resolve runs while the next pass's render jobs are queued, waiting with the normal scheduler the main
+    // thread would pick up whole render tiles and their time would count as resolving
+    const JobScheduler resolve_job_scheduler = get_group_job_scheduler(thread_pool);
 
-        // back
-        1, 1,
-
-        // light
-        3, 3,
-
-        // right box
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-
-        // left box
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
-    };
-
-    const BVH cornell_triangle_bvh = construct_triangle_bvh(cornell_triangles, 36);
-
-    const Scene cornell_box{
-        cornell_materials,
-        cornell_spheres,
-        &cornell_sphere_bvh,
-        cornell_sphere_material_indices,
-        cornell_triangles,
-        &cornell_triangle_bvh,
-        cornell_triangle_material_indices,
-        Colour{0.0f, 0.0f, 0.0f},
-        Colour{0.0f, 0.0f, 0.0f}
-    };
-
-    const Vec3 cornell_camera_start_position{278.0f, 278.0f, -800.0f};
-    Camera cornell_camera = {};
-    cornell_camera.target = Vec3{278.0f, 278.0f, 0.0f};
-    cornell_camera.orientation = look_at_matrix(cornell_camera_start_position, cornell_camera.target);
-    cornell_camera.distance = magnitude(cornell_camera_start_position - cornell_camera.target);
-    cornell_camera.fov_y = degrees_to_radians(40.0f);
-    cornell_camera.aperture = 0.1f;
-    cornell_camera.focus_distance = cornell_camera.distance;
-
-    const Material model_materials[2] = {
-        construct_lambertian_material(Colour{6.0f / 255.0f, 4.0f / 255.0f, 3.0f / 255.0f}),
-        construct_diffuse_light_material(Colour{1.0f, 1.0f, 1.0f}, 10.0f)
-    };
-
-    std::vector<Triangle> model_triangles = load_triangles_file(".\\models\\rook.triangles");
-    const std::vector<int> model_triangle_material_indices(model_triangles.size(), 0);
-
-    const Mat3 model_transform = rotation_matrix(-PI / 2.0f, 1.0f, 0.0f, 0.0f);
-    for (Triangle& triangle : model_triangles) {
-        triangle.a = model_transform * triangle.a;
-        triangle.b = model_transform * triangle.b;
-        triangle.c = model_transform * triangle.c;
-    }
-
-    const BVH model_triangle_bvh = construct_triangle_bvh(model_triangles.data(), model_triangles.size());
-
-    const Sphere model_light{Vec3{20.0f, 80.0f, 10.0f}, 20.0f};
-    const int model_light_material_index = 1;
-    const BVH model_light_bvh = construct_sphere_bvh(&model_light, 1);
-
-    const Scene model{
-        model_materials,
-        &model_light,
-        &model_light_bvh,
-        &model_light_material_index,
-        model_triangles.data(),
-        &model_triangle_bvh,
-        model_triangle_material_indices.data(),
-        Colour{0.01f, 0.01f, 0.01f},
-        Colour{0.01f, 0.01f, 0.01f}
-    };
-
-    const Vec3 model_camera_start_position{0.0f, 150.0f, 150.0f};
-    Camera model_camera = {};
-    model_camera.target = Vec3{0.0f, 0.0f, 0.0f};
-    model_camera.orientation = look_at_matrix(model_camera_start_position, model_camera.target);
-    model_camera.distance = magnitude(model_camera_start_position - model_camera.target);
-    model_camera.fov_y = degrees_to_radians(40.0f);
-    model_camera.aperture = 0.1f;
-    model_camera.focus_distance = model_camera.distance;
+    // the window's aspect ratio has to match, see ASPECT_RATIO
+    const SceneData scene_data = construct_chess_scene(job_scheduler);
 
     ApplicationState application_state = {};
     const HWND window = create_window(instance, CLIENT_WIDTH, CLIENT_HEIGHT, application_state);
@@ -862,18 +844,86 @@ int WINAPI wWinMain(const HINSTANCE instance, HINSTANCE, PWSTR, int) {
     bitmap_info.bmiHeader.biClrImportant = 0;
 
     static constexpr u32 PIXEL_COUNT = CLIENT_WIDTH * CLIENT_HEIGHT;
-    real* const pixels_real = static_cast<real*>(VirtualAlloc(0, 4 * PIXEL_COUNT * sizeof(real), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));    // TODO: 3x, not 4x
-    assert(pixels_real != nullptr);
+    Film film = construct_film(CLIENT_WIDTH, CLIENT_HEIGHT);
 
     unsigned char* const pixels_u8 = static_cast<unsigned char*>(VirtualAlloc(0, 4 * PIXEL_COUNT, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
-    assert(pixels_u8 != nullptr);    
+    assert(pixels_u8 != nullptr);
+
+    // per pixel means the denoiser reads, and its output
+    std::vector<real> mean_colours(3 * PIXEL_COUNT);
+    std::vector<real> mean_albedos(3 * PIXEL_COUNT);
+    std::vector<real> mean_normals(3 * PIXEL_COUNT);
+    std::vector<real> mean_depths(PIXEL_COUNT);
+    std::vector<real> denoise_scratch(2 * 3 * PIXEL_COUNT);
+    std::vector<real> denoised_colours(3 * PIXEL_COUNT);
+
+    DenoiseImages denoise_images = {};
+    denoise_images.width = CLIENT_WIDTH;
+    denoise_images.height = CLIENT_HEIGHT;
+    denoise_images.colours = mean_colours.data();
+    denoise_images.albedos = mean_albedos.data();
+    denoise_images.normals = mean_normals.data();
+    denoise_images.depths = mean_depths.data();
+    denoise_images.scratch = denoise_scratch.data();
+    denoise_images.denoised_colours = denoised_colours.data();
+    bool denoising = true;
+
+    AdaptiveTiles adaptive_tiles = construct_adaptive_tiles(CLIENT_WIDTH, CLIENT_HEIGHT);
+    int active_tile_count = adaptive_tiles.tile_count;
+    u64 samples_taken = 0;
 
     LARGE_INTEGER previous_time = {};
     const BOOL read_previous_time = QueryPerformanceCounter(&previous_time);
     assert(read_previous_time != FALSE);
 
-    const Scene& scene = model;
-    Camera& camera = model_camera;
+    const Scene scene = get_scene(scene_data);
+    Camera camera = scene_data.camera;
+    PathSettings path_settings = DEFAULT_PATH_SETTINGS;
+
+    // sobol has the lowest error per sample of the three in the Cornell box and chess scenes
+    const BlueNoiseTile blue_noise_tile = construct_blue_noise_tile();
+    Sampler::Type sampler_type = Sampler::Type::SOBOL;
+
+    const std::vector<RenderTile> render_tiles = construct_render_tiles(CLIENT_WIDTH, CLIENT_HEIGHT, RENDER_TILE_SIZE, RENDER_TILE_ORDER);
+    const int render_job_count = USE_WAVEFRONT_ENGINE ? WAVEFRONT_BAND_COUNT : static_cast<int>(render_tiles.size());
+
+    std::vector<BounceHistogram> job_bounce_histograms(render_job_count);
+    BounceHistogram bounce_histogram = {};
+    std::vector<RayCounts> job_ray_counts(render_job_count);
+    RayCounts ray_counts = {};
+
+    std::vector<real> preview_colours(3 * PIXEL_COUNT);
+    int preview_scale = PREVIEW_START_SCALE;
+    bool showing_preview = false;
+    std::atomic<u32> render_epoch{0};
+    std::atomic<int> next_tile_index{0};
+
+    // what doesn't change between passes, the camera's filled in as each one starts
+    FrameRenderData frame = {};
+    frame.render_tiles = render_tiles.data();
+    frame.adaptive_tiles = &adaptive_tiles;
+    frame.scene = scene;
+    frame.film = &film;
+    frame.bounce_histograms = job_bounce_histograms.data();
+    frame.ray_counts = job_ray_counts.data();
+    frame.preview_colours = preview_colours.data();
+    frame.render_epoch = &render_epoch;
+    frame.next_tile_index = &next_tile_index;
+
+    const Job render_job = USE_WAVEFRONT_ENGINE ? render_band_wavefront_job : render_tile_job;
+    JobGroup render_jobs;
+    bool render_in_flight = false;
+    LARGE_INTEGER render_start = {};
+
+    ResolveData resolve_data = {};
+    resolve_data.film = &film;
+    resolve_data.mean_colours = mean_colours.data();
+    resolve_data.mean_albedos = mean_albedos.data();
+    resolve_data.mean_normals = mean_normals.data();
+    resolve_data.mean_depths = mean_depths.data();
+    resolve_data.pixels_u8 = pixels_u8;
+
+    FrameTimings frame_timings = {};
 
     ApplicationState previous_application_state = application_state;
 
@@ -984,6 +1034,23 @@ int WINAPI wWinMain(const HINSTANCE instance, HINSTANCE, PWSTR, int) {
             camera_modified = true;
         }
 
+        // Page Up/Down change the most bounces a path can take and Home/End the fewest before russian roulette,
+        // the image starts again as if the camera moved
+        const KeyboardInput& previous_keyboard_input = previous_application_state.keyboard_input;
+        const int max_bounce_change = (!keyboard_input.page_up && previous_keyboard_input.page_up) - (!keyboard_input.page_down && previous_keyboard_input.page_down);
+        const int min_bounce_change = (!keyboard_input.home && previous_keyboard_input.home) - (!keyboard_input.end && previous_keyboard_input.end);
+        if (max_bounce_change != 0 || min_bounce_change != 0) {
+            path_settings = construct_path_settings(path_settings.min_bounce_count + min_bounce_change, path_settings.max_bounce_count + max_bounce_change);
+            camera_modified = true;
+        }
+
+        // M cycles through the samplers, starting the image again
+        const bool sampler_changed = !keyboard_input.m && previous_keyboard_input.m;
+        if (sampler_changed) {
+            sampler_type = static_cast<Sampler::Type>((sampler_type + 1) % (Sampler::Type::BLUE_NOISE + 1));
+            camera_modified = true;
+        }
+
         const Vec3 camera_position = get_position(camera);
 
         const real viewport_height = 2.0f * std::tan(0.5f * camera.fov_y);
@@ -993,48 +1060,174 @@ int WINAPI wWinMain(const HINSTANCE instance, HINSTANCE, PWSTR, int) {
         const Vec3 step_y = camera.focus_distance * viewport_height * camera_y;
         const Vec3 bottom_left = camera_position - 0.5f * step_x - 0.5f * step_y - camera.focus_distance * camera_z;
 
+        // Backpressure, the pass started last frame has to finish before another starts. A camera move cancels
+        // its tiles that haven't started, except the coarsest preview's, that's cheap and is what shows the
+        // move, a frame late.
+        bool pass_finished = false;
+        bool preview_finished = false;
+        if (render_in_flight) {
+            const bool cancelling = camera_modified && (frame.preview_scale != PREVIEW_START_SCALE);
+            if (cancelling) {
+                render_epoch.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            const LARGE_INTEGER wait_start = get_ticks();
+            wait_for_jobs(thread_pool, render_jobs);
+            const LARGE_INTEGER render_end = get_ticks();
+            update_timing(frame_timings.waiting, get_seconds_between(wait_start, render_end, tick_frequency));
+            if (!cancelling) {
+                update_timing(frame_timings.render, get_seconds_between(render_start, render_end, tick_frequency));
+            }
+
+            render_in_flight = false;
+            preview_finished = !cancelling && (frame.preview_scale > 1);
+            pass_finished = !cancelling && (frame.preview_scale == 1);
+        }
+
+        if (preview_finished) {
+            const LARGE_INTEGER copy_start = get_ticks();
+            std::copy(preview_colours.begin(), preview_colours.end(), mean_colours.begin());
+            update_timing(frame_timings.copy, get_seconds_between(copy_start, get_ticks(), tick_frequency));
+
+            showing_preview = true;
+            preview_scale = frame.preview_scale / 2;
+
+            char window_title[256] = {};
+            snprintf(
+                window_title,
+                sizeof(window_title),
+                "Path Tracer - previewing at 1/%d resolution | "
+                "frame %.1fms: render %.1fms (waited %.1fms), copy %.1fms, resolve %.1fms, present %.1fms",
+                frame.preview_scale,
+                1000.0f * frame_timings.frame,
+                1000.0f * frame_timings.render,
+                1000.0f * frame_timings.waiting,
+                1000.0f * frame_timings.copy,
+                1000.0f * frame_timings.resolve,
+                1000.0f * frame_timings.present
+            );
+
+            SetWindowTextA(window, window_title);
+        }
+
+        if (pass_finished) {
+            for (const BounceHistogram& job_bounce_histogram : job_bounce_histograms) {
+                add(bounce_histogram, job_bounce_histogram);
+            }
+
+            for (const RayCounts& job_ray_count : job_ray_counts) {
+                add(ray_counts, job_ray_count);
+            }
+
+            samples_taken += get_active_pixel_count(adaptive_tiles);
+            ++sample;
+            active_tile_count = update_active_tiles(film, adaptive_tiles);
+
+            // the means are the pass's copy, the film is free for the next one as soon as they're taken
+            const LARGE_INTEGER copy_start = get_ticks();
+            parallel_for(job_scheduler, copy_means_row_job, &resolve_data, CLIENT_HEIGHT);
+            update_timing(frame_timings.copy, get_seconds_between(copy_start, get_ticks(), tick_frequency));
+            showing_preview = false;
+
+            // against giving every pixel a sample every pass
+            const real uniform_sample_fraction = static_cast<real>(samples_taken) / (static_cast<real>(sample) * static_cast<real>(PIXEL_COUNT));
+
+            char window_title[256] = {};
+            snprintf(
+                window_title,
+                sizeof(window_title),
+                "Path Tracer - %d %s passes, %.0f%% of uniform samples, %d/%d tiles active, %.2f bounces per path (%d min, %d max) | "
+                "frame %.1fms: render %.1fms (waited %.1fms), copy %.1fms, resolve %.1fms, present %.1fms",
+                sample,
+                get_sampler_name(sampler_type),
+                100.0f * uniform_sample_fraction,
+                active_tile_count,
+                adaptive_tiles.tile_count,
+                get_mean_bounce_count(bounce_histogram),
+                path_settings.min_bounce_count,
+                path_settings.max_bounce_count,
+                1000.0f * frame_timings.frame,
+                1000.0f * frame_timings.render,
+                1000.0f * frame_timings.waiting,
+                1000.0f * frame_timings.copy,
+                1000.0f * frame_timings.resolve,
+                1000.0f * frame_timings.present
+            );
+
+            SetWindowTextA(window, window_title);
+        }
+
         if (camera_modified) {
-            memset(pixels_real, 0, 4 * sizeof(real) * PIXEL_COUNT);
+            clear(film);
+            activate_all(adaptive_tiles);
+            active_tile_count = adaptive_tiles.tile_count;
+            samples_taken = 0;
             sample = 0;
+            bounce_histogram = BounceHistogram{};
+            ray_counts = RayCounts{};
+            preview_scale = PREVIEW_START_SCALE;
         }
 
-        for (int row = 0; row < CLIENT_HEIGHT; ++row) {
-            RenderWorkQueue::Entry entry = {};
-            entry.row = row;
-            entry.sample = sample;
-            entry.scene = scene;
-            entry.aperture = camera.aperture;
-            entry.camera_position = camera_position;
-            entry.camera_x = camera_x;
-            entry.camera_y = camera_y;
-            entry.bottom_left = bottom_left;
-            entry.step_x = step_x;
-            entry.step_y = step_y;
-            entry.pixels = pixels_real;
-
-            push_entry(work_queue, entry);
+        // N toggles the denoiser, the image is redone even if it has converged
+        const bool denoising_toggled = !keyboard_input.n && previous_keyboard_input.n;
+        if (denoising_toggled) {
+            denoising = !denoising;
         }
 
-        while (work_in_progress(work_queue)) {
-            process_work_queue_entry(work_queue);
-        }
+        // nothing left to do until the camera moves once every tile has converged
+        const bool rendering = (active_tile_count > 0);
+        if (rendering) {
+            for (BounceHistogram& job_bounce_histogram : job_bounce_histograms) {
+                job_bounce_histogram = BounceHistogram{};
+            }
 
-        reset(work_queue);
+            for (RayCounts& job_ray_count : job_ray_counts) {
+                job_ray_count = RayCounts{};
+            }
 
-        for (int pixel_index = 0; pixel_index < PIXEL_COUNT; ++pixel_index) {
-            const int index = 4 * pixel_index;
-            const real b = std::min<real>(std::sqrt(pixels_real[index + 0] / static_cast<real>(sample + 1)), 1.0f);
-            const real g = std::min<real>(std::sqrt(pixels_real[index + 1] / static_cast<real>(sample + 1)), 1.0f);
-            const real r = std::min<real>(std::sqrt(pixels_real[index + 2] / static_cast<real>(sample + 1)), 1.0f);
+            frame.sampler = construct_sampler(sampler_type, blue_noise_tile);
+            frame.path_settings = path_settings;
+            frame.aperture = camera.aperture;
+            frame.camera_position = camera_position;
+            frame.camera_x = camera_x;
+            frame.camera_y = camera_y;
+            frame.bottom_left = bottom_left;
+            frame.step_x = step_x;
+            frame.step_y = step_y;
+            frame.preview_scale = preview_scale;
+            frame.epoch = render_epoch.load(std::memory_order_relaxed);
+
+            const bool previewing = (preview_scale > 1);
+            next_tile_index.store(0, std::memory_order_relaxed);
+            render_start = get_ticks();
+            if (previewing) {
+                start_jobs(thread_pool, render_jobs, render_preview_tile_job, &frame, static_cast<int>(render_tiles.size()));
+            } else {
+                start_jobs(thread_pool, render_jobs, render_job, &frame, render_job_count);
+            }
 
-            pixels_u8[index + 0] = static_cast<unsigned char>(255.0f * b);
-            pixels_u8[index + 1] = static_cast<unsigned char>(255.0f * g);
-            pixels_u8[index + 2] = static_cast<unsigned char>(255.0f * r);
-            pixels_u8[index + 3] = 255;
+            render_in_flight = true;
         }
 
-        ++sample;
+        // The workers render the next pass meanwhile, the last one is resolved from its means. The main thread only
+        // runs resolve jobs so the resolve timing is the resolve alone, workers busy with tiles just help it less.
+        if (pass_finished || preview_finished || denoising_toggled) {
+            const LARGE_INTEGER resolve_start = get_ticks();
+
+            // denoised before the sqrt and clamp so the filter works on radiance, previews have no features
+            const bool denoising_display = denoising && !showing_preview;
+            if (denoising_display) {
+                denoise(denoise_images, DEFAULT_DENOISE_SETTINGS, resolve_job_scheduler);
+            }
+
+            resolve_data.display_colours = denoising_display ? denoised_colours.data() : mean_colours.data();
+            parallel_for(resolve_job_scheduler, convert_for_display_row_job, &resolve_data, CLIENT_HEIGHT);
+            update_timing(frame_timings.resolve, get_seconds_between(resolve_start, get_ticks(), tick_frequency));
+        } else if (!rendering) {
+            Sleep(10);
+        }
 
+        const LARGE_INTEGER present_start = get_ticks();
         const int scanlines_copied = StretchDIBits(
           window_device_context,
           0,
@@ -1052,10 +1245,14 @@ int WINAPI wWinMain(const HINSTANCE instance, HINSTANCE, PWSTR, int) {
         );
 
         assert(scanlines_copied == CLIENT_HEIGHT);
+        update_timing(frame_timings.present, get_seconds_between(present_start, get_ticks(), tick_frequency));
+        update_timing(frame_timings.frame, frame_duration);
 
-        const KeyboardInput& previous_keyboard_input = previous_application_state.keyboard_input;
         if (keyboard_input.ctrl && !keyboard_input.s && previous_keyboard_input.s) {
             write_pixel_data_to_file(pixels_u8, 4 * PIXEL_COUNT);
+            print_bounce_histogram(bounce_histogram);
+            print_ray_counts(ray_counts);
+            print_thread_pool_counters(get_counters(thread_pool));
         }
 
         previous_application_state = application_state;
@@ -1071,5 +1268,11 @@ int WINAPI wWinMain(const HINSTANCE instance, HINSTANCE, PWSTR, int) {
         }
     }
 
+    if (render_in_flight) {
+        wait_for_jobs(thread_pool, render_jobs);
+    }
+
+    destroy_film(film);
+    stop_thread_pool(thread_pool);
     return 0;
 }
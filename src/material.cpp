@@ -10,10 +10,10 @@ static Material construct_lambertian_material(const Colour& albedo) {
     return material;
 }
 
-static Material construct_metal_material(const Colour& albedo, const real fuzziness) {
+static Material construct_metal_material(const Colour& albedo, const real roughness) {
     Material material = {};
     material.metal.albedo = albedo;
-    material.metal.fuzziness = fuzziness;
+    material.metal.roughness = roughness;
     material.type = Material::Type::METAL;
 
     return material;
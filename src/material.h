@@ -8,9 +8,10 @@ struct Lambertian {
     Colour albedo;
 };
 
+// GGX microfacets, albedo is the reflectance head on
 struct Metal {
     Colour albedo;
-    real fuzziness;
+    real roughness;     // perceptual, GGX alpha is its square, zero is a mirror
 };
 
 struct Dielectric {
@@ -41,7 +42,7 @@ struct Material {
 };
 
 static Material construct_lambertian_material(const Colour& albedo);
-static Material construct_metal_material(const Colour& albedo, real fuzziness);
+static Material construct_metal_material(const Colour& albedo, real roughness);
 static Material construct_dielectric_material(real refraction_index);
 static Material construct_diffuse_light_material(const Colour& emission_colour, real emission_power);
 static Colour get_colour(const Material& material);
@@ -2,62 +2,95 @@
 #include "types.h"
 
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+
+// Files start with a header saying how wide their reals are so either precision's build can read them. Files
+// from before there was a header are bare doubles.
+struct TrianglesFileHeader {
+    char magic[4];
+    u32 real_size;
+};
 
-// TODO: a bit weird this file depends on windows?
-#define NOMINMAX
-#include <Windows.h>
+static constexpr char TRIANGLES_FILE_MAGIC[4] = {'T', 'R', 'I', 'S'};
 
-static std::vector<Triangle> load_triangles_file(const char* const filename) {
-    const HANDLE file_handle = CreateFileA(
-        filename,
-        GENERIC_READ,
-        0,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
+template <typename FileReal>
+static std::vector<Triangle> read_triangles(const char* const data, const u64 size) {
+    static constexpr u64 TRIANGLE_SIZE = 9 * sizeof(FileReal);
+    assert(size % TRIANGLE_SIZE == 0);
 
-    assert(file_handle != INVALID_HANDLE_VALUE);
+    std::vector<Triangle> triangles(size / TRIANGLE_SIZE);
+    for (std::size_t triangle_index = 0; triangle_index < triangles.size(); ++triangle_index) {
+        FileReal values[9] = {};
+        memcpy(values, data + triangle_index * TRIANGLE_SIZE, TRIANGLE_SIZE);
 
-    LARGE_INTEGER file_size = {};
-    const BOOL got_file_size = GetFileSizeEx(file_handle, &file_size);
-    assert(got_file_size != FALSE);
-    assert(file_size.QuadPart % sizeof(Triangle) == 0);
+        Triangle& triangle = triangles[triangle_index];
+        triangle.a = Vec3{static_cast<real>(values[0]), static_cast<real>(values[1]), static_cast<real>(values[2])};
+        triangle.b = Vec3{static_cast<real>(values[3]), static_cast<real>(values[4]), static_cast<real>(values[5])};
+        triangle.c = Vec3{static_cast<real>(values[6]), static_cast<real>(values[7]), static_cast<real>(values[8])};
+    }
 
-    std::vector<Triangle> triangles(file_size.QuadPart / sizeof(Triangle));
+    return triangles;
+}
 
-    DWORD bytes_read = 0;
-    const BOOL read_file_triangles = ReadFile(file_handle, triangles.data(), file_size.QuadPart, &bytes_read, nullptr);
-    assert(read_file_triangles != FALSE);
-    assert(bytes_read == file_size.QuadPart);
+// the whole file, plain stdio so the loaders work outside the Windows app too
+static std::vector<char> read_file(const char* const filename) {
+    FILE* const file = fopen(filename, "rb");
+    assert(file != nullptr);
 
-    const BOOL closed_file_handle = CloseHandle(file_handle);
-    assert(closed_file_handle != FALSE);
+    const int sought_end = fseek(file, 0, SEEK_END);
+    assert(sought_end == 0);
+    const long file_size = ftell(file);
+    assert(file_size >= 0);
+    const int sought_start = fseek(file, 0, SEEK_SET);
+    assert(sought_start == 0);
 
-    return triangles;
+    std::vector<char> file_data(file_size);
+    const std::size_t bytes_read = fread(file_data.data(), 1, file_data.size(), file);
+    assert(bytes_read == file_data.size());
+
+    const int closed_file = fclose(file);
+    assert(closed_file == 0);
+
+    return file_data;
+}
+
+static std::vector<Triangle> load_triangles_file(const char* const filename) {
+    const std::vector<char> file_data = read_file(filename);
+
+    TrianglesFileHeader header = {};
+    const bool has_header = (file_data.size() >= sizeof(header)) && (memcmp(file_data.data(), TRIANGLES_FILE_MAGIC, sizeof(TRIANGLES_FILE_MAGIC)) == 0);
+    if (!has_header) {
+        return read_triangles<double>(file_data.data(), file_data.size());
+    }
+
+    memcpy(&header, file_data.data(), sizeof(header));
+    assert(header.real_size == sizeof(float) || header.real_size == sizeof(double));
+
+    const char* const triangle_data = file_data.data() + sizeof(header);
+    const u64 triangle_data_size = file_data.size() - sizeof(header);
+    return (header.real_size == sizeof(float)) ? read_triangles<float>(triangle_data, triangle_data_size) : read_triangles<double>(triangle_data, triangle_data_size);
 }
 
+// in this build's precision
 static void save_triangles_file(const std::vector<Triangle>& triangles, const char* const filename) {
-    const HANDLE file_handle = CreateFileA(
-        filename,
-        GENERIC_WRITE,
-        0,
-        nullptr,
-        CREATE_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
-
-    assert(file_handle != INVALID_HANDLE_VALUE);
-
-    DWORD bytes_written = 0;
-    const BOOL wrote_file = WriteFile(file_handle, triangles.data(), sizeof(Triangle) * triangles.size(), &bytes_written, nullptr);
-    assert(wrote_file != FALSE);
-    assert(bytes_written == sizeof(Triangle) * triangles.size());
-
-    const BOOL closed_file_handle = CloseHandle(file_handle);
-    assert(closed_file_handle != FALSE);
+    static_assert(sizeof(Triangle) == 9 * sizeof(real), "triangles are written straight from memory");
+
+    FILE* const file = fopen(filename, "wb");
+    assert(file != nullptr);
+
+    TrianglesFileHeader header = {};
+    memcpy(header.magic, TRIANGLES_FILE_MAGIC, sizeof(TRIANGLES_FILE_MAGIC));
+    header.real_size = sizeof(real);
+
+    const std::size_t headers_written = fwrite(&header, sizeof(header), 1, file);
+    assert(headers_written == 1);
+
+    const std::size_t triangles_written = fwrite(triangles.data(), sizeof(Triangle), triangles.size(), file);
+    assert(triangles_written == triangles.size());
+
+    const int closed_file = fclose(file);
+    assert(closed_file == 0);
 }
 
 struct ByteStream {
@@ -80,7 +113,7 @@ Token get_next_token(ByteStream& byte_stream) {
         ++byte_stream.index;
     }
 
-    const DWORD token_start = byte_stream.index;
+    const u32 token_start = byte_stream.index;
     while (byte_stream.index < byte_stream.size && !is_whitespace(byte_stream.data[byte_stream.index])) {
         ++byte_stream.index;
     }
@@ -108,31 +141,14 @@ static Vec3 parse_stl_vec3(ByteStream& byte_stream) {
 }
 
 static std::vector<Triangle> parse_stl_file(const char* const filename) {
-    const HANDLE file_handle = CreateFileA(
-        filename,
-        GENERIC_READ,
-        0,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
-
-    assert(file_handle != INVALID_HANDLE_VALUE);
-
-    LARGE_INTEGER file_size = {};
-    const BOOL got_file_size = GetFileSizeEx(file_handle, &file_size);
-    assert(got_file_size != FALSE);
+    // terminated so the last number's conversion stops at the end
+    std::vector<char> file_data = read_file(filename);
+    const u32 file_size = static_cast<u32>(file_data.size());
+    file_data.push_back('\0');
 
     ByteStream stl_file = {};
-    stl_file.data = static_cast<char*>(VirtualAlloc(0, file_size.QuadPart + 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
-    assert(stl_file.data != nullptr);
-
-    DWORD bytes_read = 0;
-    const BOOL file_read = ReadFile(file_handle, stl_file.data, file_size.QuadPart, &bytes_read, nullptr);
-    assert(file_read != FALSE);
-    assert(bytes_read == file_size.QuadPart);
-    stl_file.size = file_size.QuadPart;
+    stl_file.data = file_data.data();
+    stl_file.size = file_size;
     stl_file.index = 0;
 
     std::vector<Triangle> triangles;
@@ -187,10 +203,5 @@ static std::vector<Triangle> parse_stl_file(const char* const filename) {
         }
     }
 
-    VirtualFree(stl_file.data, file_size.QuadPart + 1, MEM_RELEASE);
-
-    const BOOL closed_file_handle = CloseHandle(file_handle);
-    assert(closed_file_handle != FALSE);
-
     return triangles;
 }
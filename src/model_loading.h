@@ -5,6 +5,7 @@
 
 #include <vector>
 
+// reads files written in either precision, converting to this build's
 static std::vector<Triangle> load_triangles_file(const char* filename);
 static void save_triangles_file(const std::vector<Triangle>& triangles, const char* const filename);
 
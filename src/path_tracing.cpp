@@ -1,19 +1,20 @@
 #include "path_tracing.h"
 #include "bvh.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 
 static Vec3 reflect(const Vec3& direction, const Vec3& unit_normal) {
-    assert(std::abs(direction * direction - 1.0f) < 1.0e-6f);
-    assert(std::abs(unit_normal * unit_normal - 1.0f) < 1.0e-6f);
+    assert(std::abs(direction * direction - 1.0f) < UNIT_LENGTH_TOLERANCE);
+    assert(std::abs(unit_normal * unit_normal - 1.0f) < UNIT_LENGTH_TOLERANCE);
 
     return direction - 2.0f * (direction * unit_normal) * unit_normal;
 }
 
 static Vec3 refract(const Vec3& direction, const Vec3& unit_normal, const real refraction_ratio) {
-    assert(std::abs(direction * direction - 1.0f) < 1.0e-6f);
-    assert(std::abs(unit_normal * unit_normal - 1.0f) < 1.0e-6f);
+    assert(std::abs(direction * direction - 1.0f) < UNIT_LENGTH_TOLERANCE);
+    assert(std::abs(unit_normal * unit_normal - 1.0f) < UNIT_LENGTH_TOLERANCE);
 
     const real cos_theta = -direction * unit_normal;
     assert(-1.0f <= cos_theta && cos_theta <= 1.0f);
@@ -32,70 +33,336 @@ static real reflectance(const real cos_theta, const real refraction_ratio) {
     return r0 + (1.0f - r0) * difference * difference * difference * difference * difference;
 }
 
-static Maybe<Ray> scatter(const Ray& ray, const Material& material, const Vec3& point, const Vec3& point_unit_normal) {
-    assert(std::abs(ray.direction * ray.direction - 1.0f) < 1.0e-6f);
-    assert(std::abs(point_unit_normal * point_unit_normal - 1.0f) < 1.0e-6f);
+// Scattered rays start this far off the surface so they don't hit it again. Far from the origin rounding
+// in the hit point outgrows it, which only happens at float precision, so it grows with the point.
+static constexpr real NUDGE_FACTOR = 0.001f;
+static constexpr real RELATIVE_NUDGE_FACTOR = 64.0f * REAL_EPSILON;
 
-    static constexpr real NUDGE_FACTOR = 0.001f;
+static real get_nudge_distance(const Vec3& point) {
+    const real max_coordinate = std::max(std::abs(point.x), std::max(std::abs(point.y), std::abs(point.z)));
+    return std::max(NUDGE_FACTOR, RELATIVE_NUDGE_FACTOR * max_coordinate);
+}
+
+// Schlick's approximation for a conductor, the albedo is its reflectance head on
+static Colour get_conductor_fresnel(const Colour& albedo, const real cos_theta) {
+    const real difference = 1.0f - std::min<real>(std::max<real>(cos_theta, 0.0f), 1.0f);
+    const real weight = difference * difference * difference * difference * difference;
+    return (1.0f - weight) * albedo + Colour{weight, weight, weight};
+}
+
+// metals smoother than this are mirrors, GGX's distribution is too spiky to evaluate below it
+static constexpr real MIN_GGX_ALPHA = 0.001f;
+
+// roughness is perceptual, squaring it spreads the look of the lobe out evenly over zero to one
+static real get_ggx_alpha(const Metal& metal) {
+    return metal.roughness * metal.roughness;
+}
+
+// density of microfacet normals, cos_theta is the microfacet normal's against the surface's
+static real get_ggx_distribution(const real cos_theta, const real alpha) {
+    const real alpha_squared = alpha * alpha;
+    const real denominator = cos_theta * cos_theta * (alpha_squared - 1.0f) + 1.0f;
+    return alpha_squared / (PI * denominator * denominator);
+}
+
+// Smith's lambda, G1 = 1 / (1 + lambda) is how much of the microfacets a direction sees
+static real get_ggx_lambda(const real cos_theta, const real alpha) {
+    const real cos_theta_squared = cos_theta * cos_theta;
+    const real tan_theta_squared = std::max<real>(0.0f, 1.0f - cos_theta_squared) / cos_theta_squared;
+    return 0.5f * (std::sqrt(1.0f + alpha * alpha * tan_theta_squared) - 1.0f);
+}
+
+// What light sampling needs to know to weigh its samples against scattering. Lambertian scattering is
+// cosine weighted about the normal, metal reflects off GGX microfacets picked in proportion to how much
+// of each the outgoing direction sees.
+struct ScatterLobe {
+    enum Type {
+        COSINE = 0,
+        GGX_REFLECTION = 1
+    };
+
+    Type type;
+    Mat3 basis;             // z along the normal
+    Vec3 local_outgoing;    // back along the ray in the basis, GGX only
+    real alpha;             // GGX only
+    Colour albedo;
+};
+
+static Maybe<ScatterLobe> get_scatter_lobe(const Ray& ray, const Material& material, const Vec3& point_unit_normal) {
+    Maybe<ScatterLobe> scatter_lobe = {};
+    scatter_lobe.value.basis = orthonormal_basis(point_unit_normal);
+    if (material.type == Material::Type::LAMBERTIAN) {
+        scatter_lobe.value.type = ScatterLobe::Type::COSINE;
+        scatter_lobe.value.albedo = material.lambertian.albedo;
+        scatter_lobe.is_valid = true;
+    } else if (material.type == Material::Type::METAL && get_ggx_alpha(material.metal) >= MIN_GGX_ALPHA) {
+        scatter_lobe.value.type = ScatterLobe::Type::GGX_REFLECTION;
+        scatter_lobe.value.local_outgoing = transpose(scatter_lobe.value.basis) * -ray.direction;
+        scatter_lobe.value.alpha = get_ggx_alpha(material.metal);
+        scatter_lobe.value.albedo = material.metal.albedo;
+        scatter_lobe.is_valid = (scatter_lobe.value.local_outgoing.z > 0.0f);
+    }
+
+    return scatter_lobe;
+}
+
+// Density over solid angle. Reflecting a visible normal sample h doubles angles so the density
+// is G1(o) max(0, o.h) D(h) / o.z over 4 o.h.
+static real get_scatter_pdf(const ScatterLobe& scatter_lobe, const Vec3& direction) {
+    const Vec3 local_incoming = transpose(scatter_lobe.basis) * direction;
+    if (scatter_lobe.type == ScatterLobe::Type::COSINE) {
+        return std::max<real>(0.0f, local_incoming.z) / PI;
+    }
+
+    const Vec3& local_outgoing = scatter_lobe.local_outgoing;
+    if (local_incoming.z <= 0.0f || local_outgoing.z <= 0.0f) {
+        return 0.0f;
+    }
 
+    const Vec3 half_vector = normalise(local_outgoing + local_incoming);
+    const real alpha = scatter_lobe.alpha;
+    const real visibility = 1.0f / (1.0f + get_ggx_lambda(local_outgoing.z, alpha));
+    return visibility * get_ggx_distribution(half_vector.z, alpha) / (4.0f * local_outgoing.z);
+}
+
+// BSDF times the cosine at the surface, for GGX F D G2 / (4 o.z) with the height correlated G2
+static Colour evaluate_scatter(const ScatterLobe& scatter_lobe, const Vec3& direction) {
+    const Vec3 local_incoming = transpose(scatter_lobe.basis) * direction;
+    if (scatter_lobe.type == ScatterLobe::Type::COSINE) {
+        return (std::max<real>(0.0f, local_incoming.z) / PI) * scatter_lobe.albedo;
+    }
+
+    const Vec3& local_outgoing = scatter_lobe.local_outgoing;
+    if (local_incoming.z <= 0.0f || local_outgoing.z <= 0.0f) {
+        return Colour{0.0f, 0.0f, 0.0f};
+    }
+
+    const Vec3 half_vector = normalise(local_outgoing + local_incoming);
+    const real alpha = scatter_lobe.alpha;
+    const real masking_shadowing = 1.0f / (1.0f + get_ggx_lambda(local_outgoing.z, alpha) + get_ggx_lambda(local_incoming.z, alpha));
+    const real scale = get_ggx_distribution(half_vector.z, alpha) * masking_shadowing / (4.0f * local_outgoing.z);
+    return scale * get_conductor_fresnel(scatter_lobe.albedo, local_outgoing * half_vector);
+}
+
+struct ScatteredRay {
+    Ray ray;
+    Colour weight;  // BSDF times cosine over pdf, what the path's attenuation is multiplied by
+};
+
+static Maybe<ScatteredRay> scatter(const Ray& ray, const Material& material, const Vec3& point, const Vec3& point_unit_normal, SampleStream& sample_stream) {
+    assert(std::abs(ray.direction * ray.direction - 1.0f) < UNIT_LENGTH_TOLERANCE);
+    assert(std::abs(point_unit_normal * point_unit_normal - 1.0f) < UNIT_LENGTH_TOLERANCE);
+
+    const real nudge_distance = get_nudge_distance(point);
     switch (material.type) {
         case Material::Type::LAMBERTIAN: {
-            Maybe<Ray> scattered_ray = {};
-            const Vec3 random = random_unit_vector(ray.direction);
-            scattered_ray.value.origin = point + NUDGE_FACTOR * point_unit_normal;
-            scattered_ray.value.direction = normalise(point_unit_normal + 0.99f * random);
+            Maybe<ScatteredRay> scattered_ray = {};
+            const Vec3 local_direction = sample_cosine_hemisphere(next_2d(sample_stream));
+            scattered_ray.value.ray.origin = point + nudge_distance * point_unit_normal;
+            scattered_ray.value.ray.direction = normalise(orthonormal_basis(point_unit_normal) * local_direction);
+            scattered_ray.value.weight = material.lambertian.albedo;
             scattered_ray.is_valid = true;
             
             return scattered_ray;
         }
 
         case Material::Type::METAL: {
-            Maybe<Ray> scattered_ray = {};
-            const Vec3 random = random_unit_vector(ray.direction);
-            const real fuzziness = material.metal.fuzziness;
-            const Vec3 reflected_direction = reflect(ray.direction, point_unit_normal);
-            scattered_ray.value.origin = point + NUDGE_FACTOR * point_unit_normal;
-            scattered_ray.value.direction = normalise(reflected_direction + fuzziness * random);
-            scattered_ray.is_valid = (scattered_ray.value.direction * point_unit_normal > 0.0f);
-            
+            Maybe<ScatteredRay> scattered_ray = {};
+            const Vec3 outgoing = -ray.direction;
+            const real cos_theta_outgoing = outgoing * point_unit_normal;
+            if (cos_theta_outgoing <= 0.0f) {
+                return scattered_ray;
+            }
+
+            scattered_ray.value.ray.origin = point + nudge_distance * point_unit_normal;
+            const real alpha = get_ggx_alpha(material.metal);
+            if (alpha < MIN_GGX_ALPHA) {
+                scattered_ray.value.ray.direction = reflect(ray.direction, point_unit_normal);
+                scattered_ray.value.weight = get_conductor_fresnel(material.metal.albedo, cos_theta_outgoing);
+                scattered_ray.is_valid = true;
+
+                return scattered_ray;
+            }
+
+            // G2 / G1 is left once the sample's pdf divides out, a reflection that goes under the
+            // surface is light lost to bouncing between microfacets. shade() still takes the vertex's
+            // light sample, that's evaluated on its own.
+            const Mat3 basis = orthonormal_basis(point_unit_normal);
+            const Vec3 local_outgoing = transpose(basis) * outgoing;
+            const Vec3 half_vector = sample_ggx_visible_normal(local_outgoing, alpha, next_2d(sample_stream));
+            const real cos_theta_half = local_outgoing * half_vector;
+            const Vec3 local_incoming = 2.0f * cos_theta_half * half_vector - local_outgoing;
+            if (local_incoming.z <= 0.0f) {
+                return scattered_ray;
+            }
+
+            const real outgoing_lambda = get_ggx_lambda(local_outgoing.z, alpha);
+            const real incoming_lambda = get_ggx_lambda(local_incoming.z, alpha);
+            const real visibility_ratio = (1.0f + outgoing_lambda) / (1.0f + outgoing_lambda + incoming_lambda);
+            scattered_ray.value.ray.direction = normalise(basis * local_incoming);
+            scattered_ray.value.weight = visibility_ratio * get_conductor_fresnel(material.metal.albedo, cos_theta_half);
+            scattered_ray.is_valid = true;
+
             return scattered_ray;
         }
 
         case Material::Type::DIELECTRIC: {
-            Maybe<Ray> scattered_ray = {};
+            Maybe<ScatteredRay> scattered_ray = {};
             const bool front_face = (ray.direction * point_unit_normal < 0.0f);
             const real refraction_ratio = front_face ? 1.0f / material.dielectric.refraction_index : material.dielectric.refraction_index;
             const Vec3 unit_normal = front_face ? point_unit_normal : -point_unit_normal;
 
             const real cos_theta = -ray.direction * unit_normal;
             const real sin_theta = std::sqrt(1.0f - cos_theta * cos_theta);
-            const u32 reflectance_rng = noise_1d(static_cast<u32>(1000000000.0f * sin_theta));
-            const real reflectance_threshold = real_from_rng(reflectance_rng);
+            const real reflectance_threshold = next_1d(sample_stream);
             if (refraction_ratio * sin_theta > 1.0f || reflectance(cos_theta, refraction_ratio) > reflectance_threshold) {
-                scattered_ray.value.origin = point + NUDGE_FACTOR * unit_normal;
-                scattered_ray.value.direction = reflect(ray.direction, unit_normal);
+                scattered_ray.value.ray.origin = point + nudge_distance * unit_normal;
+                scattered_ray.value.ray.direction = reflect(ray.direction, unit_normal);
             } else {
-                scattered_ray.value.origin = point - NUDGE_FACTOR * unit_normal;
-                scattered_ray.value.direction = refract(ray.direction, unit_normal, refraction_ratio);
+                scattered_ray.value.ray.origin = point - nudge_distance * unit_normal;
+                scattered_ray.value.ray.direction = refract(ray.direction, unit_normal, refraction_ratio);
             }
 
+            scattered_ray.value.weight = Colour{1.0f, 1.0f, 1.0f};
             scattered_ray.is_valid = true;
 
             return scattered_ray;
         }
 
         case Material::Type::DIFFUSE_LIGHT: {
-            Maybe<Ray> scattered_ray = {};
+            Maybe<ScatteredRay> scattered_ray = {};
             return scattered_ray;
         }
 
         default: {
             assert(false);
-            return Maybe<Ray>{};
+            return Maybe<ScatteredRay>{};
         }
     }
 }
 
+// power heuristic with beta = 2
+static real get_mis_weight(const real pdf, const real other_pdf) {
+    const real pdf_squared = pdf * pdf;
+    const real sum_of_squares = pdf_squared + other_pdf * other_pdf;
+    return (sum_of_squares > 0.0f) ? pdf_squared / sum_of_squares : 0.0f;
+}
+
+struct LightSample {
+    Vec3 direction;
+    real distance;
+    real pdf;   // over solid angle, not including the choice of light
+};
+
+// uniform over the cone of directions the sphere covers, zero from inside it
+// Solid angle of the cone a sphere subtends over 2 pi. As sin^2 / (1 + cos) rather than 1 - cos, which
+// loses everything to cancellation in float for small or distant lights.
+static real get_one_minus_cos_theta_max(const real radius_squared, const real distance_squared) {
+    const real sin_theta_max_squared = radius_squared / distance_squared;
+    return sin_theta_max_squared / (1.0f + std::sqrt(1.0f - sin_theta_max_squared));
+}
+
+static real get_sphere_light_pdf(const Vec3& point, const Sphere& sphere) {
+    const Vec3 point_to_centre = sphere.centre - point;
+    const real distance_squared = point_to_centre * point_to_centre;
+    const real radius_squared = sphere.radius * sphere.radius;
+    if (distance_squared <= radius_squared) {
+        return 0.0f;
+    }
+
+    return 1.0f / (2.0f * PI * get_one_minus_cos_theta_max(radius_squared, distance_squared));
+}
+
+static Maybe<LightSample> sample_sphere_light(const Vec3& point, const Sphere& sphere, const real u, const real v) {
+    Maybe<LightSample> light_sample = {};
+    const Vec3 point_to_centre = sphere.centre - point;
+    const real distance_squared = point_to_centre * point_to_centre;
+    const real radius_squared = sphere.radius * sphere.radius;
+    if (distance_squared <= radius_squared) {
+        return light_sample;
+    }
+
+    const real one_minus_cos_theta_max = get_one_minus_cos_theta_max(radius_squared, distance_squared);
+    const real cos_theta = 1.0f - u * one_minus_cos_theta_max;
+    const real sin_theta = std::sqrt(std::max<real>(0.0f, 1.0f - cos_theta * cos_theta));
+    const real phi = 2.0f * PI * v;
+    const Mat3 basis = orthonormal_basis((1.0f / std::sqrt(distance_squared)) * point_to_centre);
+
+    const real distance_to_centre = std::sqrt(distance_squared);
+    const real half_chord_squared = radius_squared - distance_squared * sin_theta * sin_theta;
+
+    light_sample.value.direction = basis * Vec3{sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta};
+    light_sample.value.distance = distance_to_centre * cos_theta - std::sqrt(std::max<real>(0.0f, half_chord_squared));
+    light_sample.value.pdf = 1.0f / (2.0f * PI * one_minus_cos_theta_max);
+    light_sample.is_valid = true;
+
+    return light_sample;
+}
+
+// uniform over the triangle's area converted to solid angle, lights emit from both faces
+static real get_triangle_light_pdf(const TriangleRecords& triangles, const int triangle_index, const Vec3& direction, const real distance) {
+    const Vec3 a_to_b{triangles.a_to_b_x[triangle_index], triangles.a_to_b_y[triangle_index], triangles.a_to_b_z[triangle_index]};
+    const Vec3 a_to_c{triangles.a_to_c_x[triangle_index], triangles.a_to_c_y[triangle_index], triangles.a_to_c_z[triangle_index]};
+    const real area = 0.5f * magnitude(a_to_b ^ a_to_c);
+    const real cos_theta = std::abs(direction * triangles.unit_normals[triangle_index]);
+    return (area > 0.0f && cos_theta > 0.0f) ? distance * distance / (cos_theta * area) : 0.0f;
+}
+
+static Maybe<LightSample> sample_triangle_light(const Vec3& point, const TriangleRecords& triangles, const int triangle_index, const real u, const real v) {
+    const real sqrt_u = std::sqrt(u);
+    const Vec3 a{triangles.a_x[triangle_index], triangles.a_y[triangle_index], triangles.a_z[triangle_index]};
+    const Vec3 a_to_b{triangles.a_to_b_x[triangle_index], triangles.a_to_b_y[triangle_index], triangles.a_to_b_z[triangle_index]};
+    const Vec3 a_to_c{triangles.a_to_c_x[triangle_index], triangles.a_to_c_y[triangle_index], triangles.a_to_c_z[triangle_index]};
+    const Vec3 light_point = a + (sqrt_u * (1.0f - v)) * a_to_b + (sqrt_u * v) * a_to_c;
+
+    Maybe<LightSample> light_sample = {};
+    const Vec3 point_to_light = light_point - point;
+    light_sample.value.distance = magnitude(point_to_light);
+    light_sample.value.direction = (1.0f / light_sample.value.distance) * point_to_light;
+    light_sample.value.pdf = get_triangle_light_pdf(triangles, triangle_index, light_sample.value.direction, light_sample.value.distance);
+    light_sample.is_valid = (light_sample.value.pdf > 0.0f);
+
+    return light_sample;
+}
+
+// Next event estimation, one light is picked uniformly and a point on it is left for the caller to check
+// for visibility
+static Maybe<ShadowRay> sample_direct_lighting(const Scene& scene, const Vec3& origin, const Vec3& point_unit_normal, const ScatterLobe& scatter_lobe, SampleStream& sample_stream) {
+    const int light_index = std::min(static_cast<int>(next_1d(sample_stream) * static_cast<real>(scene.light_count)), scene.light_count - 1);
+    const Sample2D light_point_sample = next_2d(sample_stream);
+    const real u = light_point_sample.u;
+    const real v = light_point_sample.v;
+
+    const Light& light = scene.lights[light_index];
+    const Maybe<LightSample> light_sample = (light.type == Light::Type::SPHERE)
+        ? sample_sphere_light(origin, scene.spheres[light.index], u, v)
+        : sample_triangle_light(origin, *scene.triangles, light.index, u, v);
+
+    Maybe<ShadowRay> shadow_ray = {};
+    if (!light_sample.is_valid || light_sample.value.direction * point_unit_normal <= 0.0f) {
+        return shadow_ray;
+    }
+
+    const real scatter_pdf = get_scatter_pdf(scatter_lobe, light_sample.value.direction);
+    if (scatter_pdf <= 0.0f) {
+        return shadow_ray;
+    }
+
+    const int light_material_index = (light.type == Light::Type::SPHERE) ? scene.sphere_material_indices[light.index] : scene.triangle_material_indices[light.index];
+    const Colour emission = get_emission(scene.materials[light_material_index]);
+    const real light_pdf = light_sample.value.pdf / static_cast<real>(scene.light_count);
+    const real weight = get_mis_weight(light_pdf, scatter_pdf) / light_pdf;
+
+    // stop just short of the light so it doesn't shadow itself
+    static constexpr real SHADOW_RAY_LENGTH_FACTOR = 0.999f;
+    shadow_ray.value.ray = Ray{origin, light_sample.value.direction};
+    shadow_ray.value.max_distance = SHADOW_RAY_LENGTH_FACTOR * light_sample.value.distance;
+    shadow_ray.value.contribution = weight * (evaluate_scatter(scatter_lobe, light_sample.value.direction) * emission);
+    shadow_ray.is_valid = true;
+
+    return shadow_ray;
+}
+
 static Colour background_gradient(const Colour& start, const Colour& end, const real ray_direction_y) {
     const real t = 0.5f * (ray_direction_y + 1.0f);
     return (1.0f - t) * start + t * end;
@@ -108,124 +375,839 @@ struct ClosestShapeIntersection {
 
 static constexpr ClosestShapeIntersection MISS{-1, REAL_MAX};
 
-static ClosestShapeIntersection intersect(const Ray& ray, const BVH& bvh, const int node_index, const Sphere* const spheres) {
-    const Node& node = bvh[node_index];
-    const AABBIntersections aabb_intersections = intersect(ray, node.aabb);
-    if (aabb_intersections.max_distance < 0.0f || aabb_intersections.min_distance > aabb_intersections.max_distance) {
+struct BVHStackEntry {
+    int node_index;
+    real min_distance;
+};
+
+// a node's far child waits on the stack at each level above it, and both children go on at the deepest
+static constexpr int BVH_STACK_CAPACITY = MAX_BVH_DEPTH + 1;
+
+// Visits the nearer child first and skips anything entered beyond the closest hit found so far. With
+// ANY_HIT set it returns the first hit found instead, for when only visibility matters.
+template <bool ANY_HIT, typename IntersectPrimitive>
+static ClosestShapeIntersection traverse(const Ray& ray, const BVH& bvh, const real max_distance, IntersectPrimitive intersect_primitive) {
+    const Vec3 ray_inverse_direction = inverse_direction(ray);
+
+    ClosestShapeIntersection closest_intersection = MISS;
+    closest_intersection.distance = max_distance;
+
+    const AABBIntersections root_intersections = intersect(ray, ray_inverse_direction, get_aabb(bvh.nodes[0]), closest_intersection.distance);
+    if (root_intersections.min_distance > root_intersections.max_distance) {
         return MISS;
     }
 
-    if (node.left == 0 && node.right == 0) {
-        const Sphere& sphere = spheres[node.index];
-        const Maybe<SphereIntersections> sphere_intersections = intersect(ray, sphere);
-        ClosestShapeIntersection sphere_intersection = MISS;
-        if (sphere_intersections.is_valid && (sphere_intersections.value.min_distance > 0.0f || sphere_intersections.value.max_distance > 0.0f)) {
-            sphere_intersection.distance = sphere_intersections.value.min_distance > 0.0f ? sphere_intersections.value.min_distance : sphere_intersections.value.max_distance;
-            sphere_intersection.index = node.index;
+    BVHStackEntry stack[BVH_STACK_CAPACITY];
+    int stack_size = 0;
+    stack[stack_size++] = BVHStackEntry{0, root_intersections.min_distance};
+    while (stack_size > 0) {
+        const BVHStackEntry entry = stack[--stack_size];
+        if (entry.min_distance > closest_intersection.distance) {
+            continue;
         }
 
-        return sphere_intersection;
-    } else {
-        const ClosestShapeIntersection left_intersection = intersect(ray, bvh, node.left, spheres);
-        const ClosestShapeIntersection right_intersection = intersect(ray, bvh, node.right, spheres);
-        if (left_intersection.distance < right_intersection.distance) {
-            return left_intersection;
-        } else if (right_intersection.distance < left_intersection.distance) {
-            return right_intersection;
-        } else {
-            return MISS;
+        const Node& node = bvh.nodes[entry.node_index];
+        if (is_leaf(node)) {
+            for (int primitive_index = node.offset; primitive_index < node.offset + node.primitive_count; ++primitive_index) {
+                const Maybe<real> primitive_intersection = intersect_primitive(primitive_index, closest_intersection.distance);
+                if (primitive_intersection.is_valid && primitive_intersection.value < closest_intersection.distance) {
+                    closest_intersection.distance = primitive_intersection.value;
+                    closest_intersection.index = primitive_index;
+                    if (ANY_HIT) {
+                        return closest_intersection;
+                    }
+                }
+            }
+
+            continue;
+        }
+
+        const int left_index = entry.node_index + 1;
+        const int right_index = node.offset;
+        const AABBIntersections left_intersections = intersect(ray, ray_inverse_direction, get_aabb(bvh.nodes[left_index]), closest_intersection.distance);
+        const AABBIntersections right_intersections = intersect(ray, ray_inverse_direction, get_aabb(bvh.nodes[right_index]), closest_intersection.distance);
+        const bool hit_left = (left_intersections.min_distance <= left_intersections.max_distance);
+        const bool hit_right = (right_intersections.min_distance <= right_intersections.max_distance);
+
+        assert(stack_size + 2 <= BVH_STACK_CAPACITY);
+        if (hit_left && hit_right) {
+            const bool left_is_nearer = (left_intersections.min_distance <= right_intersections.min_distance);
+            const BVHStackEntry near_entry = left_is_nearer ? BVHStackEntry{left_index, left_intersections.min_distance} : BVHStackEntry{right_index, right_intersections.min_distance};
+            const BVHStackEntry far_entry = left_is_nearer ? BVHStackEntry{right_index, right_intersections.min_distance} : BVHStackEntry{left_index, left_intersections.min_distance};
+            stack[stack_size++] = far_entry;
+            stack[stack_size++] = near_entry;
+        } else if (hit_left) {
+            stack[stack_size++] = BVHStackEntry{left_index, left_intersections.min_distance};
+        } else if (hit_right) {
+            stack[stack_size++] = BVHStackEntry{right_index, right_intersections.min_distance};
         }
     }
+
+    return (closest_intersection.index != -1) ? closest_intersection : MISS;
 }
 
-static ClosestShapeIntersection intersect(const Ray& ray, const BVH& bvh, const int node_index, const Triangle* const triangles) {
-    const Node& node = bvh[node_index];
-    const AABBIntersections aabb_intersections = intersect(ray, node.aabb);
-    if (aabb_intersections.max_distance < 0.0f || aabb_intersections.min_distance > aabb_intersections.max_distance) {
-        return MISS;
+struct WideBVHStackEntry {
+    int offset;
+    int primitive_count;
+    real min_distance;
+};
+
+// up to three children wait at each level, wide nodes are never deeper than the binary ones they came from
+static constexpr int WIDE_BVH_STACK_CAPACITY = (WIDE_NODE_WIDTH - 1) * BVH_STACK_CAPACITY;
+
+template <bool ANY_HIT, typename IntersectPrimitive>
+static ClosestShapeIntersection traverse_wide(const Ray& ray, const BVH& bvh, const real max_distance, IntersectPrimitive intersect_primitive) {
+    const WideRay wide_ray = construct_wide_ray(ray, inverse_direction(ray));
+
+    ClosestShapeIntersection closest_intersection = MISS;
+    closest_intersection.distance = max_distance;
+
+    WideBVHStackEntry stack[WIDE_BVH_STACK_CAPACITY];
+    int stack_size = 0;
+    stack[stack_size++] = WideBVHStackEntry{0, 0, 0.0f};
+    while (stack_size > 0) {
+        const WideBVHStackEntry entry = stack[--stack_size];
+        if (entry.min_distance > closest_intersection.distance) {
+            continue;
+        }
+
+        if (entry.primitive_count > 0) {
+            for (int primitive_index = entry.offset; primitive_index < entry.offset + entry.primitive_count; ++primitive_index) {
+                const Maybe<real> primitive_intersection = intersect_primitive(primitive_index, closest_intersection.distance);
+                if (primitive_intersection.is_valid && primitive_intersection.value < closest_intersection.distance) {
+                    closest_intersection.distance = primitive_intersection.value;
+                    closest_intersection.index = primitive_index;
+                    if (ANY_HIT) {
+                        return closest_intersection;
+                    }
+                }
+            }
+
+            continue;
+        }
+
+        const WideNode& node = bvh.wide_nodes[entry.offset];
+        alignas(16) float child_min_distances[WIDE_NODE_WIDTH];
+        const int hit_mask = intersect(wide_ray, node, closest_intersection.distance, child_min_distances);
+
+        // insertion sort the hit children furthest first so the nearest is popped next
+        WideBVHStackEntry hit_children[WIDE_NODE_WIDTH];
+        int hit_count = 0;
+        for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+            if ((hit_mask & (1 << slot)) == 0) {
+                continue;
+            }
+
+            const WideBVHStackEntry child{node.offsets[slot], node.primitive_counts[slot], child_min_distances[slot]};
+            int insert_index = hit_count++;
+            while (insert_index > 0 && hit_children[insert_index - 1].min_distance < child.min_distance) {
+                hit_children[insert_index] = hit_children[insert_index - 1];
+                --insert_index;
+            }
+
+            hit_children[insert_index] = child;
+        }
+
+        assert(stack_size + hit_count <= WIDE_BVH_STACK_CAPACITY);
+        for (int hit_index = 0; hit_index < hit_count; ++hit_index) {
+            stack[stack_size++] = hit_children[hit_index];
+        }
+    }
+
+    return (closest_intersection.index != -1) ? closest_intersection : MISS;
+}
+
+template <typename IntersectPrimitive>
+static ClosestShapeIntersection intersect(const Ray& ray, const BVH& bvh, const real max_distance, IntersectPrimitive intersect_primitive) {
+    return is_wide(bvh) ? traverse_wide<false>(ray, bvh, max_distance, intersect_primitive) : traverse<false>(ray, bvh, max_distance, intersect_primitive);
+}
+
+// any hit nearer than max_distance, not necessarily the closest
+template <typename IntersectPrimitive>
+static ClosestShapeIntersection intersect_any(const Ray& ray, const BVH& bvh, const real max_distance, IntersectPrimitive intersect_primitive) {
+    return is_wide(bvh) ? traverse_wide<true>(ray, bvh, max_distance, intersect_primitive) : traverse<true>(ray, bvh, max_distance, intersect_primitive);
+}
+
+// Packet of rays that start close together and head the same way, like neighbouring camera rays. Bounds on
+// their origins and inverse directions rule out whole nodes for the packet before any ray is tested.
+struct RayPacket {
+    Ray rays[MAX_PACKET_SIZE];
+    WideRay wide_rays[MAX_PACKET_SIZE];
+    int count;
+    bool is_coherent;   // direction signs agree on every axis, otherwise the bounds are useless
+
+    // from the same float values the per ray slab tests use
+    real origin_min[3];
+    real origin_max[3];
+    real inverse_direction_min[3];
+    real inverse_direction_max[3];
+};
+
+static RayPacket construct_ray_packet(const Ray* const rays, const int ray_count) {
+    assert(0 < ray_count && ray_count <= MAX_PACKET_SIZE);
+
+    RayPacket packet = {};
+    packet.count = ray_count;
+    packet.is_coherent = true;
+    for (int axis = 0; axis < 3; ++axis) {
+        packet.origin_min[axis] = REAL_MAX;
+        packet.origin_max[axis] = -REAL_MAX;
+        packet.inverse_direction_min[axis] = REAL_MAX;
+        packet.inverse_direction_max[axis] = -REAL_MAX;
+    }
+
+    for (int ray_index = 0; ray_index < ray_count; ++ray_index) {
+        const Ray& ray = rays[ray_index];
+        const Vec3 ray_inverse_direction = inverse_direction(ray);
+        packet.rays[ray_index] = ray;
+        packet.wide_rays[ray_index] = construct_wide_ray(ray, ray_inverse_direction);
+
+        const real origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+        const real inverse[3] = {ray_inverse_direction.x, ray_inverse_direction.y, ray_inverse_direction.z};
+        for (int axis = 0; axis < 3; ++axis) {
+            const real rounded_origin = static_cast<float>(origin[axis]);
+            const real rounded_inverse = static_cast<float>(inverse[axis]);
+            packet.origin_min[axis] = std::min(packet.origin_min[axis], rounded_origin);
+            packet.origin_max[axis] = std::max(packet.origin_max[axis], rounded_origin);
+            packet.inverse_direction_min[axis] = std::min(packet.inverse_direction_min[axis], rounded_inverse);
+            packet.inverse_direction_max[axis] = std::max(packet.inverse_direction_max[axis], rounded_inverse);
+        }
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const bool all_positive = (packet.inverse_direction_min[axis] > 0.0f);
+        const bool all_negative = (packet.inverse_direction_max[axis] < 0.0f);
+        const bool finite = (packet.inverse_direction_min[axis] > -FLT_MAX && packet.inverse_direction_max[axis] < FLT_MAX);
+        packet.is_coherent = packet.is_coherent && (all_positive || all_negative) && finite;
     }
 
-    if (node.left == 0 && node.right == 0) {
-        const Triangle& triangle = triangles[node.index];
-        const Maybe<real> triangle_intersection = intersect(ray, triangle); // TODO: should this routine check < 0, sphere intersection doesn't
-        ClosestShapeIntersection result = MISS;
-        if (triangle_intersection.is_valid) {
-            result.distance = triangle_intersection.value;
-            result.index = node.index;
+    return packet;
+}
+
+// smallest and largest products of values from two intervals
+static real get_interval_product_min(const real a_min, const real a_max, const real b_min, const real b_max) {
+    return std::min(std::min(a_min * b_min, a_min * b_max), std::min(a_max * b_min, a_max * b_max));
+}
+
+static real get_interval_product_max(const real a_min, const real a_max, const real b_min, const real b_max) {
+    return std::max(std::max(a_min * b_min, a_min * b_max), std::max(a_max * b_min, a_max * b_max));
+}
+
+// Interval arithmetic slab test, a bit per child that some ray in the packet might hit. Only ever errs
+// towards keeping a child, the rays are tested one by one afterwards.
+static int get_packet_child_mask(const RayPacket& packet, const WideNode& node, const real max_distance) {
+    static constexpr real ROBUST_SCALE = 1.0f + 1.0e-5f;   // well over the per ray test's float rounding
+
+    const float* const node_min[3] = {node.min_x, node.min_y, node.min_z};
+    const float* const node_max[3] = {node.max_x, node.max_y, node.max_z};
+
+    int child_mask = 0;
+    for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+        real near_distance = 0.0f;
+        real far_distance = max_distance;
+        for (int axis = 0; axis < 3; ++axis) {
+            const bool positive = (packet.inverse_direction_min[axis] > 0.0f);
+            const real near_plane = positive ? node_min[axis][slot] : node_max[axis][slot];
+            const real far_plane = positive ? node_max[axis][slot] : node_min[axis][slot];
+
+            const real inverse_min = packet.inverse_direction_min[axis];
+            const real inverse_max = packet.inverse_direction_max[axis];
+            near_distance = std::max(near_distance, get_interval_product_min(near_plane - packet.origin_max[axis], near_plane - packet.origin_min[axis], inverse_min, inverse_max));
+            far_distance = std::min(far_distance, get_interval_product_max(far_plane - packet.origin_max[axis], far_plane - packet.origin_min[axis], inverse_min, inverse_max));
         }
 
-        return result;
-    } else {
-        const ClosestShapeIntersection left_intersection = intersect(ray, bvh, node.left, triangles);
-        const ClosestShapeIntersection right_intersection = intersect(ray, bvh, node.right, triangles);
-        if (left_intersection.distance < right_intersection.distance) {
-            return left_intersection;
-        } else if (right_intersection.distance < left_intersection.distance) {
-            return right_intersection;
-        } else {
-            return MISS;
-        }
-    }
-}
-
-static Colour intersect(Ray ray, const Scene& scene) {
-    static constexpr int MAX_BOUNCE_COUNT = 50;
-
-    Colour colour = {0.0f, 0.0f, 0.0f};
-    Colour attenuation = {1.0f, 1.0f, 1.0f};
-    for (int bounce_index = 0; bounce_index < MAX_BOUNCE_COUNT; ++bounce_index) {
-        const ClosestShapeIntersection closest_sphere_intersection = (scene.sphere_bvh != nullptr) ? intersect(ray, *scene.sphere_bvh, 0, scene.spheres) : MISS;
-        const ClosestShapeIntersection closest_triangle_intersection = (scene.triangle_bvh != nullptr) ? intersect(ray, *scene.triangle_bvh, 0, scene.triangles) : MISS;
-        if (closest_sphere_intersection.index != -1 || closest_triangle_intersection.index != -1) {
-            Vec3 intersection_point = {};
-            Vec3 shape_unit_normal = {};
-            Material material = {};
-            if (closest_sphere_intersection.distance < closest_triangle_intersection.distance) {
-                assert(closest_sphere_intersection.distance < REAL_MAX);
-
-                const int sphere_index = closest_sphere_intersection.index;
-                const Sphere& sphere = scene.spheres[sphere_index];
-                intersection_point = ray.origin + closest_sphere_intersection.distance * ray.direction;
-                
-                const real sign = (sphere.radius < 0.0f) ? -1.0f : 1.0f;    // trick to model hollow spheres, don't want this polluting the scatter routine
-                shape_unit_normal = sign * normalise(intersection_point - sphere.centre);   // TODO: can divide by radius instead
-
-                const int sphere_material_index = scene.sphere_material_indices[sphere_index];
-                material = scene.materials[sphere_material_index];
-            } else {
-                assert(closest_triangle_intersection.distance < REAL_MAX);
+        if (near_distance <= ROBUST_SCALE * far_distance + 1.0e-5f) {
+            child_mask |= (1 << slot);
+        }
+    }
+
+    return child_mask;
+}
 
-                const int triangle_index = closest_triangle_intersection.index;
-                const Triangle& triangle = scene.triangles[triangle_index];
-                intersection_point = ray.origin + closest_triangle_intersection.distance * ray.direction;
-                
-                shape_unit_normal = unit_normal(triangle);
+struct PacketStackEntry {
+    int offset;
+    int primitive_count;
+    int first_active_ray;   // rays before this one missed the node
+    real min_distance;      // for the first active ray
+};
+
+// Ranged packet traversal: every node is fetched once for the whole packet and the rays up to the first
+// one that hits a child are dropped for that child's subtree. Closest intersections come in holding each
+// ray's max distance. Binary BVHs and incoherent packets go one ray at a time.
+template <typename IntersectPrimitive>
+static void traverse_packet(const RayPacket& packet, const BVH& bvh, ClosestShapeIntersection* const closest_intersections, IntersectPrimitive intersect_primitive) {
+    if (!is_wide(bvh) || !packet.is_coherent) {
+        for (int ray_index = 0; ray_index < packet.count; ++ray_index) {
+            const ClosestShapeIntersection ray_intersection = intersect(packet.rays[ray_index], bvh, closest_intersections[ray_index].distance, [ray_index, &intersect_primitive](const int primitive_index, const real closest_distance) {
+                return intersect_primitive(ray_index, primitive_index, closest_distance);
+            });
+
+            closest_intersections[ray_index] = ray_intersection;
+        }
+
+        return;
+    }
+
+    for (int ray_index = 0; ray_index < packet.count; ++ray_index) {
+        closest_intersections[ray_index].index = -1;
+    }
 
-                const int triangle_material_index = scene.triangle_material_indices[triangle_index];
-                material = scene.materials[triangle_material_index];
+    PacketStackEntry stack[WIDE_BVH_STACK_CAPACITY];
+    int stack_size = 0;
+    stack[stack_size++] = PacketStackEntry{0, 0, 0, 0.0f};
+    while (stack_size > 0) {
+        const PacketStackEntry entry = stack[--stack_size];
+        if (entry.primitive_count > 0) {
+            for (int ray_index = entry.first_active_ray; ray_index < packet.count; ++ray_index) {
+                ClosestShapeIntersection& closest_intersection = closest_intersections[ray_index];
+                for (int primitive_index = entry.offset; primitive_index < entry.offset + entry.primitive_count; ++primitive_index) {
+                    const Maybe<real> primitive_intersection = intersect_primitive(ray_index, primitive_index, closest_intersection.distance);
+                    if (primitive_intersection.is_valid && primitive_intersection.value < closest_intersection.distance) {
+                        closest_intersection.distance = primitive_intersection.value;
+                        closest_intersection.index = primitive_index;
+                    }
+                }
             }
 
-            const Colour material_emission = get_emission(material);
-            const Maybe<Ray> scattered_ray = scatter(ray, material, intersection_point, shape_unit_normal);
-            if (scattered_ray.is_valid) {
-                ray = scattered_ray.value;
+            continue;
+        }
 
-                const Colour& material_colour = get_colour(material);
-                colour += attenuation * material_emission;
-                attenuation *= material_colour;
-            } else {
-                colour += attenuation * material_emission;
-                break;
+        real max_distance = 0.0f;
+        for (int ray_index = entry.first_active_ray; ray_index < packet.count; ++ray_index) {
+            max_distance = std::max(max_distance, closest_intersections[ray_index].distance);
+        }
+
+        const WideNode& node = bvh.wide_nodes[entry.offset];
+        const int candidate_mask = get_packet_child_mask(packet, node, max_distance);
+
+        // each child goes down with the first ray that actually hits it
+        PacketStackEntry children[WIDE_NODE_WIDTH];
+        int remaining_mask = candidate_mask;
+        for (int ray_index = entry.first_active_ray; ray_index < packet.count && remaining_mask != 0; ++ray_index) {
+            alignas(16) float child_min_distances[WIDE_NODE_WIDTH];
+            const int hit_mask = intersect(packet.wide_rays[ray_index], node, closest_intersections[ray_index].distance, child_min_distances) & remaining_mask;
+            for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+                if ((hit_mask & (1 << slot)) != 0) {
+                    children[slot] = PacketStackEntry{node.offsets[slot], node.primitive_counts[slot], ray_index, child_min_distances[slot]};
+                }
+            }
+
+            remaining_mask &= ~hit_mask;
+        }
+
+        // insertion sort furthest first so the nearest is popped next
+        const int hit_mask = candidate_mask & ~remaining_mask;
+        PacketStackEntry hit_children[WIDE_NODE_WIDTH];
+        int hit_count = 0;
+        for (int slot = 0; slot < WIDE_NODE_WIDTH; ++slot) {
+            if ((hit_mask & (1 << slot)) == 0) {
+                continue;
+            }
+
+            int insert_index = hit_count++;
+            while (insert_index > 0 && hit_children[insert_index - 1].min_distance < children[slot].min_distance) {
+                hit_children[insert_index] = hit_children[insert_index - 1];
+                --insert_index;
+            }
+
+            hit_children[insert_index] = children[slot];
+        }
+
+        assert(stack_size + hit_count <= WIDE_BVH_STACK_CAPACITY);
+        for (int hit_index = 0; hit_index < hit_count; ++hit_index) {
+            stack[stack_size++] = hit_children[hit_index];
+        }
+    }
+
+    for (int ray_index = 0; ray_index < packet.count; ++ray_index) {
+        if (closest_intersections[ray_index].index == -1) {
+            closest_intersections[ray_index] = MISS;
+        }
+    }
+}
+
+// nearest intersection in front of the ray, which is the far side when the ray starts inside
+static Maybe<real> intersect_front(const Ray& ray, const Sphere& sphere) {
+    const Maybe<SphereIntersections> sphere_intersections = intersect(ray, sphere);
+    Maybe<real> sphere_intersection = {};
+    if (sphere_intersections.is_valid && (sphere_intersections.value.min_distance > 0.0f || sphere_intersections.value.max_distance > 0.0f)) {
+        sphere_intersection.value = sphere_intersections.value.min_distance > 0.0f ? sphere_intersections.value.min_distance : sphere_intersections.value.max_distance;
+        sphere_intersection.is_valid = true;
+    }
+
+    return sphere_intersection;
+}
+
+static ClosestShapeIntersection intersect(const Ray& ray, const BVH& bvh, const Sphere* const spheres, const real max_distance) {
+    return intersect(ray, bvh, max_distance, [&ray, spheres](const int sphere_index, real) {
+        return intersect_front(ray, spheres[sphere_index]);
+    });
+}
+
+static ClosestShapeIntersection intersect_any(const Ray& ray, const BVH& bvh, const Sphere* const spheres, const real max_distance) {
+    return intersect_any(ray, bvh, max_distance, [&ray, spheres](const int sphere_index, real) {
+        return intersect_front(ray, spheres[sphere_index]);
+    });
+}
+
+static ClosestShapeIntersection intersect(const Ray& ray, const BVH& bvh, const TriangleRecords& triangles, const real max_distance) {
+    return intersect(ray, bvh, max_distance, [&ray, &triangles](const int triangle_index, real) {
+        return intersect(ray, triangles, triangle_index);
+    });
+}
+
+static ClosestShapeIntersection intersect_any(const Ray& ray, const BVH& bvh, const TriangleRecords& triangles, const real max_distance) {
+    return intersect_any(ray, bvh, max_distance, [&ray, &triangles](const int triangle_index, real) {
+        return intersect(ray, triangles, triangle_index);
+    });
+}
+
+struct ClosestInstanceIntersection {
+    int instance_index;
+    int triangle_index;
+    real distance;
+};
+
+static constexpr ClosestInstanceIntersection INSTANCE_MISS{-1, -1, REAL_MAX};
+
+// Rays are moved into object space at the instance leaves and renormalised, object space distances
+// are scaled back by the length of the transformed direction
+struct ObjectRay {
+    Ray ray;
+    real distance_scale;    // object space distance per world space distance
+};
+
+static ObjectRay construct_object_ray(const Ray& ray, const Instance& instance) {
+    const Vec3 object_direction = instance.world_to_object * ray.direction;
+    const real object_direction_magnitude = magnitude(object_direction);
+    const Ray object_ray{instance.world_to_object * (ray.origin - instance.translation), (1.0f / object_direction_magnitude) * object_direction};
+    return ObjectRay{object_ray, object_direction_magnitude};
+}
+
+// closest hit on one instance's mesh nearer than closest_distance, remembering which triangle it was
+static Maybe<real> intersect_instance(const Ray& ray, const Scene& scene, const int instance_index, const real closest_distance, int& closest_triangle_index) {
+    const Instance& instance = scene.instances[instance_index];
+    const Mesh& mesh = scene.meshes[instance.mesh_index];
+
+    const ObjectRay object_ray = construct_object_ray(ray, instance);
+    const ClosestShapeIntersection triangle_intersection = intersect(object_ray.ray, *mesh.bvh, *mesh.triangles, closest_distance * object_ray.distance_scale);
+
+    Maybe<real> instance_intersection = {};
+    if (triangle_intersection.index != -1) {
+        instance_intersection.value = triangle_intersection.distance / object_ray.distance_scale;
+        instance_intersection.is_valid = (instance_intersection.value < closest_distance);
+        if (instance_intersection.is_valid) {
+            closest_triangle_index = triangle_intersection.index;
+        }
+    }
+
+    return instance_intersection;
+}
+
+static ClosestInstanceIntersection intersect(const Ray& ray, const Scene& scene, const real max_distance) {
+    int closest_triangle_index = -1;
+    const ClosestShapeIntersection closest_instance_intersection = intersect(ray, *scene.instance_bvh, max_distance, [&ray, &scene, &closest_triangle_index](const int instance_index, const real closest_distance) {
+        return intersect_instance(ray, scene, instance_index, closest_distance, closest_triangle_index);
+    });
+
+    if (closest_instance_intersection.index == -1) {
+        return INSTANCE_MISS;
+    }
+
+    return ClosestInstanceIntersection{closest_instance_intersection.index, closest_triangle_index, closest_instance_intersection.distance};
+}
+
+// shadow and visibility rays, stops at the first hit and never looks at normals or materials
+static bool occluded(const Ray& ray, const real max_distance, const Scene& scene) {
+    if (scene.sphere_bvh != nullptr && intersect_any(ray, *scene.sphere_bvh, scene.spheres, max_distance).index != -1) {
+        return true;
+    }
+
+    if (scene.triangle_bvh != nullptr && intersect_any(ray, *scene.triangle_bvh, *scene.triangles, max_distance).index != -1) {
+        return true;
+    }
+
+    if (scene.instance_bvh != nullptr) {
+        const ClosestShapeIntersection instance_intersection = intersect_any(ray, *scene.instance_bvh, max_distance, [&ray, &scene](const int instance_index, const real closest_distance) {
+            const Instance& instance = scene.instances[instance_index];
+            const Mesh& mesh = scene.meshes[instance.mesh_index];
+
+            const ObjectRay object_ray = construct_object_ray(ray, instance);
+            const ClosestShapeIntersection triangle_intersection = intersect_any(object_ray.ray, *mesh.bvh, *mesh.triangles, closest_distance * object_ray.distance_scale);
+            return Maybe<real>{triangle_intersection.distance / object_ray.distance_scale, triangle_intersection.index != -1};
+        });
+
+        return instance_intersection.index != -1;
+    }
+
+    return false;
+}
+
+static SceneIntersection get_scene_intersection(const ClosestShapeIntersection& closest_sphere_intersection, const ClosestShapeIntersection& closest_triangle_intersection, const ClosestInstanceIntersection& closest_instance_intersection) {
+    SceneIntersection scene_intersection{REAL_MAX, -1, -1, -1};
+    if (closest_instance_intersection.instance_index != -1) {
+        scene_intersection.distance = closest_instance_intersection.distance;
+        scene_intersection.triangle_index = closest_instance_intersection.triangle_index;
+        scene_intersection.instance_index = closest_instance_intersection.instance_index;
+    } else if (closest_sphere_intersection.distance < closest_triangle_intersection.distance) {
+        scene_intersection.distance = closest_sphere_intersection.distance;
+        scene_intersection.sphere_index = closest_sphere_intersection.index;
+    } else if (closest_triangle_intersection.index != -1) {
+        scene_intersection.distance = closest_triangle_intersection.distance;
+        scene_intersection.triangle_index = closest_triangle_intersection.index;
+    }
+
+    return scene_intersection;
+}
+
+static SceneIntersection intersect_closest(const Ray& ray, const Scene& scene) {
+    const ClosestShapeIntersection closest_sphere_intersection = (scene.sphere_bvh != nullptr) ? intersect(ray, *scene.sphere_bvh, scene.spheres, REAL_MAX) : MISS;
+    const ClosestShapeIntersection closest_triangle_intersection = (scene.triangle_bvh != nullptr) ? intersect(ray, *scene.triangle_bvh, *scene.triangles, closest_sphere_intersection.distance) : MISS;
+    const real closest_shape_distance = std::min(closest_sphere_intersection.distance, closest_triangle_intersection.distance);
+    const ClosestInstanceIntersection closest_instance_intersection = (scene.instance_bvh != nullptr) ? intersect(ray, scene, closest_shape_distance) : INSTANCE_MISS;
+
+    return get_scene_intersection(closest_sphere_intersection, closest_triangle_intersection, closest_instance_intersection);
+}
+
+static void intersect_closest(const Ray* const rays, const int ray_count, const Scene& scene, SceneIntersection* const scene_intersections) {
+    const RayPacket packet = construct_ray_packet(rays, ray_count);
+
+    ClosestShapeIntersection closest_sphere_intersections[MAX_PACKET_SIZE];
+    std::fill(closest_sphere_intersections, closest_sphere_intersections + ray_count, MISS);
+    if (scene.sphere_bvh != nullptr) {
+        traverse_packet(packet, *scene.sphere_bvh, closest_sphere_intersections, [&packet, &scene](const int ray_index, const int sphere_index, real) {
+            return intersect_front(packet.rays[ray_index], scene.spheres[sphere_index]);
+        });
+    }
+
+    ClosestShapeIntersection closest_triangle_intersections[MAX_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < ray_count; ++ray_index) {
+        closest_triangle_intersections[ray_index] = ClosestShapeIntersection{-1, closest_sphere_intersections[ray_index].distance};
+    }
+
+    if (scene.triangle_bvh != nullptr) {
+        traverse_packet(packet, *scene.triangle_bvh, closest_triangle_intersections, [&packet, &scene](const int ray_index, const int triangle_index, real) {
+            return intersect(packet.rays[ray_index], *scene.triangles, triangle_index);
+        });
+    } else {
+        std::fill(closest_triangle_intersections, closest_triangle_intersections + ray_count, MISS);
+    }
+
+    ClosestShapeIntersection closest_instance_intersections[MAX_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < ray_count; ++ray_index) {
+        closest_instance_intersections[ray_index] = ClosestShapeIntersection{-1, std::min(closest_sphere_intersections[ray_index].distance, closest_triangle_intersections[ray_index].distance)};
+    }
+
+    int closest_triangle_indices[MAX_PACKET_SIZE];
+    std::fill(closest_triangle_indices, closest_triangle_indices + ray_count, -1);
+    if (scene.instance_bvh != nullptr) {
+        traverse_packet(packet, *scene.instance_bvh, closest_instance_intersections, [&packet, &scene, &closest_triangle_indices](const int ray_index, const int instance_index, const real closest_distance) {
+            return intersect_instance(packet.rays[ray_index], scene, instance_index, closest_distance, closest_triangle_indices[ray_index]);
+        });
+    }
+
+    for (int ray_index = 0; ray_index < ray_count; ++ray_index) {
+        const ClosestShapeIntersection& closest_instance_intersection = closest_instance_intersections[ray_index];
+        const ClosestInstanceIntersection instance_intersection = (closest_instance_intersection.index != -1) ? ClosestInstanceIntersection{closest_instance_intersection.index, closest_triangle_indices[ray_index], closest_instance_intersection.distance} : INSTANCE_MISS;
+        scene_intersections[ray_index] = get_scene_intersection(closest_sphere_intersections[ray_index], closest_triangle_intersections[ray_index], instance_intersection);
+    }
+}
+
+static bool is_hit(const SceneIntersection& scene_intersection) {
+    return scene_intersection.sphere_index != -1 || scene_intersection.triangle_index != -1;
+}
+
+static int get_material_index(const Scene& scene, const SceneIntersection& scene_intersection) {
+    assert(is_hit(scene_intersection));
+    if (scene_intersection.instance_index != -1) {
+        return scene.instances[scene_intersection.instance_index].material_index;
+    } else if (scene_intersection.sphere_index != -1) {
+        return scene.sphere_material_indices[scene_intersection.sphere_index];
+    } else {
+        return scene.triangle_material_indices[scene_intersection.triangle_index];
+    }
+}
+
+// what shading needs to know about the point a ray hit
+struct SurfacePoint {
+    Vec3 point;
+    Vec3 unit_normal;
+    Material material;
+    real light_pdf; // of light sampling picking this point from the ray's origin, not counting the choice of light, zero if it isn't a light
+};
+
+static SurfacePoint get_surface_point(const Ray& ray, const Scene& scene, const SceneIntersection& scene_intersection) {
+    assert(is_hit(scene_intersection));
+
+    SurfacePoint surface_point = {};
+    surface_point.point = ray.origin + scene_intersection.distance * ray.direction;
+    surface_point.material = scene.materials[get_material_index(scene, scene_intersection)];
+    if (scene_intersection.instance_index != -1) {
+        const Instance& instance = scene.instances[scene_intersection.instance_index];
+        const TriangleRecords& triangles = *scene.meshes[instance.mesh_index].triangles;
+
+        // normals go back to world space with the inverse transpose
+        surface_point.unit_normal = normalise(transpose(instance.world_to_object) * triangles.unit_normals[scene_intersection.triangle_index]);
+    } else if (scene_intersection.sphere_index != -1) {
+        const Sphere& sphere = scene.spheres[scene_intersection.sphere_index];
+        const real sign = (sphere.radius < 0.0f) ? -1.0f : 1.0f;    // trick to model hollow spheres, don't want this polluting the scatter routine
+        surface_point.unit_normal = sign * normalise(surface_point.point - sphere.centre);   // TODO: can divide by radius instead
+
+        if (surface_point.material.type == Material::Type::DIFFUSE_LIGHT) {
+            surface_point.light_pdf = get_sphere_light_pdf(ray.origin, sphere);
+        }
+    } else {
+        surface_point.unit_normal = scene.triangles->unit_normals[scene_intersection.triangle_index];
+
+        if (surface_point.material.type == Material::Type::DIFFUSE_LIGHT) {
+            surface_point.light_pdf = get_triangle_light_pdf(*scene.triangles, scene_intersection.triangle_index, ray.direction, scene_intersection.distance);
+        }
+    }
+
+    return surface_point;
+}
+
+static FeatureSample get_feature_sample(const Ray& ray, const SceneIntersection& scene_intersection, const Scene& scene) {
+    const Colour white{1.0f, 1.0f, 1.0f};
+    if (!is_hit(scene_intersection)) {
+        return FeatureSample{white, Vec3{0.0f, 0.0f, 0.0f}, 0.0f};
+    }
+
+    const SurfacePoint surface_point = get_surface_point(ray, scene, scene_intersection);
+    const bool is_light = (surface_point.material.type == Material::Type::DIFFUSE_LIGHT);
+    return FeatureSample{is_light ? white : get_colour(surface_point.material), surface_point.unit_normal, scene_intersection.distance};
+}
+
+static PathState construct_path_state(const Ray& camera_ray) {
+    PathState path_state = {};
+    path_state.ray = camera_ray;
+    path_state.colour = Colour{0.0f, 0.0f, 0.0f};
+    path_state.attenuation = Colour{1.0f, 1.0f, 1.0f};
+
+    // emission found by a scattered ray is weighed against the chance light sampling picked it,
+    // after a mirror or glass bounce (or straight from the camera) it couldn't have been
+    path_state.scatter_pdf = 0.0f;
+    path_state.scatter_was_specular = true;
+    path_state.bounce_count = 0;
+
+    return path_state;
+}
+
+static PathSettings construct_path_settings(const int min_bounce_count, const int max_bounce_count) {
+    PathSettings settings = {};
+    settings.max_bounce_count = std::min(std::max(max_bounce_count, 0), MAX_BOUNCE_COUNT);
+    settings.min_bounce_count = std::min(std::max(min_bounce_count, 0), settings.max_bounce_count);
+
+    return settings;
+}
+
+static bool shade(PathState& path_state, const SceneIntersection& scene_intersection, const Scene& scene, const PathSettings& settings, SampleStream& sample_stream, Maybe<ShadowRay>& shadow_ray) {
+    assert(0 <= settings.min_bounce_count && settings.min_bounce_count <= settings.max_bounce_count);
+    assert(settings.max_bounce_count <= MAX_BOUNCE_COUNT);
+    assert(path_state.bounce_count < settings.max_bounce_count);
+
+    // every bounce draws from the same dimensions whichever branches it takes
+    static constexpr u32 SCATTER_DIMENSION = 0;
+    static constexpr u32 LIGHT_DIMENSION = 1;       // choice of light then point on it
+    static constexpr u32 ROULETTE_DIMENSION = 3;
+    static constexpr u32 BOUNCE_DIMENSION_COUNT = 4;
+
+    shadow_ray.is_valid = false;
+
+    const Ray& ray = path_state.ray;
+    Colour& attenuation = path_state.attenuation;
+    if (!is_hit(scene_intersection)) {
+        path_state.colour += attenuation * background_gradient(scene.background_gradient_start, scene.background_gradient_end, ray.direction.y);
+        return false;
+    }
+
+    const SurfacePoint surface_point = get_surface_point(ray, scene, scene_intersection);
+    const Material& material = surface_point.material;
+
+    const Colour material_emission = get_emission(material);
+    const bool light_could_be_sampled = !path_state.scatter_was_specular && scene.light_count > 0 && surface_point.light_pdf > 0.0f;
+    const real emission_weight = light_could_be_sampled ? get_mis_weight(path_state.scatter_pdf, surface_point.light_pdf / static_cast<real>(scene.light_count)) : 1.0f;
+    path_state.colour += emission_weight * (attenuation * material_emission);
+
+    const u32 bounce_dimension = CAMERA_DIMENSION_COUNT + BOUNCE_DIMENSION_COUNT * static_cast<u32>(path_state.bounce_count);
+
+    // The light sample doesn't depend on the scattered ray so it's taken even when scattering fails, the MIS
+    // weight already counts scattered directions that are lost as never finding the light
+    const Maybe<ScatterLobe> scatter_lobe = get_scatter_lobe(ray, material, surface_point.unit_normal);
+    if (scatter_lobe.is_valid && scene.light_count > 0) {
+        const Vec3 light_sample_origin = surface_point.point + get_nudge_distance(surface_point.point) * surface_point.unit_normal;
+        set_dimension(sample_stream, bounce_dimension + LIGHT_DIMENSION);
+        shadow_ray = sample_direct_lighting(scene, light_sample_origin, surface_point.unit_normal, scatter_lobe.value, sample_stream);
+        shadow_ray.value.contribution = attenuation * shadow_ray.value.contribution;
+    }
+
+    set_dimension(sample_stream, bounce_dimension + SCATTER_DIMENSION);
+    const Maybe<ScatteredRay> scattered_ray = scatter(ray, material, surface_point.point, surface_point.unit_normal, sample_stream);
+    ++path_state.bounce_count;
+    if (!scattered_ray.is_valid) {
+        return false;
+    }
+
+    if (scatter_lobe.is_valid) {
+        path_state.scatter_pdf = get_scatter_pdf(scatter_lobe.value, scattered_ray.value.ray.direction);
+    }
+
+    path_state.scatter_was_specular = !scatter_lobe.is_valid;
+    path_state.ray = scattered_ray.value.ray;
+    attenuation *= scattered_ray.value.weight;
+
+    // Past the minimum depth a path carries on with probability equal to its throughput, survivors
+    // are scaled up to keep the estimate unbiased. Dark materials end paths within a few bounces.
+    if (path_state.bounce_count >= settings.min_bounce_count) {
+        const real survival_probability = std::min<real>(std::max(attenuation.r, std::max(attenuation.g, attenuation.b)), 1.0f);
+        set_dimension(sample_stream, bounce_dimension + ROULETTE_DIMENSION);
+        if (next_1d(sample_stream) >= survival_probability) {
+            return false;
+        }
+
+        attenuation /= survival_probability;
+    }
+
+    return path_state.bounce_count < settings.max_bounce_count;
+}
+
+static Colour trace_path(const Ray& ray, const SceneIntersection& first_intersection, const Scene& scene, const PathSettings& settings, SampleStream& sample_stream, BounceHistogram& bounce_histogram, RayCounts& ray_counts) {
+    PathState path_state = construct_path_state(ray);
+    SceneIntersection scene_intersection = first_intersection;
+    bool path_continues = (settings.max_bounce_count > 0);
+    while (path_continues) {
+        Maybe<ShadowRay> shadow_ray = {};
+        path_continues = shade(path_state, scene_intersection, scene, settings, sample_stream, shadow_ray);
+        if (shadow_ray.is_valid) {
+            ++ray_counts.shadow_count;
+            if (!occluded(shadow_ray.value.ray, shadow_ray.value.max_distance, scene)) {
+                path_state.colour += shadow_ray.value.contribution;
             }
-        } else {
-            colour += attenuation * background_gradient(scene.background_gradient_start, scene.background_gradient_end, ray.direction.y);
-            break;
         }
+
+        if (path_continues) {
+            scene_intersection = intersect_closest(path_state.ray, scene);
+            ++ray_counts.closest_hit_count;
+        }
+    }
+
+    ++bounce_histogram.path_counts[path_state.bounce_count];
+    return path_state.colour;
+}
+
+static Colour intersect(const Ray& ray, const Scene& scene, const PathSettings& settings, SampleStream& sample_stream, BounceHistogram& bounce_histogram, RayCounts& ray_counts) {
+    ++ray_counts.closest_hit_count;
+    return trace_path(ray, intersect_closest(ray, scene), scene, settings, sample_stream, bounce_histogram, ray_counts);
+}
+
+static void add(BounceHistogram& bounce_histogram, const BounceHistogram& other) {
+    for (int bounce_count = 0; bounce_count <= MAX_BOUNCE_COUNT; ++bounce_count) {
+        bounce_histogram.path_counts[bounce_count] += other.path_counts[bounce_count];
+    }
+}
+
+static real get_mean_bounce_count(const BounceHistogram& bounce_histogram) {
+    u64 path_count = 0;
+    u64 total_bounce_count = 0;
+    for (int bounce_count = 0; bounce_count <= MAX_BOUNCE_COUNT; ++bounce_count) {
+        path_count += bounce_histogram.path_counts[bounce_count];
+        total_bounce_count += bounce_histogram.path_counts[bounce_count] * static_cast<u64>(bounce_count);
     }
 
-    return colour;
+    return (path_count > 0) ? static_cast<real>(total_bounce_count) / static_cast<real>(path_count) : 0.0f;
+}
+
+static void add(RayCounts& ray_counts, const RayCounts& other) {
+    ray_counts.closest_hit_count += other.closest_hit_count;
+    ray_counts.shadow_count += other.shadow_count;
 }
 
 static Vec3 get_position(const Camera& camera) {
     return camera.orientation * Vec3{0.0f, 0.0f, camera.distance} + camera.target;
 }
+
+static Ray generate_camera_ray(
+    const int row,
+    const int column,
+    const int image_width,
+    const int image_height,
+    const real aperture,
+    const Vec3& camera_position,
+    const Vec3& camera_x,
+    const Vec3& camera_y,
+    const Vec3& bottom_left,
+    const Vec3& step_x,
+    const Vec3& step_y,
+    SampleStream& sample_stream
+) {
+    set_dimension(sample_stream, FILM_DIMENSION);
+    const Sample2D film_sample = next_2d(sample_stream);
+    const real u = (static_cast<real>(column) + film_sample.u) / static_cast<real>(image_width - 1);
+    const real v = (static_cast<real>(row) + film_sample.v) / static_cast<real>(image_height - 1);
+
+    const real lens_radius = 0.5f * aperture;
+    set_dimension(sample_stream, LENS_DIMENSION);
+    const Sample2D lens_sample = next_2d(sample_stream);
+    const real a = aperture * lens_sample.u - lens_radius;
+
+    const real b_max = std::sqrt(lens_radius * lens_radius - a * a);
+    const real b_min = -b_max;
+    const real b = (b_max - b_min) * lens_sample.v + b_min;
+
+    const Vec3 random_offset = a * camera_x + b * camera_y;
+
+    const Vec3 ray_direction = normalise(Vec3{bottom_left + u * step_x + v * step_y - camera_position - random_offset});
+    return Ray{camera_position + random_offset, ray_direction};
+}
+
+static Instance construct_instance(const int mesh_index, const int material_index, const Mat3& object_to_world, const Vec3& translation) {
+    Instance instance = {};
+    instance.mesh_index = mesh_index;
+    instance.material_index = material_index;
+    instance.object_to_world = object_to_world;
+    instance.world_to_object = inverse(object_to_world);
+    instance.translation = translation;
+
+    return instance;
+}
+
+static BVH construct_instance_bvh(const Instance* const instances, const int count, const Mesh* const meshes, const BVHBuildSettings& settings) {
+    std::vector<AABB> instance_aabbs(count);
+    for (int instance_index = 0; instance_index < count; ++instance_index) {
+        const Instance& instance = instances[instance_index];
+        const Mesh& mesh = meshes[instance.mesh_index];
+        instance_aabbs[instance_index] = transform(mesh.bvh->aabb, instance.object_to_world, instance.translation);
+    }
+
+    return construct_bvh(instance_aabbs.data(), count, settings);
+}
+
+// every emissive sphere and top level triangle once, spatial splits can repeat a triangle in leaf order
+static std::vector<Light> construct_lights(const Scene& scene) {
+    std::vector<Light> lights;
+    if (scene.sphere_bvh != nullptr) {
+        const std::vector<int>& primitive_indices = scene.sphere_bvh->primitive_indices;
+        std::vector<bool> seen(primitive_indices.size(), false);
+        for (std::size_t sphere_index = 0; sphere_index < primitive_indices.size(); ++sphere_index) {
+            const Material& material = scene.materials[scene.sphere_material_indices[sphere_index]];
+            if (material.type == Material::Type::DIFFUSE_LIGHT && !seen[primitive_indices[sphere_index]]) {
+                seen[primitive_indices[sphere_index]] = true;
+                lights.push_back(Light{Light::Type::SPHERE, static_cast<int>(sphere_index)});
+            }
+        }
+    }
+
+    if (scene.triangle_bvh != nullptr) {
+        const std::vector<int>& primitive_indices = scene.triangle_bvh->primitive_indices;
+        std::vector<bool> seen(primitive_indices.size(), false);
+        for (std::size_t triangle_index = 0; triangle_index < primitive_indices.size(); ++triangle_index) {
+            const Material& material = scene.materials[scene.triangle_material_indices[triangle_index]];
+            if (material.type == Material::Type::DIFFUSE_LIGHT && !seen[primitive_indices[triangle_index]]) {
+                seen[primitive_indices[triangle_index]] = true;
+                lights.push_back(Light{Light::Type::TRIANGLE, static_cast<int>(triangle_index)});
+            }
+        }
+    }
+
+    return lights;
+}
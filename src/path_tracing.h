@@ -5,6 +5,36 @@
 #include "material.h"
 #include "colour.h"
 #include "bvh.h"
+#include "sampling.h"
+
+// Triangles in object space with their own BVH, built once however many times the mesh is placed
+struct Mesh {
+    const TriangleRecords* triangles;
+    const BVH* bvh;
+};
+
+struct Instance {
+    int mesh_index;
+    int material_index;
+    Mat3 object_to_world;
+    Mat3 world_to_object;
+    Vec3 translation;
+};
+
+static Instance construct_instance(int mesh_index, int material_index, const Mat3& object_to_world, const Vec3& translation);
+static BVH construct_instance_bvh(const Instance* instances, int count, const Mesh* meshes, const BVHBuildSettings& settings);
+
+// Emissive spheres and top level triangles, sampled directly at diffuse and glossy vertices. Emissive
+// instances are only found by scattered rays.
+struct Light {
+    enum Type {
+        SPHERE = 0,
+        TRIANGLE = 1
+    };
+
+    Type type;
+    int index;  // leaf ordered sphere or triangle
+};
 
 struct Scene {
     const Material* materials;
@@ -13,15 +43,114 @@ struct Scene {
     const BVH* sphere_bvh;
     const int* sphere_material_indices;
 
-    const Triangle* triangles;
+    const TriangleRecords* triangles;
     const BVH* triangle_bvh;
     const int* triangle_material_indices;
 
+    const Mesh* meshes;
+    const Instance* instances;
+    const BVH* instance_bvh;
+
+    const Light* lights;
+    int light_count;
+
     Colour background_gradient_start;
     Colour background_gradient_end;
 };
 
-static Colour intersect(Ray ray, const Scene& scene);
+static std::vector<Light> construct_lights(const Scene& scene);
+
+// Paths always go at least min_bounce_count bounces before russian roulette can end them, and never
+// more than max_bounce_count
+struct PathSettings {
+    int min_bounce_count;
+    int max_bounce_count;
+};
+
+static constexpr int MAX_BOUNCE_COUNT = 64;
+static constexpr PathSettings DEFAULT_PATH_SETTINGS{3, 50};
+
+// clamped into 0 <= min <= max <= MAX_BOUNCE_COUNT, for settings read from the user
+static PathSettings construct_path_settings(int min_bounce_count, int max_bounce_count);
+
+// number of paths by how many surfaces they scattered off, including the one they ended at
+struct BounceHistogram {
+    u64 path_counts[MAX_BOUNCE_COUNT + 1];
+};
+
+static void add(BounceHistogram& bounce_histogram, const BounceHistogram& other);
+static real get_mean_bounce_count(const BounceHistogram& bounce_histogram);
+
+// rays counted where they're traced, closest hit ones include the camera rays
+struct RayCounts {
+    u64 closest_hit_count;
+    u64 shadow_count;
+};
+
+static void add(RayCounts& ray_counts, const RayCounts& other);
+
+// the camera draws the first dimensions of each sample, paths carry on after them
+static constexpr u32 FILM_DIMENSION = 0;
+static constexpr u32 LENS_DIMENSION = 1;
+static constexpr u32 CAMERA_DIMENSION_COUNT = 2;
+
+// the closest thing a ray hits, a miss has neither a sphere nor a triangle
+struct SceneIntersection {
+    real distance;
+    int sphere_index;
+    int triangle_index;     // the mesh's triangle when the instance is set
+    int instance_index;
+};
+
+static SceneIntersection intersect_closest(const Ray& ray, const Scene& scene);
+
+// Closest hits for a packet of rays, which should start near each other and point roughly the same way like
+// neighbouring camera rays. Incoherent packets are traced a ray at a time.
+static constexpr int MAX_PACKET_SIZE = 16;
+static void intersect_closest(const Ray* rays, int ray_count, const Scene& scene, SceneIntersection* scene_intersections);
+
+static bool is_hit(const SceneIntersection& scene_intersection);
+static int get_material_index(const Scene& scene, const SceneIntersection& scene_intersection);
+
+// The first thing a camera ray sees, for the denoiser to find edges with. Misses are white, facing
+// nowhere and at depth zero.
+struct FeatureSample {
+    Colour albedo;  // white for lights so their emission isn't divided away
+    Vec3 normal;
+    real depth;
+};
+
+static FeatureSample get_feature_sample(const Ray& ray, const SceneIntersection& scene_intersection, const Scene& scene);
+
+// everything a path carries from one bounce to the next
+struct PathState {
+    Ray ray;
+    Colour colour;
+    Colour attenuation;
+    real scatter_pdf;           // of the ray's direction, for weighing any light it finds against light sampling
+    bool scatter_was_specular;
+    int bounce_count;
+};
+
+// a light sample for next event estimation, its contribution counts if nothing is in the way
+struct ShadowRay {
+    Ray ray;
+    real max_distance;
+    Colour contribution;
+};
+
+static PathState construct_path_state(const Ray& camera_ray);
+
+// One bounce at the point the path's ray hit: adds emission or the background, picks the next ray and maybe a
+// shadow ray for the caller to trace. Returns false once the path has ended.
+static bool shade(PathState& path_state, const SceneIntersection& scene_intersection, const Scene& scene, const PathSettings& settings, SampleStream& sample_stream, Maybe<ShadowRay>& shadow_ray);
+
+// traces one path to the end, the first hit can come from a packet and whoever traced it counts that ray
+static Colour trace_path(const Ray& ray, const SceneIntersection& first_intersection, const Scene& scene, const PathSettings& settings, SampleStream& sample_stream, BounceHistogram& bounce_histogram, RayCounts& ray_counts);
+static Colour intersect(const Ray& ray, const Scene& scene, const PathSettings& settings, SampleStream& sample_stream, BounceHistogram& bounce_histogram, RayCounts& ray_counts);
+
+// true if anything is hit in (0, max_distance), cheaper than finding the closest hit
+static bool occluded(const Ray& ray, real max_distance, const Scene& scene);
 
 // TODO: should this have an aspect ratio? would need to handle resizing of window
 struct Camera {
@@ -36,4 +165,21 @@ struct Camera {
 
 static Vec3 get_position(const Camera& camera);
 
+// Through a random point on the pixel from a random point on the lens. The viewport's corner and steps across
+// it are at the focus distance.
+static Ray generate_camera_ray(
+    int row,
+    int column,
+    int image_width,
+    int image_height,
+    real aperture,
+    const Vec3& camera_position,
+    const Vec3& camera_x,
+    const Vec3& camera_y,
+    const Vec3& bottom_left,
+    const Vec3& step_x,
+    const Vec3& step_y,
+    SampleStream& sample_stream
+);
+
 #endif
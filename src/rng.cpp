@@ -1,5 +1,7 @@
 #include "rng.h"
 
+#include <climits>
+
 static constexpr u32 NOISE_SEED = 1;
 
 static u32 noise_1d(const int x) {
@@ -20,10 +22,12 @@ static u32 noise_1d(const int x) {
 }
 
 static u32 noise_3d(const int x, const int y, const int z) {
-    static constexpr int PRIME_1 = 198491317;
-    static constexpr int PRIME_2 = 6542989;
-    const int new_x = x + PRIME_1 * y + PRIME_2 * z;
-    const u32 result = noise_1d(new_x);
+    static constexpr u32 PRIME_1 = 198491317;
+    static constexpr u32 PRIME_2 = 6542989;
+
+    // mixed in u32 so the products wrap instead of overflowing int, which every row past the tenth would
+    const u32 new_x = static_cast<u32>(x) + PRIME_1 * static_cast<u32>(y) + PRIME_2 * static_cast<u32>(z);
+    const u32 result = noise_1d(static_cast<int>(new_x));
     return result;
 }
 
@@ -31,35 +35,6 @@ static real real_from_rng(const u32 rng) {
     return static_cast<real>(rng) / static_cast<real>(UINT_MAX);
 }
 
-static Vec3 random_unit_vector(const Vec3& seed) {
-    const int x = static_cast<int>(1000000000.0f * seed.x);
-    const int y = static_cast<int>(1000000000.0f * seed.y);
-    const int z = static_cast<int>(1000000000.0f * seed.z);
-
-    u32 rng = noise_3d(x, y, z);
-
-    rng = random_number(rng);
-    const real x_randomness = real_from_rng(rng);
-    const real random_x = 2.0f * x_randomness - 1.0f;
-
-    const real y_max = std::sqrt(1.0f - random_x * random_x);
-    const real y_min = -y_max;
-
-    rng = random_number(rng);
-    const real y_randomness = real_from_rng(rng);
-    const real random_y = (y_max - y_min) * y_randomness + y_min;
-
-    const real z_max = std::sqrt(1.0f - random_x * random_x - random_y * random_y);
-    const real z_min = -z_max;
-
-    rng = random_number(rng);
-    const real z_randomness = real_from_rng(rng);
-    const real random_z = (z_max - z_min) * z_randomness + z_min;
-
-    const Vec3 random_vector = Vec3{random_x, random_y, random_z};
-    return normalise(random_vector);
-}
-
 static u32 random_number(u32 seed) {
     seed ^= (seed << 13);
     seed ^= (seed >> 17);
@@ -67,3 +42,15 @@ static u32 random_number(u32 seed) {
 
     return seed;
 }
+
+static u32 pcg32(u64& state) {
+    static constexpr u64 MULTIPLIER = 6364136223846793005ull;
+    static constexpr u64 INCREMENT = 1442695040888963407ull;
+
+    const u64 old_state = state;
+    state = old_state * MULTIPLIER + INCREMENT;
+
+    const u32 xor_shifted = static_cast<u32>(((old_state >> 18u) ^ old_state) >> 27u);
+    const u32 rotation = static_cast<u32>(old_state >> 59u);
+    return (xor_shifted >> rotation) | (xor_shifted << ((32u - rotation) & 31u));
+}
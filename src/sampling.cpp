@@ -0,0 +1,323 @@
+#include "sampling.h"
+#include "rng.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+// top 24 bits so the result stays below 1 whatever precision real is
+static real real_from_bits(const u32 bits) {
+    return static_cast<real>(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+static u32 hash_combine(const u32 seed, const u32 value) {
+    return noise_1d(static_cast<int>(seed ^ (value + 0x9E3779B9u + (seed << 6) + (seed >> 2))));
+}
+
+static u32 reverse_bits(u32 x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Laine and Karras, each bit only depends on the bits below it so on bit reversed values it's an Owen scramble
+static u32 laine_karras_permutation(u32 x, const u32 seed) {
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return x;
+}
+
+static u32 nested_uniform_scramble(const u32 x, const u32 seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The first Sobol dimension is van der Corput. The second's generator matrix is Pascal's triangle mod 2, by
+// Lucas' theorem digit d takes the xor of every index bit j whose position has d's position bits set, which
+// is a superset transform over the five bits of the position.
+static u32 sobol_dimension_1_reversed(u32 index) {
+    index ^= (index >> 1) & 0x55555555u;
+    index ^= (index >> 2) & 0x33333333u;
+    index ^= (index >> 4) & 0x0F0F0F0Fu;
+    index ^= (index >> 8) & 0x00FF00FFu;
+    index ^= (index >> 16) & 0x0000FFFFu;
+    return index;
+}
+
+// Burley's shuffled and scrambled Sobol pair, shuffling the index decorrelates pairs with different seeds.
+// Sobol points come out bit reversed here, which is what the scramble wants anyway.
+static Sample2D scrambled_sobol_2d(const u32 index, const u32 seed) {
+    const u32 shuffled_index = nested_uniform_scramble(index, seed);
+    const u32 x = reverse_bits(laine_karras_permutation(shuffled_index, hash_combine(seed, 0)));
+    const u32 y = reverse_bits(laine_karras_permutation(sobol_dimension_1_reversed(shuffled_index), hash_combine(seed, 1)));
+    return Sample2D{real_from_bits(x), real_from_bits(y)};
+}
+
+static real get_blue_noise(const BlueNoiseTile& blue_noise_tile, const int x, const int y) {
+    const int tile_x = x & (BLUE_NOISE_TILE_SIZE - 1);
+    const int tile_y = y & (BLUE_NOISE_TILE_SIZE - 1);
+    return blue_noise_tile.values[tile_y * BLUE_NOISE_TILE_SIZE + tile_x];
+}
+
+// Cranley-Patterson rotation
+static real shift(const real value, const real offset) {
+    const real shifted_value = value + offset;
+    return (shifted_value < 1.0f) ? shifted_value : shifted_value - 1.0f;
+}
+
+static Sampler construct_random_sampler() {
+    return Sampler{Sampler::Type::RANDOM, nullptr};
+}
+
+static Sampler construct_sobol_sampler() {
+    return Sampler{Sampler::Type::SOBOL, nullptr};
+}
+
+static Sampler construct_blue_noise_sampler(const BlueNoiseTile& blue_noise_tile) {
+    return Sampler{Sampler::Type::BLUE_NOISE, &blue_noise_tile};
+}
+
+static Sampler construct_sampler(const Sampler::Type type, const BlueNoiseTile& blue_noise_tile) {
+    switch (type) {
+        case Sampler::Type::RANDOM: {
+            return construct_random_sampler();
+        }
+
+        case Sampler::Type::SOBOL: {
+            return construct_sobol_sampler();
+        }
+
+        case Sampler::Type::BLUE_NOISE: {
+            return construct_blue_noise_sampler(blue_noise_tile);
+        }
+
+        default: {
+            assert(false);
+            return Sampler{};
+        }
+    }
+}
+
+static const char* get_sampler_name(const Sampler::Type type) {
+    switch (type) {
+        case Sampler::Type::RANDOM: {
+            return "random";
+        }
+
+        case Sampler::Type::SOBOL: {
+            return "sobol";
+        }
+
+        case Sampler::Type::BLUE_NOISE: {
+            return "blue-noise";
+        }
+
+        default: {
+            assert(false);
+            return "";
+        }
+    }
+}
+
+static void add_energy(std::vector<real>& energy, const std::vector<real>& kernel, const int pixel_index, const real sign) {
+    const int pixel_x = pixel_index % BLUE_NOISE_TILE_SIZE;
+    const int pixel_y = pixel_index / BLUE_NOISE_TILE_SIZE;
+    for (int y = 0; y < BLUE_NOISE_TILE_SIZE; ++y) {
+        const int offset_y = (y - pixel_y) & (BLUE_NOISE_TILE_SIZE - 1);
+        for (int x = 0; x < BLUE_NOISE_TILE_SIZE; ++x) {
+            const int offset_x = (x - pixel_x) & (BLUE_NOISE_TILE_SIZE - 1);
+            energy[y * BLUE_NOISE_TILE_SIZE + x] += sign * kernel[offset_y * BLUE_NOISE_TILE_SIZE + offset_x];
+        }
+    }
+}
+
+// the set pixel with the most energy around it
+static int find_tightest_cluster(const std::vector<real>& energy, const std::vector<bool>& is_set) {
+    int tightest_cluster = -1;
+    for (int pixel_index = 0; pixel_index < static_cast<int>(energy.size()); ++pixel_index) {
+        if (is_set[pixel_index] && (tightest_cluster == -1 || energy[pixel_index] > energy[tightest_cluster])) {
+            tightest_cluster = pixel_index;
+        }
+    }
+
+    return tightest_cluster;
+}
+
+// the unset pixel with the least energy around it
+static int find_largest_void(const std::vector<real>& energy, const std::vector<bool>& is_set) {
+    int largest_void = -1;
+    for (int pixel_index = 0; pixel_index < static_cast<int>(energy.size()); ++pixel_index) {
+        if (!is_set[pixel_index] && (largest_void == -1 || energy[pixel_index] < energy[largest_void])) {
+            largest_void = pixel_index;
+        }
+    }
+
+    return largest_void;
+}
+
+// Ulichney's void and cluster. Ranking the pixels of a well spread initial pattern by removing its tightest
+// clusters, then the rest by filling the largest voids, makes every threshold of the ranks blue noise.
+static BlueNoiseTile construct_blue_noise_tile() {
+    static constexpr int PIXEL_COUNT = BLUE_NOISE_TILE_SIZE * BLUE_NOISE_TILE_SIZE;
+    static constexpr int INITIAL_SET_PIXEL_COUNT = PIXEL_COUNT / 10;
+    static constexpr real SIGMA = 1.5f;
+
+    // gaussian energy by toroidal offset
+    std::vector<real> kernel(PIXEL_COUNT);
+    for (int y = 0; y < BLUE_NOISE_TILE_SIZE; ++y) {
+        const int distance_y = std::min(y, BLUE_NOISE_TILE_SIZE - y);
+        for (int x = 0; x < BLUE_NOISE_TILE_SIZE; ++x) {
+            const int distance_x = std::min(x, BLUE_NOISE_TILE_SIZE - x);
+            const real distance_squared = static_cast<real>(distance_x * distance_x + distance_y * distance_y);
+            kernel[y * BLUE_NOISE_TILE_SIZE + x] = std::exp(-distance_squared / (2.0f * SIGMA * SIGMA));
+        }
+    }
+
+    std::vector<bool> is_set(PIXEL_COUNT, false);
+    std::vector<real> energy(PIXEL_COUNT, 0.0f);
+    u64 rng = 1;
+    for (int set_pixel_count = 0; set_pixel_count < INITIAL_SET_PIXEL_COUNT;) {
+        const int pixel_index = static_cast<int>(pcg32(rng) % PIXEL_COUNT);
+        if (!is_set[pixel_index]) {
+            is_set[pixel_index] = true;
+            add_energy(energy, kernel, pixel_index, 1.0f);
+            ++set_pixel_count;
+        }
+    }
+
+    // spread the initial pattern out, moving the tightest cluster to the largest void until it's already there
+    for (int iteration = 0; iteration < PIXEL_COUNT; ++iteration) {
+        const int tightest_cluster = find_tightest_cluster(energy, is_set);
+        is_set[tightest_cluster] = false;
+        add_energy(energy, kernel, tightest_cluster, -1.0f);
+
+        const int largest_void = find_largest_void(energy, is_set);
+        is_set[largest_void] = true;
+        add_energy(energy, kernel, largest_void, 1.0f);
+        if (largest_void == tightest_cluster) {
+            break;
+        }
+    }
+
+    std::vector<int> ranks(PIXEL_COUNT, 0);
+    std::vector<bool> initial_is_set = is_set;
+    std::vector<real> initial_energy = energy;
+    for (int rank = INITIAL_SET_PIXEL_COUNT - 1; rank >= 0; --rank) {
+        const int tightest_cluster = find_tightest_cluster(energy, is_set);
+        is_set[tightest_cluster] = false;
+        add_energy(energy, kernel, tightest_cluster, -1.0f);
+        ranks[tightest_cluster] = rank;
+    }
+
+    // with more than half set the largest void among the unset pixels is also the tightest cluster of them
+    is_set = initial_is_set;
+    energy = initial_energy;
+    for (int rank = INITIAL_SET_PIXEL_COUNT; rank < PIXEL_COUNT; ++rank) {
+        const int largest_void = find_largest_void(energy, is_set);
+        is_set[largest_void] = true;
+        add_energy(energy, kernel, largest_void, 1.0f);
+        ranks[largest_void] = rank;
+    }
+
+    BlueNoiseTile blue_noise_tile = {};
+    for (int pixel_index = 0; pixel_index < PIXEL_COUNT; ++pixel_index) {
+        blue_noise_tile.values[pixel_index] = (static_cast<float>(ranks[pixel_index]) + 0.5f) / static_cast<float>(PIXEL_COUNT);
+    }
+
+    return blue_noise_tile;
+}
+
+static SampleStream construct_sample_stream(const Sampler& sampler, const int x, const int y, const int sample_index) {
+    SampleStream sample_stream = {};
+    sample_stream.sampler = &sampler;
+    sample_stream.x = x;
+    sample_stream.y = y;
+    sample_stream.pixel_seed = noise_3d(x, y, 0);
+    sample_stream.sample_index = static_cast<u32>(sample_index);
+    set_dimension(sample_stream, 0);
+
+    return sample_stream;
+}
+
+static void set_dimension(SampleStream& sample_stream, const u32 dimension) {
+    sample_stream.dimension = dimension;
+    if (sample_stream.sampler->type == Sampler::Type::RANDOM) {
+        const u32 sample_seed = hash_combine(sample_stream.pixel_seed, sample_stream.sample_index);
+        sample_stream.pcg_state = (static_cast<u64>(sample_seed) << 32) | hash_combine(sample_seed, dimension);
+        pcg32(sample_stream.pcg_state);
+    }
+}
+
+static real next_1d(SampleStream& sample_stream) {
+    return next_2d(sample_stream).u;
+}
+
+static Sample2D next_2d(SampleStream& sample_stream) {
+    const Sampler& sampler = *sample_stream.sampler;
+    const u32 dimension = sample_stream.dimension;
+    ++sample_stream.dimension;
+
+    switch (sampler.type) {
+        case Sampler::Type::RANDOM: {
+            const real u = real_from_bits(pcg32(sample_stream.pcg_state));
+            const real v = real_from_bits(pcg32(sample_stream.pcg_state));
+            return Sample2D{u, v};
+        }
+
+        case Sampler::Type::SOBOL: {
+            return scrambled_sobol_2d(sample_stream.sample_index, hash_combine(sample_stream.pixel_seed, dimension));
+        }
+
+        // every pixel gets the same point, it's the shift that differs and neighbouring shifts are far apart
+        case Sampler::Type::BLUE_NOISE: {
+            assert(sampler.blue_noise_tile != nullptr);
+            static constexpr u32 BLUE_NOISE_SEED = 0x2545F491u;
+            const u32 dimension_seed = hash_combine(BLUE_NOISE_SEED, dimension);
+            const Sample2D sample = scrambled_sobol_2d(sample_stream.sample_index, dimension_seed);
+
+            const u32 u_offset = hash_combine(dimension_seed, 2);
+            const u32 v_offset = hash_combine(dimension_seed, 3);
+            const real u_shift = get_blue_noise(*sampler.blue_noise_tile, sample_stream.x + static_cast<int>(u_offset & 0xFFFFu), sample_stream.y + static_cast<int>(u_offset >> 16));
+            const real v_shift = get_blue_noise(*sampler.blue_noise_tile, sample_stream.x + static_cast<int>(v_offset & 0xFFFFu), sample_stream.y + static_cast<int>(v_offset >> 16));
+            return Sample2D{shift(sample.u, u_shift), shift(sample.v, v_shift)};
+        }
+
+        default: {
+            assert(false);
+            return Sample2D{};
+        }
+    }
+}
+
+// Malley's method, uniform on the disc projected up onto the hemisphere
+static Vec3 sample_cosine_hemisphere(const Sample2D& sample) {
+    const real radius = std::sqrt(sample.u);
+    const real phi = 2.0f * PI * sample.v;
+    const real z = std::sqrt(std::max<real>(0.0f, 1.0f - sample.u));
+    return Vec3{radius * std::cos(phi), radius * std::sin(phi), z};
+}
+
+// Heitz 2018, "Sampling the GGX Distribution of Visible Normals". Stretching the view direction turns the
+// microfacets into a hemisphere, the part of it facing the view is a disc plus half a disc foreshortened
+// which is sampled directly, then everything is unstretched.
+static Vec3 sample_ggx_visible_normal(const Vec3& outgoing, const real alpha, const Sample2D& sample) {
+    const Vec3 stretched = normalise(Vec3{alpha * outgoing.x, alpha * outgoing.y, outgoing.z});
+    const real length_squared = stretched.x * stretched.x + stretched.y * stretched.y;
+    const Vec3 t1 = (length_squared > 0.0f) ? (1.0f / std::sqrt(length_squared)) * Vec3{-stretched.y, stretched.x, 0.0f} : Vec3{1.0f, 0.0f, 0.0f};
+    const Vec3 t2 = stretched ^ t1;
+
+    const real radius = std::sqrt(sample.u);
+    const real phi = 2.0f * PI * sample.v;
+    const real p1 = radius * std::cos(phi);
+    const real s = 0.5f * (1.0f + stretched.z);
+    const real p2 = (1.0f - s) * std::sqrt(std::max<real>(0.0f, 1.0f - p1 * p1)) + s * radius * std::sin(phi);
+    const real p3 = std::sqrt(std::max<real>(0.0f, 1.0f - p1 * p1 - p2 * p2));
+
+    const Vec3 normal = p1 * t1 + p2 * t2 + p3 * stretched;
+    return normalise(Vec3{alpha * normal.x, alpha * normal.y, std::max<real>(0.0f, normal.z)});
+}
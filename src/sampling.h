@@ -0,0 +1,62 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include "linear_algebra.h"
+#include "types.h"
+
+static constexpr int BLUE_NOISE_TILE_SIZE = 64;
+
+// void and cluster ranks scaled to [0, 1), tiles toroidally
+struct BlueNoiseTile {
+    float values[BLUE_NOISE_TILE_SIZE * BLUE_NOISE_TILE_SIZE];
+};
+
+struct Sampler {
+    enum Type {
+        RANDOM = 0,     // PCG32, independent for every pixel, sample and dimension
+        SOBOL = 1,      // Owen scrambled Sobol pairs, every pixel scrambles with its own seed
+        BLUE_NOISE = 2  // Owen scrambled Sobol pairs shared by every pixel, each pixel shifted by a blue noise tile
+    };
+
+    Type type;
+    const BlueNoiseTile* blue_noise_tile;   // only used by BLUE_NOISE
+};
+
+// The draws for one sample of one pixel. Each draw uses up one dimension, the path tracer sets the
+// dimension at the start of every bounce so a draw lands in the same dimension for every sample.
+struct SampleStream {
+    const Sampler* sampler;
+    int x;
+    int y;
+    u32 pixel_seed;
+    u32 sample_index;
+    u32 dimension;
+    u64 pcg_state;
+};
+
+struct Sample2D {
+    real u;
+    real v;
+};
+
+static Sampler construct_random_sampler();
+static Sampler construct_sobol_sampler();
+static Sampler construct_blue_noise_sampler(const BlueNoiseTile& blue_noise_tile);
+static BlueNoiseTile construct_blue_noise_tile();
+
+// the tile is only used by BLUE_NOISE, it has to outlive the sampler either way
+static Sampler construct_sampler(Sampler::Type type, const BlueNoiseTile& blue_noise_tile);
+static const char* get_sampler_name(Sampler::Type type);
+
+static SampleStream construct_sample_stream(const Sampler& sampler, int x, int y, int sample_index);
+static void set_dimension(SampleStream& sample_stream, u32 dimension);
+static real next_1d(SampleStream& sample_stream);
+static Sample2D next_2d(SampleStream& sample_stream);
+
+// warps from the unit square
+static Vec3 sample_cosine_hemisphere(const Sample2D& sample);   // about +z, pdf cos(theta) / pi
+
+// GGX microfacet normal about +z seen from outgoing (also about +z), pdf G1(outgoing) max(0, outgoing.h) D(h) / outgoing.z
+static Vec3 sample_ggx_visible_normal(const Vec3& outgoing, real alpha, const Sample2D& sample);
+
+#endif
@@ -0,0 +1,468 @@
+#include "scenes.h"
+#include "model_loading.h"
+#include "rng.h"
+
+#include <cassert>
+#include <cmath>
+
+static SceneData construct_random_spheres_scene() {
+    static constexpr int SPHERE_COUNT = 22 * 22 + 4;
+    Material materials[SPHERE_COUNT] = {};
+    Sphere spheres[SPHERE_COUNT] = {};
+    int sphere_material_indices[SPHERE_COUNT] = {};
+
+    int sphere_index = 0;
+    materials[sphere_index] = construct_lambertian_material(Colour{0.5f, 0.5f, 0.5f});
+    spheres[sphere_index] = Sphere{Vec3{0.0f, -1000.0f, 0.0f}, 1000.0f};
+    sphere_material_indices[sphere_index] = sphere_index;
+    ++sphere_index;
+
+    u32 rng = 479001599;
+    for (int a = -11; a < 11; ++a) {
+        for (int b = -11; b < 11; ++b) {
+            rng = random_number(rng);
+            const real material_choice = real_from_rng(rng);
+
+            rng = random_number(rng);
+            const real x_offset = 0.9f * real_from_rng(rng);
+
+            rng = random_number(rng);
+            const real z_offset = 0.9f * real_from_rng(rng);
+
+            const Vec3 sphere_centre{static_cast<real>(a) + x_offset, 0.2f, static_cast<real>(b) + z_offset};
+            spheres[sphere_index] = Sphere{sphere_centre, 0.2f};
+
+            if (material_choice < 0.8f) {
+                rng = random_number(rng);
+                const real colour_1_r = real_from_rng(rng);
+                rng = random_number(rng);
+                const real colour_1_g = real_from_rng(rng);
+                rng = random_number(rng);
+                const real colour_1_b = real_from_rng(rng);
+
+                const Colour colour_1{colour_1_r, colour_1_g, colour_1_b};
+
+                rng = random_number(rng);
+                const real colour_2_r = real_from_rng(rng);
+                rng = random_number(rng);
+                const real colour_2_g = real_from_rng(rng);
+                rng = random_number(rng);
+                const real colour_2_b = real_from_rng(rng);
+
+                const Colour colour_2{colour_2_r, colour_2_g, colour_2_b};
+
+                const Colour albedo = colour_1 * colour_2;
+                materials[sphere_index] = construct_lambertian_material(albedo);
+            } else if (material_choice < 0.95f) {
+                rng = random_number(rng);
+                const real colour_r = 0.5f * real_from_rng(rng) + 0.5f;
+                rng = random_number(rng);
+                const real colour_g = 0.5f * real_from_rng(rng) + 0.5f;
+                rng = random_number(rng);
+                const real colour_b = 0.5f * real_from_rng(rng) + 0.5f;                
+
+                const Colour albedo{colour_r, colour_g, colour_b};
+
+                rng = random_number(rng);
+                const real roughness = real_from_rng(rng);
+
+                materials[sphere_index] = construct_metal_material(albedo, roughness);
+            } else {
+                materials[sphere_index] = construct_dielectric_material(1.5f);
+            }
+
+            sphere_material_indices[sphere_index] = sphere_index;
+            ++sphere_index;
+        }
+    }
+
+    assert(sphere_index == SPHERE_COUNT - 3);
+
+    materials[sphere_index] = construct_dielectric_material(1.5f);
+    spheres[sphere_index] = Sphere{Vec3{0.0f, 1.0f, 0.0f}, 1.0f};
+    sphere_material_indices[sphere_index] = sphere_index;
+    ++sphere_index;
+
+    materials[sphere_index] = construct_lambertian_material(Colour{0.4f, 0.2f, 0.1f});
+    spheres[sphere_index] = Sphere{Vec3{-4.0f, 1.0f, 0.0f}, 1.0f};
+    sphere_material_indices[sphere_index] = sphere_index;
+    ++sphere_index;
+
+    materials[sphere_index] = construct_metal_material(Colour{0.7f, 0.6f, 0.5f}, 0.0f);
+    spheres[sphere_index] = Sphere{Vec3{4.0f, 1.0f, 0.0f}, 1.0f};
+    sphere_material_indices[sphere_index] = sphere_index;
+    ++sphere_index;
+
+    assert(sphere_index == SPHERE_COUNT);
+
+    SceneData scene_data = {};
+    scene_data.materials.assign(materials, materials + SPHERE_COUNT);
+    scene_data.sphere_bvh = construct_sphere_bvh(spheres, SPHERE_COUNT, DEFAULT_BVH_BUILD_SETTINGS);
+    scene_data.spheres = reorder_to_leaf_order(scene_data.sphere_bvh, spheres);
+    scene_data.sphere_material_indices = reorder_to_leaf_order(scene_data.sphere_bvh, sphere_material_indices);
+    scene_data.background_gradient_start = Colour{1.0f, 1.0f, 1.0f};
+    scene_data.background_gradient_end = Colour{0.5f, 0.7f, 1.0f};
+    scene_data.lights = construct_lights(get_scene(scene_data));
+
+    const Vec3 camera_start_position{13.0f, 2.0f, 3.0f};
+    Camera& camera = scene_data.camera;
+    camera.target = Vec3{0.0f, 0.0f, 0.0f};
+    camera.orientation = look_at_matrix(camera_start_position, camera.target);
+    camera.distance = magnitude(camera_start_position - camera.target);
+    camera.fov_y = degrees_to_radians(20.0f);
+    camera.aperture = 0.1f;
+    camera.focus_distance = 10.0f;
+    scene_data.aspect_ratio = RANDOM_SPHERES_ASPECT_RATIO;
+
+    return scene_data;
+}
+
+static SceneData construct_cornell_box_scene() {
+    SceneData scene_data = {};
+    scene_data.materials = {
+        construct_lambertian_material(Colour{0.65f, 0.05f, 0.05f}), // red
+        construct_lambertian_material(Colour{0.73f, 0.73f, 0.73f}), // white
+        construct_lambertian_material(Colour{0.12f, 0.45f, 0.15f}), // green
+        construct_diffuse_light_material(Colour{1.0f, 1.0f, 1.0f}, 15.0f),  // light
+        construct_dielectric_material(1.5f)
+    };
+
+    scene_data.spheres = {
+        Sphere{Vec3{183.0f, 240.0f, 169.0f}, 75.0f}
+    };
+
+    scene_data.sphere_material_indices = {4};
+    scene_data.sphere_bvh = construct_sphere_bvh(scene_data.spheres.data(), 1, DEFAULT_BVH_BUILD_SETTINGS);
+
+    const Vec3 unit_box_vertices[] = {
+        // +z
+        Vec3{0.0f, 1.0f, 1.0f}, Vec3{0.0f, 0.0f, 1.0f}, Vec3{1.0f, 0.0f, 1.0f},
+        Vec3{1.0f, 0.0f, 1.0f}, Vec3{1.0f, 1.0f, 1.0f}, Vec3{0.0f, 1.0f, 1.0f},
+
+        // +x
+        Vec3{1.0f, 1.0f, 1.0f}, Vec3{1.0f, 0.0f, 1.0f}, Vec3{1.0f, 0.0f, 0.0f},
+        Vec3{1.0f, 0.0f, 0.0f}, Vec3{1.0f, 1.0f, 0.0f}, Vec3{1.0f, 1.0f, 1.0f},
+
+        // -z
+        Vec3{1.0f, 1.0f, 0.0f}, Vec3{1.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 0.0f},
+        Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f}, Vec3{1.0f, 1.0f, 0.0f},
+
+        // -x
+        Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f},
+        Vec3{0.0f, 0.0f, 1.0f}, Vec3{0.0f, 1.0f, 1.0f}, Vec3{0.0f, 1.0f, 0.0f},
+
+        // +y
+        Vec3{1.0f, 1.0f, 1.0f}, Vec3{1.0f, 1.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f},
+        Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 1.0f, 1.0f}, Vec3{1.0f, 1.0f, 1.0f},
+
+        // -y
+        Vec3{0.0f, 0.0f, 1.0f}, Vec3{0.0f, 0.0f, 0.0f}, Vec3{1.0f, 0.0f, 0.0f},
+        Vec3{1.0f, 0.0f, 0.0f}, Vec3{1.0f, 0.0f, 1.0f}, Vec3{0.0f, 0.0f, 1.0f}
+    };
+
+    const Mat3 right_box_transform = scaling_matrix(165.0f, 165.0f, 165.0f) * rotation_matrix(-PI / 10.0f, 0.0f, 1.0f, 0.0f);
+    Vec3 right_box_vertices[36] = {};
+    for (int i = 0; i < 36; ++i) {
+        right_box_vertices[i] = right_box_transform * unit_box_vertices[i] + Vec3{130.0f, 0.0f, 65.0f};
+    }
+
+    assert(sizeof(unit_box_vertices) == sizeof(right_box_vertices));
+
+    const Mat3 left_box_transform = scaling_matrix(165.0f, 330.0f, 165.0f) * rotation_matrix(PI / 12.0f, 0.0f, 1.0f, 0.0f);
+    Vec3 left_box_vertices[36] = {};
+    for (int i = 0; i < 36; ++i) {
+        left_box_vertices[i] = left_box_transform * unit_box_vertices[i] + Vec3{265.0f, 0.0f, 295.0f};
+    }
+
+    assert(sizeof(unit_box_vertices) == sizeof(left_box_vertices));
+
+    const Triangle cornell_triangles[36] = {
+        // left wall
+        Triangle{Vec3{555.0f, 0.0f, 0.0f}, Vec3{555.0f, 0.0f, 555.0f}, Vec3{555.0f, 555.0f, 555.0f}},
+        Triangle{Vec3{555.0f, 555.0f, 555.0f}, Vec3{555.0f, 555.0f, 0.0f}, Vec3{555.0f, 0.0f, 0.0f}},
+
+        // right wall
+        Triangle{Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 555.0f, 0.0f}, Vec3{0.0f, 555.0f, 555.0f}},
+        Triangle{Vec3{0.0f, 555.0f, 555.0f}, Vec3{0.0f, 0.0f, 555.0f}, Vec3{0.0f, 0.0f, 0.0f}},
+
+        // floor
+        Triangle{Vec3{0.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 555.0f}, Vec3{555.0f, 0.0f, 555.0f}},
+        Triangle{Vec3{555.0f, 0.0f, 555.0f}, Vec3{555.0f, 0.0f, 0.0f}, Vec3{0.0f, 0.0f, 0.0f}},
+
+        // ceiling
+        Triangle{Vec3{0.0f, 555.0f, 0.0f}, Vec3{555.0f, 555.0f, 0.0f}, Vec3{555.0f, 555.0f, 555.0f}},
+        Triangle{Vec3{555.0f, 555.0f, 555.0f}, Vec3{0.0f, 555.0f, 555.0f}, Vec3{0.0f, 555.0f, 0.0f}},
+
+        // back
+        Triangle{Vec3{0.0f, 0.0f, 555.0f}, Vec3{0.0f, 555.0f, 555.0f}, Vec3{555.0f, 555.0f, 555.0f}},
+        Triangle{Vec3{555.0f, 555.0f, 555.0f}, Vec3{555.0f, 0.0f, 555.0f}, Vec3{0.0f, 0.0f, 555.0f}},
+
+        // light
+        Triangle{Vec3{213.0f, 554.0f, 227.0f}, Vec3{343.0f, 554.0f, 227.0f}, Vec3{343.0f, 554.0f, 332.0f}},
+        Triangle{Vec3{343.0f, 554.0f, 332.0f}, Vec3{213.0f, 554.0f, 332.0f}, Vec3{213.0f, 554.0f, 227.0f}},
+
+        // right box
+        Triangle{right_box_vertices[0], right_box_vertices[1], right_box_vertices[2]},
+        Triangle{right_box_vertices[3], right_box_vertices[4], right_box_vertices[5]},
+
+        Triangle{right_box_vertices[6], right_box_vertices[7], right_box_vertices[8]},
+        Triangle{right_box_vertices[9], right_box_vertices[10], right_box_vertices[11]},
+
+        Triangle{right_box_vertices[12], right_box_vertices[13], right_box_vertices[14]},
+        Triangle{right_box_vertices[15], right_box_vertices[16], right_box_vertices[17]},
+
+        Triangle{right_box_vertices[18], right_box_vertices[19], right_box_vertices[20]},
+        Triangle{right_box_vertices[21], right_box_vertices[22], right_box_vertices[23]},
+
+        Triangle{right_box_vertices[24], right_box_vertices[25], right_box_vertices[26]},
+        Triangle{right_box_vertices[27], right_box_vertices[28], right_box_vertices[29]},
+
+        Triangle{right_box_vertices[30], right_box_vertices[31], right_box_vertices[32]},
+        Triangle{right_box_vertices[33], right_box_vertices[34], right_box_vertices[35]},
+
+        // left box
+        Triangle{left_box_vertices[0], left_box_vertices[1], left_box_vertices[2]},
+        Triangle{left_box_vertices[3], left_box_vertices[4], left_box_vertices[5]},
+
+        Triangle{left_box_vertices[6], left_box_vertices[7], left_box_vertices[8]},
+        Triangle{left_box_vertices[9], left_box_vertices[10], left_box_vertices[11]},
+
+        Triangle{left_box_vertices[12], left_box_vertices[13], left_box_vertices[14]},
+        Triangle{left_box_vertices[15], left_box_vertices[16], left_box_vertices[17]},
+
+        Triangle{left_box_vertices[18], left_box_vertices[19], left_box_vertices[20]},
+        Triangle{left_box_vertices[21], left_box_vertices[22], left_box_vertices[23]},
+
+        Triangle{left_box_vertices[24], left_box_vertices[25], left_box_vertices[26]},
+        Triangle{left_box_vertices[27], left_box_vertices[28], left_box_vertices[29]},
+
+        Triangle{left_box_vertices[30], left_box_vertices[31], left_box_vertices[32]},
+        Triangle{left_box_vertices[33], left_box_vertices[34], left_box_vertices[35]}
+    };
+
+    const int cornell_triangle_material_indices[36] = {
+        // left wall
+        2, 2,
+
+        // right wall
+        0, 0,
+
+        // floor
+        1, 1,
+
+        // ceiling
+        1, 1,
+
+        // back
+        1, 1,
+
+        // light
+        3, 3,
+
+        // right box
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+
+        // left box
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+    };
+
+    scene_data.triangle_bvh = construct_triangle_bvh(cornell_triangles, 36, DEFAULT_BVH_BUILD_SETTINGS);
+    const std::vector<Triangle> leaf_ordered_triangles = reorder_to_leaf_order(scene_data.triangle_bvh, cornell_triangles);
+    scene_data.triangles = construct_triangle_records(leaf_ordered_triangles.data(), leaf_ordered_triangles.size());
+    scene_data.triangle_material_indices = reorder_to_leaf_order(scene_data.triangle_bvh, cornell_triangle_material_indices);
+    scene_data.background_gradient_start = Colour{0.0f, 0.0f, 0.0f};
+    scene_data.background_gradient_end = Colour{0.0f, 0.0f, 0.0f};
+    scene_data.lights = construct_lights(get_scene(scene_data));
+
+    const Vec3 camera_start_position{278.0f, 278.0f, -800.0f};
+    Camera& camera = scene_data.camera;
+    camera.target = Vec3{278.0f, 278.0f, 0.0f};
+    camera.orientation = look_at_matrix(camera_start_position, camera.target);
+    camera.distance = magnitude(camera_start_position - camera.target);
+    camera.fov_y = degrees_to_radians(40.0f);
+    camera.aperture = 0.1f;
+    camera.focus_distance = camera.distance;
+    scene_data.aspect_ratio = CORNELL_BOX_ASPECT_RATIO;
+
+    return scene_data;
+}
+
+// meshes at least this big get the parallel linear BVH, startup would otherwise be dominated by the SAH build
+static constexpr int LINEAR_BVH_MIN_TRIANGLE_COUNT = 1000000;
+
+// the STL models are full of long thin triangles, letting spatial splits add 10% more references pays for itself
+static constexpr BVHBuildSettings MODEL_BVH_BUILD_SETTINGS{16, 4, 1.0f, 1.0f, WIDE_NODE_WIDTH, 0.1f, 1.0e-5f};
+
+static constexpr int BLACK_PIECE_MATERIAL_INDEX = 0;
+static constexpr int CHESS_LIGHT_MATERIAL_INDEX = 1;
+static constexpr int WHITE_PIECE_MATERIAL_INDEX = 2;
+
+static std::vector<Material> construct_chess_materials() {
+    return std::vector<Material>{
+        construct_lambertian_material(Colour{6.0f / 255.0f, 4.0f / 255.0f, 3.0f / 255.0f}),
+        construct_diffuse_light_material(Colour{1.0f, 1.0f, 1.0f}, 10.0f),
+        construct_lambertian_material(Colour{200.0f / 255.0f, 190.0f / 255.0f, 170.0f / 255.0f})
+    };
+}
+
+// models are z up, this stands them on the xz plane
+static Mat3 get_white_piece_transform() {
+    return rotation_matrix(-PI / 2.0f, 1.0f, 0.0f, 0.0f);
+}
+
+static void load_chess_piece(const ChessPiece::Type piece, const JobScheduler& scheduler, TriangleRecords& triangles, BVH& bvh) {
+    static constexpr const char* PIECE_FILENAMES[CHESS_PIECE_COUNT] = {
+        "./models/pawn.triangles",
+        "./models/rook.triangles",
+        "./models/knight.triangles",
+        "./models/bishop.triangles",
+        "./models/queen.triangles",
+        "./models/king.triangles"
+    };
+
+    const std::vector<Triangle> file_triangles = load_triangles_file(PIECE_FILENAMES[piece]);
+    const int triangle_count = file_triangles.size();
+    bvh = (triangle_count >= LINEAR_BVH_MIN_TRIANGLE_COUNT)
+        ? construct_linear_triangle_bvh(file_triangles.data(), triangle_count, MODEL_BVH_BUILD_SETTINGS, scheduler)
+        : construct_triangle_bvh(file_triangles.data(), triangle_count, MODEL_BVH_BUILD_SETTINGS);
+    const std::vector<Triangle> leaf_ordered_triangles = reorder_to_leaf_order(bvh, file_triangles.data());
+    triangles = construct_triangle_records(leaf_ordered_triangles.data(), leaf_ordered_triangles.size());
+}
+
+struct ChessPieceLoad {
+    const JobScheduler* scheduler;
+    SceneData* scene_data;
+};
+
+// pieces load side by side, each one's BVH build splits into jobs of its own
+static void load_chess_piece_job(void* const data, const int piece) {
+    const ChessPieceLoad& load = *static_cast<const ChessPieceLoad*>(data);
+    load_chess_piece(static_cast<ChessPiece::Type>(piece), *load.scheduler, load.scene_data->mesh_triangles[piece], load.scene_data->mesh_bvhs[piece]);
+}
+
+// the light both chess scenes share, and where they put the instances and their BVH
+static void finish_chess_scene(SceneData& scene_data) {
+    scene_data.spheres = {Sphere{Vec3{0.0f, 400.0f, 100.0f}, 80.0f}};
+    scene_data.sphere_material_indices = {CHESS_LIGHT_MATERIAL_INDEX};
+    scene_data.sphere_bvh = construct_sphere_bvh(scene_data.spheres.data(), 1, DEFAULT_BVH_BUILD_SETTINGS);
+
+    scene_data.instance_bvh = construct_instance_bvh(scene_data.instances.data(), scene_data.instances.size(), scene_data.meshes.data(), DEFAULT_BVH_BUILD_SETTINGS);
+    scene_data.instances = reorder_to_leaf_order(scene_data.instance_bvh, scene_data.instances.data());
+
+    scene_data.background_gradient_start = Colour{0.01f, 0.01f, 0.01f};
+    scene_data.background_gradient_end = Colour{0.01f, 0.01f, 0.01f};
+    scene_data.lights = construct_lights(get_scene(scene_data));
+    scene_data.aspect_ratio = CHESS_ASPECT_RATIO;
+}
+
+static SceneData construct_chess_scene(const JobScheduler& scheduler) {
+    SceneData scene_data = {};
+    scene_data.materials = construct_chess_materials();
+
+    // each piece is loaded and gets its BVH once, the board places them as instances
+    scene_data.mesh_triangles.resize(CHESS_PIECE_COUNT);
+    scene_data.mesh_bvhs.resize(CHESS_PIECE_COUNT);
+    scene_data.meshes.resize(CHESS_PIECE_COUNT);
+    ChessPieceLoad load{&scheduler, &scene_data};
+    parallel_for(scheduler, load_chess_piece_job, &load, CHESS_PIECE_COUNT);
+    for (int piece = 0; piece < CHESS_PIECE_COUNT; ++piece) {
+        scene_data.meshes[piece] = Mesh{&scene_data.mesh_triangles[piece], &scene_data.mesh_bvhs[piece]};
+    }
+
+    // white nearest the camera and black turned to face it
+    static constexpr ChessPiece::Type BACK_RANK[8] = {
+        ChessPiece::Type::ROOK,
+        ChessPiece::Type::KNIGHT,
+        ChessPiece::Type::BISHOP,
+        ChessPiece::Type::QUEEN,
+        ChessPiece::Type::KING,
+        ChessPiece::Type::BISHOP,
+        ChessPiece::Type::KNIGHT,
+        ChessPiece::Type::ROOK
+    };
+
+    static constexpr real SQUARE_SIZE = 40.0f;
+    const Mat3 white_model_transform = get_white_piece_transform();
+    const Mat3 black_model_transform = rotation_matrix(PI, 0.0f, 1.0f, 0.0f) * white_model_transform;
+
+    std::vector<Instance>& instances = scene_data.instances;
+    instances.reserve(32);
+    for (int file = 0; file < 8; ++file) {
+        const real x = (static_cast<real>(file) - 3.5f) * SQUARE_SIZE;
+        instances.push_back(construct_instance(BACK_RANK[file], WHITE_PIECE_MATERIAL_INDEX, white_model_transform, Vec3{x, 0.0f, 3.5f * SQUARE_SIZE}));
+        instances.push_back(construct_instance(ChessPiece::Type::PAWN, WHITE_PIECE_MATERIAL_INDEX, white_model_transform, Vec3{x, 0.0f, 2.5f * SQUARE_SIZE}));
+        instances.push_back(construct_instance(ChessPiece::Type::PAWN, BLACK_PIECE_MATERIAL_INDEX, black_model_transform, Vec3{x, 0.0f, -2.5f * SQUARE_SIZE}));
+        instances.push_back(construct_instance(BACK_RANK[file], BLACK_PIECE_MATERIAL_INDEX, black_model_transform, Vec3{x, 0.0f, -3.5f * SQUARE_SIZE}));
+    }
+
+    finish_chess_scene(scene_data);
+
+    const Vec3 camera_start_position{0.0f, 320.0f, 520.0f};
+    Camera& camera = scene_data.camera;
+    camera.target = Vec3{0.0f, 0.0f, 0.0f};
+    camera.orientation = look_at_matrix(camera_start_position, camera.target);
+    camera.distance = magnitude(camera_start_position - camera.target);
+    camera.fov_y = degrees_to_radians(40.0f);
+    camera.aperture = 0.1f;
+    camera.focus_distance = camera.distance;
+
+    return scene_data;
+}
+
+static SceneData construct_chess_piece_scene(const ChessPiece::Type piece, const JobScheduler& scheduler) {
+    SceneData scene_data = {};
+    scene_data.materials = construct_chess_materials();
+
+    scene_data.mesh_triangles.resize(1);
+    scene_data.mesh_bvhs.resize(1);
+    load_chess_piece(piece, scheduler, scene_data.mesh_triangles[0], scene_data.mesh_bvhs[0]);
+    scene_data.meshes = {Mesh{&scene_data.mesh_triangles[0], &scene_data.mesh_bvhs[0]}};
+    scene_data.instances = {construct_instance(0, WHITE_PIECE_MATERIAL_INDEX, get_white_piece_transform(), Vec3{0.0f, 0.0f, 0.0f})};
+
+    finish_chess_scene(scene_data);
+
+    // looking down at the piece from the same direction as the board's camera, near enough to fill the view
+    const AABB& aabb = scene_data.instance_bvh.aabb;
+    const real bounding_radius = 0.5f * magnitude(aabb.max - aabb.min);
+    const Vec3 camera_direction = normalise(Vec3{0.0f, 320.0f, 520.0f});
+
+    Camera& camera = scene_data.camera;
+    camera.target = 0.5f * (aabb.min + aabb.max);
+    camera.fov_y = degrees_to_radians(40.0f);
+    camera.distance = bounding_radius / std::sin(0.5f * camera.fov_y);
+    camera.orientation = look_at_matrix(camera.target + camera.distance * camera_direction, camera.target);
+    camera.aperture = 0.1f;
+    camera.focus_distance = camera.distance;
+
+    return scene_data;
+}
+
+static Scene get_scene(const SceneData& scene_data) {
+    Scene scene = {};
+    scene.materials = scene_data.materials.data();
+
+    if (!scene_data.spheres.empty()) {
+        scene.spheres = scene_data.spheres.data();
+        scene.sphere_bvh = &scene_data.sphere_bvh;
+        scene.sphere_material_indices = scene_data.sphere_material_indices.data();
+    }
+
+    if (!scene_data.triangle_material_indices.empty()) {
+        scene.triangles = &scene_data.triangles;
+        scene.triangle_bvh = &scene_data.triangle_bvh;
+        scene.triangle_material_indices = scene_data.triangle_material_indices.data();
+    }
+
+    if (!scene_data.instances.empty()) {
+        scene.meshes = scene_data.meshes.data();
+        scene.instances = scene_data.instances.data();
+        scene.instance_bvh = &scene_data.instance_bvh;
+    }
+
+    scene.lights = scene_data.lights.data();
+    scene.light_count = static_cast<int>(scene_data.lights.size());
+    scene.background_gradient_start = scene_data.background_gradient_start;
+    scene.background_gradient_end = scene_data.background_gradient_end;
+
+    return scene;
+}
@@ -0,0 +1,68 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "path_tracing.h"
+#include "geometry.h"
+#include "material.h"
+#include "colour.h"
+#include "types.h"
+#include "jobs.h"
+#include "bvh.h"
+
+#include <vector>
+
+// Everything one of the built in scenes points at. Scenes hold pointers into this, so get_scene() makes one
+// once the data has stopped moving. Moving is fine but copies' meshes still point into the original.
+struct SceneData {
+    std::vector<Material> materials;
+
+    std::vector<Sphere> spheres;
+    BVH sphere_bvh;
+    std::vector<int> sphere_material_indices;
+
+    TriangleRecords triangles;
+    BVH triangle_bvh;
+    std::vector<int> triangle_material_indices;
+
+    std::vector<TriangleRecords> mesh_triangles;
+    std::vector<BVH> mesh_bvhs;
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    BVH instance_bvh;
+
+    std::vector<Light> lights;
+
+    Colour background_gradient_start;
+    Colour background_gradient_end;
+
+    Camera camera;
+    real aspect_ratio;
+};
+
+static constexpr real RANDOM_SPHERES_ASPECT_RATIO = 3.0f / 2.0f;
+static constexpr real CORNELL_BOX_ASPECT_RATIO = 1.0f;
+static constexpr real CHESS_ASPECT_RATIO = 1.0f;
+
+struct ChessPiece {
+    enum Type {
+        PAWN = 0,
+        ROOK = 1,
+        KNIGHT = 2,
+        BISHOP = 3,
+        QUEEN = 4,
+        KING = 5
+    };
+};
+
+static constexpr int CHESS_PIECE_COUNT = 6;
+
+static SceneData construct_random_spheres_scene();
+static SceneData construct_cornell_box_scene();
+static SceneData construct_chess_scene(const JobScheduler& scheduler);
+
+// one white piece under the chess scene's light, the camera framing it
+static SceneData construct_chess_piece_scene(ChessPiece::Type piece, const JobScheduler& scheduler);
+
+static Scene get_scene(const SceneData& scene_data);
+
+#endif
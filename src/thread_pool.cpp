@@ -0,0 +1,295 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+// times a worker looks through every queue and yields before it sleeps, more work usually comes soon
+static constexpr int THREAD_POOL_SPIN_COUNT = 64;
+
+// which of its pool's queues the thread owns, threads outside every pool share the last one
+static thread_local const ThreadPool* current_thread_pool = nullptr;
+static thread_local int current_queue_index = 0;
+
+static int get_queue_index(const ThreadPool& pool) {
+    return (current_thread_pool == &pool) ? current_queue_index : static_cast<int>(pool.queues.size()) - 1;
+}
+
+static int get_default_worker_count() {
+    const int hardware_thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    return (hardware_thread_count > 1) ? hardware_thread_count - 1 : 0;
+}
+
+static void push_task(ThreadPool& pool, ThreadPoolQueue& queue, const ThreadPoolTask& task) {
+    {
+        const std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+    }
+
+    // sleepers check the count holding the sleep mutex, so taking it here means they've either seen this
+    // task or are waiting and get woken
+    pool.queued_task_count.fetch_add(1);
+    if (pool.sleeping_thread_count.load() > 0) {
+        {
+            const std::lock_guard<std::mutex> lock(pool.sleep_mutex);
+        }
+
+        pool.wake.notify_one();
+    }
+}
+
+static Maybe<ThreadPoolTask> pop_newest_task(ThreadPool& pool, ThreadPoolQueue& queue) {
+    Maybe<ThreadPoolTask> task = {};
+
+    const std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+        task.value = queue.tasks.back();
+        task.is_valid = true;
+        queue.tasks.pop_back();
+        pool.queued_task_count.fetch_sub(1);
+    }
+
+    return task;
+}
+
+static Maybe<ThreadPoolTask> pop_oldest_task(ThreadPool& pool, ThreadPoolQueue& queue) {
+    Maybe<ThreadPoolTask> task = {};
+
+    const std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+        task.value = queue.tasks.front();
+        task.is_valid = true;
+        queue.tasks.pop_front();
+        pool.queued_task_count.fetch_sub(1);
+    }
+
+    return task;
+}
+
+// the newest or oldest of the queue's tasks from the range counting down remaining_job_count, if it has any
+static Maybe<ThreadPoolTask> pop_group_task(ThreadPool& pool, ThreadPoolQueue& queue, const std::atomic<int>* const remaining_job_count, const bool newest) {
+    Maybe<ThreadPoolTask> task = {};
+
+    const std::lock_guard<std::mutex> lock(queue.mutex);
+    const int task_count = static_cast<int>(queue.tasks.size());
+    for (int offset = 0; offset < task_count && !task.is_valid; ++offset) {
+        const int task_index = newest ? task_count - 1 - offset : offset;
+        if (queue.tasks[task_index].remaining_job_count == remaining_job_count) {
+            task.value = queue.tasks[task_index];
+            task.is_valid = true;
+            queue.tasks.erase(queue.tasks.begin() + task_index);
+            pool.queued_task_count.fetch_sub(1);
+        }
+    }
+
+    return task;
+}
+
+static void run_task(ThreadPool& pool, ThreadPoolQueue& queue, ThreadPoolTask task) {
+    while (task.job_end - task.job_start > 1) {
+        const int job_middle = task.job_start + (task.job_end - task.job_start) / 2;
+
+        ThreadPoolTask back_half = task;
+        back_half.job_start = job_middle;
+        push_task(pool, queue, back_half);
+
+        task.job_end = job_middle;
+    }
+
+    task.job(task.data, task.job_start);
+    queue.job_count.fetch_add(1, std::memory_order_relaxed);
+
+    // releases the job's writes to whoever is waiting on the range, the task mustn't be touched after
+    task.remaining_job_count->fetch_sub(1, std::memory_order_acq_rel);
+}
+
+// the thread's own newest task, otherwise the oldest from the next queue round that has one
+static bool run_any_task(ThreadPool& pool, const int queue_index) {
+    if (pool.queued_task_count.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    ThreadPoolQueue& queue = pool.queues[queue_index];
+    Maybe<ThreadPoolTask> task = pop_newest_task(pool, queue);
+
+    const int queue_count = static_cast<int>(pool.queues.size());
+    for (int offset = 1; offset < queue_count && !task.is_valid; ++offset) {
+        task = pop_oldest_task(pool, pool.queues[(queue_index + offset) % queue_count]);
+        if (task.is_valid) {
+            queue.steal_count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (!task.is_valid) {
+        queue.failed_steal_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    run_task(pool, queue, task.value);
+    return true;
+}
+
+// as run_any_task() but only the group's tasks
+static bool run_group_task(ThreadPool& pool, const int queue_index, const std::atomic<int>* const remaining_job_count) {
+    if (pool.queued_task_count.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    ThreadPoolQueue& queue = pool.queues[queue_index];
+    Maybe<ThreadPoolTask> task = pop_group_task(pool, queue, remaining_job_count, true);
+
+    const int queue_count = static_cast<int>(pool.queues.size());
+    for (int offset = 1; offset < queue_count && !task.is_valid; ++offset) {
+        task = pop_group_task(pool, pool.queues[(queue_index + offset) % queue_count], remaining_job_count, false);
+        if (task.is_valid) {
+            queue.steal_count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (!task.is_valid) {
+        queue.failed_steal_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    run_task(pool, queue, task.value);
+    return true;
+}
+
+static void run_worker(ThreadPool* const pool, const int queue_index) {
+    current_thread_pool = pool;
+    current_queue_index = queue_index;
+
+    ThreadPoolQueue& queue = pool->queues[queue_index];
+    int idle_spin_count = 0;
+    while (!pool->stopping.load()) {
+        if (run_any_task(*pool, queue_index)) {
+            idle_spin_count = 0;
+            continue;
+        }
+
+        if (++idle_spin_count < THREAD_POOL_SPIN_COUNT) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        idle_spin_count = 0;
+        const std::chrono::steady_clock::time_point sleep_start = std::chrono::steady_clock::now();
+        {
+            std::unique_lock<std::mutex> lock(pool->sleep_mutex);
+            pool->sleeping_thread_count.fetch_add(1);
+            pool->wake.wait(lock, [pool]() { return pool->queued_task_count.load() > 0 || pool->stopping.load(); });
+            pool->sleeping_thread_count.fetch_sub(1);
+        }
+
+        const std::chrono::nanoseconds sleep_duration = std::chrono::steady_clock::now() - sleep_start;
+        queue.sleep_count.fetch_add(1, std::memory_order_relaxed);
+        queue.sleep_nanoseconds.fetch_add(sleep_duration.count(), std::memory_order_relaxed);
+    }
+}
+
+static void start_thread_pool(ThreadPool& pool, const int worker_count) {
+    assert(worker_count >= 0);
+    assert(pool.threads.empty());
+
+    pool.queues = std::vector<ThreadPoolQueue>(worker_count + 1);
+    for (ThreadPoolQueue& queue : pool.queues) {
+        queue.job_count = 0;
+        queue.steal_count = 0;
+        queue.failed_steal_count = 0;
+        queue.sleep_count = 0;
+        queue.sleep_nanoseconds = 0;
+    }
+
+    pool.queued_task_count = 0;
+    pool.sleeping_thread_count = 0;
+    pool.stopping = false;
+
+    pool.threads.reserve(worker_count);
+    for (int queue_index = 0; queue_index < worker_count; ++queue_index) {
+        pool.threads.emplace_back(run_worker, &pool, queue_index);
+    }
+}
+
+// waits for workers to finish what they're running, nothing should still be queued
+static void stop_thread_pool(ThreadPool& pool) {
+    {
+        const std::lock_guard<std::mutex> lock(pool.sleep_mutex);
+        pool.stopping = true;
+    }
+
+    pool.wake.notify_all();
+    for (std::thread& thread : pool.threads) {
+        thread.join();
+    }
+
+    pool.threads.clear();
+}
+
+static void start_jobs(ThreadPool& pool, JobGroup& group, const Job job, void* const data, const int job_count) {
+    group.remaining_job_count.store(std::max(job_count, 0), std::memory_order_relaxed);
+    if (job_count > 0) {
+        ThreadPoolQueue& queue = pool.queues[get_queue_index(pool)];
+        push_task(pool, queue, ThreadPoolTask{job, data, 0, job_count, &group.remaining_job_count});
+    }
+}
+
+static bool jobs_finished(const JobGroup& group) {
+    return (group.remaining_job_count.load(std::memory_order_acquire) == 0);
+}
+
+static void wait_for_jobs(ThreadPool& pool, JobGroup& group) {
+    const int queue_index = get_queue_index(pool);
+    while (!jobs_finished(group)) {
+        if (!run_any_task(pool, queue_index)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void wait_for_group_jobs(ThreadPool& pool, JobGroup& group) {
+    const int queue_index = get_queue_index(pool);
+    while (!jobs_finished(group)) {
+        if (!run_group_task(pool, queue_index, &group.remaining_job_count)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void thread_pool_parallel_for(void* const context, const Job job, void* const data, const int job_count) {
+    ThreadPool& pool = *static_cast<ThreadPool*>(context);
+
+    JobGroup group;
+    start_jobs(pool, group, job, data, job_count);
+    wait_for_jobs(pool, group);
+}
+
+static JobScheduler get_job_scheduler(ThreadPool& pool) {
+    return JobScheduler{&pool, thread_pool_parallel_for};
+}
+
+static void thread_pool_group_parallel_for(void* const context, const Job job, void* const data, const int job_count) {
+    ThreadPool& pool = *static_cast<ThreadPool*>(context);
+
+    JobGroup group;
+    start_jobs(pool, group, job, data, job_count);
+    wait_for_group_jobs(pool, group);
+}
+
+static JobScheduler get_group_job_scheduler(ThreadPool& pool) {
+    return JobScheduler{&pool, thread_pool_group_parallel_for};
+}
+
+static ThreadPoolCounters get_counters(const ThreadPool& pool) {
+    ThreadPoolCounters counters = {};
+    u64 sleep_nanoseconds = 0;
+    for (const ThreadPoolQueue& queue : pool.queues) {
+        counters.job_count += queue.job_count.load(std::memory_order_relaxed);
+        counters.steal_count += queue.steal_count.load(std::memory_order_relaxed);
+        counters.failed_steal_count += queue.failed_steal_count.load(std::memory_order_relaxed);
+        counters.sleep_count += queue.sleep_count.load(std::memory_order_relaxed);
+        sleep_nanoseconds += queue.sleep_nanoseconds.load(std::memory_order_relaxed);
+    }
+
+    counters.sleep_seconds = static_cast<double>(sleep_nanoseconds) * 1.0e-9;
+    return counters;
+}
@@ -0,0 +1,84 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "types.h"
+#include "jobs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work stealing pool. Every thread has its own deque, parallel_for pushes its whole range of jobs as one task
+// and whoever runs a range splits off the back half for others to steal until one job is left. Owners take
+// their newest tasks and thieves the oldest, the biggest ranges, so they rarely meet. Jobs can call
+// parallel_for themselves, a caller runs tasks, anyone's, until its own range is done.
+struct ThreadPoolTask {
+    Job job;
+    void* data;
+    int job_start;
+    int job_end;
+    std::atomic<int>* remaining_job_count;
+};
+
+// counters are atomic so they can be read while the pool runs
+struct alignas(64) ThreadPoolQueue {
+    std::mutex mutex;
+    std::deque<ThreadPoolTask> tasks;
+
+    std::atomic<u64> job_count;
+    std::atomic<u64> steal_count;
+    std::atomic<u64> failed_steal_count;    // looked in every queue and found nothing
+    std::atomic<u64> sleep_count;
+    std::atomic<u64> sleep_nanoseconds;
+};
+
+struct ThreadPool {
+    std::vector<std::thread> threads;
+    std::vector<ThreadPoolQueue> queues;    // one per worker then one for threads outside the pool
+    std::atomic<int> queued_task_count;
+    std::atomic<int> sleeping_thread_count;
+    std::atomic<bool> stopping;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+};
+
+// Jobs started without waiting for them, the group has to outlive them
+struct JobGroup {
+    std::atomic<int> remaining_job_count;
+};
+
+struct ThreadPoolCounters {
+    u64 job_count;
+    u64 steal_count;
+    u64 failed_steal_count;
+    u64 sleep_count;
+    double sleep_seconds;
+};
+
+// threads calling parallel_for run jobs too while they wait, so one fewer worker than hardware threads
+static int get_default_worker_count();
+
+static void start_thread_pool(ThreadPool& pool, int worker_count);
+static void stop_thread_pool(ThreadPool& pool);
+static JobScheduler get_job_scheduler(ThreadPool& pool);
+static JobScheduler get_group_job_scheduler(ThreadPool& pool);    // waits with wait_for_group_jobs()
+
+// A parallel_for that returns straight away so the caller can get on with something else. With no workers
+// nothing runs until the caller waits.
+static void start_jobs(ThreadPool& pool, JobGroup& group, Job job, void* data, int job_count);
+static bool jobs_finished(const JobGroup& group);
+
+// runs tasks, anyone's, until the group's jobs are done
+static void wait_for_jobs(ThreadPool& pool, JobGroup& group);
+
+// Runs only the group's tasks until its jobs are done, anyone else's are left to the workers. For callers whose
+// wait shouldn't include jobs queued before theirs, at the cost of sitting idle once the group's are all taken.
+static void wait_for_group_jobs(ThreadPool& pool, JobGroup& group);
+
+// totals since the pool started, callers' jobs included
+static ThreadPoolCounters get_counters(const ThreadPool& pool);
+
+#endif
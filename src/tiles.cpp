@@ -0,0 +1,124 @@
+#include "tiles.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+static const char* get_tile_order_name(const TileOrder::Type order) {
+    switch (order) {
+        case TileOrder::Type::SCANLINES: {
+            return "scanlines";
+        }
+
+        case TileOrder::Type::MORTON: {
+            return "morton";
+        }
+
+        case TileOrder::Type::HILBERT: {
+            return "hilbert";
+        }
+
+        default: {
+            assert(false);
+            return "";
+        }
+    }
+}
+
+// spreads the low 16 bits out to the even bits
+static u32 spread_bits(u32 value) {
+    value &= 0x0000ffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+    return value;
+}
+
+static u32 get_morton_index(const u32 x, const u32 y) {
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+// distance along the Hilbert curve filling a grid_size x grid_size grid, grid_size a power of two
+static u32 get_hilbert_index(const u32 grid_size, u32 x, u32 y) {
+    u32 index = 0;
+    for (u32 quadrant_size = grid_size / 2; quadrant_size > 0; quadrant_size /= 2) {
+        const u32 right = ((x & quadrant_size) != 0) ? 1 : 0;
+        const u32 top = ((y & quadrant_size) != 0) ? 1 : 0;
+        index += quadrant_size * quadrant_size * ((3 * right) ^ top);
+
+        // turns the quadrant so the curve inside it starts and ends where the bigger one needs
+        if (top == 0) {
+            if (right == 1) {
+                x = grid_size - 1 - x;
+                y = grid_size - 1 - y;
+            }
+
+            std::swap(x, y);
+        }
+    }
+
+    return index;
+}
+
+struct OrderedTile {
+    RenderTile tile;
+    int ring;
+    u32 curve_index;
+};
+
+static std::vector<RenderTile> construct_render_tiles(const int width, const int height, const int tile_size, const TileOrder::Type order) {
+    assert(width > 0 && height > 0);
+
+    std::vector<RenderTile> tiles;
+    if (order == TileOrder::Type::SCANLINES) {
+        tiles.reserve(height);
+        for (int row = 0; row < height; ++row) {
+            tiles.push_back(RenderTile{row, row + 1, 0, width});
+        }
+
+        return tiles;
+    }
+
+    assert(tile_size > 0);
+    const int tile_column_count = (width + tile_size - 1) / tile_size;
+    const int tile_row_count = (height + tile_size - 1) / tile_size;
+
+    u32 grid_size = 1;
+    while (grid_size < static_cast<u32>(std::max(tile_column_count, tile_row_count))) {
+        grid_size *= 2;
+    }
+
+    std::vector<OrderedTile> ordered_tiles;
+    ordered_tiles.reserve(tile_column_count * tile_row_count);
+    for (int tile_row = 0; tile_row < tile_row_count; ++tile_row) {
+        for (int tile_column = 0; tile_column < tile_column_count; ++tile_column) {
+            OrderedTile ordered_tile = {};
+            ordered_tile.tile.row_start = tile_row * tile_size;
+            ordered_tile.tile.row_end = std::min(ordered_tile.tile.row_start + tile_size, height);
+            ordered_tile.tile.column_start = tile_column * tile_size;
+            ordered_tile.tile.column_end = std::min(ordered_tile.tile.column_start + tile_size, width);
+
+            // in doubled tile units so the middle two tiles of an even count are both in the first ring
+            const int centre_offset_x = std::abs(2 * tile_column + 1 - tile_column_count);
+            const int centre_offset_y = std::abs(2 * tile_row + 1 - tile_row_count);
+            ordered_tile.ring = std::max(centre_offset_x, centre_offset_y) / 2;
+            ordered_tile.curve_index = (order == TileOrder::Type::MORTON)
+                ? get_morton_index(tile_column, tile_row)
+                : get_hilbert_index(grid_size, tile_column, tile_row);
+
+            ordered_tiles.push_back(ordered_tile);
+        }
+    }
+
+    std::sort(ordered_tiles.begin(), ordered_tiles.end(), [](const OrderedTile& lhs, const OrderedTile& rhs) {
+        return (lhs.ring != rhs.ring) ? (lhs.ring < rhs.ring) : (lhs.curve_index < rhs.curve_index);
+    });
+
+    tiles.reserve(ordered_tiles.size());
+    for (const OrderedTile& ordered_tile : ordered_tiles) {
+        tiles.push_back(ordered_tile.tile);
+    }
+
+    return tiles;
+}
@@ -0,0 +1,33 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include "types.h"
+
+#include <vector>
+
+// A rectangle of the image rendered as one job. Rays from a small square go through much the same BVH nodes
+// and triangles so the job keeps finding them in cache, where a scanline's rays spread over the whole scene.
+struct RenderTile {
+    int row_start;
+    int row_end;
+    int column_start;
+    int column_end;
+};
+
+struct TileOrder {
+    enum Type {
+        SCANLINES = 0,  // a full width row per tile, bottom to top, the way rendering used to be split
+        MORTON = 1,
+        HILBERT = 2
+    };
+};
+
+static const char* get_tile_order_name(TileOrder::Type order);
+
+// Square tiles ring by ring out from the middle of the image so the centre fills in first, each ring's tiles
+// in the order the curve visits them. A ring is a thin square loop the curve crosses many times, so the list
+// goes along runs of neighbouring tiles but jumps wherever the curve leaves the ring. Render jobs should take
+// tiles in list order, a parallel_for's job indices don't start in order. Scanlines ignore tile_size.
+static std::vector<RenderTile> construct_render_tiles(int width, int height, int tile_size, TileOrder::Type order);
+
+#endif
@@ -6,10 +6,20 @@
 using u32 = unsigned int;
 using u64 = unsigned long long;
 
+// Double unless built with REAL_FLOAT defined, float halves the size of everything geometric and
+// doubles how many lanes fit in a SIMD register
+#ifdef REAL_FLOAT
+using real = float;
+static constexpr real REAL_MAX = FLT_MAX;
+static constexpr real REAL_EPSILON = FLT_EPSILON;
+#define strtor strtof
+#else
 using real = double;
 static constexpr real REAL_MAX = DBL_MAX;
-
-// TODO: maybe a #define for single vs. double precision? can define this elsewhere then
+static constexpr real REAL_EPSILON = DBL_EPSILON;
 #define strtor strtod
+#endif
+
+static constexpr real PI = 3.14159265358979323846264;
 
 #endif
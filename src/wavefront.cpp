@@ -0,0 +1,230 @@
+#include "wavefront.h"
+
+#include <utility>
+
+static void ensure_capacity(PathQueue& queue, const int capacity) {
+    if (static_cast<int>(queue.path_indices.size()) >= capacity) {
+        return;
+    }
+
+    queue.origin_x.resize(capacity);
+    queue.origin_y.resize(capacity);
+    queue.origin_z.resize(capacity);
+    queue.direction_x.resize(capacity);
+    queue.direction_y.resize(capacity);
+    queue.direction_z.resize(capacity);
+    queue.attenuation_r.resize(capacity);
+    queue.attenuation_g.resize(capacity);
+    queue.attenuation_b.resize(capacity);
+    queue.scatter_pdfs.resize(capacity);
+    queue.scatter_was_specular.resize(capacity);
+    queue.bounce_counts.resize(capacity);
+    queue.path_indices.resize(capacity);
+}
+
+static void ensure_capacity(HitQueue& queue, const int capacity) {
+    if (static_cast<int>(queue.distances.size()) >= capacity) {
+        return;
+    }
+
+    queue.distances.resize(capacity);
+    queue.sphere_indices.resize(capacity);
+    queue.triangle_indices.resize(capacity);
+    queue.instance_indices.resize(capacity);
+}
+
+static void ensure_capacity(ShadowQueue& queue, const int capacity) {
+    if (static_cast<int>(queue.path_indices.size()) >= capacity) {
+        return;
+    }
+
+    queue.origin_x.resize(capacity);
+    queue.origin_y.resize(capacity);
+    queue.origin_z.resize(capacity);
+    queue.direction_x.resize(capacity);
+    queue.direction_y.resize(capacity);
+    queue.direction_z.resize(capacity);
+    queue.max_distances.resize(capacity);
+    queue.contribution_r.resize(capacity);
+    queue.contribution_g.resize(capacity);
+    queue.contribution_b.resize(capacity);
+    queue.path_indices.resize(capacity);
+}
+
+static Ray get_ray(const PathQueue& queue, const int slot) {
+    const Vec3 origin{queue.origin_x[slot], queue.origin_y[slot], queue.origin_z[slot]};
+    const Vec3 direction{queue.direction_x[slot], queue.direction_y[slot], queue.direction_z[slot]};
+    return Ray{origin, direction};
+}
+
+static void push(PathQueue& queue, const PathState& path_state, const int path_index) {
+    const int slot = queue.count++;
+    queue.origin_x[slot] = path_state.ray.origin.x;
+    queue.origin_y[slot] = path_state.ray.origin.y;
+    queue.origin_z[slot] = path_state.ray.origin.z;
+    queue.direction_x[slot] = path_state.ray.direction.x;
+    queue.direction_y[slot] = path_state.ray.direction.y;
+    queue.direction_z[slot] = path_state.ray.direction.z;
+    queue.attenuation_r[slot] = path_state.attenuation.r;
+    queue.attenuation_g[slot] = path_state.attenuation.g;
+    queue.attenuation_b[slot] = path_state.attenuation.b;
+    queue.scatter_pdfs[slot] = path_state.scatter_pdf;
+    queue.scatter_was_specular[slot] = path_state.scatter_was_specular ? 1 : 0;
+    queue.bounce_counts[slot] = path_state.bounce_count;
+    queue.path_indices[slot] = path_index;
+}
+
+static void push(ShadowQueue& queue, const ShadowRay& shadow_ray, const int path_index) {
+    const int slot = queue.count++;
+    queue.origin_x[slot] = shadow_ray.ray.origin.x;
+    queue.origin_y[slot] = shadow_ray.ray.origin.y;
+    queue.origin_z[slot] = shadow_ray.ray.origin.z;
+    queue.direction_x[slot] = shadow_ray.ray.direction.x;
+    queue.direction_y[slot] = shadow_ray.ray.direction.y;
+    queue.direction_z[slot] = shadow_ray.ray.direction.z;
+    queue.max_distances[slot] = shadow_ray.max_distance;
+    queue.contribution_r[slot] = shadow_ray.contribution.r;
+    queue.contribution_g[slot] = shadow_ray.contribution.g;
+    queue.contribution_b[slot] = shadow_ray.contribution.b;
+    queue.path_indices[slot] = path_index;
+}
+
+static void extend(const PathQueue& paths, const Scene& scene, HitQueue& hits, RayCounts& ray_counts) {
+    ray_counts.closest_hit_count += paths.count;
+    for (int slot = 0; slot < paths.count; ++slot) {
+        const SceneIntersection scene_intersection = intersect_closest(get_ray(paths, slot), scene);
+        hits.distances[slot] = scene_intersection.distance;
+        hits.sphere_indices[slot] = scene_intersection.sphere_index;
+        hits.triangle_indices[slot] = scene_intersection.triangle_index;
+        hits.instance_indices[slot] = scene_intersection.instance_index;
+    }
+}
+
+static SceneIntersection get_scene_intersection(const HitQueue& hits, const int slot) {
+    return SceneIntersection{hits.distances[slot], hits.sphere_indices[slot], hits.triangle_indices[slot], hits.instance_indices[slot]};
+}
+
+// counting sort, stable so paths within a group keep the order they were queued in
+static void sort_by_shading_group(const PathQueue& paths, const HitQueue& hits, const Scene& scene, std::vector<int>& shading_order, std::vector<int>& shading_groups) {
+    int group_starts[SHADING_GROUP_COUNT + 1] = {};
+    for (int slot = 0; slot < paths.count; ++slot) {
+        const SceneIntersection scene_intersection = get_scene_intersection(hits, slot);
+        const int shading_group = is_hit(scene_intersection) ? 1 + scene.materials[get_material_index(scene, scene_intersection)].type : 0;
+        shading_groups[slot] = shading_group;
+        ++group_starts[shading_group + 1];
+    }
+
+    for (int shading_group = 0; shading_group < SHADING_GROUP_COUNT; ++shading_group) {
+        group_starts[shading_group + 1] += group_starts[shading_group];
+    }
+
+    for (int slot = 0; slot < paths.count; ++slot) {
+        shading_order[group_starts[shading_groups[slot]]++] = slot;
+    }
+}
+
+static void shade_paths(
+    const PathQueue& paths,
+    const HitQueue& hits,
+    const std::vector<int>& shading_order,
+    const Scene& scene,
+    const PathSettings& settings,
+    SampleStream* const sample_streams,
+    Colour* const colours,
+    FeatureSample* const features,
+    PathQueue& next_paths,
+    ShadowQueue& shadows,
+    BounceHistogram& bounce_histogram
+) {
+    for (int order_index = 0; order_index < paths.count; ++order_index) {
+        const int slot = shading_order[order_index];
+        const int path_index = paths.path_indices[slot];
+
+        PathState path_state = {};
+        path_state.ray = get_ray(paths, slot);
+        path_state.colour = colours[path_index];
+        path_state.attenuation = Colour{paths.attenuation_r[slot], paths.attenuation_g[slot], paths.attenuation_b[slot]};
+        path_state.scatter_pdf = paths.scatter_pdfs[slot];
+        path_state.scatter_was_specular = (paths.scatter_was_specular[slot] != 0);
+        path_state.bounce_count = paths.bounce_counts[slot];
+
+        const SceneIntersection scene_intersection = get_scene_intersection(hits, slot);
+        if (path_state.bounce_count == 0) {
+            features[path_index] = get_feature_sample(path_state.ray, scene_intersection, scene);
+        }
+
+        Maybe<ShadowRay> shadow_ray = {};
+        const bool path_continues = shade(path_state, scene_intersection, scene, settings, sample_streams[path_index], shadow_ray);
+        colours[path_index] = path_state.colour;
+
+        if (shadow_ray.is_valid) {
+            push(shadows, shadow_ray.value, path_index);
+        }
+
+        if (path_continues) {
+            push(next_paths, path_state, path_index);
+        } else {
+            ++bounce_histogram.path_counts[path_state.bounce_count];
+        }
+    }
+}
+
+// a path's light sample lands after everything it gathered at the same vertex, as it does in intersect()
+static void trace_shadow_rays(const ShadowQueue& shadows, const Scene& scene, Colour* const colours, RayCounts& ray_counts) {
+    ray_counts.shadow_count += shadows.count;
+    for (int slot = 0; slot < shadows.count; ++slot) {
+        const Vec3 origin{shadows.origin_x[slot], shadows.origin_y[slot], shadows.origin_z[slot]};
+        const Vec3 direction{shadows.direction_x[slot], shadows.direction_y[slot], shadows.direction_z[slot]};
+        if (!occluded(Ray{origin, direction}, shadows.max_distances[slot], scene)) {
+            colours[shadows.path_indices[slot]] += Colour{shadows.contribution_r[slot], shadows.contribution_g[slot], shadows.contribution_b[slot]};
+        }
+    }
+}
+
+static void trace_paths(
+    const Ray* const camera_rays,
+    SampleStream* const sample_streams,
+    const int path_count,
+    const Scene& scene,
+    const PathSettings& settings,
+    WavefrontQueues& queues,
+    Colour* const colours,
+    FeatureSample* const features,
+    BounceHistogram& bounce_histogram,
+    RayCounts& ray_counts
+) {
+    ensure_capacity(queues.paths, path_count);
+    ensure_capacity(queues.next_paths, path_count);
+    ensure_capacity(queues.hits, path_count);
+    ensure_capacity(queues.shadows, path_count);
+    if (static_cast<int>(queues.shading_order.size()) < path_count) {
+        queues.shading_order.resize(path_count);
+        queues.shading_groups.resize(path_count);
+    }
+
+    // ray generation
+    queues.paths.count = 0;
+    for (int path_index = 0; path_index < path_count; ++path_index) {
+        const PathState path_state = construct_path_state(camera_rays[path_index]);
+        colours[path_index] = path_state.colour;
+        features[path_index] = FeatureSample{Colour{1.0f, 1.0f, 1.0f}, Vec3{0.0f, 0.0f, 0.0f}, 0.0f};
+
+        if (settings.max_bounce_count > 0) {
+            push(queues.paths, path_state, path_index);
+        } else {
+            ++bounce_histogram.path_counts[0];
+        }
+    }
+
+    while (queues.paths.count > 0) {
+        extend(queues.paths, scene, queues.hits, ray_counts);
+        sort_by_shading_group(queues.paths, queues.hits, scene, queues.shading_order, queues.shading_groups);
+
+        queues.next_paths.count = 0;
+        queues.shadows.count = 0;
+        shade_paths(queues.paths, queues.hits, queues.shading_order, scene, settings, sample_streams, colours, features, queues.next_paths, queues.shadows, bounce_histogram);
+        trace_shadow_rays(queues.shadows, scene, colours, ray_counts);
+
+        std::swap(queues.paths, queues.next_paths);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "path_tracing.h"
+#include "sampling.h"
+#include "colour.h"
+#include "types.h"
+
+#include <vector>
+
+// Paths still going, structure of arrays so each stage only streams through the parts it needs. Colours
+// and sample streams stay with the batch, a path refers to them by its index in the batch.
+struct PathQueue {
+    std::vector<real> origin_x;
+    std::vector<real> origin_y;
+    std::vector<real> origin_z;
+    std::vector<real> direction_x;
+    std::vector<real> direction_y;
+    std::vector<real> direction_z;
+    std::vector<real> attenuation_r;
+    std::vector<real> attenuation_g;
+    std::vector<real> attenuation_b;
+    std::vector<real> scatter_pdfs;
+    std::vector<int> scatter_was_specular;     // 0 or 1, plain ints rather than vector<bool>'s packed bits
+    std::vector<int> bounce_counts;
+    std::vector<int> path_indices;
+    int count;
+};
+
+// closest hits for the paths in a queue, same order as the queue
+struct HitQueue {
+    std::vector<real> distances;
+    std::vector<int> sphere_indices;
+    std::vector<int> triangle_indices;
+    std::vector<int> instance_indices;
+};
+
+struct ShadowQueue {
+    std::vector<real> origin_x;
+    std::vector<real> origin_y;
+    std::vector<real> origin_z;
+    std::vector<real> direction_x;
+    std::vector<real> direction_y;
+    std::vector<real> direction_z;
+    std::vector<real> max_distances;
+    std::vector<real> contribution_r;
+    std::vector<real> contribution_g;
+    std::vector<real> contribution_b;
+    std::vector<int> path_indices;
+    int count;
+};
+
+// paths are shaded grouped by what they hit, misses first then each material type
+static constexpr int SHADING_GROUP_COUNT = Material::Type::DIFFUSE_LIGHT + 2;
+
+// One set per worker, only ever grows so after the first batch nothing is allocated
+struct WavefrontQueues {
+    PathQueue paths;
+    PathQueue next_paths;   // survivors of the current round, swapped in at the end of it
+    HitQueue hits;
+    ShadowQueue shadows;
+    std::vector<int> shading_groups;
+    std::vector<int> shading_order;     // queue slots grouped by shading group
+};
+
+// Traces a batch of paths a stage at a time rather than each to the end: extension finds every path's closest
+// hit, paths are sorted by material so each kind gets shaded together, shading queues up shadow rays which are
+// then traced together, and the survivors are compacted for the next round. Shading is shared with intersect()
+// and draws the same dimensions, so a path gets the same colour whichever engine traces it.
+static void trace_paths(
+    const Ray* camera_rays,
+    SampleStream* sample_streams,
+    int path_count,
+    const Scene& scene,
+    const PathSettings& settings,
+    WavefrontQueues& queues,
+    Colour* colours,
+    FeatureSample* features,    // first hits, for the denoiser
+    BounceHistogram& bounce_histogram,
+    RayCounts& ray_counts
+);
+
+#endif